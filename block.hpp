@@ -0,0 +1,413 @@
+#ifndef BLOCK_HPP_INCLUDED
+#define BLOCK_HPP_INCLUDED
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : block.hpp
+//  Description    : This is the header-only C++20 interface of the BLOCK
+//                   driver.  block::File is a move-only handle that closes
+//                   its file when destroyed; reads and writes take spans of
+//                   std::byte straight through to block_read/block_write,
+//                   positional overloads seek first, and readv/writev take
+//                   any range of spans.  Every operation returns a
+//                   block::Result, which is std::expected where the library
+//                   has it and an equivalent class otherwise.
+//
+//  Author         : Vinayak Gupta
+//
+
+// Include files
+#include <concepts>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <ranges>
+#include <span>
+#include <utility>
+#if __has_include(<expected>)
+#include <expected>
+#endif
+
+// Project Includes
+extern "C" {
+#include <block_controller.h>
+}
+#include <block_driver.h>
+#include <block_qos.h>
+
+namespace block {
+
+//
+// Errors
+
+enum class Errc {
+	failed = 1, // the driver call returned -1
+	closed, // the handle does not refer to an open file
+	too_large, // the transfer does not fit the driver's 32 bit count
+};
+
+struct Error {
+	Errc code; // what went wrong
+	const char* op; // the driver call that failed
+};
+
+#if defined(__cpp_lib_expected) && (__cpp_lib_expected >= 202202L)
+
+template <class T>
+using Result = std::expected<T, Error>;
+
+inline std::unexpected<Error> fail(Errc code, const char* op) { return std::unexpected<Error>(Error { code, op }); }
+
+#else
+
+// The failure half of a Result, what std::unexpected is to std::expected
+struct Unexpected {
+	Error err;
+};
+
+inline Unexpected fail(Errc code, const char* op) { return Unexpected { Error { code, op } }; }
+
+// A value or an Error, the subset of std::expected used here
+template <class T>
+class Result {
+public:
+	Result(const T& v) : val_(v), ok_(true) { }
+	Result(T&& v) : val_(std::move(v)), ok_(true) { }
+	Result(Unexpected u) : err_(u.err), ok_(false) { }
+
+	bool has_value() const noexcept { return ok_; }
+	explicit operator bool() const noexcept { return ok_; }
+	T& value() & { return val_; }
+	const T& value() const& { return val_; }
+	T&& value() && { return std::move(val_); }
+	T& operator*() & { return val_; }
+	const T& operator*() const& { return val_; }
+	T&& operator*() && { return std::move(val_); }
+	T* operator->() { return &val_; }
+	const T* operator->() const { return &val_; }
+	const Error& error() const { return err_; }
+	template <class U>
+	T value_or(U&& alt) const& { return ok_ ? val_ : static_cast<T>(std::forward<U>(alt)); }
+
+private:
+	T val_ {};
+	Error err_ {};
+	bool ok_;
+};
+
+template <>
+class Result<void> {
+public:
+	Result() : ok_(true) { }
+	Result(Unexpected u) : err_(u.err), ok_(false) { }
+
+	bool has_value() const noexcept { return ok_; }
+	explicit operator bool() const noexcept { return ok_; }
+	void value() const { }
+	void operator*() const { }
+	const Error& error() const { return err_; }
+
+private:
+	Error err_ {};
+	bool ok_;
+};
+
+#endif
+
+// Ranges whose elements are spans of bytes, for readv/writev
+template <class R>
+concept ByteSpanRange = std::ranges::input_range<R> && std::convertible_to<std::ranges::range_reference_t<R>, std::span<std::byte>>;
+
+template <class R>
+concept ConstByteSpanRange = std::ranges::input_range<R> && std::convertible_to<std::ranges::range_reference_t<R>, std::span<const std::byte>>;
+
+//
+// Driver power
+
+// Powers the driver on when created and off when destroyed
+class Driver {
+public:
+	static Result<Driver> power_on()
+	{
+		if (block_poweron() == -1) {
+			return fail(Errc::failed, "block_poweron");
+		}
+		return Driver(true);
+	}
+
+	Driver() noexcept = default;
+	Driver(Driver&& other) noexcept : on_(std::exchange(other.on_, false)) { }
+	Driver& operator=(Driver&& other) noexcept
+	{
+		if (this != &other) {
+			(void)power_off();
+			on_ = std::exchange(other.on_, false);
+		}
+		return *this;
+	}
+	Driver(const Driver&) = delete;
+	Driver& operator=(const Driver&) = delete;
+	~Driver() { (void)power_off(); }
+
+	// Power off now rather than at destruction, closing every file
+	Result<void> power_off()
+	{
+		if (std::exchange(on_, false) && (block_poweroff() == -1)) {
+			return fail(Errc::failed, "block_poweroff");
+		}
+		return {};
+	}
+
+private:
+	explicit Driver(bool on) noexcept : on_(on) { }
+	bool on_ = false;
+};
+
+//
+// Files
+
+// An open BLOCK file, closed when destroyed
+class File {
+public:
+	static Result<File> open(const char* path, int32_t flags = BLOCK_O_RDWR)
+	{
+		int16_t fd = block_open_flags(const_cast<char*>(path), flags);
+		if (fd == -1) {
+			return fail(Errc::failed, "block_open_flags");
+		}
+		return File(fd);
+	}
+
+	File() noexcept = default;
+	File(File&& other) noexcept : fd_(std::exchange(other.fd_, -1)) { }
+	File& operator=(File&& other) noexcept
+	{
+		if (this != &other) {
+			(void)close();
+			fd_ = std::exchange(other.fd_, -1);
+		}
+		return *this;
+	}
+	File(const File&) = delete;
+	File& operator=(const File&) = delete;
+	~File() { (void)close(); }
+
+	bool is_open() const noexcept { return fd_ != -1; }
+	int16_t native_handle() const noexcept { return fd_; }
+
+	// Give up ownership of the handle without closing it
+	int16_t release() noexcept { return std::exchange(fd_, -1); }
+
+	// Close now rather than at destruction, flushing buffered writes
+	Result<void> close()
+	{
+		if ((fd_ != -1) && (block_close(std::exchange(fd_, -1)) == -1)) {
+			return fail(Errc::failed, "block_close");
+		}
+		return {};
+	}
+
+	// Read at the cursor, returns the bytes read (short at end of file)
+	Result<std::size_t> read(std::span<std::byte> buf)
+	{
+		if (fd_ == -1) {
+			return fail(Errc::closed, "block_read");
+		}
+		if (buf.size() > static_cast<std::size_t>(std::numeric_limits<int32_t>::max())) {
+			return fail(Errc::too_large, "block_read");
+		}
+		int32_t n = block_read(fd_, reinterpret_cast<char*>(buf.data()), static_cast<int32_t>(buf.size()));
+		if (n == -1) {
+			return fail(Errc::failed, "block_read");
+		}
+		return static_cast<std::size_t>(n);
+	}
+
+	// Write at the cursor, returns the bytes written
+	Result<std::size_t> write(std::span<const std::byte> buf)
+	{
+		if (fd_ == -1) {
+			return fail(Errc::closed, "block_write");
+		}
+		if (buf.size() > static_cast<std::size_t>(std::numeric_limits<int32_t>::max())) {
+			return fail(Errc::too_large, "block_write");
+		}
+		int32_t n = block_write(fd_, const_cast<char*>(reinterpret_cast<const char*>(buf.data())), static_cast<int32_t>(buf.size()));
+		if (n == -1) {
+			return fail(Errc::failed, "block_write");
+		}
+		return static_cast<std::size_t>(n);
+	}
+
+	// Move the cursor to byte off
+	Result<void> seek(uint32_t off)
+	{
+		if (fd_ == -1) {
+			return fail(Errc::closed, "block_seek");
+		}
+		if (block_seek(fd_, off) == -1) {
+			return fail(Errc::failed, "block_seek");
+		}
+		return {};
+	}
+
+	// Read at byte off, leaves the cursor after the data
+	Result<std::size_t> read(std::span<std::byte> buf, uint32_t off)
+	{
+		if (auto r = seek(off); !r) {
+			return fail(r.error().code, r.error().op);
+		}
+		return read(buf);
+	}
+
+	// Write at byte off, leaves the cursor after the data
+	Result<std::size_t> write(std::span<const std::byte> buf, uint32_t off)
+	{
+		if (auto r = seek(off); !r) {
+			return fail(r.error().code, r.error().op);
+		}
+		return write(buf);
+	}
+
+	// Read at byte off without using or moving the cursor
+	Result<std::size_t> pread(std::span<std::byte> buf, uint32_t off)
+	{
+		if (fd_ == -1) {
+			return fail(Errc::closed, "block_pread");
+		}
+		if (buf.size() > static_cast<std::size_t>(std::numeric_limits<int32_t>::max())) {
+			return fail(Errc::too_large, "block_pread");
+		}
+		int32_t n = block_pread(fd_, reinterpret_cast<char*>(buf.data()), static_cast<int32_t>(buf.size()), off);
+		if (n == -1) {
+			return fail(Errc::failed, "block_pread");
+		}
+		return static_cast<std::size_t>(n);
+	}
+
+	// Write at byte off without using or moving the cursor
+	Result<std::size_t> pwrite(std::span<const std::byte> buf, uint32_t off)
+	{
+		if (fd_ == -1) {
+			return fail(Errc::closed, "block_pwrite");
+		}
+		if (buf.size() > static_cast<std::size_t>(std::numeric_limits<int32_t>::max())) {
+			return fail(Errc::too_large, "block_pwrite");
+		}
+		int32_t n = block_pwrite(fd_, const_cast<char*>(reinterpret_cast<const char*>(buf.data())), static_cast<int32_t>(buf.size()), off);
+		if (n == -1) {
+			return fail(Errc::failed, "block_pwrite");
+		}
+		return static_cast<std::size_t>(n);
+	}
+
+	// Scatter read at the cursor into each span in turn, stops at end of file
+	template <ByteSpanRange R>
+	Result<std::size_t> readv(R&& bufs)
+	{
+		std::size_t total = 0;
+		for (std::span<std::byte> buf : bufs) {
+			auto n = read(buf);
+			if (!n) {
+				return n;
+			}
+			total += *n;
+			if (*n < buf.size()) {
+				break;
+			}
+		}
+		return total;
+	}
+
+	// Gather write at the cursor from each span in turn
+	template <ConstByteSpanRange R>
+	Result<std::size_t> writev(R&& bufs)
+	{
+		std::size_t total = 0;
+		for (std::span<const std::byte> buf : bufs) {
+			auto n = write(buf);
+			if (!n) {
+				return n;
+			}
+			total += *n;
+		}
+		return total;
+	}
+
+	// Declare the expected access pattern of a range
+	Result<void> advise(uint32_t off, uint32_t len, BlockAdvice hint)
+	{
+		if (fd_ == -1) {
+			return fail(Errc::closed, "block_advise");
+		}
+		if (block_advise(fd_, off, len, hint) == -1) {
+			return fail(Errc::failed, "block_advise");
+		}
+		return {};
+	}
+
+	// Reserve contiguous frames for a range, the size is unchanged
+	Result<void> fallocate(uint32_t off, uint32_t len)
+	{
+		if (fd_ == -1) {
+			return fail(Errc::closed, "block_fallocate");
+		}
+		if (block_fallocate(fd_, off, len) == -1) {
+			return fail(Errc::failed, "block_fallocate");
+		}
+		return {};
+	}
+
+	// Put the file in an I/O class until it is closed
+	Result<void> qos(BlockQosClass cls)
+	{
+		if (fd_ == -1) {
+			return fail(Errc::closed, "block_qos");
+		}
+		if (block_qos(fd_, cls) == -1) {
+			return fail(Errc::failed, "block_qos");
+		}
+		return {};
+	}
+
+	// Create a copy-on-write clone of the file at path
+	Result<void> clone(const char* path)
+	{
+		if (fd_ == -1) {
+			return fail(Errc::closed, "block_clone");
+		}
+		if (block_clone(fd_, const_cast<char*>(path)) == -1) {
+			return fail(Errc::failed, "block_clone");
+		}
+		return {};
+	}
+
+	// Create a read-only snapshot of the file at path
+	Result<void> snapshot(const char* path)
+	{
+		if (fd_ == -1) {
+			return fail(Errc::closed, "block_snapshot");
+		}
+		if (block_snapshot(fd_, const_cast<char*>(path)) == -1) {
+			return fail(Errc::failed, "block_snapshot");
+		}
+		return {};
+	}
+
+private:
+	explicit File(int16_t fd) noexcept : fd_(fd) { }
+	int16_t fd_ = -1;
+};
+
+// Remove a closed file
+inline Result<void> unlink(const char* path)
+{
+	if (block_unlink(const_cast<char*>(path)) == -1) {
+		return fail(Errc::failed, "block_unlink");
+	}
+	return {};
+}
+
+} // namespace block
+
+#endif
@@ -0,0 +1,783 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : block_bench.c
+//  Description    : This is the frame geometry benchmark.  The driver is
+//                   compiled once per frame size (see the Makefile bench
+//                   targets), each build against the stand-in store, and
+//                   this program runs the same workloads on whichever
+//                   geometry it was built with.  For every record size it
+//                   writes a file sequentially, overwrites it at random
+//                   record offsets, reads it back and then creates a set of
+//                   one-record files, and stores the same records in a bkv
+//                   store where they fit; block_sim workload files given on the
+//                   command line are replayed as further workloads.  Each
+//                   phase reports its throughput, its read and write
+//                   amplification (bytes moved on the bus per byte the
+//                   workload read or wrote), the driver metadata memory and
+//                   the space amplification (bytes of allotted frames per
+//                   byte stored).  With -p the record phases run at once
+//                   on several independent driver contexts, one thread
+//                   each, and the aggregate throughput is reported.
+//
+//  Author         : Vinayak Gupta
+//
+
+// Include Files
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Project Includes
+#include <block_cache.h>
+#include <block_ctx.h>
+#include <block_driver.h>
+#include <block_geometry.h>
+#include <block_kv.h>
+#include <block_log.h>
+#include <block_pack.h>
+#include <block_volume.h>
+#include <cmpsc311_log.h>
+
+// Defines
+#define BENCH_ARGUMENTS "hvl:n:r:f:c:m:w:q:g:k:s:p:"
+#define BENCH_DEFAULT_BYTES (16 * 1024 * 1024) // Bytes moved by each phase
+#define BENCH_DEFAULT_FILES 4096 // Most files created by the files phase
+#define BENCH_MAX_RECORDS 16 // Record sizes in one run
+#define BENCH_MAX_RECORD (1024 * 1024) // Largest record size
+#define BENCH_MAX_INSTANCES 64 // Most driver contexts run at once
+#define USAGE                                                                    \
+    "USAGE: block_bench [-h] [-v] [-l <logfile>] [-n <bytes>] [-r <sizes>]\n"    \
+    "                   [-f <files>] [-c <sz>] [-m <members>] [-w <stripe>]\n"   \
+    "                   [-q <depth>] [-g <frames>] [-k <bytes>] [-s <seed>]\n"  \
+    "                   [-p <instances>] [<workload-file> ...]\n"               \
+    "\n"                                                                         \
+    "where:\n"                                                                   \
+    "    -h - help mode (display this message)\n"                                \
+    "    -v - verbose output\n"                                                  \
+    "    -l - write log messages to the filename <logfile>\n"                    \
+    "    -n - bytes moved by each phase (default 16777216)\n"                    \
+    "    -r - comma separated record sizes (default 128,1024,4096,65536)\n"      \
+    "    -f - most files created by the files phase (default 4096)\n"            \
+    "    -c - set the block frame cache to <sz> frames (0 disables)\n"          \
+    "    -m - stripe the volume across <members> controllers (default 1)\n"      \
+    "    -w - stripe width of <stripe> frames per member (default 1)\n"          \
+    "    -q - hold up to <depth> writes in the volume scheduler (0 disables)\n" \
+    "    -g - log-structured writes in segments of <frames> frames\n"         \
+    "    -k - pack files of up to <bytes> bytes several to a frame\n"          \
+    "    -s - PRNG seed of the overwrite offsets (default 1)\n"                  \
+    "    -p - run the record phases on <instances> driver contexts at once\n"  \
+    "\n"                                                                         \
+    "    <workload-file> - block_sim workload replayed after the record phases\n" \
+    "\n"
+
+// One measured phase
+typedef struct {
+    uint64_t start; // monotonic usec the phase began
+    BlockVolumeStats bus; // bus counters when the phase began
+    uint64_t written; // bytes written by the workload
+    uint64_t read; // bytes read by the workload
+    uint64_t stored; // bytes held in files at the end of the phase
+} BenchPhase;
+
+// Driver configuration applied to every context
+typedef struct {
+    uint32_t cache_size; // frame cache lines
+    uint32_t log_segment; // log segment frames, 0 writes in place
+    uint32_t pack_threshold; // largest packed file, 0 disables packing
+    int members; // volume members
+    int stripe; // stripe width in frames
+    int queue_depth; // scheduler queue depth
+} BenchConfig;
+
+// One driver context running the record phases
+typedef struct {
+    BlockContext* ctx; // the context
+    int id; // instance number, from 1
+    uint64_t seed; // overwrite offset PRNG seed
+    uint32_t* records; // record sizes
+    int nrecords; // number of record sizes
+    uint32_t bytes; // bytes moved by each phase
+    uint32_t files; // most files created by the files phase
+    uint64_t moved; // bytes read and written (output)
+    int ret; // 0 if every phase succeeded (output)
+} BenchInstance;
+
+//
+// Global Data
+__thread uint64_t bench_seed = 1; // overwrite offset PRNG state
+__thread int bench_instance; // instance number of the calling thread, 0 without -p
+__thread uint64_t bench_moved; // bytes read and written by the calling thread's phases
+
+//
+// Functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bench_usec
+// Description  : monotonic clock in microseconds
+//
+// Inputs       : none
+// Outputs      : microseconds
+
+static uint64_t bench_usec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bench_random
+// Description  : next value of the xorshift PRNG
+//
+// Inputs       : none
+// Outputs      : a pseudo-random 64 bit value
+
+static uint64_t bench_random(void)
+{
+    bench_seed ^= bench_seed << 13;
+    bench_seed ^= bench_seed >> 7;
+    bench_seed ^= bench_seed << 17;
+    return (bench_seed);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bench_fill
+// Description  : fill a record with a pattern that depends on its offset,
+//                so a read back can be checked
+//
+// Inputs       : buf - the record
+//                len - its length
+//                off - its file offset
+//                pass - distinguishes rewrites of the same offset
+// Outputs      : none
+
+static void bench_fill(char* buf, uint32_t len, uint32_t off, uint32_t pass)
+{
+    uint32_t i;
+
+    for (i = 0; i < len; i++) {
+        buf[i] = (char)((off + i) * 31 + pass);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bench_begin
+// Description  : start a phase
+//
+// Inputs       : phase - the phase
+// Outputs      : none
+
+static void bench_begin(BenchPhase* phase)
+{
+    memset(phase, 0x0, sizeof(BenchPhase));
+    block_volume_stats(&phase->bus);
+    phase->start = bench_usec();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bench_report
+// Description  : flush the volume scheduler and print the results of a
+//                phase
+//
+// Inputs       : name - the phase name
+//                record - the record size, 0 for a replayed workload
+//                phase - the phase
+// Outputs      : 0 if successful, -1 if failure
+
+static int bench_report(char* name, uint32_t record, BenchPhase* phase)
+{
+    BlockVolumeStats bus;
+    BlockVolumeFrame f, used = 0;
+    double secs, ramp = 0, wamp = 0, samp = 0;
+    char label[32];
+
+    if (block_volume_flush()) {
+        logMessage(LOG_ERROR_LEVEL, "Failed to flush the volume after phase %s", name);
+        return (-1);
+    }
+    secs = (bench_usec() - phase->start) / 1e6;
+    block_volume_stats(&bus);
+    for (f = 0; f < block_volume_frames(); f++) {
+        used += getFrameStatus(f);
+    }
+    if (phase->read > 0) {
+        ramp = (double)(bus.frames_read - phase->bus.frames_read) * BLOCK_FRAME_SIZE / phase->read;
+    }
+    if (phase->written > 0) {
+        wamp = (double)(bus.frames_written - phase->bus.frames_written) * BLOCK_FRAME_SIZE / phase->written;
+    }
+    if (phase->stored > 0) {
+        samp = (double)used * BLOCK_FRAME_SIZE / phase->stored;
+    }
+    if (bench_instance > 0) {
+        snprintf(label, sizeof(label), "%s/%d", name, bench_instance);
+    } else {
+        snprintf(label, sizeof(label), "%s", name);
+    }
+    bench_moved += phase->written + phase->read;
+    printf("%6d %-16.16s %8u %10.2f %8.2f %8.2f %12lu %8.2f\n", BLOCK_FRAME_SIZE, label, record,
+        (phase->written + phase->read) / (secs > 0 ? secs : 1e-6) / (1024 * 1024),
+        ramp, wamp, (unsigned long)(driverMetadataBytes() / 1024), samp);
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bench_records
+// Description  : run the write, overwrite, read, files and kv phases at
+//                one record size on a freshly powered on volume
+//
+// Inputs       : record - the record size
+//                bytes - bytes moved by each phase
+//                files - most files created by the files phase
+// Outputs      : 0 if successful, -1 if failure
+
+static int bench_records(uint32_t record, uint32_t bytes, uint32_t files)
+{
+    BenchPhase phase;
+    char *buf, *chk, name[BLOCK_MAX_PATH_LENGTH];
+    uint32_t off, nrec = bytes / record, i;
+    uint16_t klen;
+    BlockKV* kv;
+    int16_t fd;
+    int ret = -1;
+
+    if (nrec == 0) {
+        logMessage(LOG_ERROR_LEVEL, "Record size %u larger than the phase size %u", record, bytes);
+        return (-1);
+    }
+    if (((buf = malloc(record)) == NULL) || ((chk = malloc(record)) == NULL)) {
+        logMessage(LOG_ERROR_LEVEL, "Failed to allocate %u byte records", record);
+        free(buf);
+        return (-1);
+    }
+    if (block_poweron() == -1) {
+        logMessage(LOG_ERROR_LEVEL, "Benchmark failed to power on the driver");
+        free(buf);
+        free(chk);
+        return (-1);
+    }
+
+    // Sequential write of the file
+    bench_begin(&phase);
+    if ((fd = block_open("bench.seq")) == -1) {
+        goto done;
+    }
+    for (i = 0; i < nrec; i++) {
+        bench_fill(buf, record, i * record, 0);
+        if (block_write(fd, buf, record) != (int32_t)record) {
+            logMessage(LOG_ERROR_LEVEL, "Write of record %u failed", i);
+            goto done;
+        }
+    }
+    block_close(fd);
+    phase.written = phase.stored = (uint64_t)nrec * record;
+    if (bench_report("write", record, &phase)) {
+        goto done;
+    }
+
+    // Overwrite at random record offsets
+    bench_begin(&phase);
+    if ((fd = block_open("bench.seq")) == -1) {
+        goto done;
+    }
+    for (i = 0; i < nrec; i++) {
+        off = (uint32_t)(bench_random() % nrec) * record;
+        bench_fill(buf, record, off, 0);
+        if ((block_seek(fd, off) != 0) || (block_write(fd, buf, record) != (int32_t)record)) {
+            logMessage(LOG_ERROR_LEVEL, "Overwrite at offset %u failed", off);
+            goto done;
+        }
+    }
+    block_close(fd);
+    phase.written = phase.stored = (uint64_t)nrec * record;
+    if (bench_report("overwrite", record, &phase)) {
+        goto done;
+    }
+
+    // Sequential read back
+    bench_begin(&phase);
+    if ((fd = block_open("bench.seq")) == -1) {
+        goto done;
+    }
+    for (i = 0; i < nrec; i++) {
+        bench_fill(chk, record, i * record, 0);
+        if ((block_read(fd, buf, record) != (int32_t)record) || memcmp(buf, chk, record)) {
+            logMessage(LOG_ERROR_LEVEL, "Read back of record %u failed", i);
+            goto done;
+        }
+    }
+    block_close(fd);
+    phase.read = phase.stored = (uint64_t)nrec * record;
+    if (bench_report("read", record, &phase)) {
+        goto done;
+    }
+
+    // One record in each of many files
+    bench_begin(&phase);
+    for (i = 0; (i < files) && (i < nrec); i++) {
+        snprintf(name, sizeof(name), "bench.%u", i);
+        bench_fill(buf, record, 0, i);
+        if (((fd = block_open(name)) == -1) || (block_write(fd, buf, record) != (int32_t)record)) {
+            logMessage(LOG_ERROR_LEVEL, "Write of file %s failed", name);
+            goto done;
+        }
+        block_close(fd);
+        phase.written += record;
+    }
+    phase.stored = (uint64_t)nrec * record + phase.written;
+    if (bench_report("files", record, &phase)) {
+        goto done;
+    }
+
+    // The same records as keys of one bkv store, then looked up
+    if (record + BLOCK_MAX_PATH_LENGTH <= BKV_MAX_RECORD) {
+        bench_begin(&phase);
+        if ((kv = bkv_open("bench.kv")) == NULL) {
+            goto done;
+        }
+        for (i = 0; (i < files) && (i < nrec); i++) {
+            klen = snprintf(name, sizeof(name), "bench.%u", i);
+            bench_fill(buf, record, 0, i);
+            if (bkv_put(kv, name, klen, buf, record)) {
+                logMessage(LOG_ERROR_LEVEL, "Put of key %s failed", name);
+                bkv_close(kv);
+                goto done;
+            }
+            phase.written += record;
+        }
+        for (i = 0; (i < files) && (i < nrec); i++) {
+            klen = snprintf(name, sizeof(name), "bench.%u", i);
+            bench_fill(chk, record, 0, i);
+            if ((bkv_get(kv, name, klen, buf, record) != (int32_t)record) || memcmp(buf, chk, record)) {
+                logMessage(LOG_ERROR_LEVEL, "Get of key %s failed", name);
+                bkv_close(kv);
+                goto done;
+            }
+            phase.read += record;
+        }
+        if (bkv_close(kv)) {
+            goto done;
+        }
+        phase.stored = (uint64_t)nrec * record + 2 * phase.written;
+        if (bench_report("kv", record, &phase)) {
+            goto done;
+        }
+    }
+    ret = 0;
+
+done:
+    if (block_poweroff() == -1) {
+        logMessage(LOG_ERROR_LEVEL, "Benchmark failed to power off the driver");
+        ret = -1;
+    }
+    free(buf);
+    free(chk);
+    return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bench_replay
+// Description  : replay a block_sim workload file on a freshly powered on
+//                volume, the reads are not validated
+//
+// Inputs       : wload - the workload file
+// Outputs      : 0 if successful, -1 if failure
+
+static int bench_replay(char* wload)
+{
+    BenchPhase phase;
+    char line[2048], fname[128], command[128], text[1025], *sep, *base;
+    char* names[BLOCK_MAX_OPEN_FILES];
+    int16_t fds[BLOCK_MAX_OPEN_FILES];
+    int32_t len, off, size;
+    int idx, i, nfiles = 0, ret = -1;
+    FILE* fhandle;
+
+    if ((fhandle = fopen(wload, "r")) == NULL) {
+        logMessage(LOG_ERROR_LEVEL, "Failure opening the workload file [%s], error: %s.", wload, strerror(errno));
+        return (-1);
+    }
+    if (block_poweron() == -1) {
+        logMessage(LOG_ERROR_LEVEL, "Benchmark failed to power on the driver");
+        fclose(fhandle);
+        return (-1);
+    }
+
+    bench_begin(&phase);
+    while (fgets(line, sizeof(line), fhandle) != NULL) {
+        if ((sscanf(line, "%127s %127s %d %d", fname, command, &len, &off) != 4) ||
+            ((sep = strchr(line, ':')) == NULL) || (len < 0) || (len > 1024)) {
+            logMessage(LOG_ERROR_LEVEL, "Un-parsable workload line [%s]", line);
+            goto done;
+        }
+
+        // A payload may hold a raw newline, the rest of it is on the next line
+        while ((strlen(sep + 1) < (size_t)len) && (strlen(line) < sizeof(line) - 1) &&
+            (fgets(line + strlen(line), sizeof(line) - strlen(line), fhandle) != NULL))
+            ;
+
+        // Find the file, opening it on first use
+        for (idx = 0; (idx < nfiles) && strcmp(names[idx], fname); idx++)
+            ;
+        if (idx == nfiles) {
+            if ((nfiles == BLOCK_MAX_OPEN_FILES) || ((fds[idx] = block_open(fname)) == -1)) {
+                logMessage(LOG_ERROR_LEVEL, "Open of workload file [%s] failed", fname);
+                goto done;
+            }
+            names[nfiles++] = strdup(fname);
+        }
+
+        if (strncmp(command, "WRITEAT", 7) == 0) {
+            if (block_seek(fds[idx], off)) {
+                logMessage(LOG_ERROR_LEVEL, "Seek of [%s] to %d failed", fname, off);
+                goto done;
+            }
+        }
+        if (strncmp(command, "WRITE", 5) == 0) {
+            strncpy(text, sep + 1, len);
+            for (i = 0; i < len; i++) {
+                text[i] = (text[i] == '^') ? '\n' : text[i];
+            }
+            if (block_write(fds[idx], text, len) != len) {
+                logMessage(LOG_ERROR_LEVEL, "Write of [%s], length %d failed", fname, len);
+                goto done;
+            }
+            phase.written += len;
+        } else if (strncmp(command, "SEEK", 4) == 0) {
+            if (block_seek(fds[idx], off)) {
+                logMessage(LOG_ERROR_LEVEL, "Seek of [%s] to %d failed", fname, off);
+                goto done;
+            }
+        } else if (strncmp(command, "READ", 4) == 0) {
+            if (block_read(fds[idx], text, len) != len) {
+                logMessage(LOG_ERROR_LEVEL, "Read of [%s], length %d failed", fname, len);
+                goto done;
+            }
+            phase.read += len;
+        } else {
+            logMessage(LOG_ERROR_LEVEL, "Unknown workload command [%s]", command);
+            goto done;
+        }
+    }
+    for (idx = 0; idx < nfiles; idx++) {
+        if ((size = getFileSize(fds[idx])) > 0) {
+            phase.stored += size;
+        }
+        block_close(fds[idx]);
+    }
+    base = strrchr(wload, '/');
+    if (bench_report(base ? base + 1 : wload, 0, &phase) == 0) {
+        ret = 0;
+    }
+
+done:
+    if (block_poweroff() == -1) {
+        logMessage(LOG_ERROR_LEVEL, "Benchmark failed to power off the driver");
+        ret = -1;
+    }
+    for (idx = 0; idx < nfiles; idx++) {
+        free(names[idx]);
+    }
+    fclose(fhandle);
+    return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bench_configure
+// Description  : configure the driver context of the calling thread
+//
+// Inputs       : cfg - the configuration
+// Outputs      : 0 if successful, -1 if failure
+
+static int bench_configure(BenchConfig* cfg)
+{
+    if (block_volume_configure(cfg->members, cfg->stripe) == -1) {
+        fprintf(stderr, "Bad volume geometry (%d members, stripe %d), aborting.\n", cfg->members, cfg->stripe);
+        return (-1);
+    }
+    if (block_volume_schedule(cfg->queue_depth, BLOCK_VOLUME_QUEUE_DEADLINE_USEC) == -1) {
+        fprintf(stderr, "Bad scheduler queue depth %d, aborting.\n", cfg->queue_depth);
+        return (-1);
+    }
+    block_cache_configure(cfg->cache_size);
+    block_log_configure(cfg->log_segment);
+    if (block_pack_configure(cfg->pack_threshold) == -1) {
+        fprintf(stderr, "Bad pack threshold %u, aborting.\n", cfg->pack_threshold);
+        return (-1);
+    }
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bench_thread
+// Description  : run the record phases of one instance on its context
+//
+// Inputs       : arg - the BenchInstance
+// Outputs      : NULL
+
+static void* bench_thread(void* arg)
+{
+    BenchInstance* inst = arg;
+    int i;
+
+    block_ctx_enter(inst->ctx);
+    bench_seed = inst->seed;
+    bench_instance = inst->id;
+    for (i = 0; (i < inst->nrecords) && (inst->ret == 0); i++) {
+        if (bench_records(inst->records[i], inst->bytes, inst->files)) {
+            logMessage(LOG_ERROR_LEVEL, "Instance %d benchmark of %u byte records failed.", inst->id, inst->records[i]);
+            inst->ret = -1;
+        }
+    }
+    inst->moved = bench_moved;
+    return (NULL);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bench_parallel
+// Description  : run the record phases on several driver contexts at once
+//                and report the aggregate throughput
+//
+// Inputs       : cfg - the configuration of every context
+//                ninst - the number of contexts
+//                records - the record sizes
+//                nrecords - number of record sizes
+//                bytes - bytes moved by each phase
+//                files - most files created by the files phase
+// Outputs      : 0 if successful, -1 if failure
+
+static int bench_parallel(BenchConfig* cfg, int ninst, uint32_t* records, int nrecords, uint32_t bytes, uint32_t files)
+{
+    BenchInstance inst[BENCH_MAX_INSTANCES];
+    pthread_t threads[BENCH_MAX_INSTANCES];
+    BlockContext* prev;
+    uint64_t start, moved = 0;
+    int i, started, ret = 0;
+    double secs;
+
+    // Every instance gets its own context, configured alike
+    memset(inst, 0x0, sizeof(inst));
+    for (i = 0; (i < ninst) && (ret == 0); i++) {
+        inst[i].id = i + 1;
+        inst[i].seed = bench_seed + i;
+        inst[i].records = records;
+        inst[i].nrecords = nrecords;
+        inst[i].bytes = bytes;
+        inst[i].files = files;
+        if ((inst[i].ctx = block_ctx_create()) == NULL) {
+            ret = -1;
+            break;
+        }
+        prev = block_ctx_enter(inst[i].ctx);
+        ret = bench_configure(cfg);
+        block_ctx_leave(prev);
+    }
+    if (ret) {
+        goto done;
+    }
+
+    start = bench_usec();
+    for (started = 0; started < ninst; started++) {
+        if (pthread_create(&threads[started], NULL, bench_thread, &inst[started])) {
+            logMessage(LOG_ERROR_LEVEL, "Failed to start benchmark instance %d", started + 1);
+            ret = -1;
+            break;
+        }
+    }
+    for (i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+        moved += inst[i].moved;
+        ret = inst[i].ret ? -1 : ret;
+    }
+    secs = (bench_usec() - start) / 1e6;
+    printf("# %d instances moved %lu MB in %.2f s, %.2f MB/s aggregate\n", started, (unsigned long)(moved >> 20), secs,
+        moved / (secs > 0 ? secs : 1e-6) / (1024 * 1024));
+
+done:
+    for (i = 0; i < ninst; i++) {
+        if (inst[i].ctx != NULL) {
+            block_ctx_destroy(inst[i].ctx);
+        }
+    }
+    return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : main
+// Description  : The main function for the frame geometry benchmark
+//
+// Inputs       : argc - the number of command line parameters
+//                argv - the parameters
+// Outputs      : 0 if successful, -1 if failure
+
+int main(int argc, char* argv[])
+{
+
+    // Local variables
+    int ch, i, verbose = 0, log_initialized = 0, nrecords = 4, instances = 1;
+    uint32_t records[BENCH_MAX_RECORDS] = { 128, 1024, 4096, 65536 };
+    uint32_t bytes = BENCH_DEFAULT_BYTES, files = BENCH_DEFAULT_FILES;
+    BenchConfig cfg = { 1024, 0, 0, 1, 1, BLOCK_VOLUME_QUEUE_DEPTH };
+    char *tok, *save;
+
+    // Process the command line parameters
+    while ((ch = getopt(argc, argv, BENCH_ARGUMENTS)) != -1) {
+
+        switch (ch) {
+        case 'h': // Help, print usage
+            fprintf(stderr, USAGE);
+            return (-1);
+
+        case 'v': // Verbose Flag
+            verbose = 1;
+            break;
+
+        case 'l': // Set the log filename
+            initializeLogWithFilename(optarg);
+            log_initialized = 1;
+            break;
+
+        case 'n': // Set the phase size
+            if ((sscanf(optarg, "%u", &bytes) != 1) || (bytes == 0) || (bytes > INT32_MAX)) {
+                fprintf(stderr, "Bad phase size [%s]\n", optarg);
+                return (-1);
+            }
+            break;
+
+        case 'r': // Set the record sizes
+            nrecords = 0;
+            for (tok = strtok_r(optarg, ",", &save); tok != NULL; tok = strtok_r(NULL, ",", &save)) {
+                if ((nrecords == BENCH_MAX_RECORDS) || (sscanf(tok, "%u", &records[nrecords]) != 1) ||
+                    (records[nrecords] == 0) || (records[nrecords] > BENCH_MAX_RECORD)) {
+                    fprintf(stderr, "Bad record size [%s]\n", tok);
+                    return (-1);
+                }
+                nrecords++;
+            }
+            break;
+
+        case 'f': // Set the files phase size
+            if (sscanf(optarg, "%u", &files) != 1) {
+                fprintf(stderr, "Bad file count [%s]\n", optarg);
+                return (-1);
+            }
+            break;
+
+        case 'c': // Set cache line size
+            if (sscanf(optarg, "%u", &cfg.cache_size) != 1) {
+                fprintf(stderr, "Bad cache size [%s]\n", optarg);
+                return (-1);
+            }
+            break;
+
+        case 'm': // Set the number of volume members
+            if (sscanf(optarg, "%d", &cfg.members) != 1) {
+                fprintf(stderr, "Bad volume member count [%s]\n", optarg);
+                return (-1);
+            }
+            break;
+
+        case 'w': // Set the stripe width
+            if (sscanf(optarg, "%d", &cfg.stripe) != 1) {
+                fprintf(stderr, "Bad stripe width [%s]\n", optarg);
+                return (-1);
+            }
+            break;
+
+        case 'q': // Set the scheduler queue depth
+            if (sscanf(optarg, "%d", &cfg.queue_depth) != 1) {
+                fprintf(stderr, "Bad scheduler queue depth [%s]\n", optarg);
+                return (-1);
+            }
+            break;
+
+        case 'g': // Write log-structured
+            if ((sscanf(optarg, "%u", &cfg.log_segment) != 1) || (cfg.log_segment == 0)) {
+                fprintf(stderr, "Bad log segment size [%s]\n", optarg);
+                return (-1);
+            }
+            break;
+
+        case 'k': // Pack small files
+            if (sscanf(optarg, "%u", &cfg.pack_threshold) != 1) {
+                fprintf(stderr, "Bad pack threshold [%s]\n", optarg);
+                return (-1);
+            }
+            break;
+
+        case 's': // Set the PRNG seed
+            if ((sscanf(optarg, "%lu", (unsigned long*)&bench_seed) != 1) || (bench_seed == 0)) {
+                fprintf(stderr, "Bad seed [%s]\n", optarg);
+                return (-1);
+            }
+            break;
+
+        case 'p': // Set the number of parallel instances
+            if ((sscanf(optarg, "%d", &instances) != 1) || (instances < 1) || (instances > BENCH_MAX_INSTANCES)) {
+                fprintf(stderr, "Bad instance count [%s]\n", optarg);
+                return (-1);
+            }
+            break;
+
+        default: // Default (unknown)
+            fprintf(stderr, "Unknown command line option (%c), aborting.\n", ch);
+            return (-1);
+        }
+    }
+
+    // Setup the log as needed
+    if (!log_initialized) {
+        initializeLogWithFilehandle(CMPSC311_LOG_STDERR);
+    }
+    if (verbose) {
+        enableLogLevels(LOG_INFO_LEVEL);
+    }
+
+    // Configure the volume the same way for every phase
+    if (bench_configure(&cfg)) {
+        return (-1);
+    }
+
+    // Run the phases
+    printf("# frame %d bytes, %d frames per member, %d members, %lu MB capacity\n", BLOCK_FRAME_SIZE,
+        BLOCK_BLOCK_SIZE, cfg.members, (unsigned long)((uint64_t)cfg.members * BLOCK_BLOCK_SIZE * BLOCK_FRAME_SIZE >> 20));
+    printf("%6s %-16s %8s %10s %8s %8s %12s %8s\n", "frame", "workload", "record", "MB/s", "ramp", "wamp",
+        "meta(KB)", "space");
+    if (instances > 1) {
+        if (bench_parallel(&cfg, instances, records, nrecords, bytes, files)) {
+            logMessage(LOG_ERROR_LEVEL, "Benchmark of %d instances failed, aborting.", instances);
+            return (-1);
+        }
+    }
+    for (i = 0; (i < nrecords) && (instances == 1); i++) {
+        if (bench_records(records[i], bytes, files)) {
+            logMessage(LOG_ERROR_LEVEL, "Benchmark of %u byte records failed, aborting.", records[i]);
+            return (-1);
+        }
+    }
+    for (i = optind; i < argc; i++) {
+        if (bench_replay(argv[i])) {
+            logMessage(LOG_ERROR_LEVEL, "Replay of workload [%s] failed, aborting.", argv[i]);
+            return (-1);
+        }
+    }
+
+    // Return successfully
+    return (0);
+}
@@ -0,0 +1,364 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : block_cache.c
+//  Description    : This is the implementation of the BLOCK frame cache.
+//                   Lines live in one array, linked into an LRU list and
+//                   into hash chains by index.  The cache only ever holds
+//                   frames whose checksum was verified or which were just
+//                   written, so a hit never needs to be re-checked.
+//
+//  Author         : Vinayak Gupta
+//
+
+// Includes
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Project Includes
+#include <block_cache.h>
+#include <block_ctx.h>
+#include <block_geometry.h>
+#include <cmpsc311_log.h>
+
+// Type definitions
+typedef struct {
+	BlockVolumeFrame frame; // frame held by the line
+	int valid; // 1 if the line holds a frame
+	int32_t prev, next; // LRU list links, -1 terminated
+	int32_t hnext; // hash chain link, -1 terminated
+} BlockCacheLine;
+
+// The cache of a context
+struct BlockCacheState {
+	uint32_t lines; // configured number of lines
+	uint32_t buckets; // hash buckets, a power of two
+	BlockCacheLine* line; // line descriptors
+	char* data; // line data, lines * BLOCK_FRAME_SIZE
+	int32_t* bucket; // hash chain heads
+	int32_t head, tail; // most / least recently used line
+	uint64_t hits, misses; // lookup statistics
+	pthread_mutex_t lock;
+};
+#define cache (*block_ctx_bound->cache) // the cache of the calling thread's context
+
+//
+// Implementation
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_cache_ctx_create / block_cache_ctx_destroy
+// Description  : create and release the cache of a context
+//
+// Inputs       : state - the cache to release, may be NULL
+// Outputs      : block_cache_ctx_create returns the cache, NULL if failure
+struct BlockCacheState* block_cache_ctx_create(void)
+{
+	struct BlockCacheState* state;
+
+	if ((state = calloc(1, sizeof(struct BlockCacheState))) == NULL) {
+		return NULL;
+	}
+	state->lines = BLOCK_CACHE_DEFAULT_LINES;
+	pthread_mutex_init(&state->lock, NULL);
+	return state;
+}
+
+void block_cache_ctx_destroy(struct BlockCacheState* state)
+{
+	if (state == NULL) {
+		return;
+	}
+	pthread_mutex_destroy(&state->lock);
+	free(state);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_cache_hash
+// Description  : hash bucket of a frame
+//
+// Inputs       : frame - the volume frame
+// Outputs      : the bucket index
+static uint32_t block_cache_hash(BlockVolumeFrame frame)
+{
+	return ((frame * 2654435761u) & (cache.buckets - 1));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_cache_unlink / block_cache_link
+// Description  : remove a line from the LRU list / add it at one end
+//
+// Inputs       : l - the line index
+//                prio - the end to add it to
+// Outputs      : none
+static void block_cache_unlink(int32_t l)
+{
+	if (cache.line[l].prev >= 0) {
+		cache.line[cache.line[l].prev].next = cache.line[l].next;
+	} else {
+		cache.head = cache.line[l].next;
+	}
+	if (cache.line[l].next >= 0) {
+		cache.line[cache.line[l].next].prev = cache.line[l].prev;
+	} else {
+		cache.tail = cache.line[l].prev;
+	}
+	cache.line[l].prev = cache.line[l].next = -1;
+}
+
+static void block_cache_link(int32_t l, BlockCachePriority prio)
+{
+	if (prio == BLOCK_CACHE_HOT) {
+		cache.line[l].prev = -1;
+		cache.line[l].next = cache.head;
+		if (cache.head >= 0) {
+			cache.line[cache.head].prev = l;
+		}
+		cache.head = l;
+		if (cache.tail < 0) {
+			cache.tail = l;
+		}
+	} else {
+		cache.line[l].next = -1;
+		cache.line[l].prev = cache.tail;
+		if (cache.tail >= 0) {
+			cache.line[cache.tail].next = l;
+		}
+		cache.tail = l;
+		if (cache.head < 0) {
+			cache.head = l;
+		}
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_cache_lookup
+// Description  : find the line holding a frame, cache lock held
+//
+// Inputs       : frame - the volume frame
+// Outputs      : the line index, -1 if not cached
+static int32_t block_cache_lookup(BlockVolumeFrame frame)
+{
+	int32_t l;
+	for (l = cache.bucket[block_cache_hash(frame)]; l >= 0; l = cache.line[l].hnext) {
+		if (cache.line[l].frame == frame) {
+			return l;
+		}
+	}
+	return -1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_cache_unhash
+// Description  : remove a line from its hash chain, cache lock held
+//
+// Inputs       : l - the line index
+// Outputs      : none
+static void block_cache_unhash(int32_t l)
+{
+	int32_t* link = &cache.bucket[block_cache_hash(cache.line[l].frame)];
+	while (*link != l) {
+		link = &cache.line[*link].hnext;
+	}
+	*link = cache.line[l].hnext;
+	cache.line[l].valid = 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_cache_configure
+// Description  : set the number of cache lines
+//
+// Inputs       : lines - number of frames to cache, 0 disables the cache
+// Outputs      : 0 if successful, -1 if failure
+int32_t block_cache_configure(uint32_t lines)
+{
+	if (cache.line != NULL) {
+		logMessage(LOG_ERROR_LEVEL, "Cannot resize the frame cache while powered on");
+		return -1;
+	}
+	cache.lines = lines;
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_cache_poweron
+// Description  : allocate the cache lines, all lines start free at the cold
+//                end of the LRU list
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+int32_t block_cache_poweron(void)
+{
+	uint32_t i;
+
+	cache.hits = cache.misses = 0;
+	cache.head = cache.tail = -1;
+	if (cache.lines == 0) {
+		return 0;
+	}
+	for (cache.buckets = 1; cache.buckets < cache.lines; cache.buckets <<= 1)
+		;
+	cache.line = calloc(cache.lines, sizeof(BlockCacheLine));
+	cache.data = malloc((size_t)cache.lines * BLOCK_FRAME_SIZE);
+	cache.bucket = malloc(cache.buckets * sizeof(int32_t));
+	if ((cache.line == NULL) || (cache.data == NULL) || (cache.bucket == NULL)) {
+		logMessage(LOG_ERROR_LEVEL, "Failed to allocate frame cache of %u lines", cache.lines);
+		block_cache_poweroff();
+		return -1;
+	}
+	for (i = 0; i < cache.buckets; i++) {
+		cache.bucket[i] = -1;
+	}
+	for (i = 0; i < cache.lines; i++) {
+		block_cache_link(i, BLOCK_CACHE_COLD);
+	}
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_cache_poweroff
+// Description  : release the cache lines
+//
+// Inputs       : none
+// Outputs      : 0
+int32_t block_cache_poweroff(void)
+{
+	if (cache.line != NULL) {
+		logMessage(LOG_INFO_LEVEL, "Frame cache %lu hits, %lu misses", (unsigned long)cache.hits, (unsigned long)cache.misses);
+	}
+	free(cache.line);
+	free(cache.data);
+	free(cache.bucket);
+	cache.line = NULL;
+	cache.data = NULL;
+	cache.bucket = NULL;
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_cache_enabled
+// Description  : is the cache allocated
+//
+// Inputs       : none
+// Outputs      : 1 if the cache has lines, 0 otherwise
+int32_t block_cache_enabled(void)
+{
+	return (cache.line != NULL);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_cache_get
+// Description  : copy a cached frame, a hit moves the line to the hot end
+//
+// Inputs       : frame - the volume frame
+//                buf - frame buffer to copy into
+// Outputs      : 0 on hit, -1 on miss
+int32_t block_cache_get(BlockVolumeFrame frame, void* buf)
+{
+	int32_t l;
+
+	if (cache.line == NULL) {
+		return -1;
+	}
+	pthread_mutex_lock(&cache.lock);
+	if ((l = block_cache_lookup(frame)) < 0) {
+		cache.misses++;
+		pthread_mutex_unlock(&cache.lock);
+		return -1;
+	}
+	memcpy(buf, cache.data + (size_t)l * BLOCK_FRAME_SIZE, BLOCK_FRAME_SIZE);
+	block_cache_unlink(l);
+	block_cache_link(l, BLOCK_CACHE_HOT);
+	cache.hits++;
+	pthread_mutex_unlock(&cache.lock);
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_cache_put
+// Description  : insert or update a frame, evicting the coldest line
+//
+// Inputs       : frame - the volume frame
+//                buf - the frame contents
+//                prio - where the line enters the LRU list
+// Outputs      : none
+void block_cache_put(BlockVolumeFrame frame, void* buf, BlockCachePriority prio)
+{
+	int32_t l;
+	uint32_t h;
+
+	if (cache.line == NULL) {
+		return;
+	}
+	pthread_mutex_lock(&cache.lock);
+	if ((l = block_cache_lookup(frame)) < 0) {
+		l = cache.tail;
+		if (cache.line[l].valid) {
+			block_cache_unhash(l);
+		}
+		h = block_cache_hash(frame);
+		cache.line[l].frame = frame;
+		cache.line[l].valid = 1;
+		cache.line[l].hnext = cache.bucket[h];
+		cache.bucket[h] = l;
+	}
+	memcpy(cache.data + (size_t)l * BLOCK_FRAME_SIZE, buf, BLOCK_FRAME_SIZE);
+	block_cache_unlink(l);
+	block_cache_link(l, prio);
+	pthread_mutex_unlock(&cache.lock);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_cache_demote
+// Description  : move a cached frame to the cold end so it is evicted next
+//
+// Inputs       : frame - the volume frame
+// Outputs      : none
+void block_cache_demote(BlockVolumeFrame frame)
+{
+	int32_t l;
+
+	if (cache.line == NULL) {
+		return;
+	}
+	pthread_mutex_lock(&cache.lock);
+	if ((l = block_cache_lookup(frame)) >= 0) {
+		block_cache_unlink(l);
+		block_cache_link(l, BLOCK_CACHE_COLD);
+	}
+	pthread_mutex_unlock(&cache.lock);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_cache_invalidate
+// Description  : drop a frame from the cache
+//
+// Inputs       : frame - the volume frame
+// Outputs      : none
+void block_cache_invalidate(BlockVolumeFrame frame)
+{
+	int32_t l;
+
+	if (cache.line == NULL) {
+		return;
+	}
+	pthread_mutex_lock(&cache.lock);
+	if ((l = block_cache_lookup(frame)) >= 0) {
+		block_cache_unhash(l);
+		block_cache_unlink(l);
+		block_cache_link(l, BLOCK_CACHE_COLD);
+	}
+	pthread_mutex_unlock(&cache.lock);
+}
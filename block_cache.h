@@ -0,0 +1,69 @@
+#ifndef BLOCK_CACHE_INCLUDED
+#define BLOCK_CACHE_INCLUDED
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : block_cache.h
+//  Description    : This is the interface of the BLOCK frame cache, an LRU
+//                   cache of verified frames keyed by volume frame.
+//
+//  Author         : Vinayak Gupta
+//
+
+// Include files
+#include <stdint.h>
+
+// Project Includes
+#include <block_volume.h>
+
+// Defines
+#define BLOCK_CACHE_DEFAULT_LINES 1024 // Default number of cached frames
+
+// Where a frame enters the LRU list
+typedef enum {
+	BLOCK_CACHE_HOT = 0, // most recently used end, evicted last
+	BLOCK_CACHE_COLD = 1, // least recently used end, evicted first
+} BlockCachePriority;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//
+// Interface functions
+
+int32_t block_cache_configure(uint32_t lines);
+// Set the number of cache lines (0 disables), must precede block_poweron
+
+int32_t block_cache_poweron(void);
+// Allocate the cache lines
+
+int32_t block_cache_poweroff(void);
+// Release the cache lines, logs the hit rate
+
+int32_t block_cache_enabled(void);
+// 1 if the cache has lines, 0 otherwise
+
+int32_t block_cache_get(BlockVolumeFrame frame, void* buf);
+// Copy a cached frame into buf, 0 on hit, -1 on miss
+
+void block_cache_put(BlockVolumeFrame frame, void* buf, BlockCachePriority prio);
+// Insert or update a frame
+
+void block_cache_demote(BlockVolumeFrame frame);
+// Move a cached frame to the cold end of the LRU list
+
+void block_cache_invalidate(BlockVolumeFrame frame);
+// Drop a frame from the cache
+
+struct BlockCacheState* block_cache_ctx_create(void);
+// Create the cache of a new context, NULL if failure
+
+void block_cache_ctx_destroy(struct BlockCacheState* state);
+// Release the cache of a context
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
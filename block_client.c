@@ -0,0 +1,386 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : block_client.c
+//  Description    : This is the client library of block_server.  Requests
+//                   are written into the claimed slot's ring and large reads
+//                   and writes are cut into BLOCK_SERVER_CHUNK pieces, up to
+//                   a ring's worth in flight, so the copy of one piece
+//                   overlaps the server's work on the next.  The ring
+//                   indices are plain shared words published with release
+//                   stores; a side only enters the kernel, on a futex, when
+//                   it has spun for a while with nothing to do.
+//
+//  Author         : Vinayak Gupta
+//
+
+// Includes
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+// Project Includes
+#include <block_client.h>
+#include <block_driver.h>
+#include <block_server.h>
+#include <cmpsc311_log.h>
+
+// The connection, one per process
+static struct {
+	BlockServerShared* shm; // the mapped segment
+	BlockServerSlot* slot; // the claimed slot
+	uint32_t next; // index of the next request
+} client;
+
+//
+// Implementation
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_server_sleep
+// Description  : wait for a shared word to move off a value, spinning first
+//                and then sleeping on it with a futex; the sleeping flag
+//                tells the other side a wake is needed.  On a single CPU
+//                the other side cannot run while we spin, so we don't.
+//
+// Inputs       : word - the shared word
+//                sleeping - flag raised while asleep
+//                seen - the value to wait past
+//                msec - longest sleep, -1 for no bound
+// Outputs      : 1 if the word changed, 0 if the wait timed out
+int block_server_sleep(uint32_t* word, uint32_t* sleeping, uint32_t seen, int msec)
+{
+	static int maxspins = -1;
+	struct timespec timeout = { msec / 1000, (msec % 1000) * 1000000L };
+	int spins;
+
+	if (maxspins == -1) {
+		maxspins = (sysconf(_SC_NPROCESSORS_ONLN) > 1) ? BLOCK_SERVER_SPINS : 0;
+	}
+	for (spins = 0; spins < maxspins; spins++) {
+		if (__atomic_load_n(word, __ATOMIC_ACQUIRE) != seen) {
+			return 1;
+		}
+#if defined(__x86_64__) || defined(__i386__)
+		__builtin_ia32_pause();
+#endif
+	}
+	__atomic_store_n(sleeping, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(word, __ATOMIC_SEQ_CST) == seen) {
+		syscall(SYS_futex, word, FUTEX_WAIT, seen, (msec < 0) ? NULL : &timeout, NULL, 0);
+	}
+	__atomic_store_n(sleeping, 0, __ATOMIC_RELAXED);
+	return (__atomic_load_n(word, __ATOMIC_ACQUIRE) != seen);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_server_post
+// Description  : publish a shared word, waking the other side only if it
+//                went to sleep on it
+//
+// Inputs       : word - the shared word
+//                value - its new value
+//                sleeping - the other side's sleeping flag
+// Outputs      : none
+void block_server_post(uint32_t* word, uint32_t value, uint32_t* sleeping)
+{
+	__atomic_store_n(word, value, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(sleeping, __ATOMIC_SEQ_CST)) {
+		syscall(SYS_futex, word, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_client_wait
+// Description  : wait for a request to complete
+//
+// Inputs       : index - the request
+// Outputs      : 0 if it completed, -1 if the server went away
+static int block_client_wait(uint32_t index)
+{
+	BlockServerSlot* s = client.slot;
+	uint32_t done;
+
+	while ((int32_t)((done = __atomic_load_n(&s->cq_tail, __ATOMIC_ACQUIRE)) - index) <= 0) {
+		if (!__atomic_load_n(&client.shm->running, __ATOMIC_ACQUIRE)) {
+			logMessage(LOG_ERROR_LEVEL, "Block server shut down with requests outstanding");
+			return -1;
+		}
+		block_server_sleep(&s->cq_tail, &s->client_sleeping, done, BLOCK_SERVER_POLL_MSEC);
+	}
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_client_submit
+// Description  : queue a request in the next ring entry, which the caller
+//                has seen complete; the payload is filled beforehand
+//
+// Inputs       : op, fd, arg, len - the request
+// Outputs      : the request index, the server sees it at once
+static uint32_t block_client_submit(uint32_t op, int16_t fd, uint32_t arg, int32_t len)
+{
+	BlockServerEntry* e = &client.slot->ring[client.next % BLOCK_SERVER_RING_DEPTH];
+
+	e->op = op;
+	e->fd = fd;
+	e->arg = arg;
+	e->len = len;
+	e->result = -1;
+	block_server_post(&client.slot->sq_tail, client.next + 1, &client.slot->server_sleeping);
+	return (client.next++);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_client_call
+// Description  : run one request and wait for its result
+//
+// Inputs       : op, fd, arg, len - the request
+// Outputs      : the driver's return value, -1 if failure
+static int32_t block_client_call(uint32_t op, int16_t fd, uint32_t arg, int32_t len)
+{
+	uint32_t i;
+
+	if (client.slot == NULL) {
+		logMessage(LOG_ERROR_LEVEL, "Not connected to a block server");
+		return -1;
+	}
+	i = block_client_submit(op, fd, arg, len);
+	if (block_client_wait(i)) {
+		return -1;
+	}
+	return (client.slot->ring[i % BLOCK_SERVER_RING_DEPTH].result);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_client_transfer
+// Description  : read or write in chunk-sized pieces, keeping up to a ring
+//                of them in flight; a short read ends the transfer
+//
+// Inputs       : op - BLOCK_SERVER_OP_READ or BLOCK_SERVER_OP_WRITE
+//                fd - the file handle
+//                buf - the caller's buffer
+//                count - number of bytes
+// Outputs      : bytes transferred if successful, -1 if failure
+static int32_t block_client_transfer(uint32_t op, int16_t fd, char* buf, int32_t count)
+{
+	BlockServerEntry* e;
+	int32_t npieces, p, q, len, total = 0, err = 0, stop = 0;
+	uint32_t first;
+
+	if (client.slot == NULL) {
+		logMessage(LOG_ERROR_LEVEL, "Not connected to a block server");
+		return -1;
+	}
+	if (count < 0) {
+		return -1;
+	}
+	npieces = count / BLOCK_SERVER_CHUNK + ((count % BLOCK_SERVER_CHUNK) != 0);
+	first = client.next;
+	for (p = 0, q = 0; (q < p) || ((p < npieces) && !stop);) {
+
+		// Fill the ring, piece p goes to entry first+p
+		while ((p < npieces) && !stop && (p - q < BLOCK_SERVER_RING_DEPTH)) {
+			len = (count - p * BLOCK_SERVER_CHUNK < BLOCK_SERVER_CHUNK) ? count - p * BLOCK_SERVER_CHUNK : BLOCK_SERVER_CHUNK;
+			if (op == BLOCK_SERVER_OP_WRITE) {
+				memcpy(client.slot->payload[client.next % BLOCK_SERVER_RING_DEPTH], buf + p * BLOCK_SERVER_CHUNK, len);
+			}
+			block_client_submit(op, fd, 0, len);
+			p++;
+		}
+
+		// Collect the oldest piece, anything after a failure or a short read is ignored
+		if (block_client_wait(first + q)) {
+			return -1;
+		}
+		e = &client.slot->ring[(first + q) % BLOCK_SERVER_RING_DEPTH];
+		if (!stop) {
+			if (e->result < 0) {
+				err = stop = 1;
+			} else {
+				if (op == BLOCK_SERVER_OP_READ) {
+					memcpy(buf + q * BLOCK_SERVER_CHUNK, client.slot->payload[(first + q) % BLOCK_SERVER_RING_DEPTH], e->result);
+				}
+				total += e->result;
+				stop = (e->result < e->len); // end of file
+			}
+		}
+		q++;
+	}
+	return (err ? -1 : total);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_client_connect
+// Description  : attach to the server segment and claim a free slot
+//
+// Inputs       : name - the shared memory object, NULL for the default
+// Outputs      : 0 if successful, -1 if failure
+int32_t block_client_connect(const char* name)
+{
+	BlockServerShared* shm;
+	struct stat st;
+	uint32_t expect;
+	int fd, i;
+
+	if (client.slot != NULL) {
+		logMessage(LOG_ERROR_LEVEL, "Already connected to a block server");
+		return -1;
+	}
+	if (name == NULL) {
+		name = BLOCK_SERVER_NAME;
+	}
+	if ((fd = shm_open(name, O_RDWR, 0)) == -1) {
+		logMessage(LOG_ERROR_LEVEL, "No block server at %s (%s)", name, strerror(errno));
+		return -1;
+	}
+	if ((fstat(fd, &st) == -1) || (st.st_size != sizeof(BlockServerShared))) {
+		logMessage(LOG_ERROR_LEVEL, "Block server segment %s has the wrong size", name);
+		close(fd);
+		return -1;
+	}
+	shm = mmap(NULL, sizeof(BlockServerShared), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (shm == MAP_FAILED) {
+		logMessage(LOG_ERROR_LEVEL, "Failed to map block server segment %s (%s)", name, strerror(errno));
+		return -1;
+	}
+	if ((__atomic_load_n(&shm->magic, __ATOMIC_ACQUIRE) != BLOCK_SERVER_MAGIC) || (shm->version != BLOCK_SERVER_VERSION) || !shm->running) {
+		logMessage(LOG_ERROR_LEVEL, "Block server at %s is not ready or has another layout version", name);
+		munmap(shm, sizeof(BlockServerShared));
+		return -1;
+	}
+
+	// Claim the first free slot
+	for (i = 0; i < BLOCK_SERVER_MAX_CLIENTS; i++) {
+		expect = BLOCK_SERVER_SLOT_FREE;
+		if (__atomic_compare_exchange_n(&shm->slot[i].state, &expect, BLOCK_SERVER_SLOT_BUSY, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+			shm->slot[i].pid = getpid();
+			client.shm = shm;
+			client.slot = &shm->slot[i];
+			client.next = __atomic_load_n(&client.slot->sq_tail, __ATOMIC_ACQUIRE);
+			syscall(SYS_futex, &shm->slot[i].state, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+			logMessage(LOG_INFO_LEVEL, "Connected to block server %s on slot %d", name, i);
+			return 0;
+		}
+	}
+	logMessage(LOG_ERROR_LEVEL, "Block server %s has no free client slot", name);
+	munmap(shm, sizeof(BlockServerShared));
+	return -1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_client_disconnect
+// Description  : hand the slot back and wait for the server to close what
+//                was left open
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if not connected
+int32_t block_client_disconnect(void)
+{
+	struct timespec poll = { 0, BLOCK_SERVER_POLL_MSEC * 1000000L };
+
+	if (client.slot == NULL) {
+		return -1;
+	}
+	__atomic_store_n(&client.slot->state, BLOCK_SERVER_SLOT_LEAVING, __ATOMIC_RELEASE);
+	syscall(SYS_futex, &client.slot->sq_tail, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+	while ((__atomic_load_n(&client.slot->state, __ATOMIC_ACQUIRE) == BLOCK_SERVER_SLOT_LEAVING) &&
+	       __atomic_load_n(&client.shm->running, __ATOMIC_ACQUIRE)) {
+		syscall(SYS_futex, &client.slot->state, FUTEX_WAIT, BLOCK_SERVER_SLOT_LEAVING, &poll, NULL, 0);
+	}
+	munmap(client.shm, sizeof(BlockServerShared));
+	client.shm = NULL;
+	client.slot = NULL;
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_client_open
+// Description  : open a file in the server
+//
+// Inputs       : path - filename of the file
+//                flags - BLOCK_O_* flags
+// Outputs      : file handle if successful, -1 if failure
+int16_t block_client_open(char* path, int32_t flags)
+{
+	size_t len = strlen(path) + 1;
+
+	if (client.slot == NULL) {
+		logMessage(LOG_ERROR_LEVEL, "Not connected to a block server");
+		return -1;
+	}
+	if (len > BLOCK_MAX_PATH_LENGTH) {
+		logMessage(LOG_ERROR_LEVEL, "Path too long for the block server [%s]", path);
+		return -1;
+	}
+	memcpy(client.slot->payload[client.next % BLOCK_SERVER_RING_DEPTH], path, len);
+	return ((int16_t)block_client_call(BLOCK_SERVER_OP_OPEN, -1, (uint32_t)flags, (int32_t)len));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_client_close
+// Description  : close a file in the server
+//
+// Inputs       : fd - the file handle
+// Outputs      : 0 if successful, -1 if failure
+int16_t block_client_close(int16_t fd)
+{
+	return ((int16_t)block_client_call(BLOCK_SERVER_OP_CLOSE, fd, 0, 0));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_client_read
+// Description  : read count bytes at the cursor of a file in the server
+//
+// Inputs       : fd - the file handle
+//                buf - buffer to read into
+//                count - number of bytes
+// Outputs      : bytes read if successful, -1 if failure
+int32_t block_client_read(int16_t fd, char* buf, int32_t count)
+{
+	return (block_client_transfer(BLOCK_SERVER_OP_READ, fd, buf, count));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_client_write
+// Description  : write count bytes at the cursor of a file in the server
+//
+// Inputs       : fd - the file handle
+//                buf - buffer to write from
+//                count - number of bytes
+// Outputs      : bytes written if successful, -1 if failure
+int32_t block_client_write(int16_t fd, char* buf, int32_t count)
+{
+	return (block_client_transfer(BLOCK_SERVER_OP_WRITE, fd, buf, count));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_client_seek
+// Description  : move the cursor of a file in the server
+//
+// Inputs       : fd - the file handle
+//                loc - the byte offset
+// Outputs      : 0 if successful, -1 if failure
+int32_t block_client_seek(int16_t fd, uint32_t loc)
+{
+	return (block_client_call(BLOCK_SERVER_OP_SEEK, fd, loc, 0));
+}
@@ -0,0 +1,51 @@
+#ifndef BLOCK_CLIENT_INCLUDED
+#define BLOCK_CLIENT_INCLUDED
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : block_client.h
+//  Description    : This is the client interface of block_server.  The calls
+//                   mirror the block_* file functions but run in the server
+//                   process, so several processes can share one device.  A
+//                   process holds one connection, used by one thread at a
+//                   time.
+//
+//  Author         : Vinayak Gupta
+//
+
+// Include files
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//
+// Interface functions
+
+int32_t block_client_connect(const char* name);
+// Attach to the server at shared memory object name (NULL for the default) and claim a slot
+
+int32_t block_client_disconnect(void);
+// Release the slot once the server has closed any file left open
+
+int16_t block_client_open(char* path, int32_t flags);
+// Open a file with BLOCK_O_* flags, returns a handle or -1
+
+int16_t block_client_close(int16_t fd);
+// Close a file
+
+int32_t block_client_read(int16_t fd, char* buf, int32_t count);
+// Read count bytes at the cursor, returns the bytes read or -1
+
+int32_t block_client_write(int16_t fd, char* buf, int32_t count);
+// Write count bytes at the cursor, returns the bytes written or -1
+
+int32_t block_client_seek(int16_t fd, uint32_t loc);
+// Move the cursor to byte loc
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
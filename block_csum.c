@@ -0,0 +1,276 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : block_csum.c
+//  Description    : This is the implementation of the checksum pool.  Groups
+//                   of frames are queued in submission order and workers
+//                   claim single frames from the oldest group, so several
+//                   workers can share a group.  A thread waiting on a group
+//                   hashes its unclaimed frames itself; a pool with no
+//                   workers therefore just hashes on the caller.
+//
+//  Author         : Vinayak Gupta
+//
+
+// Includes
+#include <pthread.h>
+#include <stdlib.h>
+
+// Project Includes
+#include <block_csum.h>
+#include <block_ctx.h>
+#include <block_driver.h>
+#include <cmpsc311_log.h>
+
+// The pool of a context
+struct BlockCsumState {
+	int threads; // configured number of workers
+	int running; // workers started
+	int stopping; // set to stop the workers
+	BlockCsumGroup *head, *tail; // groups with unclaimed frames
+	pthread_mutex_t lock; // protects the queue and the groups
+	pthread_cond_t work; // signalled when frames are queued
+	pthread_cond_t done; // signalled when frames complete
+	pthread_t worker[BLOCK_CSUM_MAX_THREADS];
+};
+#define pool (*block_ctx_bound->csum) // the pool of the calling thread's context
+
+//
+// Implementation
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_csum_ctx_create / block_csum_ctx_destroy
+// Description  : create and release the pool of a context
+//
+// Inputs       : state - the pool to release, may be NULL
+// Outputs      : block_csum_ctx_create returns the pool, NULL if failure
+struct BlockCsumState* block_csum_ctx_create(void)
+{
+	struct BlockCsumState* state;
+
+	if ((state = calloc(1, sizeof(struct BlockCsumState))) == NULL) {
+		return NULL;
+	}
+	state->threads = BLOCK_CSUM_DEFAULT_THREADS;
+	pthread_mutex_init(&state->lock, NULL);
+	pthread_cond_init(&state->work, NULL);
+	pthread_cond_init(&state->done, NULL);
+	return state;
+}
+
+void block_csum_ctx_destroy(struct BlockCsumState* state)
+{
+	if (state == NULL) {
+		return;
+	}
+	pthread_cond_destroy(&state->done);
+	pthread_cond_destroy(&state->work);
+	pthread_mutex_destroy(&state->lock);
+	free(state);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_csum_claim
+// Description  : take the next frame of a group, dropping the group from the
+//                queue once all its frames are taken, pool lock held
+//
+// Inputs       : group - the group
+// Outputs      : the job, NULL if every frame is already taken
+static BlockCsumJob* block_csum_claim(BlockCsumGroup* group)
+{
+	BlockCsumGroup *prev = NULL, *g;
+	BlockCsumJob* job;
+
+	if (group->claimed == group->count) {
+		return NULL;
+	}
+	job = &group->jobs[group->claimed++];
+	if (group->claimed == group->count) {
+		for (g = pool.head; g != group; g = g->next) {
+			prev = g;
+		}
+		if (prev != NULL) {
+			prev->next = group->next;
+		} else {
+			pool.head = group->next;
+		}
+		if (pool.tail == group) {
+			pool.tail = prev;
+		}
+	}
+	return job;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_csum_run
+// Description  : hash one claimed frame and mark it finished, called and
+//                returns with the pool lock held
+//
+// Inputs       : group - the group the job belongs to
+//                job - the job
+// Outputs      : none
+static void block_csum_run(BlockCsumGroup* group, BlockCsumJob* job)
+{
+	pthread_mutex_unlock(&pool.lock);
+	job->status = computeframechecksum(job->buf, &job->checksum) ? -1 : 0;
+	pthread_mutex_lock(&pool.lock);
+	if (++group->finished == group->count) {
+		pthread_cond_broadcast(&pool.done);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_csum_worker
+// Description  : worker thread, hashes frames from the oldest group
+//
+// Inputs       : arg - unused
+// Outputs      : NULL
+static void* block_csum_worker(void* arg)
+{
+	BlockCsumGroup* group;
+	BlockCsumJob* job;
+
+	(void)arg;
+	pthread_mutex_lock(&pool.lock);
+	for (;;) {
+		while ((!pool.stopping) && (pool.head == NULL)) {
+			pthread_cond_wait(&pool.work, &pool.lock);
+		}
+		if (pool.stopping) {
+			break;
+		}
+		group = pool.head;
+		job = block_csum_claim(group);
+		block_csum_run(group, job);
+	}
+	pthread_mutex_unlock(&pool.lock);
+	return NULL;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_csum_configure
+// Description  : set the number of hashing workers
+//
+// Inputs       : threads - number of workers, 0 hashes on the caller
+// Outputs      : 0 if successful, -1 if failure
+int32_t block_csum_configure(int threads)
+{
+	if (pool.running) {
+		logMessage(LOG_ERROR_LEVEL, "Cannot resize the checksum pool while powered on");
+		return -1;
+	}
+	if ((threads < 0) || (threads > BLOCK_CSUM_MAX_THREADS)) {
+		logMessage(LOG_ERROR_LEVEL, "Invalid checksum pool size %d", threads);
+		return -1;
+	}
+	pool.threads = threads;
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_csum_poweron
+// Description  : start the hashing workers
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+int32_t block_csum_poweron(void)
+{
+	pool.stopping = 0;
+	for (pool.running = 0; pool.running < pool.threads; pool.running++) {
+		if (block_ctx_spawn(&pool.worker[pool.running], block_csum_worker, NULL)) {
+			logMessage(LOG_ERROR_LEVEL, "Failed to start checksum worker %d", pool.running);
+			block_csum_poweroff();
+			return -1;
+		}
+	}
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_csum_poweroff
+// Description  : stop the hashing workers
+//
+// Inputs       : none
+// Outputs      : 0
+int32_t block_csum_poweroff(void)
+{
+	int i;
+
+	pthread_mutex_lock(&pool.lock);
+	pool.stopping = 1;
+	pthread_cond_broadcast(&pool.work);
+	pthread_mutex_unlock(&pool.lock);
+	for (i = 0; i < pool.running; i++) {
+		pthread_join(pool.worker[i], NULL);
+	}
+	pool.running = 0;
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_csum_submit
+// Description  : queue a group of frames for hashing
+//
+// Inputs       : group - the group to fill in
+//                jobs - the frames, buf set by the caller
+//                count - number of frames
+// Outputs      : none
+void block_csum_submit(BlockCsumGroup* group, BlockCsumJob* jobs, int count)
+{
+	group->jobs = jobs;
+	group->count = count;
+	group->claimed = group->finished = 0;
+	group->next = NULL;
+	if (count == 0) {
+		return;
+	}
+	pthread_mutex_lock(&pool.lock);
+	if (pool.tail != NULL) {
+		pool.tail->next = group;
+	} else {
+		pool.head = group;
+	}
+	pool.tail = group;
+	if ((pool.running > 0) && (count > 1)) {
+		pthread_cond_broadcast(&pool.work); // a single frame is left to the waiter
+	}
+	pthread_mutex_unlock(&pool.lock);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_csum_wait
+// Description  : wait for a group to complete, hashing its unclaimed frames
+//
+// Inputs       : group - the group
+// Outputs      : 0 if every frame was hashed, -1 otherwise
+int32_t block_csum_wait(BlockCsumGroup* group)
+{
+	BlockCsumJob* job;
+	int i;
+
+	if (group->count == 0) {
+		return 0;
+	}
+	pthread_mutex_lock(&pool.lock);
+	while ((job = block_csum_claim(group)) != NULL) {
+		block_csum_run(group, job);
+	}
+	while (group->finished < group->count) {
+		pthread_cond_wait(&pool.done, &pool.lock);
+	}
+	pthread_mutex_unlock(&pool.lock);
+	for (i = 0; i < group->count; i++) {
+		if (group->jobs[i].status) {
+			return -1;
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,70 @@
+#ifndef BLOCK_CSUM_INCLUDED
+#define BLOCK_CSUM_INCLUDED
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : block_csum.h
+//  Description    : This is the interface of the checksum pool, a few worker
+//                   threads that compute frame checksums so multi-frame
+//                   requests can hash one group of frames while the bus
+//                   moves another.
+//
+//  Author         : Vinayak Gupta
+//
+
+// Include files
+#include <stdint.h>
+
+// Defines
+#define BLOCK_CSUM_DEFAULT_THREADS 2 // Default number of hashing workers
+#define BLOCK_CSUM_MAX_THREADS 16 // Maximum number of hashing workers
+#define BLOCK_CSUM_PIPELINE_FRAMES 16 // Frames per group in a pipelined request
+
+// Type definitions
+typedef struct {
+	void* buf; // frame to hash
+	uint32_t checksum; // result
+	int32_t status; // 0 if hashed, -1 if hashing failed
+} BlockCsumJob;
+
+typedef struct BlockCsumGroup {
+	BlockCsumJob* jobs; // the frames of the group
+	int count; // number of jobs
+	int claimed; // jobs taken by a worker or the waiter
+	int finished; // jobs completed
+	struct BlockCsumGroup* next; // pool queue link
+} BlockCsumGroup;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//
+// Interface functions
+
+int32_t block_csum_configure(int threads);
+// Set the number of hashing workers (0 hashes on the caller), must precede block_poweron
+
+int32_t block_csum_poweron(void);
+// Start the hashing workers
+
+int32_t block_csum_poweroff(void);
+// Stop the hashing workers
+
+void block_csum_submit(BlockCsumGroup* group, BlockCsumJob* jobs, int count);
+// Queue a group of frames for hashing, the group must be waited on
+
+int32_t block_csum_wait(BlockCsumGroup* group);
+// Wait for a group, hashing its unclaimed frames on the caller; -1 if any failed
+
+struct BlockCsumState* block_csum_ctx_create(void);
+// Create the checksum pool of a new context, NULL if failure
+
+void block_csum_ctx_destroy(struct BlockCsumState* state);
+// Release the checksum pool of a context
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
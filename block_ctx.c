@@ -0,0 +1,417 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : block_ctx.c
+//  Description    : This is the implementation of the driver contexts.  A
+//                   context is a set of per-module states, each created and
+//                   released by its module; the default context is built
+//                   before main runs.  The binding of a thread is a thread
+//                   local pointer, so the modules reach their state through
+//                   one load and the block_ctx_* calls are a bind around
+//                   the block_* call.
+//
+//  Author         : Vinayak Gupta
+//
+
+// Includes
+#include <stdio.h>
+#include <stdlib.h>
+
+// Project Includes
+#include <block_cache.h>
+#include <block_csum.h>
+#include <block_ctx.h>
+#include <block_driver.h>
+#include <block_log.h>
+#include <block_mmap.h>
+#include <block_pack.h>
+#include <block_scrub.h>
+#include <block_volume.h>
+#include <cmpsc311_log.h>
+
+// Type definitions
+typedef struct {
+	BlockContext* ctx; // context of the new thread
+	void* (*fn)(void*); // thread body
+	void* arg; // its argument
+} BlockCtxStart;
+
+// The default context, its states are created before main
+static BlockContext defaultctx;
+
+__thread BlockContext* block_ctx_bound = &defaultctx;
+
+//
+// Implementation
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_ctx_release
+// Description  : release the states of a context, any may be missing
+//
+// Inputs       : ctx - the context
+// Outputs      : none
+static void block_ctx_release(BlockContext* ctx)
+{
+	block_scrub_ctx_destroy(ctx->scrub);
+	block_pack_ctx_destroy(ctx->pack);
+	block_log_ctx_destroy(ctx->log);
+	block_csum_ctx_destroy(ctx->csum);
+	block_cache_ctx_destroy(ctx->cache);
+	block_volume_ctx_destroy(ctx->volume);
+	block_driver_ctx_destroy(ctx->driver);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_ctx_build
+// Description  : create the states of a context
+//
+// Inputs       : ctx - the context, zeroed
+//                standin - 1 to back member 0 with a stand-in store
+// Outputs      : 0 if successful, -1 if failure
+static int32_t block_ctx_build(BlockContext* ctx, int standin)
+{
+	if (((ctx->driver = block_driver_ctx_create()) == NULL) ||
+		((ctx->volume = block_volume_ctx_create(standin)) == NULL) ||
+		((ctx->cache = block_cache_ctx_create()) == NULL) ||
+		((ctx->csum = block_csum_ctx_create()) == NULL) ||
+		((ctx->log = block_log_ctx_create()) == NULL) ||
+		((ctx->pack = block_pack_ctx_create()) == NULL) ||
+		((ctx->scrub = block_scrub_ctx_create()) == NULL)) {
+		block_ctx_release(ctx);
+		return -1;
+	}
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_ctx_init
+// Description  : build the default context before main runs
+//
+// Inputs       : none
+// Outputs      : none
+__attribute__((constructor)) static void block_ctx_init(void)
+{
+	if (block_ctx_build(&defaultctx, BLOCK_VOLUME_STANDIN)) {
+		fprintf(stderr, "Failed to create the default driver context, aborting.\n");
+		abort();
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_ctx_create
+// Description  : create a new powered off context, configured with the
+//                module defaults and backed by stand-in stores
+//
+// Inputs       : none
+// Outputs      : the context, NULL if failure
+BlockContext* block_ctx_create(void)
+{
+	BlockContext* ctx;
+
+	if ((ctx = calloc(1, sizeof(BlockContext))) == NULL) {
+		logMessage(LOG_ERROR_LEVEL, "Failed to allocate driver context");
+		return NULL;
+	}
+	if (block_ctx_build(ctx, 1)) {
+		logMessage(LOG_ERROR_LEVEL, "Failed to allocate driver context");
+		free(ctx);
+		return NULL;
+	}
+	return ctx;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_ctx_destroy
+// Description  : release a context made by block_ctx_create
+//
+// Inputs       : ctx - the context, powered off
+// Outputs      : 0 if successful, -1 if failure
+int32_t block_ctx_destroy(BlockContext* ctx)
+{
+	if ((ctx == NULL) || (ctx == &defaultctx)) {
+		logMessage(LOG_ERROR_LEVEL, "Cannot destroy the default driver context");
+		return -1;
+	}
+	if (block_driver_ctx_powered(ctx->driver)) {
+		logMessage(LOG_ERROR_LEVEL, "Cannot destroy a powered on driver context");
+		return -1;
+	}
+	block_ctx_release(ctx);
+	free(ctx);
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_ctx_default
+// Description  : the default context
+//
+// Inputs       : none
+// Outputs      : the context
+BlockContext* block_ctx_default(void)
+{
+	return &defaultctx;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_ctx_enter / block_ctx_leave
+// Description  : bind the calling thread to a context and back
+//
+// Inputs       : ctx - the context to bind / prev - what block_ctx_enter returned
+// Outputs      : block_ctx_enter returns the context bound before
+BlockContext* block_ctx_enter(BlockContext* ctx)
+{
+	BlockContext* prev = block_ctx_bound;
+	block_ctx_bound = ctx;
+	return prev;
+}
+
+void block_ctx_leave(BlockContext* prev)
+{
+	block_ctx_bound = prev;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_ctx_thread
+// Description  : bind a new driver thread to its context and run it
+//
+// Inputs       : arg - the BlockCtxStart
+// Outputs      : what the thread body returns
+static void* block_ctx_thread(void* arg)
+{
+	BlockCtxStart start = *(BlockCtxStart*)arg;
+
+	free(arg);
+	block_ctx_bound = start.ctx;
+	return start.fn(start.arg);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_ctx_spawn
+// Description  : start a driver thread in the caller's context
+//
+// Inputs       : thread - the thread (output)
+//                fn - the thread body
+//                arg - its argument
+// Outputs      : 0 if successful, non-zero if failure
+int block_ctx_spawn(pthread_t* thread, void* (*fn)(void*), void* arg)
+{
+	BlockCtxStart* start;
+	int err;
+
+	if ((start = malloc(sizeof(BlockCtxStart))) == NULL) {
+		return -1;
+	}
+	start->ctx = block_ctx_bound;
+	start->fn = fn;
+	start->arg = arg;
+	if ((err = pthread_create(thread, NULL, block_ctx_thread, start)) != 0) {
+		free(start);
+	}
+	return err;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_ctx_poweron ... block_ctx_scrub_stats
+// Description  : the block_* calls on an explicit context
+//
+// Inputs       : ctx - the context, then the arguments of the block_* call
+// Outputs      : what the block_* call returns
+int32_t block_ctx_poweron(BlockContext* ctx)
+{
+	BlockContext* prev = block_ctx_enter(ctx);
+	int32_t ret = block_poweron();
+	block_ctx_leave(prev);
+	return ret;
+}
+
+int32_t block_ctx_poweroff(BlockContext* ctx)
+{
+	BlockContext* prev = block_ctx_enter(ctx);
+	int32_t ret = block_poweroff();
+	block_ctx_leave(prev);
+	return ret;
+}
+
+int16_t block_ctx_open(BlockContext* ctx, char* path)
+{
+	BlockContext* prev = block_ctx_enter(ctx);
+	int16_t ret = block_open(path);
+	block_ctx_leave(prev);
+	return ret;
+}
+
+int16_t block_ctx_open_flags(BlockContext* ctx, char* path, int32_t flags)
+{
+	BlockContext* prev = block_ctx_enter(ctx);
+	int16_t ret = block_open_flags(path, flags);
+	block_ctx_leave(prev);
+	return ret;
+}
+
+int16_t block_ctx_close(BlockContext* ctx, int16_t fd)
+{
+	BlockContext* prev = block_ctx_enter(ctx);
+	int16_t ret = block_close(fd);
+	block_ctx_leave(prev);
+	return ret;
+}
+
+int32_t block_ctx_read(BlockContext* ctx, int16_t fd, char* buf, int32_t count)
+{
+	BlockContext* prev = block_ctx_enter(ctx);
+	int32_t ret = block_read(fd, buf, count);
+	block_ctx_leave(prev);
+	return ret;
+}
+
+int32_t block_ctx_write(BlockContext* ctx, int16_t fd, char* buf, int32_t count)
+{
+	BlockContext* prev = block_ctx_enter(ctx);
+	int32_t ret = block_write(fd, buf, count);
+	block_ctx_leave(prev);
+	return ret;
+}
+
+int32_t block_ctx_seek(BlockContext* ctx, int16_t fd, uint32_t loc)
+{
+	BlockContext* prev = block_ctx_enter(ctx);
+	int32_t ret = block_seek(fd, loc);
+	block_ctx_leave(prev);
+	return ret;
+}
+
+int32_t block_ctx_pread(BlockContext* ctx, int16_t fd, char* buf, int32_t count, uint32_t off)
+{
+	BlockContext* prev = block_ctx_enter(ctx);
+	int32_t ret = block_pread(fd, buf, count, off);
+	block_ctx_leave(prev);
+	return ret;
+}
+
+int32_t block_ctx_pwrite(BlockContext* ctx, int16_t fd, char* buf, int32_t count, uint32_t off)
+{
+	BlockContext* prev = block_ctx_enter(ctx);
+	int32_t ret = block_pwrite(fd, buf, count, off);
+	block_ctx_leave(prev);
+	return ret;
+}
+
+int32_t block_ctx_advise(BlockContext* ctx, int16_t fd, uint32_t off, uint32_t len, int32_t hint)
+{
+	BlockContext* prev = block_ctx_enter(ctx);
+	int32_t ret = block_advise(fd, off, len, hint);
+	block_ctx_leave(prev);
+	return ret;
+}
+
+int32_t block_ctx_fallocate(BlockContext* ctx, int16_t fd, uint32_t off, uint32_t len)
+{
+	BlockContext* prev = block_ctx_enter(ctx);
+	int32_t ret = block_fallocate(fd, off, len);
+	block_ctx_leave(prev);
+	return ret;
+}
+
+int32_t block_ctx_qos(BlockContext* ctx, int16_t fd, int32_t cls)
+{
+	BlockContext* prev = block_ctx_enter(ctx);
+	int32_t ret = block_qos(fd, cls);
+	block_ctx_leave(prev);
+	return ret;
+}
+
+int32_t block_ctx_clone(BlockContext* ctx, int16_t fd, char* path)
+{
+	BlockContext* prev = block_ctx_enter(ctx);
+	int32_t ret = block_clone(fd, path);
+	block_ctx_leave(prev);
+	return ret;
+}
+
+int32_t block_ctx_snapshot(BlockContext* ctx, int16_t fd, char* path)
+{
+	BlockContext* prev = block_ctx_enter(ctx);
+	int32_t ret = block_snapshot(fd, path);
+	block_ctx_leave(prev);
+	return ret;
+}
+
+int32_t block_ctx_unlink(BlockContext* ctx, char* path)
+{
+	BlockContext* prev = block_ctx_enter(ctx);
+	int32_t ret = block_unlink(path);
+	block_ctx_leave(prev);
+	return ret;
+}
+
+int32_t block_ctx_digest(BlockContext* ctx, char* path, uint64_t* root)
+{
+	BlockContext* prev = block_ctx_enter(ctx);
+	int32_t ret = block_digest(path, root);
+	block_ctx_leave(prev);
+	return ret;
+}
+
+int32_t block_ctx_digest_diff(BlockContext* ctx, char* path1, char* path2, int32_t* frames, int32_t max)
+{
+	BlockContext* prev = block_ctx_enter(ctx);
+	int32_t ret = block_digest_diff(path1, path2, frames, max);
+	block_ctx_leave(prev);
+	return ret;
+}
+
+char* block_ctx_mmap(BlockContext* ctx, int16_t fd, uint32_t length)
+{
+	BlockContext* prev = block_ctx_enter(ctx);
+	char* ret = block_mmap(fd, length);
+	block_ctx_leave(prev);
+	return ret;
+}
+
+int32_t block_ctx_msync(BlockContext* ctx, char* addr)
+{
+	BlockContext* prev = block_ctx_enter(ctx);
+	int32_t ret = block_msync(addr);
+	block_ctx_leave(prev);
+	return ret;
+}
+
+int32_t block_ctx_munmap(BlockContext* ctx, char* addr)
+{
+	BlockContext* prev = block_ctx_enter(ctx);
+	int32_t ret = block_munmap(addr);
+	block_ctx_leave(prev);
+	return ret;
+}
+
+int32_t block_ctx_scrub_start(BlockContext* ctx, uint32_t bytes_per_sec)
+{
+	BlockContext* prev = block_ctx_enter(ctx);
+	int32_t ret = block_scrub_start(bytes_per_sec);
+	block_ctx_leave(prev);
+	return ret;
+}
+
+int32_t block_ctx_scrub_stop(BlockContext* ctx)
+{
+	BlockContext* prev = block_ctx_enter(ctx);
+	int32_t ret = block_scrub_stop();
+	block_ctx_leave(prev);
+	return ret;
+}
+
+void block_ctx_scrub_stats(BlockContext* ctx, BlockScrubStats* stats)
+{
+	BlockContext* prev = block_ctx_enter(ctx);
+	block_scrub_stats(stats);
+	block_ctx_leave(prev);
+}
@@ -0,0 +1,111 @@
+#ifndef BLOCK_CTX_INCLUDED
+#define BLOCK_CTX_INCLUDED
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : block_ctx.h
+//  Description    : This is the interface of the driver contexts.  A context
+//                   is one independent driver instance: its file system,
+//                   driver lock, volume, scheduler, frame cache, checksum
+//                   workers, log, packer and scrubber.  Every thread is
+//                   bound to a context, the default one unless it entered
+//                   another, and the block_* calls act on the context of
+//                   the calling thread; the block_ctx_* calls take the
+//                   context explicitly.  Threads the driver starts run in
+//                   the context that started them.
+//
+//                   The default context drives the block_io_bus controller
+//                   as volume member 0; a context made by block_ctx_create
+//                   backs every member with its own stand-in store.  I/O
+//                   classes, the span tracer and the call recorder are
+//                   shared by all contexts of the process.
+//
+//  Author         : Vinayak Gupta
+//
+
+// Include files
+#include <pthread.h>
+#include <stdint.h>
+
+// Project Includes
+#include <block_scrub.h>
+
+// Type definitions
+struct BlockDriverState;
+struct BlockVolumeState;
+struct BlockCacheState;
+struct BlockCsumState;
+struct BlockLogState;
+struct BlockPackState;
+struct BlockScrubState;
+
+typedef struct BlockContext {
+	struct BlockDriverState* driver; // file system and driver lock
+	struct BlockVolumeState* volume; // members and scheduler queue
+	struct BlockCacheState* cache; // frame cache
+	struct BlockCsumState* csum; // checksum workers
+	struct BlockLogState* log; // log-structured writes
+	struct BlockPackState* pack; // small-file packer
+	struct BlockScrubState* scrub; // background scrubber
+} BlockContext;
+
+// The context of the calling thread, used by the driver modules
+extern __thread BlockContext* block_ctx_bound;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//
+// Interface functions
+
+BlockContext* block_ctx_create(void);
+// Create a powered off context on stand-in stores, NULL if failure
+
+int32_t block_ctx_destroy(BlockContext* ctx);
+// Release a powered off context, -1 if it is on or is the default context
+
+BlockContext* block_ctx_default(void);
+// The context threads are bound to until they enter another
+
+BlockContext* block_ctx_enter(BlockContext* ctx);
+// Bind the calling thread to ctx, returns the context to give block_ctx_leave
+
+void block_ctx_leave(BlockContext* prev);
+// Bind the calling thread back to the context block_ctx_enter returned
+
+int block_ctx_spawn(pthread_t* thread, void* (*fn)(void*), void* arg);
+// pthread_create for driver threads, the thread runs in the caller's context
+
+int32_t block_ctx_poweron(BlockContext* ctx);
+int32_t block_ctx_poweroff(BlockContext* ctx);
+int16_t block_ctx_open(BlockContext* ctx, char* path);
+int16_t block_ctx_open_flags(BlockContext* ctx, char* path, int32_t flags);
+int16_t block_ctx_close(BlockContext* ctx, int16_t fd);
+int32_t block_ctx_read(BlockContext* ctx, int16_t fd, char* buf, int32_t count);
+int32_t block_ctx_write(BlockContext* ctx, int16_t fd, char* buf, int32_t count);
+int32_t block_ctx_seek(BlockContext* ctx, int16_t fd, uint32_t loc);
+int32_t block_ctx_pread(BlockContext* ctx, int16_t fd, char* buf, int32_t count, uint32_t off);
+int32_t block_ctx_pwrite(BlockContext* ctx, int16_t fd, char* buf, int32_t count, uint32_t off);
+int32_t block_ctx_advise(BlockContext* ctx, int16_t fd, uint32_t off, uint32_t len, int32_t hint);
+int32_t block_ctx_fallocate(BlockContext* ctx, int16_t fd, uint32_t off, uint32_t len);
+int32_t block_ctx_qos(BlockContext* ctx, int16_t fd, int32_t cls);
+int32_t block_ctx_clone(BlockContext* ctx, int16_t fd, char* path);
+int32_t block_ctx_snapshot(BlockContext* ctx, int16_t fd, char* path);
+int32_t block_ctx_unlink(BlockContext* ctx, char* path);
+int32_t block_ctx_digest(BlockContext* ctx, char* path, uint64_t* root);
+int32_t block_ctx_digest_diff(BlockContext* ctx, char* path1, char* path2, int32_t* frames, int32_t max);
+char* block_ctx_mmap(BlockContext* ctx, int16_t fd, uint32_t length);
+int32_t block_ctx_msync(BlockContext* ctx, char* addr);
+int32_t block_ctx_munmap(BlockContext* ctx, char* addr);
+int32_t block_ctx_scrub_start(BlockContext* ctx, uint32_t bytes_per_sec);
+int32_t block_ctx_scrub_stop(BlockContext* ctx);
+void block_ctx_scrub_stats(BlockContext* ctx, BlockScrubStats* stats);
+// The block_* call of the same name on ctx, file handles belong to their context
+// and a mapped view to the context that made it
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
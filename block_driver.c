@@ -8,42 +8,117 @@
 //
 
 // Includes
+#include <pthread.h>
 #include <stdlib.h>
 #include <inttypes.h>
 #include <string.h>
+#include <time.h>
 // Project Includes
-#include <block_controller.h>
+#include <block_cache.h>
+#include <block_csum.h>
+#include <block_ctx.h>
 #include <block_driver.h>
+#include <block_geometry.h>
+#include <block_log.h>
+#include <block_merkle.h>
+#include <block_mmap.h>
+#include <block_pack.h>
+#include <block_qos.h>
+#include <block_record.h>
+#include <block_scrub.h>
+#include <block_trace.h>
+#include <block_volume.h>
 #include <cmpsc311_log.h>
 #include <cmpsc311_util.h>
 
 
 typedef struct { //file structure design , cache to keep information for file handle
 	char filepath[BLOCK_MAX_PATH_LENGTH];
-	int16_t fhandle;
+	int32_t fileno; //index of this record in the file table
+	int32_t hnext; //next file on the path hash chain or free list, -1 terminated
+	int16_t fhandle; //open file handle, -1 when closed
 	int32_t filesize; //total file size
 	int32_t  position; //byte position in total file
 	int filestatus; //1 if open, 0 if closed
 	int32_t no_of_frame; //total no of frames used
-	BlockFrameIndex currentFrame;//currentFrame as per FrameList
+	BlockVolumeFrame currentFrame;//currentFrame as per FrameList
 	int currentframeno; //position in usedFrame array
 	int currentframePosition; //byte position in currentframe
-	BlockFrameIndex usedFrame[BLOCK_BLOCK_SIZE]; //array of framenos used for this file
+	BlockVolumeFrame* usedFrame; //array of framenos used for this file, then its reserved frames
+	int32_t reserved; //frames allotted past no_of_frame for the file to grow into
+	int32_t keep; //leading reserved frames preallocated by block_fallocate, kept on close
+	int32_t pack; //pack frame holding the file while it has no frame of its own
+	int32_t packslot; //first slot of the file in its pack
+	int32_t packslots; //slots held in the pack, 0 while nothing is stored
+	int32_t maxframes; //allocated length of usedFrame
+	int32_t flags; //BLOCK_O_* flags given to block_open
+	int advice; //BLOCK_ADV_* access pattern set by block_advise
+	int qos; //BLOCK_QOS_* class set by block_qos
+	int32_t nextreadframe; //frame following the last read, for sequential detection
+	int32_t readahead; //current readahead window in frames
+	int32_t raframe; //first frame not yet prefetched
+	char* wbuf; //write buffer holding one frame of the file
+	int32_t wbframe; //file frame held in wbuf, -1 if none
+	int wbdirty; //1 if wbuf has not been written to the device
+	int readonly; //1 for snapshots, every open is forced read-only
+	int ioerror; //1 if a queued write of the file was lost, reported by the next close
+	uint32_t opengen; //number of the open holding the handle, split transfers check it between pieces
+	int32_t wrhead; //next turn handed to a write at the cursor or end of the file
+	int32_t wrturn; //turn of the write at the cursor or end allowed to run
+	BlockMerkle merkle; //hash tree over the CS1 of each file frame
 } filestructure; 
 
-typedef  struct {  // Index of available frames in a block
-	BlockFrameIndex Frameno; //frame nos for all frames
+typedef  struct {  // Index of available frames in the volume
+	BlockVolumeFrame Frameno; //frame nos for all frames
 	int status; //1 if used, 0 if not used
+	int refcount; //number of file frame maps pointing at this frame
+	int written; //1 once data went to the frame, log mode moves rewrites elsewhere
+	int errors; //checksum and acknowledgement errors seen on the frame
+	int quarantined; //1 once the frame is retired, it is never allotted again
 } FrameStructure; 
 
 //structure for file system, cache to keep information about all files
 struct filesystem{ 
 	int sysstatus; // system status 0 for off & 1 for on
-	filestructure Filelist[BLOCK_MAX_TOTAL_FILES]; //total file list
-	FrameStructure Framelist[BLOCK_BLOCK_SIZE]; //total framelist
-	int NextFileNo; //NextFileNo to be allotted
-	BlockFrameIndex NextFrameNo; //Next Empty FrameNo to be allotted
-}filesystem;  
+	filestructure** FileSlabs; //file table, BLOCK_FILE_SLAB_ENTRIES records per slab
+	int32_t NumSlabs; //allocated length of FileSlabs
+	int32_t FreeFiles; //chain of records released by block_unlink, -1 if none
+	int32_t* PathHash; //heads of the path hash chains, -1 terminated
+	int32_t HashBuckets; //number of path hash chains, a power of two
+	int32_t LiveFiles; //number of records holding a file
+	filestructure* OpenFiles[BLOCK_MAX_OPEN_FILES]; //open file handles, NULL if free
+	FrameStructure* Framelist; //total framelist, one entry per volume frame
+	BlockVolumeFrame TotalFrames; //number of frames across all volume members
+	int32_t NextFileNo; //NextFileNo to be allotted
+	BlockVolumeFrame NextFrameNo; //Next Empty FrameNo to be allotted
+	BlockVolumeFrame* FreeFrames; //stack of released frames, reused before NextFrameNo by single frame allocations
+	BlockVolumeFrame FreeCount; //number of frames on the FreeFrames stack
+	BlockFrameHealth Health; //frame error counters since power on
+	uint32_t OpenGen; //opens so far, numbers each open of a file
+};
+
+//driver state of a context
+struct BlockDriverState {
+	struct filesystem fs; //the file system
+	pthread_rwlock_t lock; //driver lock, held exclusive by every public entry point and shared by the pieces of a read
+	pthread_mutex_t turnstile; //held by an exclusive locker while it waits, so a stream of shared lockers cannot starve it
+	void* owner; //lockself of the thread holding the lock exclusive, NULL if none
+	int depth; //exclusive holds of the owner; a fault in a mapped view raised inside the driver takes it again
+	pthread_mutex_t filelock[BLOCK_MAX_OPEN_FILES]; //per open file: readahead state and packed file loads of shared readers, and the write turn
+	pthread_cond_t turned[BLOCK_MAX_OPEN_FILES]; //per open file: signalled under filelock when the write turn moves or the handle closes
+	uint64_t lastcall; //monotonic usec of the last public call
+	int incalls; //public calls currently inside the driver
+};
+#define filesystem (block_ctx_bound->driver->fs) //the file system of the calling thread's context
+#define driverstate (block_ctx_bound->driver)
+#define lastactivity (block_ctx_bound->driver->lastcall)
+#define activecalls (block_ctx_bound->driver->incalls)
+#define filelock(fd) (block_ctx_bound->driver->filelock[fd])
+#define turned(fd) (block_ctx_bound->driver->turned[fd])
+static __thread char lockself; //its address names the calling thread as the owner of a driver lock
+static __thread struct BlockDriverState* sharedhold; //driver the calling thread holds shared, NULL if none
+static __thread int sharednest; //exclusive locks taken inside a shared hold, they lock nothing
+static __thread int sharedmiss; //1 once a shared read met a frame error, the read is redone exclusive
 //
 // Presently, all frames in the block are used as data blocks, 
 //actually starting one block can be used to keep information for file system.
@@ -52,6 +127,198 @@ struct filesystem{
 
 //
 // Implementation
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_driver_ctx_create / block_driver_ctx_destroy
+// Description  : create and release the driver state of a context, the
+//                file system powered off and the recursive driver lock
+//
+// Inputs       : state - the driver state to release, may be NULL
+// Outputs      : block_driver_ctx_create returns the state, NULL if failure
+struct BlockDriverState* block_driver_ctx_create(void)
+{
+	struct BlockDriverState* state;
+	int i;
+
+	if ((state = calloc(1, sizeof(struct BlockDriverState))) == NULL) {
+		return NULL;
+	}
+	pthread_rwlock_init(&state->lock, NULL);
+	pthread_mutex_init(&state->turnstile, NULL);
+	for (i = 0; i < BLOCK_MAX_OPEN_FILES; i++) {
+		pthread_mutex_init(&state->filelock[i], NULL);
+		pthread_cond_init(&state->turned[i], NULL);
+	}
+	return state;
+}
+
+void block_driver_ctx_destroy(struct BlockDriverState* state)
+{
+	int i;
+
+	if (state == NULL) {
+		return;
+	}
+	pthread_rwlock_destroy(&state->lock);
+	pthread_mutex_destroy(&state->turnstile);
+	for (i = 0; i < BLOCK_MAX_OPEN_FILES; i++) {
+		pthread_mutex_destroy(&state->filelock[i]);
+		pthread_cond_destroy(&state->turned[i]);
+	}
+	free(state);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_driver_ctx_powered
+// Description  : is the file system of a context powered on
+//
+// Inputs       : state - the driver state
+// Outputs      : 1 if powered on, 0 if not
+int block_driver_ctx_powered(struct BlockDriverState* state)
+{
+	int on;
+	pthread_rwlock_rdlock(&state->lock);
+	on = state->fs.sysstatus;
+	pthread_rwlock_unlock(&state->lock);
+	return on;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : monotonicUsec
+// Description  : monotonic clock in microseconds
+//
+// Inputs       : none
+// Outputs      : microseconds
+static uint64_t monotonicUsec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec*1000000 + ts.tv_nsec/1000);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lockDriver / unlockDriver
+// Description  : serialize access to the file system state and record
+//                foreground activity for background tasks.  The lock is
+//                taken exclusive, again by its owner at will; a thread
+//                holding it shared is already clear of every writer and
+//                takes nothing.  The outermost exclusive lock places any
+//                writes the volume parked.
+//
+// Inputs       : none
+// Outputs      : none
+void lockDriver(void)
+{
+	struct BlockDriverState* d = driverstate;
+
+	__atomic_add_fetch(&d->incalls, 1, __ATOMIC_RELAXED);
+	if (__atomic_load_n(&d->owner, __ATOMIC_RELAXED) == &lockself){
+		d->depth++;
+		return;
+	}
+	if (sharedhold == d){
+		sharednest++; //a fault in a mapped view during a shared read
+		return;
+	}
+	pthread_mutex_lock(&d->turnstile);
+	pthread_rwlock_wrlock(&d->lock);
+	pthread_mutex_unlock(&d->turnstile);
+	__atomic_store_n(&d->owner, &lockself, __ATOMIC_RELAXED);
+	d->depth = 1;
+	if (filesystem.sysstatus && block_volume_parked()){
+		placeParkedWrites();
+	}
+}
+
+void unlockDriver(void)
+{
+	struct BlockDriverState* d = driverstate;
+
+	__atomic_store_n(&d->lastcall, monotonicUsec(), __ATOMIC_RELAXED);
+	if (__atomic_load_n(&d->owner, __ATOMIC_RELAXED) != &lockself){
+		sharednest--;
+	}
+	else if (--d->depth == 0){
+		__atomic_store_n(&d->owner, NULL, __ATOMIC_RELAXED);
+		pthread_rwlock_unlock(&d->lock);
+	}
+	__atomic_sub_fetch(&d->incalls, 1, __ATOMIC_RELAXED);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lockDriverShared / unlockDriverShared
+// Description  : hold the driver lock shared for a read, which may run
+//                beside other reads but never beside anything that changes
+//                the file system; an exclusive holder just nests
+//
+// Inputs       : none
+// Outputs      : none
+void lockDriverShared(void)
+{
+	struct BlockDriverState* d = driverstate;
+
+	if ((__atomic_load_n(&d->owner, __ATOMIC_RELAXED) == &lockself) || (sharedhold == d)){
+		lockDriver();
+		return;
+	}
+	__atomic_add_fetch(&d->incalls, 1, __ATOMIC_RELAXED);
+	pthread_mutex_lock(&d->turnstile); //wait behind an exclusive locker
+	pthread_mutex_unlock(&d->turnstile);
+	pthread_rwlock_rdlock(&d->lock);
+	sharedhold = d;
+	sharedmiss = 0;
+}
+
+void unlockDriverShared(void)
+{
+	struct BlockDriverState* d = driverstate;
+
+	if ((__atomic_load_n(&d->owner, __ATOMIC_RELAXED) == &lockself) || (sharednest > 0)){
+		unlockDriver();
+		return;
+	}
+	sharedhold = NULL;
+	__atomic_store_n(&d->lastcall, monotonicUsec(), __ATOMIC_RELAXED);
+	pthread_rwlock_unlock(&d->lock);
+	__atomic_sub_fetch(&d->incalls, 1, __ATOMIC_RELAXED);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : driverIdleUsec
+// Description  : time since the last public call left the driver
+//
+// Inputs       : none
+// Outputs      : microseconds idle, 0 if a call is in progress
+uint64_t driverIdleUsec(void)
+{
+	uint64_t last;
+	if (__atomic_load_n(&activecalls, __ATOMIC_RELAXED) > 0) {
+		return 0;
+	}
+	last = __atomic_load_n(&lastactivity, __ATOMIC_RELAXED);
+	return (monotonicUsec() - last);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : getFrameStatus
+// Description  : is a volume frame allotted to a file
+//
+// Inputs       : frame - the volume frame
+// Outputs      : 1 if allotted, 0 if free or out of range
+int getFrameStatus(BlockVolumeFrame frame)
+{
+	if ((filesystem.Framelist == NULL) || (frame >= filesystem.TotalFrames)) {
+		return 0;
+	}
+	return filesystem.Framelist[frame].status;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : create_opcode
@@ -108,6 +375,28 @@ int get_CScode(BlockXferRegister regstate){
         return (regstate);
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : get_KYcode
+// Description  : extract KY (opcode) from opcode
+//
+// Inputs       : regstate(opcode)
+// Outputs      : Only KY code ( 8 bits)
+int get_KYcode(BlockXferRegister regstate){
+	return ((regstate >> 56) & 0xFF);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : get_FMcode
+// Description  : extract FM (frame number) from opcode
+//
+// Inputs       : regstate(opcode)
+// Outputs      : Only FM code ( 16 bits)
+int get_FMcode(BlockXferRegister regstate){
+	return ((regstate >> 40) & 0xFFFF);
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : compute_frame_checksum
@@ -118,78 +407,322 @@ int get_CScode(BlockXferRegister regstate){
 // Outputs      : -1 if successful, 0 if failure
 int computeframechecksum(void* frame, uint32_t* checksum){
 	uint32_t sigsz = sizeof(uint32_t);
-	if (generate_md5_signature(frame, BLOCK_FRAME_SIZE, (char*)checksum, &sigsz)){
+	uint64_t span = block_trace_begin();
+	int ret = generate_md5_signature(frame, BLOCK_FRAME_SIZE, (char*)checksum, &sigsz) ? -1 : 0;
+	block_trace_end("generate_md5_signature", span);
+	return ret;
+}
+
+//
+// Implementation
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fileEntry
+// Description  : the record of a file in the file table
+//
+// Inputs       : fileno - the file number
+// Outputs      : the file record
+static filestructure* fileEntry(int32_t fileno)
+{
+	return &filesystem.FileSlabs[fileno/BLOCK_FILE_SLAB_ENTRIES][fileno%BLOCK_FILE_SLAB_ENTRIES];
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : driverMetadataBytes
+// Description  : memory held by the driver to describe the volume and its
+//                files, frame data in buffers and the cache is not counted
+//
+// Inputs       : none
+// Outputs      : bytes of frame list, free stack, file table, path hash,
+//                file frame maps and Merkle trees
+uint64_t driverMetadataBytes(void)
+{
+	uint64_t bytes;
+	int32_t i;
+
+	lockDriver();
+	bytes = (uint64_t)filesystem.TotalFrames*(sizeof(FrameStructure)+sizeof(BlockVolumeFrame));
+	bytes += (uint64_t)filesystem.NumSlabs*BLOCK_FILE_SLAB_ENTRIES*sizeof(filestructure);
+	bytes += (uint64_t)filesystem.HashBuckets*sizeof(int32_t);
+	for (i = 0; i<filesystem.NextFileNo; i++){
+		bytes += (uint64_t)fileEntry(i)->maxframes*sizeof(BlockVolumeFrame);
+		bytes += (uint64_t)fileEntry(i)->merkle.cap*2*sizeof(uint64_t);
+	}
+	unlockDriver();
+	return bytes;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : pathHash
+// Description  : path hash chain of a filename (FNV-1a)
+//
+// Inputs       : path - the filename
+// Outputs      : the chain index
+static int32_t pathHash(char* path)
+{
+	uint32_t h = 2166136261u;
+	while (*path){
+		h = (h ^ (uint8_t)*path++) * 16777619u;
+	}
+	return (h & (filesystem.HashBuckets-1));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : findFile
+// Description  : look a file up by name
+//
+// Inputs       : path - the filename
+// Outputs      : the file record, NULL if there is no such file
+static filestructure* findFile(char* path)
+{
+	int32_t i;
+	for (i = filesystem.PathHash[pathHash(path)]; i >= 0; i = fileEntry(i)->hnext){
+		if (strcmp(fileEntry(i)->filepath, path) == 0){
+			return fileEntry(i);
+		}
+	}
+	return NULL;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : growPathHash
+// Description  : double the number of path hash chains and rehash every file
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+static int growPathHash(void)
+{
+	int32_t* buckets;
+	int32_t i, h;
+
+	buckets = malloc(2*filesystem.HashBuckets*sizeof(int32_t));
+	if (buckets == NULL){
 		return -1;
 	}
+	free(filesystem.PathHash);
+	filesystem.PathHash = buckets;
+	filesystem.HashBuckets *= 2;
+	for (i = 0; i < filesystem.HashBuckets; i++){
+		filesystem.PathHash[i] = -1;
+	}
+	for (i = 0; i < filesystem.NextFileNo; i++){
+		if (fileEntry(i)->filepath[0] != 0x0){
+			h = pathHash(fileEntry(i)->filepath);
+			fileEntry(i)->hnext = filesystem.PathHash[h];
+			filesystem.PathHash[h] = i;
+		}
+	}
 	return 0;
 }
 
-//
-// Implementation
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : block_poweron               // Filesystkem.currentFrame =0; 
+// Function     : powerOn
 // Description  : Startup up the BLOCK interface, initialize filesystem
 //
 // Inputs       : non
 // Outputs      : 0 if successful, -1 if failure
 
-int32_t block_poweron(void){
-	BlockXferRegister RT1 ;
-	BlockXferRegister regstate;
+static int32_t powerOn(void){
 	int i ;
-	regstate = create_opcode(BLOCK_OP_INITMS, 0 , 0 , 0); //initialize block
-	regstate = block_io_bus(regstate, NULL); //block_io_bus call
-	RT1 = get_RTcode(regstate);
-	if (RT1 == -1){
+	if (block_volume_poweron()){ //initialize every volume member
 		logMessage(LOG_ERROR_LEVEL, " Failed to initialize Block driver"); 
 		return -1;
 	}
+	if (block_cache_poweron()){
+		logMessage(LOG_ERROR_LEVEL, " Failed to initialize Block frame cache"); 
+		block_volume_poweroff();
+		return -1;
+	}
+	if (block_csum_poweron()){
+		logMessage(LOG_ERROR_LEVEL, " Failed to start Block checksum pool"); 
+		block_cache_poweroff();
+		block_volume_poweroff();
+		return -1;
+	}
 	else 	{
 		filesystem.sysstatus=1; //change system status
 	}
-	for (i = 0; i<=BLOCK_MAX_TOTAL_FILES; i++){
-		filesystem.Filelist[i].filepath[0] = 0x0; // set file path as null
-		filesystem.Filelist[i].fhandle = 0; // set file handle
-		filesystem.Filelist[i].filestatus = 0; // set file status
-	} filesystem.NextFileNo = 0;
-	for (i = 0; i<=BLOCK_FRAME_SIZE; i++){
-		filesystem.Framelist[i].Frameno = 0; //set file status
+	//file records are allocated a slab at a time as files are created
+	filesystem.FileSlabs = NULL;
+	filesystem.NumSlabs = 0;
+	filesystem.NextFileNo = 0;
+	filesystem.FreeFiles = -1;
+	filesystem.LiveFiles = 0;
+	filesystem.HashBuckets = BLOCK_FILE_HASH_BUCKETS;
+	filesystem.PathHash = malloc(filesystem.HashBuckets*sizeof(int32_t));
+	memset(filesystem.OpenFiles, 0x0, sizeof(filesystem.OpenFiles));
+	filesystem.TotalFrames = block_volume_frames();
+	filesystem.Framelist = calloc(filesystem.TotalFrames, sizeof(FrameStructure));
+	filesystem.FreeFrames = malloc(filesystem.TotalFrames*sizeof(BlockVolumeFrame));
+	filesystem.FreeCount = 0;
+	if (filesystem.Framelist == NULL || filesystem.FreeFrames == NULL || filesystem.PathHash == NULL){
+		logMessage(LOG_ERROR_LEVEL, " Failed to allocate frame list for %u frames", filesystem.TotalFrames);
+		free(filesystem.Framelist);
+		free(filesystem.FreeFrames);
+		free(filesystem.PathHash);
+		filesystem.Framelist = NULL;
+		filesystem.FreeFrames = NULL;
+		filesystem.PathHash = NULL;
+		block_csum_poweroff();
+		block_cache_poweroff();
+		block_volume_poweroff();
+		filesystem.sysstatus = 0;
+		return -1;
+	}
+	for (i = 0; i<filesystem.HashBuckets; i++){
+		filesystem.PathHash[i] = -1;
+	}
+	for (i = 0; i<filesystem.TotalFrames; i++){
+		filesystem.Framelist[i].Frameno = i; //set file status
 		filesystem.Framelist[i].status = 0;
+		filesystem.Framelist[i].refcount = 0;
+		filesystem.Framelist[i].written = 0;
+		filesystem.Framelist[i].errors = 0;
+		filesystem.Framelist[i].quarantined = 0;
 		} filesystem.NextFrameNo = 0;
+	memset(&filesystem.Health, 0x0, sizeof(filesystem.Health));
+	block_pack_poweron();
+	if (block_log_poweron(filesystem.TotalFrames)){
+		logMessage(LOG_ERROR_LEVEL, " Failed to start Block log");
+		free(filesystem.Framelist);
+		free(filesystem.FreeFrames);
+		free(filesystem.PathHash);
+		filesystem.Framelist = NULL;
+		filesystem.FreeFrames = NULL;
+		filesystem.PathHash = NULL;
+		block_pack_poweroff();
+		block_csum_poweroff();
+		block_cache_poweroff();
+		block_volume_poweroff();
+		filesystem.sysstatus = 0;
+		return -1;
+	}
    // Return successfully
     return (0);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : block_poweroff
+// Function     : block_poweron               // Filesystkem.currentFrame =0; 
+// Description  : Startup up the BLOCK interface, initialize filesystem
+//
+// Inputs       : non
+// Outputs      : 0 if successful, -1 if failure
+
+int32_t block_poweron(void)
+{
+	int32_t ret;
+	uint64_t span = block_trace_begin();
+	lockDriver();
+	ret = powerOn();
+	unlockDriver();
+	block_trace_end("block_poweron", span);
+	return ret;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : powerOff
 // Description  : Shut down the BLOCK interface, close all files
 //
 // Inputs       : none
 // Outputs      : 0 if successful, -1 if failure
 
-int32_t block_poweroff(void)
+static int32_t powerOff(void)
 {
-	BlockXferRegister RT1 ;
-	BlockXferRegister regstate;
+	BlockVolumeFrame frame;
+	char buf[BLOCK_FRAME_SIZE];
+	int i;
 	if (filesystem.sysstatus == 0){
 		logMessage(LOG_ERROR_LEVEL,"Block driver already off");
 		return -1;}
-	regstate = create_opcode(BLOCK_OP_POWOFF, 0 , 0 , 0);
-	regstate= block_io_bus(regstate, NULL);
-	RT1 = get_RTcode(regstate);
-	if (RT1 == -1){
+	for (i = 0; i<BLOCK_MAX_OPEN_FILES; i++){
+		if ((filesystem.OpenFiles[i] != NULL) && flushWriteBuffer(i)){
+			logMessage(LOG_ERROR_LEVEL, " Failed to flush file %d at PowerOFF", i);
+			return -1;
+		}
+	}
+
+	// Writes parked by the last flushes get BLOCK_FRAME_RETRIES rounds of new frames
+	for (i = 0; (block_volume_flush() == 0) && block_volume_parked() && (i < BLOCK_FRAME_RETRIES); i++){
+		placeParkedWrites();
+	}
+	while (block_volume_unpark(&frame, buf)){
+		filesystem.Health.lost++;
+		logMessage(LOG_ERROR_LEVEL,"Queued write of frame %u lost at PowerOFF \n", frame);
+	}
+	block_log_poweroff();
+	block_pack_poweroff();
+	block_csum_poweroff();
+	block_cache_poweroff();
+	if (block_volume_poweroff()){
 		logMessage(LOG_ERROR_LEVEL, " Failed to PowerOFF Block Driver");
 		return -1;
 	}
 	else {
 		filesystem.sysstatus = 0;      //1 as started
 	}
+	for (i = 0; i<filesystem.NextFileNo; i++){
+		free(fileEntry(i)->usedFrame);
+		free(fileEntry(i)->wbuf);
+		block_merkle_free(&fileEntry(i)->merkle);
+	}
+	for (i = 0; i<filesystem.NumSlabs; i++){
+		free(filesystem.FileSlabs[i]);
+	}
+	free(filesystem.FileSlabs);
+	filesystem.FileSlabs = NULL;
+	filesystem.NumSlabs = 0;
+	filesystem.NextFileNo = 0;
+	free(filesystem.PathHash);
+	filesystem.PathHash = NULL;
+	memset(filesystem.OpenFiles, 0x0, sizeof(filesystem.OpenFiles));
+	free(filesystem.Framelist);
+	filesystem.Framelist = NULL;
+	free(filesystem.FreeFrames);
+	filesystem.FreeFrames = NULL;
+	if (filesystem.Health.lost){
+		logMessage(LOG_ERROR_LEVEL, " Block Driver off, %lu queued writes were lost", (unsigned long)filesystem.Health.lost);
+		return -1;
+	}
     // Return successfully
     return (0);
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_poweroff
+// Description  : Shut down the BLOCK interface, close all files
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int32_t block_poweroff(void)
+{
+	int32_t ret;
+	uint64_t span = block_trace_begin();
+	lockDriver();
+	ret = block_mmap_views(-1);
+	unlockDriver();
+	if (ret > 0){
+		logMessage(LOG_ERROR_LEVEL, "Failed to PowerOFF Block Driver: %d block mappings are live", ret);
+		block_trace_end("block_poweroff", span);
+		return -1;
+	}
+	block_scrub_stop(); //the scrubber takes the driver lock to repair frames
+	block_log_stop(); //and so does the log cleaner
+	lockDriver();
+	ret = powerOff();
+	unlockDriver();
+	block_trace_end("block_poweroff", span);
+	return ret;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : block_open
@@ -200,397 +733,2659 @@ int32_t block_poweroff(void)
 
 int16_t block_open(char* path)
 {
-	int pathlen = strlen(path);
-	int i;
-	if (filesystem.sysstatus==0){
-		logMessage(LOG_ERROR_LEVEL, "Failed, System status power off");
-		return -1;}
-	for (i = 0; i<=  BLOCK_MAX_TOTAL_FILES; i++){
-		 if (strcmp(filesystem.Filelist[i].filepath, path)==0){
-			if  (filesystem.Filelist[i].filestatus == 1){
-				logMessage(LOG_ERROR_LEVEL, " Failed to open file: file is already open \n");
-				return (-1);}
-			else {
-				filesystem.Filelist[i].filestatus = 1;
-				filesystem.Filelist[i].currentFrame = filesystem.Filelist[i].usedFrame[0];
-				filesystem.Filelist[i].position = 0;
-				filesystem.Filelist[i].currentframePosition=0;
-				logMessage(LOG_INFO_LEVEL,"%s file already exists as %s Reopening now with handle %d \n",path,filesystem.Filelist[i].filepath,filesystem.Filelist[i].fhandle);
-				return (filesystem.Filelist[i].fhandle);
-			}
-			}
-			}
-	if (filesystem.NextFileNo < BLOCK_MAX_TOTAL_FILES){
-		i = filesystem.NextFileNo++;
-		strncpy(filesystem.Filelist[i].filepath, path, pathlen);
-		filesystem.Filelist[i].filestatus =  1;
-		filesystem.Filelist[i].filesize =  0;
-		filesystem.Filelist[i].position = 0;
-		filesystem.Filelist[i].fhandle = i;
-		logMessage(LOG_INFO_LEVEL, "%s file opened %d \n",path,filesystem.Filelist[i].fhandle);
+	return block_open_flags(path, BLOCK_O_RDWR);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : claimFrame
+// Description  : mark a free volume frame allotted with one reference
+//
+// Inputs       : frame - the volume frame
+// Outputs      : none
+static void claimFrame(BlockVolumeFrame frame)
+{
+	filesystem.Framelist[frame].status = 1;
+	filesystem.Framelist[frame].refcount = 1;
+	filesystem.Framelist[frame].written = 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : growFrameMap
+// Description  : make room in the frame map of a file for "need" frames,
+//                mapped and reserved
+//
+// Inputs       : f - the file record
+//                need - entries the map must hold
+// Outputs      : 0 if successful, -1 if failure
+static int16_t growFrameMap(filestructure* f, int32_t need)
+{
+	BlockVolumeFrame* frames;
+	int32_t maxframes = f->maxframes ? f->maxframes : 16;
+
+	if (need <= f->maxframes) {
+		return 0;
 	}
-	else {
-		return -1; //error adding file > total_files
+	while (maxframes < need) {
+		maxframes *= 2;
 	}
-	filesystem.Filelist[i].no_of_frame = 0;
-	if (addNewFrame(i)!=0) { //error adding frame > total_frames
+	if ((frames = realloc(f->usedFrame, maxframes*sizeof(BlockVolumeFrame))) == NULL) {
+		logMessage(LOG_ERROR_LEVEL,"Failed to grow frame map of %s to %d frames \n", f->filepath, maxframes);
 		return -1;
 	}
-	return filesystem.Filelist[i].fhandle;
-    // THIS SHOULD RETURN A FILE HANDLE
+	f->usedFrame = frames;
+	f->maxframes = maxframes;
+	return 0;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : block_close
-// Description  : This function closes the file
+// Function     : trimReservation
+// Description  : give back the reserved frames of a file past the first
+//                "keep", last frame first
 //
-// Inputs       : fd - the file descriptor
-// Outputs      : 0 if successful, -1 if failure
-
-int16_t block_close(int16_t fd)
+// Inputs       : f - the file record
+//                keep - reserved frames to hold on to
+// Outputs      : none
+static void trimReservation(filestructure* f, int32_t keep)
 {
-	 if (checkFileHandle(fd)){
-		logMessage(LOG_ERROR_LEVEL, " Failed to close file");
-		return -1;}
-	filesystem.Filelist[fd].filestatus =  0;
-    // Return successfully
-    return (0);
+	while (f->reserved > keep) {
+		f->reserved--;
+		releaseFrame(f->usedFrame[f->no_of_frame+f->reserved]);
+	}
+	if (f->keep > f->reserved) {
+		f->keep = f->reserved;
+	}
 }
+
 ////////////////////////////////////////////////////////////////////////////////
-// Function     : checkFileSize
-// Description  : Reads "count" bytes from the file handle "fd" 
 //
-// Inputs       : fd - filename of the file to read from
-//                count - number of bytes to read
-// Outputs      : bytes read if successful, -1 if failure
-int32_t checkFileSize(int16_t fd,int32_t count)
+// Function     : reclaimReservations
+// Description  : give back the speculative reservations of the other open
+//                files, when the volume runs out of free frames
+//
+// Inputs       : self - the file that needs frames
+// Outputs      : none
+static void reclaimReservations(filestructure* self)
 {
-	if (filesystem.Filelist[fd].position + count > filesystem.Filelist[fd].filesize) {
-		count = filesystem.Filelist[fd].filesize - filesystem.Filelist[fd].position;
-		logMessage(LOG_INFO_LEVEL,"trying to read beyond file size. will read till end of file %d \n",count);
+	int16_t fd;
+	for (fd = 0; fd < BLOCK_MAX_OPEN_FILES; fd++) {
+		if ((filesystem.OpenFiles[fd] != NULL) && (filesystem.OpenFiles[fd] != self)) {
+			trimReservation(filesystem.OpenFiles[fd], filesystem.OpenFiles[fd]->keep);
 		}
-	return count;
+	}
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : readCurrentFrame
-// Description  : Reads "count" bytes from the file handle "fd" into the
-//                buffer "buf"
+// Function     : reserveFrames
+// Description  : append up to "want" frames to the reservation of a file.
+//                A run is cut from the untouched end of the volume so it
+//                is contiguous; single frames and whatever the untouched
+//                end cannot supply come from allocFrame.
 //
-// Inputs       : fd - filename of the file to read from
-//                buf - pointer to buffer to read into
-//                count - number of bytes to read
-// Outputs      : bytes read if successful, -1 if failure
-int32_t readCurrentFrame(int16_t fd, void* buf, int32_t count)
+// Inputs       : f - the file record
+//                want - frames to reserve
+// Outputs      : frames reserved, at least one, -1 if failure
+static int32_t reserveFrames(filestructure* f, int32_t want)
 {
-	uint32_t newCScode,CScode;
-	BlockXferRegister regstate, RT ;
-	int success;
-	success = 1;
-	while (success >= 1 && success<=1000){
-		if (success>1);
-		regstate = create_opcode(BLOCK_OP_RDFRME, filesystem.Filelist[fd].currentFrame,0 , 0);
-		regstate = block_io_bus(regstate, buf);
-		RT = get_RTcode(regstate);
-		CScode = get_CScode(regstate);
-		logMessage(LOG_INFO_LEVEL,"read_recd_Checksum %0x %d \n", CScode,CScode);
-		if (computeframechecksum(buf, &newCScode) < 0){
-			return -1; // this returns ( 0 or -1) (it will not match CS code)
+	BlockVolumeFrame frame;
+	int32_t got = 0;
+
+	if (growFrameMap(f, f->no_of_frame+f->reserved+want)) {
+		return -1;
+	}
+	if ((want > 1) && !block_log_enabled()) {
+		while ((got < want) && (filesystem.NextFrameNo < filesystem.TotalFrames)) {
+			claimFrame(filesystem.NextFrameNo);
+			f->usedFrame[f->no_of_frame+f->reserved++] = filesystem.NextFrameNo++;
+			got++;
 		}
-	//	logMessage(LOG_INFO_LEVEL,"read_MD5_Checksum %0x %d %s \n", newCScode,newCScode,filesystem.Filelist[fd].currentFrame);
-		if (CScode != newCScode){
-			success++;
+	}
+	while (got < want) {
+		if ((got > 0) && !block_log_enabled() && (filesystem.FreeCount == 0)) {
+			break; //the volume is full, settle for what there is
 		}
-		else {
-			success = 0;
-			if (RT==-1){
+		if (allocFrame(&frame)) {
+			if (got > 0) {
+				break;
+			}
+			reclaimReservations(f); //other files may hold frames they will not use
+			if (allocFrame(&frame)) {
 				return -1;
 			}
 		}
+		f->usedFrame[f->no_of_frame+f->reserved++] = frame;
+		got++;
 	}
-
-    return (0);
+	return got;
 }
+
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : checkFileHandle
-// Description  : check for valid file handle "fd" & files status
-//
-// Inputs       : fd - filehandle of the file to read from
+// Function     : resetFileAccess
+// Description  : reset the per-open access state of file "fd"
 //
-// Outputs      : bytes read if successful, -1 if failure
-int16_t checkFileHandle(int16_t fd)
-{	
-	if (filesystem.sysstatus == 0){
-		logMessage(LOG_ERROR_LEVEL, "File system powered off: task failed");
-		return -1;}
-	if ( fd>=  BLOCK_MAX_TOTAL_FILES || fd  < 0){
-		logMessage(LOG_ERROR_LEVEL, "Invalid File Handle");
-		return -1;}
-	if (filesystem.Filelist[fd].filestatus  == 0){
-		logMessage(LOG_ERROR_LEVEL, " File is closed.");
-		return -1;}
-	return 0;
+// Inputs       : fd - the file handle
+//                flags - BLOCK_O_* flags of the open
+// Outputs      : none
+static void resetFileAccess(int16_t fd, int32_t flags)
+{
+	filesystem.OpenFiles[fd]->flags = flags;
+	filesystem.OpenFiles[fd]->advice = BLOCK_ADV_NORMAL;
+	filesystem.OpenFiles[fd]->qos = BLOCK_QOS_NORMAL;
+	filesystem.OpenFiles[fd]->nextreadframe = -1;
+	filesystem.OpenFiles[fd]->readahead = 0;
+	filesystem.OpenFiles[fd]->raframe = 0;
 }
+
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : checkSize
-// Description  : check for if increase in file size is needed
+// Function     : newFileEntry
+// Description  : claim a file record for a new (closed, empty) file, records
+//                released by block_unlink are reused first and a new slab
+//                is allocated when the table is full
 //
-// Inputs       : fd - filename of the file to read from
-//                count - number of bytes to read
-// Outputs      : return 1 if increase size of file, ekse return 0
-/*int32_t checkSize(int16_t fd,int32_t count)
+// Inputs       : path - filename of the new file
+// Outputs      : the file record if successful, NULL if failure
+static filestructure* newFileEntry(char* path)
 {
-	if (filesystem.Filelist[fd].position + count > filesystem.Filelist[fd].filesize)
-		{
-		return 1;
+	filestructure** slabs;
+	filestructure* f;
+	int32_t i, h;
+
+	if ((filesystem.LiveFiles >= 2*filesystem.HashBuckets) && growPathHash()){
+		logMessage(LOG_ERROR_LEVEL, " Failed to grow the path hash for %s \n", path);
+		return NULL;
+	}
+	if (filesystem.FreeFiles >= 0){
+		i = filesystem.FreeFiles;
+		filesystem.FreeFiles = fileEntry(i)->hnext;
+	}
+	else {
+		if (filesystem.NextFileNo >= BLOCK_MAX_TOTAL_FILES){
+			logMessage(LOG_ERROR_LEVEL, " Failed to create %s: file table full \n", path);
+			return NULL;
 		}
-	return 0;
-}*/ //not used
+		if (filesystem.NextFileNo == filesystem.NumSlabs*BLOCK_FILE_SLAB_ENTRIES){
+			slabs = realloc(filesystem.FileSlabs, (filesystem.NumSlabs+1)*sizeof(filestructure*));
+			if (slabs == NULL){
+				return NULL;
+			}
+			filesystem.FileSlabs = slabs;
+			if ((slabs[filesystem.NumSlabs] = malloc(BLOCK_FILE_SLAB_ENTRIES*sizeof(filestructure))) == NULL){
+				logMessage(LOG_ERROR_LEVEL, " Failed to allocate file table slab for %s \n", path);
+				return NULL;
+			}
+			filesystem.NumSlabs++;
+		}
+		i = filesystem.NextFileNo++;
+	}
+	f = fileEntry(i);
+	memset(f, 0x0, sizeof(filestructure));
+	strncpy(f->filepath, path, BLOCK_MAX_PATH_LENGTH-1);
+	f->filepath[BLOCK_MAX_PATH_LENGTH-1] = 0x0;
+	f->fileno = i;
+	f->fhandle = -1;
+	f->wbframe = -1;
+	h = pathHash(f->filepath);
+	f->hnext = filesystem.PathHash[h];
+	filesystem.PathHash[h] = i;
+	filesystem.LiveFiles++;
+	return f;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : checkCurrentFrame
-// Description  : check if currentframe has space left in frame
-//		 "count" bytes
-// Inputs       : fd - filename of the file to read from
-//                count - number of bytes to read
-// Outputs      : return remain frame size in count otherwise if full new frane
+// Function     : freeFileEntry
+// Description  : return a closed file record to the free list, its frames
+//                must already be released
+//
+// Inputs       : f - the file record
+// Outputs      : none
+static void freeFileEntry(filestructure* f)
+{
+	int32_t* link = &filesystem.PathHash[pathHash(f->filepath)];
+	while (*link != f->fileno){
+		link = &fileEntry(*link)->hnext;
+	}
+	*link = f->hnext;
+	free(f->usedFrame);
+	f->usedFrame = NULL;
+	block_merkle_free(&f->merkle);
+	f->filepath[0] = 0x0;
+	f->hnext = filesystem.FreeFiles;
+	filesystem.FreeFiles = f->fileno;
+	filesystem.LiveFiles--;
+}
 
-int32_t checkCurrentFrame(int16_t fd,int32_t count)
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : openHandle
+// Description  : give an open file the lowest free file handle
+//
+// Inputs       : f - the file record
+// Outputs      : file handle if successful, -1 if too many files are open
+static int16_t openHandle(filestructure* f)
 {
-	if (filesystem.Filelist[fd].currentframePosition + count > BLOCK_FRAME_SIZE){
-		count = BLOCK_FRAME_SIZE - filesystem.Filelist[fd].currentframePosition;
-		}
-	else {
-		if (count>BLOCK_FRAME_SIZE) {
-			count = BLOCK_FRAME_SIZE ;
+	int16_t fd;
+	for (fd = 0; fd < BLOCK_MAX_OPEN_FILES; fd++){
+		if (filesystem.OpenFiles[fd] == NULL){
+			pthread_mutex_lock(&filelock(fd));
+			filesystem.OpenFiles[fd] = f;
+			f->fhandle = fd;
+			f->filestatus = 1;
+			f->opengen = ++filesystem.OpenGen;
+			f->wrhead = 0;
+			f->wrturn = 0;
+			pthread_mutex_unlock(&filelock(fd));
+			return fd;
 		}
 	}
-	return count;
+	logMessage(LOG_ERROR_LEVEL, " Failed to open %s: %d files already open \n", f->filepath, BLOCK_MAX_OPEN_FILES);
+	return -1;
 }
+
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : addNewFrame
-// Description  : add new frame in the file name "fd"
+// Function     : closeHandle
+// Description  : give back the file handle of an open file
 //
-// Inputs       : fd - filename of the file to read from
+// Inputs       : fd - the file handle
+// Outputs      : none
+static void closeHandle(int16_t fd)
+{
+	pthread_mutex_lock(&filelock(fd));
+	filesystem.OpenFiles[fd]->filestatus = 0;
+	filesystem.OpenFiles[fd]->fhandle = -1;
+	filesystem.OpenFiles[fd] = NULL;
+	pthread_cond_broadcast(&turned(fd)); //writes waiting for a turn give up
+	pthread_mutex_unlock(&filelock(fd));
+}
+
+////////////////////////////////////////////////////////////////////////////////
 //
-// Outputs      : bytes read if successful, -1 if failure
-int16_t addNewFrame(int16_t fd)
+// Function     : openFile
+// Description  : This function opens the file with BLOCK_O_* access flags
+//                and returns a file handle
+//
+// Inputs       : path - filename of the file to open
+//                flags - BLOCK_O_* flags
+// Outputs      : file handle if successful, -1 if failure
+
+static int16_t openFile(char* path, int32_t flags)
 {
-	if (filesystem.NextFrameNo < BLOCK_BLOCK_SIZE){
-		//allot next available frame
-		filesystem.Framelist[filesystem.NextFrameNo].status=1;
-		//add frame to framelist of file
-		filesystem.Filelist[fd].usedFrame[filesystem.Filelist[fd].no_of_frame]=filesystem.NextFrameNo;
-		filesystem.Filelist[fd].currentFrame = filesystem.NextFrameNo;
-		//set current frame position
-		filesystem.Filelist[fd].currentframePosition = 0;
-		filesystem.Filelist[fd].currentframeno = filesystem.Filelist[fd].no_of_frame; //starts with 0
-		filesystem.Filelist[fd].usedFrame[filesystem.Filelist[fd].currentframeno] = filesystem.Filelist[fd].currentFrame;
-		filesystem.NextFrameNo++;
-		filesystem.Filelist[fd].no_of_frame++;
-		logMessage(LOG_INFO_LEVEL,"Added new frame count %d. current frame(starts with 0) %d \n", filesystem.Filelist[fd].no_of_frame,filesystem.Filelist[fd].currentFrame);
-		return 0;
+	filestructure* f;
+	int16_t fd;
+	if (filesystem.sysstatus==0){
+		logMessage(LOG_ERROR_LEVEL, "Failed, System status power off");
+		return -1;}
+	if ((f = findFile(path)) != NULL){
+		if  (f->filestatus == 1){
+			logMessage(LOG_ERROR_LEVEL, " Failed to open file: file is already open \n");
+			return (-1);}
+		if (f->readonly){
+			flags |= BLOCK_O_RDONLY; //snapshots never change
+		}
+		if ((fd = openHandle(f)) < 0){
+			return -1;
+		}
+		if (f->no_of_frame > 0){
+			f->currentFrame = f->usedFrame[0];
+		}
+		f->currentframeno = 0;
+		f->position = 0;
+		f->currentframePosition=0;
+		resetFileAccess(fd, flags);
+		logMessage(LOG_INFO_LEVEL,"%s file already exists as %s Reopening now with handle %d \n",path,f->filepath,fd);
+		return (fd);
+	}
+	if (flags & BLOCK_O_RDONLY){
+		logMessage(LOG_ERROR_LEVEL, " Failed to open file: %s does not exist for read-only open \n", path);
+		return -1;
+	}
+	if ((f = newFileEntry(path)) == NULL){
+		return -1; //error adding file > total_files
+	}
+	if ((fd = openHandle(f)) < 0){
+		freeFileEntry(f);
+		return -1;
+	}
+	resetFileAccess(fd, flags);
+	logMessage(LOG_INFO_LEVEL, "%s file opened %d \n",path,fd);
+	if (block_pack_threshold() > 0){
+		return fd; //packed until it outgrows the threshold
 	}
-	else { //Frames exhausted in block
+	if (addNewFrame(fd)!=0) { //error adding frame > total_frames
+		trimReservation(f, 0);
+		closeHandle(fd);
+		freeFileEntry(f);
 		return -1;
 	}
+	return fd;
+    // THIS SHOULD RETURN A FILE HANDLE
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_open_flags
+// Description  : This function opens the file with BLOCK_O_* access flags
+//                and returns a file handle
+//
+// Inputs       : path - filename of the file to open
+//                flags - BLOCK_O_* flags
+// Outputs      : file handle if successful, -1 if failure
+
+int16_t block_open_flags(char* path, int32_t flags)
+{
+	int16_t ret;
+	uint64_t span = block_trace_begin(), call = block_record_begin();
+	lockDriver();
+	ret = openFile(path, flags);
+	unlockDriver();
+	block_record_call(call, BLOCK_RECORD_OPEN, ret, flags, 0, ret, path);
+	block_trace_end("block_open_flags", span);
+	return ret;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : closeFile
+// Description  : This function closes the file
+//
+// Inputs       : fd - the file descriptor
+// Outputs      : 0 if successful, -1 if failure
+
+static int16_t closeFile(int16_t fd)
+{
+	int lost;
+	 if (checkFileHandle(fd)){
+		logMessage(LOG_ERROR_LEVEL, " Failed to close file");
+		return -1;}
+	if (block_mmap_views(fd) > 0){
+		logMessage(LOG_ERROR_LEVEL, " Failed to close file %d: it has live block mappings", fd);
+		return -1;}
+	if (flushWriteBuffer(fd)){
+		logMessage(LOG_ERROR_LEVEL, " Failed to flush file %d on close", fd);
+		return -1;}
+	lost = filesystem.OpenFiles[fd]->ioerror;
+	filesystem.OpenFiles[fd]->ioerror = 0;
+	trimReservation(filesystem.OpenFiles[fd], filesystem.OpenFiles[fd]->keep); //block_fallocate frames stay
+	free(filesystem.OpenFiles[fd]->wbuf);
+	filesystem.OpenFiles[fd]->wbuf = NULL;
+	filesystem.OpenFiles[fd]->wbframe = -1;
+	closeHandle(fd);
+	if (lost){
+		logMessage(LOG_ERROR_LEVEL, " File %d closed, a queued write of it was lost", fd);
+		return -1;}
+    // Return successfully
+    return (0);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : setNextFrame
-// Description  : set Next frame using inputs file handle fd and count bytes
+// Function     : block_close
+// Description  : This function closes the file
+//
+// Inputs       : fd - the file descriptor
+// Outputs      : 0 if successful, -1 if failure
+
+int16_t block_close(int16_t fd)
+{
+	int16_t ret;
+	uint64_t span = block_trace_begin(), call = block_record_begin();
+	lockDriver();
+	ret = closeFile(fd);
+	unlockDriver();
+	block_record_call(call, BLOCK_RECORD_CLOSE, fd, 0, 0, ret, NULL);
+	block_trace_end("block_close", span);
+	return ret;
+}
+////////////////////////////////////////////////////////////////////////////////
+// Function     : checkFileSize
+// Description  : Reads "count" bytes from the file handle "fd" 
 //
 // Inputs       : fd - filename of the file to read from
 //                count - number of bytes to read
-// Outputs      : calls addNewFrame if more than available frames, return 0
-int16_t setNextFrame(int16_t fd, int32_t count)
-{//update currentframePostion
-	if (filesystem.Filelist[fd].currentframePosition+count < BLOCK_FRAME_SIZE-1) {
-		filesystem.Filelist[fd].currentframePosition += count;
-		logMessage(LOG_INFO_LEVEL,"frame %d position updated %d with %d file position %d file size %d \n", filesystem.Filelist[fd].currentFrame, filesystem.Filelist[fd].currentframePosition, count, filesystem.Filelist[fd].position, filesystem.Filelist[fd].filesize);
-	}
-	else { //beyond currentframePosition, so move to next frame for this file
-		if (filesystem.Filelist[fd].currentframeno+1 < (filesystem.Filelist[fd].no_of_frame)) {
-			filesystem.Filelist[fd].currentframeno++;
-			filesystem.Filelist[fd].currentFrame = filesystem.Filelist[fd].usedFrame[filesystem.Filelist[fd].currentframeno];
-			filesystem.Filelist[fd].currentframePosition = 0;
-			logMessage(LOG_INFO_LEVEL,"moved to new frame no %d frame %d \n", filesystem.Filelist[fd].currentframeno+1,filesystem.Filelist[fd].currentFrame);
-		}
-		else { //beyond available frames, so add new frame
-			logMessage(LOG_INFO_LEVEL,"Adding new frame %d. earlier %d frame position was %d count %d \n", filesystem.Filelist[fd].no_of_frame+1,filesystem.Filelist[fd].currentframeno+1,filesystem.Filelist[fd].currentframePosition,count);
-			return addNewFrame(fd);
+// Outputs      : bytes read if successful, -1 if failure
+int32_t checkFileSize(int16_t fd,int32_t count)
+{
+	if (filesystem.OpenFiles[fd]->position + count > filesystem.OpenFiles[fd]->filesize) {
+		count = filesystem.OpenFiles[fd]->filesize - filesystem.OpenFiles[fd]->position;
+		logMessage(LOG_INFO_LEVEL,"trying to read beyond file size. will read till end of file %d \n",count);
 		}
-	}
-	return 0;
+	return count;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : writeCurrentFrame
-// Description  : Reads "count" bytes from the file handle"fd" into the
-//                buffer "buf"
+// Function     : getFileSize
+// Description  : current size in bytes of the file handle "fd"
 //
-// Inputs       : fd - filename of the file to read from
-//                buf - pointer to buffer to read into
-//                count - number of bytes to read
-// Outputs      : bytes writen if successful, -1 if failure
-int32_t writeCurrentFrame(int16_t fd, void* buf, int32_t count)
+// Inputs       : fd - filehandle of the file
+// Outputs      : file size
+int32_t getFileSize(int16_t fd)
 {
-	int success = 0;
-	uint32_t testCScode,CScode;
-	BlockXferRegister regstate ,RT ;
+	return filesystem.OpenFiles[fd]->filesize;
+}
 
-	if (computeframechecksum(buf, &testCScode)) {
-		return -1; //error in checksum
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : noteFrameError
+// Description  : count a checksum or acknowledgement error against a frame
+//
+// Inputs       : frame - the volume frame
+// Outputs      : none
+void noteFrameError(BlockVolumeFrame frame)
+{
+	if (filesystem.Framelist[frame].errors < BLOCK_QUARANTINE_ERRORS+BLOCK_FRAME_RETRIES){
+		filesystem.Framelist[frame].errors++;
 	}
-//	printf("Write_Sent_MD5Checksum Buffer %0x %d %s at %d \n", testCScode, testCScode,buf,filesystem.Filelist[fd].currentFrame);
-	while (success == 0){
-		regstate = create_opcode(BLOCK_OP_WRFRME, filesystem.Filelist[fd].currentFrame, testCScode, 0);
-      		regstate = block_io_bus(regstate, buf);
-        	RT = get_RTcode(regstate);
-        	CScode = get_CScode(regstate);
-		logMessage(LOG_INFO_LEVEL, " Write_recd_Checksum %0x %d \n", CScode, CScode);
-        	if (CScode == testCScode){
-            		success = 1;
-				if (RT == -1){ 
-					logMessage(LOG_ERROR_LEVEL,"writecurrentframe fails \n");
-					return -1;
-				}
-			}
-      }
-	return 0;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : block_read
-// Description  : Reads "count" bytes from the file handle "fh" into the
-//                buffer "buf"
+// Function     : retryFrame
+// Description  : account for a failed transfer of a frame and, if another
+//                is allowed, back off before it
 //
-// Inputs       : fd - filename of the file to read from
-//                buf - pointer to buffer to read into
-//                count - number of bytes to read
-// Outputs      : bytes read if successful, -1 if failure
-
-int32_t block_read(int16_t fd, char* buf, int32_t count)
+// Inputs       : frame - the volume frame
+//                attempt - transfers made so far, from 1
+//                op - "read" or "write", for the log
+// Outputs      : 1 if the transfer may be tried again, 0 if not
+static int retryFrame(BlockVolumeFrame frame, int attempt, const char* op)
 {
-	int32_t totalcount,readcount,curpos;
-	char* totalbuf;
+	struct timespec ts;
+	uint64_t usec;
 
-	if (checkFileHandle(fd))	{return -1;}
-	//if position+count > file size, reduce count to file size
-	count=checkFileSize(fd,count);
-	readcount=0;
+	if (sharedhold == driverstate){
+		sharedmiss = 1; //errors are counted and frames moved under the exclusive lock
+		return 0;
+	}
+	noteFrameError(frame);
+	if (attempt >= BLOCK_FRAME_RETRIES){
+		filesystem.Health.failures++;
+		logMessage(LOG_ERROR_LEVEL,"Frame %u failed %d %ss, giving up \n", frame, attempt, op);
+		return 0;
+	}
+	filesystem.Health.retries++;
+	usec = (uint64_t)BLOCK_RETRY_BACKOFF_USEC << (attempt-1);
+	if (usec > BLOCK_RETRY_BACKOFF_MAX_USEC){
+		usec = BLOCK_RETRY_BACKOFF_MAX_USEC;
+	}
+	ts.tv_sec = 0;
+	ts.tv_nsec = usec*1000;
+	nanosleep(&ts, NULL);
+	return 1;
+}
 
-	for(totalcount=count;totalcount>0;totalcount-=count)
-	{
-		count=totalcount;
-		count=checkCurrentFrame(fd,count);
-		//create buffer to write a frame
-		totalbuf = malloc(BLOCK_FRAME_SIZE);
-		//memset(totalbuf,0,BLOCK_FRAME_SIZE);
-		//currentframeposition will be 0 for new frame or entire frame
-		curpos = filesystem.Filelist[fd].currentframePosition;
-		if ((readCurrentFrame(fd,totalbuf,BLOCK_FRAME_SIZE))<0) {
-			logMessage(LOG_ERROR_LEVEL,"read fails %d \n",count);
-			return -1; //error
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : readFrame
+// Description  : Reads one volume frame into "buf", re-reading with backoff
+//                while the checksum returned by the controller does not
+//                match the data, at most BLOCK_FRAME_RETRIES times
+//
+// Inputs       : frame - volume frame to read
+//                buf - pointer to frame buffer to read into
+// Outputs      : 0 if successful, -1 if failure
+int32_t readFrame(BlockVolumeFrame frame, void* buf)
+{
+	uint32_t newCScode,CScode;
+	BlockXferRegister regstate, RT ;
+	int attempt;
+	uint64_t span;
+	for (attempt = 1; ; attempt++){
+		span = block_trace_begin();
+		regstate = create_opcode(BLOCK_OP_RDFRME, 0, 0 , 0);
+		regstate = block_volume_io(regstate, frame, buf);
+		RT = get_RTcode(regstate);
+		CScode = get_CScode(regstate);
+		logMessage(LOG_INFO_LEVEL,"read_recd_Checksum %0x %d \n", CScode,CScode);
+		if (computeframechecksum(buf, &newCScode) < 0){
+			return -1; // this returns ( 0 or -1) (it will not match CS code)
 		}
-		
-		else {
-			logMessage(LOG_INFO_LEVEL,"Read this time %d frames, earlier read %d frames out of %d frames \n",count,readcount,readcount+totalcount);
+		block_trace_end((attempt > 1) ? "readFrame retry" : "readFrame", span);
+		if (CScode == newCScode){
+			break;
 		}
-		//memcpy(buf,totalbuf,count); //rectify
-		memcpy(buf+readcount,totalbuf+curpos,count);
-		readcount+=count;
-		setNextFrame(fd,count);
-		filesystem.Filelist[fd].position = filesystem.Filelist[fd].position + readcount;
+		if (!retryFrame(frame, attempt, "read")){
+			return -1;
+		}
+	}
+	if (RT != BLOCK_RET_SUCCESS){
+		return -1;
+	}
+
+    return (0);
+}
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : logAlloc
+// Description  : allot a frame from a log head, passing over quarantined
+//                frames in the segments the log reuses
+//
+// Inputs       : head - the log head
+//                frame - the allotted frame (output)
+// Outputs      : 0 if successful, -1 if the head has no free segment
+static int32_t logAlloc(BlockLogHead head, BlockVolumeFrame* frame)
+{
+	while (block_log_alloc(head, frame) == 0){
+		if (!filesystem.Framelist[*frame].quarantined){
+			return 0;
+		}
+		block_log_release(*frame);
 	}
-	return readcount;
+	return -1;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : block_write
-// Description  : Writes "count" bytes to the file handle "fh" from the
-//                buffer  "buf"
+// Function     : retireFrame
+// Description  : quarantine a volume frame, whatever it held is dropped and
+//                it is never allotted again while the volume is on
 //
-// Inputs       : fd - filename of the file to write to
-//                buf - pointer to buffer to write from
-//                count - number of bytes to write
-// Outputs      : bytes written if successful, -1 if failure
+// Inputs       : frame - the volume frame, allotted
+// Outputs      : none
+static void retireFrame(BlockVolumeFrame frame)
+{
+	filesystem.Framelist[frame].status = 0;
+	filesystem.Framelist[frame].refcount = 0;
+	filesystem.Framelist[frame].quarantined = 1;
+	if (block_log_enabled()){
+		block_log_release(frame); //the log hands the slot out again, logAlloc passes it over
+	}
+	block_cache_invalidate(frame);
+	filesystem.Health.quarantined++;
+	logMessage(LOG_INFO_LEVEL,"Frame %u quarantined after %d errors \n", frame, filesystem.Framelist[frame].errors);
+}
 
-int32_t block_write(int16_t fd, char* buf, int32_t count)
- {
-	int32_t totalcount,writecount,curpos;
-	char* totalbuf;
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : relocateFrame
+// Description  : move the data of a flaky frame to a fresh one and retire
+//                it; every file map, clones and snapshots included, and the
+//                pack table follow the data.  In log mode the fresh frame
+//                comes from the cleaner head, so relocating never has to
+//                clean a segment.
+//
+// Inputs       : old - the flaky volume frame
+//                buf - its contents
+//                moved - the new volume frame (output)
+// Outputs      : 0 if successful, -1 if the data stays where it was
+static int32_t relocateFrame(BlockVolumeFrame old, void* buf, BlockVolumeFrame* moved)
+{
+	BlockVolumeFrame frame;
+	filestructure* f;
+	int32_t i, j;
 
-	
-	if (checkFileHandle(fd)){
+	if (block_log_enabled()){
+		if (logAlloc(BLOCK_LOG_HEAD_CLEANER, &frame)){
+			logMessage(LOG_ERROR_LEVEL,"No frame to relocate flaky frame %u to \n", old);
+			return -1;
+		}
+		claimFrame(frame);
+	}
+	else if (allocFrame(&frame)){
+		logMessage(LOG_ERROR_LEVEL,"No frame to relocate flaky frame %u to \n", old);
 		return -1;
 	}
-	
-	writecount=0;
-	for(totalcount=count;totalcount>0;totalcount-=count)
-	{
-		count=totalcount;
-		count=checkCurrentFrame(fd,count);
-		//create buffer to write a frame
-		totalbuf = malloc(BLOCK_FRAME_SIZE);
-		//memset(totalbuf,0x0,BLOCK_FRAME_SIZE);
-		//currentframeposition will be 0 for new frame or entire frame
-		curpos = filesystem.Filelist[fd].currentframePosition;
-		//read existing frame data if not writing entire frame
-		if (count<BLOCK_FRAME_SIZE) {
-			readCurrentFrame(fd,totalbuf,BLOCK_FRAME_SIZE);
-		}
-		memcpy(totalbuf+curpos,buf+writecount,count);
-		//memcpy(totalbuf,buf,count); //rectify
-		if ((writeCurrentFrame(fd,totalbuf,BLOCK_FRAME_SIZE))<0) {
-			logMessage(LOG_ERROR_LEVEL,"write fails %d \n",count);
-			return -1; //error
+	if (writeFrame(frame, buf)){
+		if (filesystem.Framelist[frame].errors >= BLOCK_QUARANTINE_ERRORS){
+			retireFrame(frame);
 		}
 		else {
-//			logMessage(LOG_INFO_LEVEL,"write this time %d earlier write %d out of %d %s \n",count,writecount,writecount+totalcount,totalbuf);
+			releaseFrame(frame);
 		}
-		writecount+=count;
-		setNextFrame(fd,count); //it may call addNewFrame(fd);  if required
+		return -1;
 	}
-	filesystem.Filelist[fd].position = filesystem.Filelist[fd].position + writecount;
-	if (filesystem.Filelist[fd].position > filesystem.Filelist[fd].filesize) {
-		filesystem.Filelist[fd].filesize = filesystem.Filelist[fd].position;
+	for (j = 0; j < filesystem.NextFileNo; j++){
+		f = fileEntry(j);
+		if (f->usedFrame == NULL){
+			continue;
+		}
+		for (i = 0; i < f->no_of_frame+f->reserved; i++){
+			if (f->usedFrame[i] == old){
+				f->usedFrame[i] = frame;
+			}
+		}
+		if (f->currentFrame == old){
+			f->currentFrame = frame;
+		}
 	}
-	return writecount;
+	block_pack_remap(old, frame);
+	filesystem.Framelist[frame].refcount = filesystem.Framelist[old].refcount;
+	filesystem.Framelist[frame].written = 1;
+	retireFrame(old);
+	filesystem.Health.relocated++;
+	logMessage(LOG_INFO_LEVEL,"Relocated flaky frame %u to frame %u \n", old, frame);
+	*moved = frame;
+	return 0;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : block_seek
-// Description  : Seek to specific point in the file
+// Function     : readMappedFrame
+// Description  : read a frame some file maps, a frame that has crossed
+//                BLOCK_QUARANTINE_ERRORS is relocated once its data is in,
+//                unless the driver is only held shared
 //
-// Inputs       : fd - filename of the file to write to
-//                loc - offfset of file in relation to beginning of file
+// Inputs       : frame - the volume frame, updated if it moves
+//                buf - frame buffer to read into
+// Outputs      : 0 if successful, -1 if failure
+int32_t readMappedFrame(BlockVolumeFrame* frame, void* buf)
+{
+	if (readFrame(*frame, buf) < 0){
+		return -1;
+	}
+	if ((filesystem.Framelist[*frame].errors >= BLOCK_QUARANTINE_ERRORS) && (sharedhold != driverstate)){
+		relocateFrame(*frame, buf, frame); //the data was read either way
+	}
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : writeMappedFrame
+// Description  : write a frame some file maps; a frame that rejects the
+//                write, or has crossed BLOCK_QUARANTINE_ERRORS, has the
+//                data written to a fresh frame instead
+//
+// Inputs       : frame - the volume frame, updated if it moves
+//                buf - frame buffer to write from
 // Outputs      : 0 if successful, -1 if failure
+int32_t writeMappedFrame(BlockVolumeFrame* frame, void* buf)
+{
+	if (writeFrame(*frame, buf)){
+		return relocateFrame(*frame, buf, frame);
+	}
+	if (filesystem.Framelist[*frame].errors >= BLOCK_QUARANTINE_ERRORS){
+		relocateFrame(*frame, buf, frame); //the data was written either way
+	}
+	return 0;
+}
 
-int32_t block_seek(int16_t fd, uint32_t loc)
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : placeParkedWrites
+// Description  : move the queued writes the volume gave up on to fresh
+//                frames, as writeMappedFrame does for a write it sees fail;
+//                a write no frame can take is lost, and every file mapping
+//                its frame fails its next close
+//
+// Inputs       : none
+// Outputs      : none
+void placeParkedWrites(void)
 {
-	if (checkFileHandle(fd))	{return -1;}
-	
-	if (filesystem.Filelist[fd].filesize < loc) {
-		logMessage(LOG_ERROR_LEVEL, "Moving to %d beyond Size of File %d",loc,filesystem.Filelist[fd].filesize);
-		return -1; }
+	char buf[BLOCK_FRAME_SIZE];
+	BlockVolumeFrame frame, moved;
+	filestructure* f;
+	int32_t i, j;
 
-	filesystem.Filelist[fd].currentframeno = loc/BLOCK_FRAME_SIZE;
-	filesystem.Filelist[fd].currentframePosition = loc%BLOCK_FRAME_SIZE;
-	filesystem.Filelist[fd].currentFrame = filesystem.Filelist[fd].usedFrame[filesystem.Filelist[fd].currentframeno];
-	filesystem.Filelist[fd].position = loc;
-	logMessage(LOG_INFO_LEVEL,"Successfully positioned %d (frame %d position %d) file size %d \n",filesystem.Filelist[fd].position,filesystem.Filelist[fd].currentframeno,filesystem.Filelist[fd].currentframePosition,filesystem.Filelist[fd].filesize);
-    // Return successfully
-    return (0);
+	while (block_volume_unpark(&frame, buf)){
+		noteFrameError(frame);
+		filesystem.Health.failures++;
+		if (!filesystem.Framelist[frame].status){
+			continue; //released since it was written, nothing needs the data
+		}
+		if (relocateFrame(frame, buf, &moved) == 0){
+			continue;
+		}
+		filesystem.Health.lost++;
+		logMessage(LOG_ERROR_LEVEL,"Queued write of frame %u lost \n", frame);
+		for (j = 0; j < filesystem.NextFileNo; j++){
+			f = fileEntry(j);
+			for (i = 0; (f->usedFrame != NULL) && (i < f->no_of_frame); i++){
+				if (f->usedFrame[i] == frame){
+					f->ioerror = 1;
+					break;
+				}
+			}
+		}
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : readCurrentFrame
+// Description  : Reads the current frame of the file handle "fd" into the
+//                buffer "buf"
+//
+// Inputs       : fd - filename of the file to read from
+//                buf - pointer to buffer to read into
+//                count - number of bytes to read
+// Outputs      : bytes read if successful, -1 if failure
+int32_t readCurrentFrame(int16_t fd, void* buf, int32_t count)
+{
+	return readMappedFrame(&filesystem.OpenFiles[fd]->currentFrame, buf);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : checkFileHandle
+// Description  : check for valid file handle "fd" & files status
+//
+// Inputs       : fd - filehandle of the file to read from
+//
+// Outputs      : bytes read if successful, -1 if failure
+int16_t checkFileHandle(int16_t fd)
+{	
+	if (filesystem.sysstatus == 0){
+		logMessage(LOG_ERROR_LEVEL, "File system powered off: task failed");
+		return -1;}
+	if ( fd>=  BLOCK_MAX_OPEN_FILES || fd  < 0){
+		logMessage(LOG_ERROR_LEVEL, "Invalid File Handle");
+		return -1;}
+	if (filesystem.OpenFiles[fd] == NULL){
+		logMessage(LOG_ERROR_LEVEL, " File is closed.");
+		return -1;}
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : allocFrame
+// Description  : allot a free volume frame with a reference count of one,
+//                released frames are reused before untouched ones; in log
+//                mode the frame comes from the log head, and a write that
+//                finds no free segment cleans one itself
+//
+// Inputs       : frame - the allotted frame (output)
+// Outputs      : 0 if successful, -1 if the volume is full
+int16_t allocFrame(BlockVolumeFrame* frame)
+{
+	if (block_log_enabled()){
+		while (logAlloc(BLOCK_LOG_HEAD_USER, frame)){
+			if (cleanLogSegment() <= 0){
+				logMessage(LOG_ERROR_LEVEL,"No free log segments left in volume of %u frames \n", filesystem.TotalFrames);
+				return -1;
+			}
+			block_log_foreground();
+		}
+	}
+	else if (filesystem.FreeCount > 0){
+		*frame = filesystem.FreeFrames[--filesystem.FreeCount];
+	}
+	else if (filesystem.NextFrameNo < filesystem.TotalFrames){
+		*frame = filesystem.NextFrameNo++;
+	}
+	else {
+		logMessage(LOG_ERROR_LEVEL,"No free frames left in volume of %u frames \n", filesystem.TotalFrames);
+		return -1;
+	}
+	claimFrame(*frame);
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : releaseFrame
+// Description  : drop one reference to a volume frame, the frame is freed
+//                when the last file map lets go of it.  The last frame
+//                handed out from the untouched end of the volume goes back
+//                to it, so trimmed reservations leave that end contiguous.
+//
+// Inputs       : frame - the volume frame
+// Outputs      : none
+void releaseFrame(BlockVolumeFrame frame)
+{
+	if (--filesystem.Framelist[frame].refcount > 0){
+		return;
+	}
+	filesystem.Framelist[frame].status = 0;
+	if (block_log_enabled()){
+		block_log_release(frame);
+	}
+	else if (frame+1 == filesystem.NextFrameNo){
+		filesystem.NextFrameNo--;
+	}
+	else {
+		filesystem.FreeFrames[filesystem.FreeCount++] = frame;
+	}
+	block_cache_invalidate(frame);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cleanLogSegment
+// Description  : reclaim the log segment block_log_victim picks, its live
+//                frames are copied to the cleaner head and every file map
+//                pointing at them, clones and snapshots included, is moved
+//                to the copies
+//
+// Inputs       : none
+// Outputs      : frames reclaimed, 0 if no segment is worth cleaning, -1
+//                if failure
+int32_t cleanLogSegment(void)
+{
+	char buf[BLOCK_FRAME_SIZE];
+	BlockVolumeFrame first, *moved;
+	filestructure* f;
+	int32_t count, i, j, live = 0;
+
+	if (block_log_victim(&first, &count)){
+		return 0;
+	}
+	if ((moved = malloc(count*sizeof(BlockVolumeFrame))) == NULL){
+		logMessage(LOG_ERROR_LEVEL,"Failed to clean log segment at frame %u \n", first);
+		return -1;
+	}
+	for (i = 0; i < count; i++){
+		moved[i] = first+i;
+		if (!filesystem.Framelist[first+i].status){
+			continue;
+		}
+		if (logAlloc(BLOCK_LOG_HEAD_CLEANER, &moved[i]) ||
+			((block_cache_get(first+i, buf) != 0) && (readFrame(first+i, buf) < 0)) ||
+			writeFrame(moved[i], buf)){
+			logMessage(LOG_ERROR_LEVEL,"Failed to move frame %u out of log segment \n", first+i);
+			if (moved[i] != first+i){
+				block_log_release(moved[i]);
+			}
+			for (j = 0; j < i; j++){
+				if (moved[j] != first+j){
+					filesystem.Framelist[moved[j]].refcount = 1;
+					releaseFrame(moved[j]);
+				}
+			}
+			free(moved);
+			return -1;
+		}
+		filesystem.Framelist[moved[i]].status = 1;
+		filesystem.Framelist[moved[i]].refcount = filesystem.Framelist[first+i].refcount;
+		filesystem.Framelist[moved[i]].written = filesystem.Framelist[first+i].written;
+		live++;
+	}
+
+	//point the file maps at the copies, then let the old frames go
+	for (j = 0; j < filesystem.NextFileNo; j++){
+		f = fileEntry(j);
+		if (f->usedFrame == NULL){
+			continue;
+		}
+		for (i = 0; i < f->no_of_frame+f->reserved; i++){
+			if (f->usedFrame[i]-first < (BlockVolumeFrame)count){
+				f->usedFrame[i] = moved[f->usedFrame[i]-first];
+			}
+		}
+		if (f->currentFrame-first < (BlockVolumeFrame)count){
+			f->currentFrame = moved[f->currentFrame-first];
+		}
+	}
+	for (i = 0; i < count; i++){
+		if (filesystem.Framelist[first+i].status){
+			block_pack_remap(first+i, moved[i]);
+			filesystem.Framelist[first+i].refcount = 1;
+			releaseFrame(first+i);
+		}
+	}
+	free(moved);
+	logMessage(LOG_INFO_LEVEL,"Cleaned log segment at frame %u, moved %d live frames \n", first, live);
+	return (count-live);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : unshareFileFrame
+// Description  : give file "fd" a private copy of a shared frame before it
+//                is written; the caller writes the full new contents, so
+//                only the mapping changes here.  In log mode a frame that
+//                already holds data is never overwritten either, the write
+//                is remapped to the log head.
+//
+// Inputs       : fd - filehandle of the file
+//                frameno - file frame about to be written
+// Outputs      : 0 if successful, -1 if failure
+int16_t unshareFileFrame(int16_t fd, int32_t frameno)
+{
+	BlockVolumeFrame old = filesystem.OpenFiles[fd]->usedFrame[frameno], frame;
+	if ((filesystem.Framelist[old].refcount <= 1) && !(block_log_enabled() && filesystem.Framelist[old].written)){
+		return 0;
+	}
+	if (allocFrame(&frame)){
+		return -1;
+	}
+	old = filesystem.OpenFiles[fd]->usedFrame[frameno]; //the cleaner may have moved it to make room
+	releaseFrame(old);
+	filesystem.OpenFiles[fd]->usedFrame[frameno] = frame;
+	if (filesystem.OpenFiles[fd]->currentframeno == frameno){
+		filesystem.OpenFiles[fd]->currentFrame = frame;
+	}
+	logMessage(LOG_INFO_LEVEL,"Remapped write of file %d frame %d, %u -> %u \n", fd, frameno, old, frame);
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : addNewFrame
+// Description  : map the next frame of the file "fd" from its reservation.
+//                When the reservation is empty a growing file reserves as
+//                many frames again as it holds (up to
+//                BLOCK_PREALLOC_MAX_FRAMES), so a file written alongside
+//                others still lands in long contiguous runs.
+//
+// Inputs       : fd - filehandle of the file
+// Outputs      : 0 if successful, -1 if failure
+int16_t addNewFrame(int16_t fd)
+{
+	filestructure* f = filesystem.OpenFiles[fd];
+	int32_t spec = 0;
+
+	if (f->reserved == 0) {
+		if (!block_log_enabled()) {
+			spec = (f->no_of_frame < BLOCK_PREALLOC_MAX_FRAMES) ? f->no_of_frame : BLOCK_PREALLOC_MAX_FRAMES;
+		}
+		if (reserveFrames(f, 1+spec) <= 0) { //Frames exhausted in volume
+			return -1;
+		}
+	}
+	f->reserved--;
+	if (f->keep > 0) {
+		f->keep--;
+	}
+	f->currentFrame = f->usedFrame[f->no_of_frame];
+	f->currentframePosition = 0;
+	f->currentframeno = f->no_of_frame; //starts with 0
+	f->no_of_frame++;
+	logMessage(LOG_INFO_LEVEL,"Added new frame count %d. current frame(starts with 0) %d \n", f->no_of_frame, f->currentFrame);
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : setFilePosition
+// Description  : move the cursor of file "fd" to byte "loc", the current
+//                frame fields are derived from the position
+//
+// Inputs       : fd - filehandle of the file
+//                loc - byte position in the file
+// Outputs      : 0
+int16_t setFilePosition(int16_t fd, uint32_t loc)
+{
+	filesystem.OpenFiles[fd]->position = loc;
+	filesystem.OpenFiles[fd]->currentframeno = loc/BLOCK_FRAME_SIZE;
+	filesystem.OpenFiles[fd]->currentframePosition = loc%BLOCK_FRAME_SIZE;
+	if (filesystem.OpenFiles[fd]->currentframeno < filesystem.OpenFiles[fd]->no_of_frame) {
+		filesystem.OpenFiles[fd]->currentFrame = filesystem.OpenFiles[fd]->usedFrame[filesystem.OpenFiles[fd]->currentframeno];
+	}
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : writeFrame
+// Description  : Writes one frame from "buf" to a volume frame, re-sending
+//                until the controller acknowledges the checksum
+//
+// Inputs       : frame - volume frame to write
+//                buf - pointer to frame buffer to write from
+// Outputs      : 0 if successful, -1 if failure
+int32_t writeFrame(BlockVolumeFrame frame, void* buf)
+{
+	int attempt;
+	uint32_t testCScode,CScode;
+	BlockXferRegister regstate ,RT ;
+
+	if (computeframechecksum(buf, &testCScode)) {
+		return -1; //error in checksum
+	}
+	for (attempt = 1; ; attempt++){
+		regstate = create_opcode(BLOCK_OP_WRFRME, 0, testCScode, 0);
+		regstate = block_volume_io(regstate, frame, buf);
+		RT = get_RTcode(regstate);
+		CScode = get_CScode(regstate);
+		logMessage(LOG_INFO_LEVEL, " Write_recd_Checksum %0x %d \n", CScode, CScode);
+		if (CScode == testCScode && RT != BLOCK_RET_CHECKSUM_ERROR){
+			break;
+		}
+		if (!retryFrame(frame, attempt, "write")){
+			return -1;
+		}
+	}
+	if (RT != BLOCK_RET_SUCCESS){ 
+		logMessage(LOG_ERROR_LEVEL,"writecurrentframe fails \n");
+		return -1;
+	}
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : writeCurrentFrame
+// Description  : Writes the buffer "buf" to the current frame of the file
+//                handle "fd"
+//
+// Inputs       : fd - filename of the file to write to
+//                buf - pointer to buffer to write from
+//                count - number of bytes to write
+// Outputs      : bytes writen if successful, -1 if failure
+int32_t writeCurrentFrame(int16_t fd, void* buf, int32_t count)
+{
+	uint32_t checksum;
+	if (writeMappedFrame(&filesystem.OpenFiles[fd]->currentFrame, buf) || computeframechecksum(buf, &checksum)) {
+		return -1;
+	}
+	filesystem.Framelist[filesystem.OpenFiles[fd]->currentFrame].written = 1;
+	return block_merkle_update(&filesystem.OpenFiles[fd]->merkle, filesystem.OpenFiles[fd]->currentframeno, 1, &checksum);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fileCached
+// Description  : may frames of file "fd" go through the frame cache
+//
+// Inputs       : fd - filehandle of the file
+// Outputs      : 1 if cached, 0 if not
+static int fileCached(int16_t fd)
+{
+	return (block_cache_enabled() && !(filesystem.OpenFiles[fd]->flags & BLOCK_O_DIRECT));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fileBuffered
+// Description  : may writes to file "fd" be staged in its write buffer,
+//                random and direct access files write every frame through
+//
+// Inputs       : fd - filehandle of the file
+// Outputs      : 1 if buffered, 0 if not
+static int fileBuffered(int16_t fd)
+{
+	return (!(filesystem.OpenFiles[fd]->flags & BLOCK_O_DIRECT) && (filesystem.OpenFiles[fd]->advice != BLOCK_ADV_RANDOM));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : readFileFrames
+// Description  : Reads "count" consecutive frames of file "fd", starting at
+//                file frame "first", into "bufs".  Frames held in the write
+//                buffer or the frame cache are copied from there, the rest
+//                are read in groups of BLOCK_CSUM_PIPELINE_FRAMES, each
+//                group handed to the checksum pool while the next is on the
+//                bus; any frame whose checksum does not match is re-read on
+//                its own through readFrame.
+//
+// Inputs       : fd - filehandle of the file to read from
+//                first - first file frame (index in usedFrame)
+//                count - number of frames, at most BLOCK_VOLUME_BATCH_FRAMES
+//                bufs - count*BLOCK_FRAME_SIZE bytes to read into
+// Outputs      : 0 if successful, -1 if failure
+int32_t readFileFrames(int16_t fd, int32_t first, int32_t count, char* bufs)
+{
+	BlockVolumeXfer xfers[BLOCK_VOLUME_BATCH_FRAMES];
+	BlockCsumJob jobs[BLOCK_VOLUME_BATCH_FRAMES];
+	BlockCsumGroup groups[BLOCK_VOLUME_BATCH_FRAMES/BLOCK_CSUM_PIPELINE_FRAMES+1];
+	int i, n, g, ngroups, cached, err;
+	char* fbuf;
+
+	cached = fileCached(fd);
+	for (i = 0, n = 0; i < count; i++) {
+		fbuf = bufs + i*BLOCK_FRAME_SIZE;
+		if ((filesystem.OpenFiles[fd]->wbuf != NULL) && (filesystem.OpenFiles[fd]->wbframe == first+i)) {
+			memcpy(fbuf, filesystem.OpenFiles[fd]->wbuf, BLOCK_FRAME_SIZE);
+			continue;
+		}
+		if (cached && (block_cache_get(filesystem.OpenFiles[fd]->usedFrame[first+i], fbuf) == 0)) {
+			if (filesystem.OpenFiles[fd]->advice == BLOCK_ADV_SEQUENTIAL) {
+				block_cache_demote(filesystem.OpenFiles[fd]->usedFrame[first+i]); //read once, evict first
+			}
+			continue;
+		}
+		xfers[n].regstate = create_opcode(BLOCK_OP_RDFRME, 0, 0, 0);
+		xfers[n].frame = filesystem.OpenFiles[fd]->usedFrame[first+i];
+		xfers[n].buf = fbuf;
+		jobs[n].buf = fbuf;
+		n++;
+	}
+
+	//bus the next group while the pool verifies the last one
+	err = 0;
+	for (i = 0, ngroups = 0; i < n; i += BLOCK_CSUM_PIPELINE_FRAMES, ngroups++) {
+		g = (n - i < BLOCK_CSUM_PIPELINE_FRAMES) ? n - i : BLOCK_CSUM_PIPELINE_FRAMES;
+		if (block_volume_batch(&xfers[i], g)) {
+			err = -1;
+			break;
+		}
+		block_csum_submit(&groups[ngroups], &jobs[i], g);
+	}
+	for (g = 0; g < ngroups; g++) {
+		if (block_csum_wait(&groups[g])) {
+			err = -1;
+		}
+	}
+	if (err) {
+		return -1;
+	}
+	for (i = 0; i < n; i++) {
+		if ((get_RTcode(xfers[i].regstate) != BLOCK_RET_SUCCESS) || ((uint32_t)get_CScode(xfers[i].regstate) != jobs[i].checksum)) {
+			if (sharedhold == driverstate) {
+				sharedmiss = 1; //retried under the exclusive lock
+				return -1;
+			}
+			logMessage(LOG_INFO_LEVEL,"batched read of frame %u failed checksum, retrying \n", xfers[i].frame);
+			noteFrameError(xfers[i].frame);
+			if (readMappedFrame(&xfers[i].frame, xfers[i].buf) < 0) {
+				return -1;
+			}
+		}
+		if (cached) {
+			block_cache_put(xfers[i].frame, xfers[i].buf, BLOCK_CACHE_HOT);
+		}
+	}
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : writeFileFrames
+// Description  : Writes "count" consecutive frames of file "fd", starting at
+//                file frame "first", from "bufs".  The checksum pool hashes
+//                the frames in groups of BLOCK_CSUM_PIPELINE_FRAMES and each
+//                group goes to the bus as soon as it is hashed, while the
+//                pool works on the next; any frame the controller rejects
+//                is re-sent on its own through writeFrame.
+//
+// Inputs       : fd - filehandle of the file to write to
+//                first - first file frame (index in usedFrame)
+//                count - number of frames, at most BLOCK_VOLUME_BATCH_FRAMES
+//                bufs - count*BLOCK_FRAME_SIZE bytes to write from
+// Outputs      : 0 if successful, -1 if failure
+int32_t writeFileFrames(int16_t fd, int32_t first, int32_t count, char* bufs)
+{
+	BlockVolumeXfer xfers[BLOCK_VOLUME_BATCH_FRAMES];
+	BlockCsumJob jobs[BLOCK_VOLUME_BATCH_FRAMES];
+	BlockCsumGroup groups[BLOCK_VOLUME_BATCH_FRAMES/BLOCK_CSUM_PIPELINE_FRAMES+1];
+	uint32_t checksums[BLOCK_VOLUME_BATCH_FRAMES];
+	int i, j, g, ngroups, cached, err;
+
+	for (i = 0; i < count; i++) {
+		if (unshareFileFrame(fd, first+i)) {
+			return -1; //no frame for the private copy
+		}
+	}
+	for (i = 0; i < count; i++) { //after every remap, a foreground clean may move frames
+		xfers[i].buf = bufs + i*BLOCK_FRAME_SIZE;
+		xfers[i].frame = filesystem.OpenFiles[fd]->usedFrame[first+i];
+		jobs[i].buf = xfers[i].buf;
+	}
+	for (i = 0, ngroups = 0; i < count; i += BLOCK_CSUM_PIPELINE_FRAMES, ngroups++) {
+		g = (count - i < BLOCK_CSUM_PIPELINE_FRAMES) ? count - i : BLOCK_CSUM_PIPELINE_FRAMES;
+		block_csum_submit(&groups[ngroups], &jobs[i], g);
+	}
+
+	//bus each group once hashed, every group is waited on before returning
+	err = 0;
+	for (g = 0, i = 0; g < ngroups; i += groups[g].count, g++) {
+		if (block_csum_wait(&groups[g]) || err) {
+			err = -1; //error in checksum
+			continue;
+		}
+		for (j = i; j < i + groups[g].count; j++) {
+			xfers[j].regstate = create_opcode(BLOCK_OP_WRFRME, 0, jobs[j].checksum, 0);
+		}
+		if (block_volume_batch(&xfers[i], groups[g].count)) {
+			err = -1;
+		}
+	}
+	if (err) {
+		return -1;
+	}
+	cached = fileCached(fd);
+	for (i = 0; i < count; i++) {
+		if ((get_RTcode(xfers[i].regstate) != BLOCK_RET_SUCCESS) || ((uint32_t)get_CScode(xfers[i].regstate) != jobs[i].checksum)) {
+			logMessage(LOG_INFO_LEVEL,"batched write of frame %u not acknowledged, retrying \n", xfers[i].frame);
+			noteFrameError(xfers[i].frame);
+			if (writeMappedFrame(&xfers[i].frame, xfers[i].buf) < 0) {
+				return -1;
+			}
+		}
+		filesystem.Framelist[xfers[i].frame].written = 1;
+		if (cached) {
+			block_cache_put(xfers[i].frame, xfers[i].buf, BLOCK_CACHE_HOT);
+		}
+		else {
+			block_cache_invalidate(xfers[i].frame);
+		}
+		//a frame written around the write buffer supersedes it
+		if ((filesystem.OpenFiles[fd]->wbframe == first+i) && (filesystem.OpenFiles[fd]->wbuf != xfers[i].buf)) {
+			memcpy(filesystem.OpenFiles[fd]->wbuf, xfers[i].buf, BLOCK_FRAME_SIZE);
+			filesystem.OpenFiles[fd]->wbdirty = 0;
+		}
+		checksums[i] = jobs[i].checksum;
+	}
+	return block_merkle_update(&filesystem.OpenFiles[fd]->merkle, first, count, checksums);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : readPackFrame
+// Description  : read a pack frame through the frame cache, a pack frame
+//                never written holds zeros
+//
+// Inputs       : frame - the volume frame of the pack
+//                buf - frame buffer to read into
+//                cached - 1 if the frame cache may be used
+// Outputs      : 0 if successful, -1 if failure
+static int32_t readPackFrame(BlockVolumeFrame frame, char* buf, int cached)
+{
+	if (!filesystem.Framelist[frame].written) {
+		memset(buf, 0x0, BLOCK_FRAME_SIZE);
+		return 0;
+	}
+	if (cached && (block_cache_get(frame, buf) == 0)) {
+		return 0;
+	}
+	if (readMappedFrame(&frame, buf) < 0) {
+		return -1;
+	}
+	if (cached) {
+		block_cache_put(frame, buf, BLOCK_CACHE_HOT);
+	}
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : releasePackSlots
+// Description  : give a run of pack slots back, freeing the pack frame once
+//                no file is left in it
+//
+// Inputs       : pack - the pack
+//                slot - first slot of the run
+//                slots - length of the run
+// Outputs      : none
+static void releasePackSlots(int32_t pack, int32_t slot, int32_t slots)
+{
+	BlockVolumeFrame frame = block_pack_frame(pack);
+	if (block_pack_release(pack, slot, slots)) {
+		releaseFrame(frame);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : loadPackedFile
+// Description  : bring the contents of a packed file into its write buffer,
+//                laid out as its frame 0 would be, zero past the end
+//
+// Inputs       : f - the file record
+// Outputs      : 0 if successful, -1 if failure
+static int32_t loadPackedFile(filestructure* f)
+{
+	if ((f->wbuf != NULL) && (f->wbframe == 0)) {
+		return 0;
+	}
+	if ((f->wbuf == NULL) && ((f->wbuf = malloc(BLOCK_FRAME_SIZE)) == NULL)) {
+		return -1;
+	}
+	if (f->packslots > 0) {
+		if (readPackFrame(block_pack_frame(f->pack), f->wbuf, block_cache_enabled() && !(f->flags & BLOCK_O_DIRECT))) {
+			return -1;
+		}
+		memmove(f->wbuf, f->wbuf+f->packslot*BLOCK_PACK_SLOT_BYTES, f->filesize);
+	}
+	memset(f->wbuf+f->filesize, 0x0, BLOCK_FRAME_SIZE-f->filesize);
+	f->wbframe = 0;
+	f->wbdirty = 0;
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : storePackedFile
+// Description  : write the buffered contents of a packed file into its pack
+//                slots, moving it to a larger run first if it has grown.
+//                The pack frame is read, patched and written whole; in log
+//                mode the patched frame goes to the log head like any
+//                other rewrite.
+//
+// Inputs       : f - the file record, its write buffer loaded
+// Outputs      : 0 if successful, -1 if failure
+static int32_t storePackedFile(filestructure* f)
+{
+	char buf[BLOCK_FRAME_SIZE];
+	BlockVolumeFrame frame, target;
+	int32_t pack = f->pack, slot = f->packslot, slots = f->packslots;
+	int cached = block_cache_enabled() && !(f->flags & BLOCK_O_DIRECT), claimed = 0;
+	uint32_t checksum;
+
+	if (f->filesize == 0) {
+		return 0;
+	}
+	//a file that has grown moves to a longer run, in a new pack frame if need be
+	if (f->filesize > slots*BLOCK_PACK_SLOT_BYTES) {
+		slots = (f->filesize+BLOCK_PACK_SLOT_BYTES-1)/BLOCK_PACK_SLOT_BYTES;
+		if ((slot = block_pack_alloc(slots, &pack)) < 0) {
+			if (allocFrame(&frame)) {
+				return -1;
+			}
+			if ((slot = block_pack_add(frame, slots, &pack)) < 0) {
+				releaseFrame(frame);
+				return -1;
+			}
+		}
+		claimed = 1;
+	}
+	frame = block_pack_frame(pack);
+	if (readPackFrame(frame, buf, cached)) {
+		goto fail;
+	}
+	memcpy(buf+slot*BLOCK_PACK_SLOT_BYTES, f->wbuf, slots*BLOCK_PACK_SLOT_BYTES);
+	target = frame;
+	if (block_log_enabled() && filesystem.Framelist[frame].written) {
+		if (allocFrame(&target)) {
+			goto fail;
+		}
+		frame = block_pack_frame(pack); //the cleaner may have moved it to make room
+	}
+	if (writeMappedFrame(&target, buf)) {
+		if (target != frame) {
+			releaseFrame(target);
+		}
+		goto fail;
+	}
+	frame = block_pack_frame(pack); //a flaky pack frame is relocated in place
+	filesystem.Framelist[target].written = 1;
+	if (target != frame) {
+		block_pack_remap(frame, target);
+		releaseFrame(frame);
+	}
+	if (cached) {
+		block_cache_put(target, buf, BLOCK_CACHE_HOT);
+	}
+	else {
+		block_cache_invalidate(target);
+	}
+	if (claimed && (f->packslots > 0)) {
+		releasePackSlots(f->pack, f->packslot, f->packslots);
+	}
+	f->pack = pack;
+	f->packslot = slot;
+	f->packslots = slots;
+	if (computeframechecksum(f->wbuf, &checksum)) {
+		return -1;
+	}
+	return block_merkle_update(&f->merkle, 0, 1, &checksum);
+
+fail:
+	if (claimed) {
+		releasePackSlots(pack, slot, slots);
+	}
+	return -1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : unpackFile
+// Description  : promote a packed file of "fd" to a dedicated frame, its
+//                contents stay in the write buffer as frame 0 and reach the
+//                new frame on the next flush
+//
+// Inputs       : fd - filehandle of the file
+// Outputs      : 0 if successful, -1 if failure
+int16_t unpackFile(int16_t fd)
+{
+	filestructure* f = filesystem.OpenFiles[fd];
+
+	if (f->no_of_frame > 0) {
+		return 0;
+	}
+	if (loadPackedFile(f) || addNewFrame(fd)) {
+		return -1;
+	}
+	if (f->packslots > 0) {
+		releasePackSlots(f->pack, f->packslot, f->packslots);
+		f->packslots = 0;
+	}
+	f->wbframe = 0;
+	f->wbdirty = (f->filesize > 0);
+	setFilePosition(fd, f->position);
+	logMessage(LOG_INFO_LEVEL, "Promoted packed file %d of %d bytes to frame %u \n", fd, f->filesize, f->usedFrame[0]);
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : flushWriteBuffer
+// Description  : write the buffered frame of file "fd" to the device, or a
+//                packed file to its pack
+//
+// Inputs       : fd - filehandle of the file
+// Outputs      : 0 if successful, -1 if failure
+int32_t flushWriteBuffer(int16_t fd)
+{
+	if ((filesystem.OpenFiles[fd]->wbuf == NULL) || (!filesystem.OpenFiles[fd]->wbdirty)) {
+		return 0;
+	}
+	if (filesystem.OpenFiles[fd]->no_of_frame == 0) {
+		if (storePackedFile(filesystem.OpenFiles[fd])) {
+			return -1;
+		}
+	}
+	else if (writeFileFrames(fd, filesystem.OpenFiles[fd]->wbframe, 1, filesystem.OpenFiles[fd]->wbuf)) {
+		return -1;
+	}
+	filesystem.OpenFiles[fd]->wbdirty = 0;
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : prefetchFileFrames
+// Description  : read frames of file "fd" into the frame cache ahead of use
+//
+// Inputs       : fd - filehandle of the file
+//                first - first file frame to prefetch
+//                count - number of frames
+// Outputs      : 0 if successful, -1 if failure
+int32_t prefetchFileFrames(int16_t fd, int32_t first, int32_t count)
+{
+	char* totalbuf;
+	int32_t n;
+
+	if (!fileCached(fd)) {
+		return 0;
+	}
+	if (first+count > filesystem.OpenFiles[fd]->no_of_frame) {
+		count = filesystem.OpenFiles[fd]->no_of_frame - first;
+	}
+	if (count <= 0) {
+		return 0;
+	}
+	if ((totalbuf = malloc(BLOCK_VOLUME_BATCH_FRAMES*BLOCK_FRAME_SIZE)) == NULL) {
+		return -1;
+	}
+	for (; count > 0; first += n, count -= n) {
+		n = (count > BLOCK_VOLUME_BATCH_FRAMES) ? BLOCK_VOLUME_BATCH_FRAMES : count;
+		if (readFileFrames(fd, first, n, totalbuf)) {
+			free(totalbuf);
+			return -1;
+		}
+	}
+	free(totalbuf);
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : readAhead
+// Description  : grow or reset the readahead window of file "fd" after a
+//                read of frames first..last, and prefetch the window; the
+//                window moves under the file lock, so readers holding the
+//                driver shared never prefetch the same frames twice
+//
+// Inputs       : fd - filehandle of the file
+//                first - first file frame of the read
+//                last - last file frame of the read
+// Outputs      : none
+static void readAhead(int16_t fd, int32_t first, int32_t last)
+{
+	filestructure* f = filesystem.OpenFiles[fd];
+	int32_t target, from = 0, count = 0;
+
+	if ((!fileCached(fd)) || (f->advice == BLOCK_ADV_RANDOM)) {
+		return;
+	}
+	pthread_mutex_lock(&filelock(fd));
+	if (f->advice == BLOCK_ADV_SEQUENTIAL) {
+		f->readahead = BLOCK_READAHEAD_MAX_FRAMES;
+	}
+	else if ((first == f->nextreadframe) || (first+1 == f->nextreadframe)) {
+		f->readahead = f->readahead ? f->readahead*2 : 4;
+		if (f->readahead > BLOCK_READAHEAD_MAX_FRAMES) {
+			f->readahead = BLOCK_READAHEAD_MAX_FRAMES;
+		}
+	}
+	else {
+		f->readahead = 0;
+	}
+	f->nextreadframe = last+1;
+	if (f->raframe < last+1) {
+		f->raframe = last+1;
+	}
+	target = last+1+f->readahead;
+	if (target > f->no_of_frame) {
+		target = f->no_of_frame;
+	}
+	if (target > f->raframe) {
+		from = f->raframe;
+		count = target-f->raframe;
+		f->raframe = target;
+	}
+	pthread_mutex_unlock(&filelock(fd));
+	if (count > 0) {
+		prefetchFileFrames(fd, from, count);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : readFile
+// Description  : Reads "count" bytes at byte "off" of the file handle "fh"
+//                into the buffer "buf", the frames come straight from the
+//                file's frame map and the cursor is left alone
+//
+// Inputs       : fd - filename of the file to read from
+//                buf - pointer to buffer to read into
+//                count - number of bytes to read
+//                off - byte offset in the file
+// Outputs      : bytes read if successful, -1 if failure
+
+static int32_t readFile(int16_t fd, char* buf, int32_t count, uint32_t off)
+{
+	int32_t readcount,curpos,first,last,nframes,len,pos;
+	char* totalbuf;
+
+	if (checkFileHandle(fd))	{return -1;}
+	//if off+count > file size, reduce count to file size
+	if (off >= (uint32_t)filesystem.OpenFiles[fd]->filesize) {
+		return 0;
+	}
+	if (count > filesystem.OpenFiles[fd]->filesize-(int32_t)off) {
+		count = filesystem.OpenFiles[fd]->filesize-(int32_t)off;
+	}
+	if (count<=0) {
+		return 0;
+	}
+	//a packed file is read whole into its write buffer, one shared reader at a time
+	if (filesystem.OpenFiles[fd]->no_of_frame == 0) {
+		pthread_mutex_lock(&filelock(fd));
+		if (loadPackedFile(filesystem.OpenFiles[fd])) {
+			pthread_mutex_unlock(&filelock(fd));
+			logMessage(LOG_ERROR_LEVEL,"read of packed file %d fails \n",fd);
+			return -1;
+		}
+		memcpy(buf,filesystem.OpenFiles[fd]->wbuf+off,count);
+		pthread_mutex_unlock(&filelock(fd));
+		return count;
+	}
+	//create buffer to stage a batch of frames
+	if ((totalbuf = malloc(BLOCK_VOLUME_BATCH_FRAMES*BLOCK_FRAME_SIZE)) == NULL) {
+		logMessage(LOG_ERROR_LEVEL,"read fails, no staging buffer \n");
+		return -1;
+	}
+	last = (off+count-1)/BLOCK_FRAME_SIZE;
+	readcount=0;
+
+	while (readcount<count)
+	{
+		pos = off+readcount;
+		first = pos/BLOCK_FRAME_SIZE;
+		curpos = pos%BLOCK_FRAME_SIZE; //non zero only for the first frame
+		nframes = last-first+1;
+		if (nframes>BLOCK_VOLUME_BATCH_FRAMES) {
+			nframes = BLOCK_VOLUME_BATCH_FRAMES;
+		}
+		len = nframes*BLOCK_FRAME_SIZE-curpos;
+		if (len>count-readcount) {
+			len = count-readcount;
+		}
+		if ((readFileFrames(fd,first,nframes,totalbuf))<0) {
+			logMessage(LOG_ERROR_LEVEL,"read fails %d \n",len);
+			free(totalbuf);
+			return -1; //error
+		}
+		logMessage(LOG_INFO_LEVEL,"Read this time %d bytes in %d frames, earlier read %d out of %d bytes \n",len,nframes,readcount,count);
+		memcpy(buf+readcount,totalbuf+curpos,len);
+		readcount+=len;
+	}
+	free(totalbuf);
+	readAhead(fd,off/BLOCK_FRAME_SIZE,last);
+	return readcount;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : pinnedFile
+// Description  : check that a handle still holds the open a split transfer
+//                started on, it may have been closed and reused between
+//                pieces
+//
+// Inputs       : fd - filehandle of the file
+//                f - the file record the transfer started on
+//                gen - the number of that open
+// Outputs      : 1 if it does, 0 if not
+static int pinnedFile(int16_t fd, filestructure* f, uint32_t gen)
+{
+	return ((filesystem.OpenFiles[fd] == f) && (f->opengen == gen));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : awaitTurn
+// Description  : wait, with the driver lock given up, until the write turn
+//                of an open file comes round; the holder of the turn
+//                signals when it hands it on and a close wakes every waiter
+//
+// Inputs       : fd - filehandle of the file
+//                f - the file record the transfer started on
+//                gen - the open the transfer started on
+//                turn - the turn of the write
+// Outputs      : 1 once it is the turn of the write, 0 if the file closed
+static int awaitTurn(int16_t fd, filestructure* f, uint32_t gen, int32_t turn)
+{
+	while (pinnedFile(fd, f, gen) && (f->wrturn != turn)) {
+		pthread_mutex_lock(&filelock(fd));
+		unlockDriver();
+		while (pinnedFile(fd, f, gen) && (f->wrturn != turn)) {
+			pthread_cond_wait(&turned(fd), &filelock(fd));
+		}
+		pthread_mutex_unlock(&filelock(fd));
+		lockDriver();
+	}
+	return (pinnedFile(fd, f, gen));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : splitTransfer
+// Description  : run a read or write in pieces that end on frame boundaries
+//                and span at most BLOCK_QOS_SPLIT_FRAMES frames, each under
+//                its own hold of the driver lock and admitted by the I/O
+//                class of the file, so other files get the bus in between.
+//                The range is claimed under the first hold: a cursor read
+//                moves the cursor past it at once, and writes at the cursor
+//                or, with BLOCK_O_APPEND, at the end take turns on the file
+//                in call order, each running whole before the next starts
+//                and finding where it goes once its turn has come.  A count
+//                of zero or less claims nothing.
+//                Every piece checks the handle still holds the same open.
+//                A positional transfer never touches the cursor.  Reads
+//                hold the driver shared, positional ones from the start,
+//                so they run beside each other; a piece that meets a frame
+//                error is read again exclusive, where the frame is retried
+//                and moved.
+//
+// Inputs       : fd - filehandle of the file
+//                buf - pointer to the caller's buffer
+//                count - number of bytes
+//                off - byte offset of a positional transfer
+//                cursor - 1 to transfer at the cursor instead of off
+//                xfer - readFile or writeFile
+//                writing - 1 for a write
+// Outputs      : bytes transferred, those moved before a failure included,
+//                -1 if failure before any
+static int32_t splitTransfer(int16_t fd, char* buf, int32_t count, uint32_t off, int cursor, int32_t (*xfer)(int16_t, char*, int32_t, uint32_t), int writing)
+{
+	BlockQosClass cls = BLOCK_QOS_NORMAL;
+	BlockRecordOp op;
+	filestructure* f = NULL;
+	int32_t done = 0, len, ret = -1, turn = -1, end = 0;
+	int excl, miss;
+	uint64_t start, call = block_record_begin();
+	uint32_t offset, pos = off, gen = 0;
+
+	if (writing || cursor) {
+		lockDriver();
+	}
+	else {
+		lockDriverShared();
+	}
+	if (checkFileHandle(fd) == 0) {
+		if (count < 0) {
+			logMessage(LOG_ERROR_LEVEL,"Failed, %d bytes is not a transfer size for file %d \n",count,fd);
+		}
+		else if (count == 0) {
+			ret = 0;
+		}
+		else if (writing && (cursor || (filesystem.OpenFiles[fd]->flags & BLOCK_O_APPEND))) {
+			f = filesystem.OpenFiles[fd];
+			cls = f->qos;
+			gen = f->opengen;
+			turn = f->wrhead++;
+			if (awaitTurn(fd, f, gen, turn)) {
+				pos = (f->flags & BLOCK_O_APPEND) ? (uint32_t)f->filesize : (uint32_t)f->position;
+			}
+			else {
+				logMessage(LOG_ERROR_LEVEL,"file %d was closed during a transfer \n",fd);
+				f = NULL;
+			}
+		}
+		else {
+			f = filesystem.OpenFiles[fd];
+			cls = f->qos;
+			gen = f->opengen;
+			if (cursor) {
+				pos = f->position;
+				end = f->filesize;
+				if (count < f->filesize-(int32_t)pos) {
+					end = (int32_t)pos+count;
+				}
+				setFilePosition(fd, end);
+			}
+		}
+	}
+	if (writing || cursor) {
+		unlockDriver();
+	}
+	else {
+		unlockDriverShared();
+	}
+	offset = pos;
+
+	start = block_qos_begin(cls);
+	while (f != NULL) {
+		len = BLOCK_QOS_SPLIT_FRAMES*BLOCK_FRAME_SIZE - pos%BLOCK_FRAME_SIZE;
+		if (len > count-done) {
+			len = count-done;
+		}
+		block_qos_admit(cls, len, done == 0);
+		excl = writing;
+		do {
+			if (excl) {
+				lockDriver();
+			}
+			else {
+				lockDriverShared();
+			}
+			if (!pinnedFile(fd, f, gen)) {
+				logMessage(LOG_ERROR_LEVEL,"file %d was closed during a transfer \n",fd);
+				ret = -1;
+			}
+			else {
+				ret = xfer(fd, buf+done, len, pos);
+				if ((ret > 0) && cursor && writing) {
+					setFilePosition(fd, pos+ret);
+				}
+			}
+			miss = !excl && (ret < 0) && sharedmiss;
+			if (excl) {
+				unlockDriver();
+			}
+			else {
+				unlockDriverShared();
+			}
+			excl = 1;
+		} while (miss);
+		if (ret < 0) {
+			break;
+		}
+		done += ret;
+		pos += ret;
+		if ((ret != len) || (done >= count)) {
+			break; //a short piece is the end of the file
+		}
+	}
+	block_qos_end(cls, start);
+
+	// Hand the turn on, and give back the part of a cursor read not read
+	if ((f != NULL) && ((turn >= 0) || (cursor && (ret < 0)))) {
+		lockDriver();
+		if (pinnedFile(fd, f, gen)) {
+			if (turn >= 0) {
+				pthread_mutex_lock(&filelock(fd));
+				f->wrturn++;
+				pthread_cond_broadcast(&turned(fd)); //the next write at the cursor or end runs
+				pthread_mutex_unlock(&filelock(fd));
+			}
+			else if (cursor && (ret < 0) && (f->position == end)) {
+				setFilePosition(fd, offset+done);
+			}
+		}
+		unlockDriver();
+	}
+	if ((ret < 0) && (done == 0)) {
+		done = -1;
+	}
+	if (writing) {
+		op = cursor ? BLOCK_RECORD_WRITE : BLOCK_RECORD_PWRITE;
+	}
+	else {
+		op = cursor ? BLOCK_RECORD_READ : BLOCK_RECORD_PREAD;
+	}
+	block_record_call(call, op, fd, offset, count, done, buf);
+	return done;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_read
+// Description  : Reads "count" bytes from the file handle "fh" into the
+//                buffer "buf"
+//
+// Inputs       : fd - filename of the file to read from
+//                buf - pointer to buffer to read into
+//                count - number of bytes to read
+// Outputs      : bytes read if successful, -1 if failure
+
+int32_t block_read(int16_t fd, char* buf, int32_t count)
+{
+	int32_t ret;
+	uint64_t span = block_trace_begin();
+	ret = splitTransfer(fd, buf, count, 0, 1, readFile, 0);
+	block_trace_end("block_read", span);
+	return ret;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_pread
+// Description  : Reads "count" bytes at byte "off" of the file handle "fh"
+//                into the buffer "buf", without using or moving the cursor
+//
+// Inputs       : fd - filename of the file to read from
+//                buf - pointer to buffer to read into
+//                count - number of bytes to read
+//                off - byte offset in the file
+// Outputs      : bytes read if successful, -1 if failure
+
+int32_t block_pread(int16_t fd, char* buf, int32_t count, uint32_t off)
+{
+	int32_t ret;
+	uint64_t span = block_trace_begin();
+	ret = splitTransfer(fd, buf, count, off, 0, readFile, 0);
+	block_trace_end("block_pread", span);
+	return ret;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bufferedWrite
+// Description  : stage a write that falls inside one frame in the write
+//                buffer of file "fd"; the buffer is written to the device
+//                when a write moves to another frame, on close and power off
+//
+// Inputs       : fd - filename of the file to write to
+//                frameno - file frame the write falls in
+//                curpos - byte offset within the frame
+//                buf - pointer to buffer to write from
+//                count - number of bytes to write
+// Outputs      : bytes written if successful, -1 if failure
+static int32_t bufferedWrite(int16_t fd, int32_t frameno, int32_t curpos, char* buf, int32_t count)
+{
+	if (filesystem.OpenFiles[fd]->wbframe != frameno) {
+		if (flushWriteBuffer(fd)) {
+			return -1;
+		}
+		if ((filesystem.OpenFiles[fd]->wbuf == NULL) && ((filesystem.OpenFiles[fd]->wbuf = malloc(BLOCK_FRAME_SIZE)) == NULL)) {
+			return -1;
+		}
+		filesystem.OpenFiles[fd]->wbframe = -1;
+		if (frameno*BLOCK_FRAME_SIZE < filesystem.OpenFiles[fd]->filesize) {
+			if (readFileFrames(fd, frameno, 1, filesystem.OpenFiles[fd]->wbuf)) {
+				return -1;
+			}
+		}
+		else {
+			memset(filesystem.OpenFiles[fd]->wbuf, 0x0, BLOCK_FRAME_SIZE);
+		}
+		filesystem.OpenFiles[fd]->wbframe = frameno;
+	}
+	memcpy(filesystem.OpenFiles[fd]->wbuf+curpos, buf, count);
+	filesystem.OpenFiles[fd]->wbdirty = 1;
+	return count;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : packedWrite
+// Description  : write into a packed file, the bytes are staged in its write
+//                buffer and reach the pack on flush
+//
+// Inputs       : fd - filename of the file to write to
+//                buf - pointer to buffer to write from
+//                count - number of bytes to write
+//                off - byte offset in the file
+// Outputs      : bytes written if successful, -1 if failure
+static int32_t packedWrite(int16_t fd, char* buf, int32_t count, uint32_t off)
+{
+	if (loadPackedFile(filesystem.OpenFiles[fd])) {
+		return -1;
+	}
+	memcpy(filesystem.OpenFiles[fd]->wbuf+off, buf, count);
+	filesystem.OpenFiles[fd]->wbdirty = 1;
+	if (off+count > (uint32_t)filesystem.OpenFiles[fd]->filesize) {
+		filesystem.OpenFiles[fd]->filesize = off+count;
+	}
+	if (!fileBuffered(fd) && flushWriteBuffer(fd)) {
+		return -1;
+	}
+	return count;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : writeFile
+// Description  : Writes "count" bytes at byte "off" of the file handle "fh"
+//                from the buffer  "buf", at most at the end of the file;
+//                the cursor is left alone
+//
+// Inputs       : fd - filename of the file to write to
+//                buf - pointer to buffer to write from
+//                count - number of bytes to write
+//                off - byte offset in the file
+// Outputs      : bytes written if successful, -1 if failure
+
+static int32_t writeFile(int16_t fd, char* buf, int32_t count, uint32_t off)
+ {
+	int32_t writecount,curpos,first,last,nframes,len,pos,endframe;
+	char* totalbuf;
+
+	
+	if (checkFileHandle(fd)){
+		return -1;
+	}
+	if (filesystem.OpenFiles[fd]->flags & BLOCK_O_RDONLY){
+		logMessage(LOG_ERROR_LEVEL,"write fails, file %d is open read-only \n",fd);
+		return -1;
+	}
+	if (off > (uint32_t)filesystem.OpenFiles[fd]->filesize){
+		logMessage(LOG_ERROR_LEVEL,"write fails, %u is beyond size of file %d \n",off,filesystem.OpenFiles[fd]->filesize);
+		return -1;
+	}
+	if (count<=0) {
+		return 0;
+	}
+	//a packed file stays packed while it fits the threshold, else it is promoted
+	if (filesystem.OpenFiles[fd]->no_of_frame == 0) {
+		if (off+count <= block_pack_threshold()) {
+			return packedWrite(fd,buf,count,off);
+		}
+		if (unpackFile(fd)) {
+			logMessage(LOG_ERROR_LEVEL,"write fails, cannot promote packed file %d \n",fd);
+			return -1;
+		}
+	}
+	//make sure every frame touched by the write is allotted
+	first = off/BLOCK_FRAME_SIZE;
+	last = (off+count-1)/BLOCK_FRAME_SIZE;
+	while (filesystem.OpenFiles[fd]->no_of_frame <= last) {
+		if (addNewFrame(fd)) {
+			logMessage(LOG_ERROR_LEVEL,"write fails, cannot grow file %d \n",fd);
+			return -1;
+		}
+	}
+
+	//small writes inside one frame are staged in the write buffer
+	if ((first == last) && fileBuffered(fd)) {
+		if (bufferedWrite(fd,first,off%BLOCK_FRAME_SIZE,buf,count) != count) {
+			logMessage(LOG_ERROR_LEVEL,"buffered write fails %d \n",count);
+			return -1;
+		}
+		writecount = count;
+	}
+	else {
+		//a buffered frame inside the range would be overwritten, write it out first
+		if ((filesystem.OpenFiles[fd]->wbframe >= first) && (filesystem.OpenFiles[fd]->wbframe <= last)) {
+			if (flushWriteBuffer(fd)) {
+				return -1;
+			}
+			filesystem.OpenFiles[fd]->wbframe = -1;
+		}
+		//create buffer to stage a batch of frames
+		if ((totalbuf = malloc(BLOCK_VOLUME_BATCH_FRAMES*BLOCK_FRAME_SIZE)) == NULL) {
+			logMessage(LOG_ERROR_LEVEL,"write fails, no staging buffer \n");
+			return -1;
+		}
+
+		writecount=0;
+		while (writecount<count)
+		{
+			pos = off+writecount;
+			first = pos/BLOCK_FRAME_SIZE;
+			curpos = pos%BLOCK_FRAME_SIZE; //non zero only for the first frame
+			nframes = last-first+1;
+			if (nframes>BLOCK_VOLUME_BATCH_FRAMES) {
+				nframes = BLOCK_VOLUME_BATCH_FRAMES;
+			}
+			len = nframes*BLOCK_FRAME_SIZE-curpos;
+			if (len>count-writecount) {
+				len = count-writecount;
+			}
+			//read existing frame data if not writing entire frame
+			if (curpos>0) {
+				if (first*BLOCK_FRAME_SIZE < filesystem.OpenFiles[fd]->filesize) {
+					if (readFileFrames(fd,first,1,totalbuf)) {
+						free(totalbuf);
+						return -1;
+					}
+				}
+				else {
+					memset(totalbuf,0x0,BLOCK_FRAME_SIZE);
+				}
+			}
+			if ((curpos+len)%BLOCK_FRAME_SIZE) {
+				endframe = (pos+len-1)/BLOCK_FRAME_SIZE;
+				if (!(endframe == first && curpos>0)) {
+					if (endframe*BLOCK_FRAME_SIZE < filesystem.OpenFiles[fd]->filesize) {
+						if (readFileFrames(fd,endframe,1,totalbuf+(endframe-first)*BLOCK_FRAME_SIZE)) {
+							free(totalbuf);
+							return -1;
+						}
+					}
+					else {
+						memset(totalbuf+(endframe-first)*BLOCK_FRAME_SIZE,0x0,BLOCK_FRAME_SIZE);
+					}
+				}
+			}
+			memcpy(totalbuf+curpos,buf+writecount,len);
+			if ((writeFileFrames(fd,first,nframes,totalbuf))<0) {
+				logMessage(LOG_ERROR_LEVEL,"write fails %d \n",len);
+				free(totalbuf);
+				return -1; //error
+			}
+			writecount+=len;
+		}
+		free(totalbuf);
+	}
+	if (off+writecount > (uint32_t)filesystem.OpenFiles[fd]->filesize) {
+		filesystem.OpenFiles[fd]->filesize = off+writecount;
+	}
+	setFilePosition(fd,filesystem.OpenFiles[fd]->position); //addNewFrame moves the frame fields, put them back on the cursor
+	return writecount;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_write
+// Description  : Writes "count" bytes to the file handle "fh" from the
+//                buffer  "buf"
+//
+// Inputs       : fd - filename of the file to write to
+//                buf - pointer to buffer to write from
+//                count - number of bytes to write
+// Outputs      : bytes written if successful, -1 if failure
+
+int32_t block_write(int16_t fd, char* buf, int32_t count)
+{
+	int32_t ret;
+	uint64_t span = block_trace_begin();
+	ret = splitTransfer(fd, buf, count, 0, 1, writeFile, 1);
+	block_trace_end("block_write", span);
+	return ret;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_pwrite
+// Description  : Writes "count" bytes at byte "off" of the file handle "fh"
+//                from the buffer "buf", without using or moving the cursor;
+//                a file opened BLOCK_O_APPEND is written at its end
+//
+// Inputs       : fd - filename of the file to write to
+//                buf - pointer to buffer to write from
+//                count - number of bytes to write
+//                off - byte offset in the file, at most its size
+// Outputs      : bytes written if successful, -1 if failure
+
+int32_t block_pwrite(int16_t fd, char* buf, int32_t count, uint32_t off)
+{
+	int32_t ret;
+	uint64_t span = block_trace_begin();
+	ret = splitTransfer(fd, buf, count, off, 0, writeFile, 1);
+	block_trace_end("block_pwrite", span);
+	return ret;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : seekFile
+// Description  : Seek to specific point in the file
+//
+// Inputs       : fd - filename of the file to write to
+//                loc - offfset of file in relation to beginning of file
+// Outputs      : 0 if successful, -1 if failure
+
+static int32_t seekFile(int16_t fd, uint32_t loc)
+{
+	if (checkFileHandle(fd))	{return -1;}
+	
+	if (filesystem.OpenFiles[fd]->filesize < loc) {
+		logMessage(LOG_ERROR_LEVEL, "Moving to %d beyond Size of File %d",loc,filesystem.OpenFiles[fd]->filesize);
+		return -1; }
+
+	setFilePosition(fd,loc);
+	logMessage(LOG_INFO_LEVEL,"Successfully positioned %d (frame %d position %d) file size %d \n",filesystem.OpenFiles[fd]->position,filesystem.OpenFiles[fd]->currentframeno,filesystem.OpenFiles[fd]->currentframePosition,filesystem.OpenFiles[fd]->filesize);
+    // Return successfully
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_seek
+// Description  : Seek to specific point in the file
+//
+// Inputs       : fd - filename of the file to write to
+//                loc - offfset of file in relation to beginning of file
+// Outputs      : 0 if successful, -1 if failure
+
+int32_t block_seek(int16_t fd, uint32_t loc)
+{
+	int32_t ret;
+	uint64_t span = block_trace_begin(), call = block_record_begin();
+	lockDriver();
+	ret = seekFile(fd, loc);
+	unlockDriver();
+	block_record_call(call, BLOCK_RECORD_SEEK, fd, loc, 0, ret, NULL);
+	block_trace_end("block_seek", span);
+	return ret;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : adviseFile
+// Description  : Declare the expected access pattern of a file.
+//                SEQUENTIAL, RANDOM and NORMAL apply to the whole file and
+//                steer readahead, write buffering and cache retention.
+//                WILLNEED prefetches the range into the frame cache,
+//                DONTNEED writes back and drops it.
+//
+// Inputs       : fd - the file handle
+//                off - first byte of the range
+//                len - length of the range, 0 means to the end of file
+//                hint - BLOCK_ADV_* hint
+// Outputs      : 0 if successful, -1 if failure
+
+static int32_t adviseFile(int16_t fd, uint32_t off, uint32_t len, int32_t hint)
+{
+	int32_t first, last, i;
+
+	if (checkFileHandle(fd))	{return -1;}
+	if (len == 0 || off+len > filesystem.OpenFiles[fd]->filesize) {
+		len = (off < filesystem.OpenFiles[fd]->filesize) ? filesystem.OpenFiles[fd]->filesize-off : 0;
+	}
+	first = off/BLOCK_FRAME_SIZE;
+	last = len ? (off+len-1)/BLOCK_FRAME_SIZE : first-1;
+	if (last >= filesystem.OpenFiles[fd]->no_of_frame) {
+		last = filesystem.OpenFiles[fd]->no_of_frame-1; //a packed file has no frame of its own
+	}
+
+	switch (hint) {
+	case BLOCK_ADV_NORMAL:
+	case BLOCK_ADV_SEQUENTIAL:
+	case BLOCK_ADV_RANDOM:
+		if (hint == BLOCK_ADV_RANDOM && flushWriteBuffer(fd)) {
+			return -1;
+		}
+		filesystem.OpenFiles[fd]->advice = hint;
+		filesystem.OpenFiles[fd]->readahead = 0;
+		filesystem.OpenFiles[fd]->nextreadframe = -1;
+		break;
+
+	case BLOCK_ADV_WILLNEED:
+		if (last >= first && prefetchFileFrames(fd, first, last-first+1)) {
+			return -1;
+		}
+		break;
+
+	case BLOCK_ADV_DONTNEED:
+		if ((filesystem.OpenFiles[fd]->wbframe >= first) && (filesystem.OpenFiles[fd]->wbframe <= last)) {
+			if (flushWriteBuffer(fd)) {
+				return -1;
+			}
+			filesystem.OpenFiles[fd]->wbframe = -1;
+		}
+		for (i = first; i <= last; i++) {
+			block_cache_invalidate(filesystem.OpenFiles[fd]->usedFrame[i]);
+		}
+		break;
+
+	default:
+		logMessage(LOG_ERROR_LEVEL, "Unknown access hint %d for file %d", hint, fd);
+		return -1;
+	}
+	logMessage(LOG_INFO_LEVEL, "File %d advised %d over %u bytes at %u", fd, hint, len, off);
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_advise
+// Description  : Declare the expected access pattern of a file.
+//                SEQUENTIAL, RANDOM and NORMAL apply to the whole file and
+//                steer readahead, write buffering and cache retention.
+//                WILLNEED prefetches the range into the frame cache,
+//                DONTNEED writes back and drops it.
+//
+// Inputs       : fd - the file handle
+//                off - first byte of the range
+//                len - length of the range, 0 means to the end of file
+//                hint - BLOCK_ADV_* hint
+// Outputs      : 0 if successful, -1 if failure
+
+int32_t block_advise(int16_t fd, uint32_t off, uint32_t len, int32_t hint)
+{
+	int32_t ret;
+	uint64_t span = block_trace_begin();
+	lockDriver();
+	ret = adviseFile(fd, off, len, hint);
+	unlockDriver();
+	block_trace_end("block_advise", span);
+	return ret;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fallocateFile
+// Description  : reserve the frames of file "fd" up to the end of a range,
+//                as one contiguous run where the volume allows
+//
+// Inputs       : fd - filehandle of the file
+//                off - first byte of the range
+//                len - length of the range
+// Outputs      : 0 if successful, -1 if failure
+
+static int32_t fallocateFile(int16_t fd, uint32_t off, uint32_t len)
+{
+	filestructure* f;
+	uint64_t end;
+	int32_t frames, need, held, n, got = 0;
+
+	if (checkFileHandle(fd))	{return -1;}
+	f = filesystem.OpenFiles[fd];
+	if (f->flags & BLOCK_O_RDONLY){
+		logMessage(LOG_ERROR_LEVEL, "fallocate fails, file %d is open read-only", fd);
+		return -1;
+	}
+	end = (uint64_t)off+len;
+	if ((len == 0) || (end > INT32_MAX)){
+		logMessage(LOG_ERROR_LEVEL, "Bad fallocate range of %u bytes at %u for file %d", len, off, fd);
+		return -1;
+	}
+	frames = (end+BLOCK_FRAME_SIZE-1)/BLOCK_FRAME_SIZE;
+	held = f->reserved;
+	need = frames-f->no_of_frame-held;
+	while (got < need){
+		if ((n = reserveFrames(f, need-got)) <= 0){
+			logMessage(LOG_ERROR_LEVEL, "fallocate fails, %d of %d frames free for file %d", got, need, fd);
+			trimReservation(f, held);
+			return -1;
+		}
+		got += n;
+	}
+	if (frames-f->no_of_frame > f->keep){
+		f->keep = frames-f->no_of_frame;
+	}
+	logMessage(LOG_INFO_LEVEL, "File %d preallocated %d frames, %d reserved", fd, got, f->reserved);
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_fallocate
+// Description  : Preallocate the frames backing a range of a file.  The
+//                file size does not change; later writes up to the end
+//                of the range map the reserved frames instead of
+//                allocating, and they are kept when the file is closed.
+//
+// Inputs       : fd - the file handle
+//                off - first byte of the range
+//                len - length of the range
+// Outputs      : 0 if successful, -1 if failure
+
+int32_t block_fallocate(int16_t fd, uint32_t off, uint32_t len)
+{
+	int32_t ret;
+	uint64_t span = block_trace_begin();
+	lockDriver();
+	ret = fallocateFile(fd, off, len);
+	unlockDriver();
+	block_trace_end("block_fallocate", span);
+	return ret;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : qosFile
+// Description  : put file "fd" in an I/O class
+//
+// Inputs       : fd - filehandle of the file
+//                cls - BLOCK_QOS_* class
+// Outputs      : 0 if successful, -1 if failure
+static int32_t qosFile(int16_t fd, int32_t cls)
+{
+	if (checkFileHandle(fd))	{return -1;}
+	if ((cls < 0) || (cls >= BLOCK_QOS_CLASSES)) {
+		logMessage(LOG_ERROR_LEVEL, "Unknown I/O class %d for file %d", cls, fd);
+		return -1;
+	}
+	filesystem.OpenFiles[fd]->qos = cls;
+	logMessage(LOG_INFO_LEVEL, "File %d moved to I/O class %d", fd, cls);
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_qos
+// Description  : put file "fd" in an I/O class until it is closed
+//
+// Inputs       : fd - filehandle of the file
+//                cls - BLOCK_QOS_* class
+// Outputs      : 0 if successful, -1 if failure
+int32_t block_qos(int16_t fd, int32_t cls)
+{
+	int32_t ret;
+	uint64_t span = block_trace_begin();
+	lockDriver();
+	ret = qosFile(fd, cls);
+	unlockDriver();
+	block_trace_end("block_qos", span);
+	return ret;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : clonePackedFile
+// Description  : fill the new record "nf" with a copy of packed file "fd",
+//                a few hundred bytes are copied into slots of their own
+//                rather than shared
+//
+// Inputs       : fd - the source file handle
+//                nf - the record of the new file
+//                readonly - 1 to create a snapshot
+// Outputs      : 0 if successful, -1 if failure
+static int32_t clonePackedFile(int16_t fd, filestructure* nf, int readonly)
+{
+	if (loadPackedFile(filesystem.OpenFiles[fd]) || ((nf->wbuf = malloc(BLOCK_FRAME_SIZE)) == NULL)){
+		freeFileEntry(nf);
+		return -1;
+	}
+	memcpy(nf->wbuf, filesystem.OpenFiles[fd]->wbuf, BLOCK_FRAME_SIZE);
+	nf->filesize = filesystem.OpenFiles[fd]->filesize;
+	nf->readonly = readonly;
+	if (storePackedFile(nf)){
+		free(nf->wbuf);
+		nf->wbuf = NULL;
+		freeFileEntry(nf);
+		return -1;
+	}
+	free(nf->wbuf);
+	nf->wbuf = NULL;
+	logMessage(LOG_INFO_LEVEL, "Cloned packed file %d to %s (%d bytes copied%s)", fd, nf->filepath, nf->filesize, readonly ? ", snapshot" : "");
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cloneFile
+// Description  : create "path" as a copy of file "fd" that shares all of its
+//                frames; frames are copied later, one at a time, by
+//                unshareFileFrame when either file writes them
+//
+// Inputs       : fd - the source file handle
+//                path - filename of the new file
+//                readonly - 1 to create a snapshot
+// Outputs      : 0 if successful, -1 if failure
+static int32_t cloneFile(int16_t fd, char* path, int readonly)
+{
+	filestructure* nf;
+	int32_t i;
+
+	if (checkFileHandle(fd))	{return -1;}
+	if (findFile(path) != NULL){
+		logMessage(LOG_ERROR_LEVEL, "Cannot clone file %d to %s: file exists", fd, path);
+		return -1;
+	}
+	//the clone must see data still sitting in the write buffer
+	if (flushWriteBuffer(fd)){
+		return -1;
+	}
+	if ((nf = newFileEntry(path)) == NULL){
+		return -1;
+	}
+	if (filesystem.OpenFiles[fd]->no_of_frame == 0){
+		return clonePackedFile(fd, nf, readonly);
+	}
+	nf->usedFrame = malloc(filesystem.OpenFiles[fd]->maxframes*sizeof(BlockVolumeFrame));
+	if (nf->usedFrame == NULL){
+		freeFileEntry(nf);
+		return -1;
+	}
+	if (block_merkle_copy(&nf->merkle, &filesystem.OpenFiles[fd]->merkle)){
+		freeFileEntry(nf);
+		return -1;
+	}
+	memcpy(nf->usedFrame, filesystem.OpenFiles[fd]->usedFrame, filesystem.OpenFiles[fd]->no_of_frame*sizeof(BlockVolumeFrame));
+	nf->maxframes = filesystem.OpenFiles[fd]->maxframes;
+	nf->no_of_frame = filesystem.OpenFiles[fd]->no_of_frame;
+	nf->filesize = filesystem.OpenFiles[fd]->filesize;
+	nf->readonly = readonly;
+	for (i = 0; i < nf->no_of_frame; i++){
+		filesystem.Framelist[nf->usedFrame[i]].refcount++;
+	}
+	logMessage(LOG_INFO_LEVEL, "Cloned file %d to %s (%d frames shared%s)", fd, path, nf->no_of_frame, readonly ? ", snapshot" : "");
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_clone
+// Description  : create a writable copy-on-write clone of an open file, the
+//                clone is created closed
+//
+// Inputs       : fd - the source file handle
+//                path - filename of the clone
+// Outputs      : 0 if successful, -1 if failure
+
+int32_t block_clone(int16_t fd, char* path)
+{
+	int32_t ret;
+	uint64_t span = block_trace_begin();
+	lockDriver();
+	ret = cloneFile(fd, path, 0);
+	unlockDriver();
+	block_trace_end("block_clone", span);
+	return ret;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_snapshot
+// Description  : create a point-in-time, read-only copy of an open file
+//
+// Inputs       : fd - the source file handle
+//                path - filename of the snapshot
+// Outputs      : 0 if successful, -1 if failure
+
+int32_t block_snapshot(int16_t fd, char* path)
+{
+	int32_t ret;
+	uint64_t span = block_trace_begin();
+	lockDriver();
+	ret = cloneFile(fd, path, 1);
+	unlockDriver();
+	block_trace_end("block_snapshot", span);
+	return ret;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : unlinkFile
+// Description  : remove a closed file, its frames are released once no
+//                clone or snapshot shares them
+//
+// Inputs       : path - filename of the file to remove
+// Outputs      : 0 if successful, -1 if failure
+
+static int32_t unlinkFile(char* path)
+{
+	filestructure* f;
+	int32_t j;
+
+	if (filesystem.sysstatus==0){
+		logMessage(LOG_ERROR_LEVEL, "Failed, System status power off");
+		return -1;}
+	if ((f = findFile(path)) == NULL){
+		logMessage(LOG_ERROR_LEVEL, "Cannot unlink %s: no such file", path);
+		return -1;
+	}
+	if (f->filestatus){
+		logMessage(LOG_ERROR_LEVEL, "Cannot unlink %s: file is open", path);
+		return -1;
+	}
+	trimReservation(f, 0);
+	for (j = f->no_of_frame-1; j >= 0; j--){
+		releaseFrame(f->usedFrame[j]);
+	}
+	if (f->packslots > 0){
+		releasePackSlots(f->pack, f->packslot, f->packslots);
+	}
+	freeFileEntry(f);
+	logMessage(LOG_INFO_LEVEL, "Unlinked %s", path);
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_unlink
+// Description  : remove a closed file, its frames are released once no
+//                clone or snapshot shares them
+//
+// Inputs       : path - filename of the file to remove
+// Outputs      : 0 if successful, -1 if failure
+
+int32_t block_unlink(char* path)
+{
+	int32_t ret;
+	uint64_t span = block_trace_begin();
+	lockDriver();
+	ret = unlinkFile(path);
+	unlockDriver();
+	block_trace_end("block_unlink", span);
+	return ret;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : digestFile
+// Description  : look up a file for its digest, writing back any frame still
+//                held in the write buffer of an open handle
+//
+// Inputs       : path - filename of the file
+// Outputs      : the file record, NULL if failure
+static filestructure* digestFile(char* path)
+{
+	filestructure* f;
+
+	if (filesystem.sysstatus==0){
+		logMessage(LOG_ERROR_LEVEL, "Failed, System status power off");
+		return NULL;}
+	if ((f = findFile(path)) == NULL){
+		logMessage(LOG_ERROR_LEVEL, "Cannot digest %s: no such file", path);
+		return NULL;
+	}
+	if ((f->fhandle != -1) && flushWriteBuffer(f->fhandle)){
+		return NULL;
+	}
+	return f;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fileLeaves
+// Description  : leaves of the Merkle tree of a file, a packed file has one
+//                leaf, the checksum its frame 0 would have
+//
+// Inputs       : f - the file record
+// Outputs      : the number of leaves
+static int32_t fileLeaves(filestructure* f)
+{
+	return (f->no_of_frame ? f->no_of_frame : (f->packslots > 0));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_digest
+// Description  : the Merkle root over the frame checksums of a file, open or
+//                closed, computed without touching the device
+//
+// Inputs       : path - filename of the file
+//                root - the digest (output), 0 for an empty file
+// Outputs      : 0 if successful, -1 if failure
+
+int32_t block_digest(char* path, uint64_t* root)
+{
+	filestructure* f;
+	int32_t ret = -1;
+	uint64_t span = block_trace_begin();
+	lockDriver();
+	if ((f = digestFile(path)) != NULL){
+		*root = block_merkle_root(&f->merkle, fileLeaves(f));
+		ret = 0;
+	}
+	unlockDriver();
+	block_trace_end("block_digest", span);
+	return ret;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_digest_diff
+// Description  : find the file frames two files (or a file and its
+//                snapshot) differ in by walking their Merkle trees, a frame
+//                present in only one of them counts as different
+//
+// Inputs       : path1, path2 - filenames of the files
+//                frames - where to list the differing file frames
+//                max - room in frames
+// Outputs      : number of differing frames if successful, -1 if failure
+
+int32_t block_digest_diff(char* path1, char* path2, int32_t* frames, int32_t max)
+{
+	filestructure *f1, *f2;
+	int32_t ret = -1;
+	uint64_t span = block_trace_begin();
+	lockDriver();
+	if (((f1 = digestFile(path1)) != NULL) && ((f2 = digestFile(path2)) != NULL)){
+		ret = block_merkle_diff(&f1->merkle, fileLeaves(f1), &f2->merkle, fileLeaves(f2), frames, max);
+	}
+	unlockDriver();
+	block_trace_end("block_digest_diff", span);
+	return ret;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_frame_health
+// Description  : the frame error counters since the volume was powered on
+//
+// Inputs       : health - the counters (output)
+// Outputs      : 0 if successful, -1 if failure
+
+int32_t block_frame_health(BlockFrameHealth* health)
+{
+	int32_t ret = -1;
+	lockDriver();
+	if (filesystem.sysstatus){
+		*health = filesystem.Health;
+		ret = 0;
+	}
+	else {
+		logMessage(LOG_ERROR_LEVEL, "File system powered off: task failed");
+	}
+	unlockDriver();
+	return ret;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_quarantined_frames
+// Description  : list the volume frames retired as flaky, in frame order
+//
+// Inputs       : frames - where to list them
+//                max - room in frames
+// Outputs      : number of quarantined frames if successful, -1 if failure
+
+int32_t block_quarantined_frames(BlockVolumeFrame* frames, int32_t max)
+{
+	BlockVolumeFrame i;
+	int32_t n = 0;
+	lockDriver();
+	if (!filesystem.sysstatus){
+		unlockDriver();
+		logMessage(LOG_ERROR_LEVEL, "File system powered off: task failed");
+		return -1;
+	}
+	for (i = 0; i < filesystem.TotalFrames; i++){
+		if (filesystem.Framelist[i].quarantined){
+			if (n < max){
+				frames[n] = i;
+			}
+			n++;
+		}
+	}
+	unlockDriver();
+	return n;
 }
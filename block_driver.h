@@ -15,60 +15,217 @@
 // Include files
 #include <stdint.h>
 
+// Project Includes
+#include <block_geometry.h>
+#include <block_volume.h>
+
 // Defines
-#define BLOCK_MAX_TOTAL_FILES 1024 // Maximum number of files ever
+#define BLOCK_MAX_TOTAL_FILES (1<<24) // Maximum number of files ever
+#define BLOCK_MAX_OPEN_FILES 1024 // Maximum number of files open at once
+#define BLOCK_FILE_SLAB_ENTRIES 4096 // File records allocated at a time
+#define BLOCK_FILE_HASH_BUCKETS 1024 // Initial path hash chains, doubled as files are added
 #define BLOCK_MAX_PATH_LENGTH 128 // Maximum length of filename length
+#define BLOCK_READAHEAD_MAX_FRAMES 32 // Largest readahead window
+#define BLOCK_PREALLOC_MAX_FRAMES 64 // Largest speculative reservation of a growing file
+#define BLOCK_FRAME_RETRIES 8 // Transfers of a frame tried before the read or write fails
+#define BLOCK_RETRY_BACKOFF_USEC 10 // Pause before the first retry, doubled for each one after
+#define BLOCK_RETRY_BACKOFF_MAX_USEC 1000 // Longest pause between retries
+#define BLOCK_QUARANTINE_ERRORS 4 // Errors after which a frame is relocated and retired
+
+// block_open_flags access flags
+#define BLOCK_O_RDWR 0x0 // read and write (block_open default)
+#define BLOCK_O_RDONLY 0x1 // writes are rejected, the file must exist
+#define BLOCK_O_APPEND 0x2 // every write goes to the end of the file
+#define BLOCK_O_DIRECT 0x4 // no frame cache, readahead or write buffering
+
+// block_advise access hints
+typedef enum {
+	BLOCK_ADV_NORMAL = 0, // adaptive readahead, buffered writes
+	BLOCK_ADV_SEQUENTIAL = 1, // full readahead, frames dropped once read
+	BLOCK_ADV_RANDOM = 2, // no readahead, writes go straight to the device
+	BLOCK_ADV_WILLNEED = 3, // prefetch the range into the frame cache
+	BLOCK_ADV_DONTNEED = 4, // write back and drop the range from the cache
+} BlockAdvice;
+
+// Frame error counters since power on
+typedef struct {
+	uint64_t retries; // frame transfers re-issued after a checksum or acknowledgement error
+	uint64_t failures; // frame reads and writes that failed every retry
+	uint64_t relocated; // frames whose data was moved off a flaky frame
+	uint32_t quarantined; // frames retired, never allotted again until power off
+	uint64_t lost; // queued writes the volume rejected that no fresh frame could take
+} BlockFrameHealth;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
 
 //
 // Interface functions
+void lockDriver(void);
+void unlockDriver(void);
+// serialize access to the driver state, taken by every block_* call
+
+void lockDriverShared(void);
+void unlockDriverShared(void);
+// hold the driver lock shared, for reads that change nothing but per-file readahead
+
+uint64_t driverIdleUsec(void);
+// microseconds since the last block_* call, 0 while one is running
+
+struct BlockDriverState* block_driver_ctx_create(void);
+// create the driver state of a new context, powered off, NULL if failure
+
+void block_driver_ctx_destroy(struct BlockDriverState* state);
+// release the driver state of a context
+
+int block_driver_ctx_powered(struct BlockDriverState* state);
+// 1 if the file system of a context is powered on
+
+int getFrameStatus(BlockVolumeFrame frame);
+// 1 if the volume frame is allotted to a file
+
+uint64_t driverMetadataBytes(void);
+// memory held for the frame list, file table and file frame maps
+
+BlockXferRegister create_opcode(BlockXferRegister KY1, BlockXferRegister FM1, BlockXferRegister CS1, BlockXferRegister RT1);
+// packs the KY1, FM1, CS1 and RT1 registers into a 64 bit opcode
+
+int get_KYcode(BlockXferRegister regstate);
+int get_FMcode(BlockXferRegister regstate);
+int get_CScode(BlockXferRegister regstate);
+int get_RTcode(BlockXferRegister regstate);
+// extract a single register from a 64 bit opcode
+
 int32_t checkFileSize(int16_t fd, int32_t count);
 //check file size of fd
 
+int32_t getFileSize(int16_t fd);
+// returns the size in bytes of fd
+
+void noteFrameError(BlockVolumeFrame frame);
+// count a checksum or acknowledgement error against a volume frame
+
+int32_t readFrame(BlockVolumeFrame frame, void* buf);
+// reads one volume frame into buf, retrying a checksum mismatch BLOCK_FRAME_RETRIES times
+
+int32_t readMappedFrame(BlockVolumeFrame* frame, void* buf);
+int32_t writeMappedFrame(BlockVolumeFrame* frame, void* buf);
+// read or write a frame some file maps, moving its data off the frame once it is flaky
+
+void placeParkedWrites(void);
+// move the queued writes the volume parked to fresh frames, flagging the files of any that are lost
+
 int32_t readCurrentFrame(int16_t fd, void* buf, int32_t count);
 // reads count bytes from the file fd into the buf
 
+int32_t readFileFrames(int16_t fd, int32_t first, int32_t count, char* bufs);
+// reads count consecutive frames of fd as one volume batch
+
 int16_t checkFileHandle(int16_t fd);
 // checks for calid file handle
 
-//int32_t checkSize(int16_t fd , int32_t count);
-//increase frame size if count is greate than max frame size
+int16_t allocFrame(BlockVolumeFrame* frame);
+// allot a free volume frame with one reference
 
-int32_t increaseFileSize(int16_t fd , int32_t count);
-//increases filesize if fd is greater than block size
+void releaseFrame(BlockVolumeFrame frame);
+// drop a reference to a volume frame, freeing it at zero
 
-int32_t checkCurrentFrame(int16_t fd , int32_t count);
-//used to check current frame in fd file 
+int32_t cleanLogSegment(void);
+// log mode: move the live frames out of one segment, returns the frames reclaimed
+
+int16_t unshareFileFrame(int16_t fd, int32_t frameno);
+// copy on write: remap a shared frame of fd, or in log mode any written frame, before a write
 
 int16_t addNewFrame(int16_t fd);
 // add new frames to file handle
 
-int16_t setNextFrame(int16_t fd, int32_t count);
-//sets next frame, if fill then add new frame
+int16_t setFilePosition(int16_t fd, uint32_t loc);
+// moves the file cursor and current frame to byte loc
+
+int32_t writeFrame(BlockVolumeFrame frame, void* buf);
+// writes one volume frame from buf, retrying BLOCK_FRAME_RETRIES times until acknowledged
 
-int32_t writeCurrentframe(int16_t fd, void* buf, int32_t count);
+int32_t writeCurrentFrame(int16_t fd, void* buf, int32_t count);
 // Writes count bytes to fd file from the buffer
 
+int32_t writeFileFrames(int16_t fd, int32_t first, int32_t count, char* bufs);
+// writes count consecutive frames of fd as one volume batch
+
+int16_t unpackFile(int16_t fd);
+// gives a packed file a frame of its own before frame-level access
+
+int32_t flushWriteBuffer(int16_t fd);
+// writes the buffered frame of fd to the device, or a packed file to its pack
+
+int32_t prefetchFileFrames(int16_t fd, int32_t first, int32_t count);
+// reads frames of fd into the frame cache ahead of use
+
 int computeframechecksum(void* frame, uint32_t* checksum);
 //This functions calculates the checksum value using generatems5 function
 int32_t block_poweron(void);
 // Startup up the BLOCK interface, initialize filesystem
 
 int32_t block_poweroff(void);
-// Shut down the BLOCK interface, close all files
+// Shut down the BLOCK interface, close all files; -1 also if a queued write was lost since power on
 
 int16_t block_open(char* path);
 // This function opens the file and returns a file handle
 
+int16_t block_open_flags(char* path, int32_t flags);
+// This function opens the file with BLOCK_O_* flags and returns a file handle
+
 int16_t block_close(int16_t fd);
-// This function closes the file
+// This function closes the file; -1 also if a queued write of the file was lost, the file is closed
 
 int32_t block_read(int16_t fd, char* buf, int32_t count);
 // Reads "count" bytes from the file handle "fh" into the buffer  "buf"
 
 int32_t block_write(int16_t fd, char* buf, int32_t count);
 // Writes "count" bytes to the file handle "fh" from the buffer  "buf"
+// (a transfer cut short by a failure or a close returns the bytes it moved)
 
 int32_t block_seek(int16_t fd, uint32_t loc);
 // Seek to specific point in the file
 
+int32_t block_pread(int16_t fd, char* buf, int32_t count, uint32_t off);
+// Reads "count" bytes at byte "off" of the file, the cursor is not used or moved
+
+int32_t block_pwrite(int16_t fd, char* buf, int32_t count, uint32_t off);
+// Writes "count" bytes at byte "off", at most the file size, the cursor is not used or moved
+
+int32_t block_advise(int16_t fd, uint32_t off, uint32_t len, int32_t hint);
+// Declare the expected access pattern (BLOCK_ADV_*) for a range of the file
+
+int32_t block_fallocate(int16_t fd, uint32_t off, uint32_t len);
+// Reserve contiguous frames for a range of the file, the size is unchanged
+
+int32_t block_qos(int16_t fd, int32_t cls);
+// Put the file in an I/O class (BLOCK_QOS_*) until it is closed
+
+int32_t block_clone(int16_t fd, char* path);
+// Create a copy-on-write clone of the file at path
+
+int32_t block_snapshot(int16_t fd, char* path);
+// Create a read-only point-in-time snapshot of the file at path
+
+int32_t block_unlink(char* path);
+// Remove a closed file, releasing the frames it does not share
+
+int32_t block_digest(char* path, uint64_t* root);
+// Merkle root over the frame checksums of a file, without reading it back
+
+int32_t block_digest_diff(char* path1, char* path2, int32_t* frames, int32_t max);
+// List up to max file frames two files or snapshots differ in, returns the count
+
+int32_t block_frame_health(BlockFrameHealth* health);
+// Fill in the frame error counters since power on
+
+int32_t block_quarantined_frames(BlockVolumeFrame* frames, int32_t max);
+// List up to max quarantined volume frames, returns how many there are
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif
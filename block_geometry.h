@@ -0,0 +1,45 @@
+#ifndef BLOCK_GEOMETRY_INCLUDED
+#define BLOCK_GEOMETRY_INCLUDED
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : block_geometry.h
+//  Description    : This is the frame geometry the driver is built for.  It
+//                   is the controller's, from block_controller.h, unless a
+//                   variant build sets BLOCK_GEOMETRY_FRAME_SIZE or
+//                   BLOCK_GEOMETRY_BLOCK_SIZE, which then stand for
+//                   BLOCK_FRAME_SIZE and BLOCK_BLOCK_SIZE in every project
+//                   file.  block_io_bus only moves controller frames, so a
+//                   variant frame size must put member 0 on a stand-in
+//                   store as well (BLOCK_VOLUME_STANDIN=1).
+//
+//  Author         : Vinayak Gupta
+//
+
+// Project Includes
+#include <block_controller.h>
+
+// Defines
+#ifndef BLOCK_VOLUME_STANDIN
+#define BLOCK_VOLUME_STANDIN 0 // 1 backs member 0 with a stand-in store too, no block_io_bus
+#endif
+#ifdef BLOCK_GEOMETRY_FRAME_SIZE
+#undef BLOCK_FRAME_SIZE
+#define BLOCK_FRAME_SIZE BLOCK_GEOMETRY_FRAME_SIZE
+#endif
+#ifdef BLOCK_GEOMETRY_BLOCK_SIZE
+#undef BLOCK_BLOCK_SIZE
+#define BLOCK_BLOCK_SIZE BLOCK_GEOMETRY_BLOCK_SIZE
+#endif
+
+#if (BLOCK_FRAME_SIZE < 512) || (BLOCK_FRAME_SIZE & (BLOCK_FRAME_SIZE - 1))
+#error "BLOCK_FRAME_SIZE must be a power of two of at least 512 bytes"
+#endif
+#if (BLOCK_BLOCK_SIZE > 65536) || (BLOCK_BLOCK_SIZE & (BLOCK_BLOCK_SIZE - 1))
+#error "BLOCK_BLOCK_SIZE must be a power of two, frame indexes travel in the 16 bit FM1 register"
+#endif
+#if (BLOCK_FRAME_SIZE != 4096) && !BLOCK_VOLUME_STANDIN
+#error "block_io_bus moves 4096 byte frames, a variant frame size needs BLOCK_VOLUME_STANDIN=1"
+#endif
+
+#endif
@@ -0,0 +1,436 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : block_import.c
+//  Description    : This is the bulk import tool.  It copies host files into
+//                   new driver files on a freshly powered on volume at full
+//                   frame granularity: each driver file is preallocated as
+//                   one contiguous run of frames with block_fallocate, then
+//                   the host file is mapped and written in large frame
+//                   aligned pieces, so no frame is read back to be merged.
+//                   The files are opened BLOCK_O_DIRECT, so the copies go
+//                   around the frame cache and the write buffer.  Inside
+//                   each piece the driver hashes one group of frames on the
+//                   checksum workers while the bus moves the previous group,
+//                   and the next piece of the host file is paged in by the
+//                   kernel meanwhile.  Files that cannot be mapped are read
+//                   into a staging buffer instead.  The throughput of each
+//                   file and of the whole import is reported; with -V every
+//                   file is read back and compared once imported.  A driver
+//                   file that already holds data is left alone unless -o
+//                   is given, which unlinks it before the copy.
+//
+//  Author         : Vinayak Gupta
+//
+
+// Include Files
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+// Project Includes
+#include <block_cache.h>
+#include <block_csum.h>
+#include <block_driver.h>
+#include <block_geometry.h>
+#include <block_log.h>
+#include <block_volume.h>
+#include <cmpsc311_log.h>
+
+// Defines
+#define IMPORT_ARGUMENTS "hvVol:c:m:w:t:q:g:p:"
+#define IMPORT_PIECE (16 * BLOCK_VOLUME_BATCH_FRAMES * BLOCK_FRAME_SIZE) // Bytes per driver write
+#define USAGE                                                                    \
+    "USAGE: block_import [-h] [-v] [-V] [-o] [-l <logfile>] [-c <sz>] [-m <members>]\n" \
+    "                    [-w <stripe>] [-t <threads>] [-q <depth>] [-g <frames>]\n" \
+    "                    [-p <prefix>] <host-file> ...\n"                      \
+    "\n"                                                                         \
+    "where:\n"                                                                   \
+    "    -h - help mode (display this message)\n"                                \
+    "    -v - verbose output\n"                                                  \
+    "    -V - read each imported file back and compare it with the host file\n"  \
+    "    -o - overwrite driver files that already exist\n"                      \
+    "    -l - write log messages to the filename <logfile>\n"                    \
+    "    -c - set the block frame cache to <sz> frames (0 disables)\n"          \
+    "    -m - stripe the volume across <members> controllers (default 1)\n"      \
+    "    -w - stripe width of <stripe> frames per member (default 1)\n"          \
+    "    -t - hash frames on <threads> checksum workers (default 2)\n"          \
+    "    -q - hold up to <depth> writes in the volume scheduler (0 disables)\n" \
+    "    -g - log-structured writes in segments of <frames> frames\n"         \
+    "    -p - name each driver file <prefix><host file name>\n"                 \
+    "\n"                                                                         \
+    "    <host-file> - file to copy into a driver file of the same base name\n" \
+    "\n"
+
+//
+// Global Data
+uint64_t import_bytes; // bytes imported so far
+uint64_t import_copy_usec; // time spent copying them, verification excluded
+
+//
+// Functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : import_usec
+// Description  : monotonic clock in microseconds
+//
+// Inputs       : none
+// Outputs      : microseconds
+
+static uint64_t import_usec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : import_read
+// Description  : read a piece of a host file that could not be mapped
+//
+// Inputs       : hfd - the host file
+//                buf - the staging buffer
+//                len - bytes to read
+// Outputs      : 0 if successful, -1 if failure
+
+static int import_read(int hfd, char* buf, uint32_t len)
+{
+    ssize_t got;
+    uint32_t done = 0;
+
+    while (done < len) {
+        if ((got = read(hfd, buf + done, len - done)) <= 0) {
+            return (-1);
+        }
+        done += got;
+    }
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : import_verify
+// Description  : read an imported file back and compare it with its source,
+//                including that it ends where the source does
+//
+// Inputs       : fd - the driver file
+//                hfd - the host file
+//                src - the host file contents, MAP_FAILED if not mapped
+//                size - its size
+//                buf - 2*IMPORT_PIECE bytes to read into
+// Outputs      : 0 if they match, -1 if not or failure
+
+static int import_verify(int16_t fd, int hfd, char* src, uint32_t size, char* buf)
+{
+    uint32_t off, len;
+    char* host;
+
+    for (off = 0; off < size; off += len) {
+        len = (size - off < IMPORT_PIECE) ? size - off : IMPORT_PIECE;
+        if (src != MAP_FAILED) {
+            host = src + off;
+        } else if ((lseek(hfd, off, SEEK_SET) == (off_t)off) && (import_read(hfd, buf + IMPORT_PIECE, len) == 0)) {
+            host = buf + IMPORT_PIECE;
+        } else {
+            logMessage(LOG_ERROR_LEVEL, "Failed to read back %u bytes at %u of the host file", len, off);
+            return (-1);
+        }
+        if ((block_pread(fd, buf, len, off) != (int32_t)len) || memcmp(buf, host, len)) {
+            logMessage(LOG_ERROR_LEVEL, "Imported file differs from its source in the %u bytes at %u", len, off);
+            return (-1);
+        }
+    }
+    if (block_pread(fd, buf, 1, size) != 0) {
+        logMessage(LOG_ERROR_LEVEL, "Imported file is longer than its %u byte source", size);
+        return (-1);
+    }
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : import_file
+// Description  : copy one host file into a new driver file
+//
+// Inputs       : host - the host file path
+//                prefix - prepended to the base name of the driver file
+//                verify - 1 to read the file back and compare it
+//                overwrite - 1 to replace a driver file that holds data
+//                buf - 2*IMPORT_PIECE bytes of staging
+// Outputs      : 0 if successful, -1 if failure
+
+static int import_file(char* host, char* prefix, int verify, int overwrite, char* buf)
+{
+    char name[BLOCK_MAX_PATH_LENGTH], *base, *src = MAP_FAILED, *piece;
+    struct stat st;
+    uint64_t start;
+    uint32_t size, off, len;
+    int32_t held;
+    int16_t fd = -1;
+    int hfd, ret = -1;
+    double secs;
+
+    // Size up the host file and name the driver file after it
+    if (((hfd = open(host, O_RDONLY)) == -1) || (fstat(hfd, &st) == -1)) {
+        logMessage(LOG_ERROR_LEVEL, "Failed to open host file [%s]", host);
+        goto done;
+    }
+    if (!S_ISREG(st.st_mode) || (st.st_size > INT32_MAX)) {
+        logMessage(LOG_ERROR_LEVEL, "Host file [%s] is not a regular file of at most %d bytes", host, INT32_MAX);
+        goto done;
+    }
+    size = (uint32_t)st.st_size;
+    base = strrchr(host, '/') ? strrchr(host, '/') + 1 : host;
+    if (snprintf(name, sizeof(name), "%s%s", prefix, base) >= (int)sizeof(name)) {
+        logMessage(LOG_ERROR_LEVEL, "Driver file name for [%s] is longer than %d bytes", host, BLOCK_MAX_PATH_LENGTH - 1);
+        goto done;
+    }
+
+    // Map the host file for the kernel to read ahead of the copy
+    if (size > 0) {
+        if ((src = mmap(NULL, size, PROT_READ, MAP_PRIVATE, hfd, 0)) != MAP_FAILED) {
+            madvise(src, size, MADV_SEQUENTIAL);
+        } else {
+            logMessage(LOG_INFO_LEVEL, "Host file [%s] cannot be mapped, reading it", host);
+        }
+    }
+
+    // Reserve one run of frames and copy the file in frame aligned pieces
+    start = import_usec();
+    if ((fd = block_open_flags(name, BLOCK_O_RDWR | BLOCK_O_DIRECT)) == -1) {
+        goto done;
+    }
+    if ((held = block_pread(fd, buf, 1, 0)) == -1) {
+        goto done;
+    }
+    if (held > 0) { // an existing file would keep whatever lies past the copy
+        if (!overwrite) {
+            logMessage(LOG_ERROR_LEVEL, "Driver file [%s] already exists, use -o to overwrite it", name);
+            goto done;
+        }
+        block_close(fd);
+        if (block_unlink(name) || ((fd = block_open_flags(name, BLOCK_O_RDWR | BLOCK_O_DIRECT)) == -1)) {
+            fd = -1;
+            logMessage(LOG_ERROR_LEVEL, "Failed to replace driver file [%s]", name);
+            goto done;
+        }
+    }
+    if ((size > 0) && block_fallocate(fd, 0, size)) {
+        logMessage(LOG_ERROR_LEVEL, "No room on the volume for the %u bytes of [%s]", size, host);
+        goto done;
+    }
+    for (off = 0; off < size; off += len) {
+        len = (size - off < IMPORT_PIECE) ? size - off : IMPORT_PIECE;
+        if (src != MAP_FAILED) {
+            piece = src + off;
+            if (off + len < size) {
+                madvise(src + off + len, (size - off - len < IMPORT_PIECE) ? size - off - len : IMPORT_PIECE, MADV_WILLNEED);
+            }
+        } else {
+            if (import_read(hfd, buf, len)) {
+                logMessage(LOG_ERROR_LEVEL, "Failed to read %u bytes at %u of host file [%s]", len, off, host);
+                goto done;
+            }
+            piece = buf;
+        }
+        if (block_pwrite(fd, piece, len, off) != (int32_t)len) {
+            logMessage(LOG_ERROR_LEVEL, "Failed to write %u bytes at %u of driver file [%s]", len, off, name);
+            goto done;
+        }
+    }
+    if (block_volume_flush()) {
+        logMessage(LOG_ERROR_LEVEL, "Failed to flush the volume after [%s]", name);
+        goto done;
+    }
+    start = import_usec() - start;
+    import_copy_usec += start;
+    secs = start / 1e6;
+    import_bytes += size;
+    printf("%-32.32s %12u %10.3f %10.2f\n", name, size, secs, size / (secs > 0 ? secs : 1e-6) / (1024 * 1024));
+
+    // Compare with the source
+    if (verify && import_verify(fd, hfd, src, size, buf)) {
+        logMessage(LOG_ERROR_LEVEL, "Verification of [%s] failed", name);
+        goto done;
+    }
+    ret = 0;
+
+done:
+    if ((fd != -1) && (block_close(fd) == -1)) {
+        ret = -1;
+    }
+    if (src != MAP_FAILED) {
+        munmap(src, size);
+    }
+    if (hfd != -1) {
+        close(hfd);
+    }
+    return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : main
+// Description  : The main function for the bulk import tool
+//
+// Inputs       : argc - the number of command line parameters
+//                argv - the parameters
+// Outputs      : 0 if successful, -1 if failure
+
+int main(int argc, char* argv[])
+{
+
+    // Local variables
+    int ch, i, verbose = 0, verify = 0, overwrite = 0, log_initialized = 0, failed = 0;
+    uint32_t cache_size = 1024, log_segment = 0;
+    int members = 1, stripe = 1, queue_depth = BLOCK_VOLUME_QUEUE_DEPTH, csum_threads = BLOCK_CSUM_DEFAULT_THREADS;
+    char *prefix = "", *buf;
+    BlockVolumeStats bus;
+    double secs;
+
+    // Process the command line parameters
+    while ((ch = getopt(argc, argv, IMPORT_ARGUMENTS)) != -1) {
+
+        switch (ch) {
+        case 'h': // Help, print usage
+            fprintf(stderr, USAGE);
+            return (-1);
+
+        case 'v': // Verbose Flag
+            verbose = 1;
+            break;
+
+        case 'V': // Verify the imported files
+            verify = 1;
+            break;
+
+        case 'o': // Overwrite existing driver files
+            overwrite = 1;
+            break;
+
+        case 'l': // Set the log filename
+            initializeLogWithFilename(optarg);
+            log_initialized = 1;
+            break;
+
+        case 'c': // Set cache line size
+            if (sscanf(optarg, "%u", &cache_size) != 1) {
+                fprintf(stderr, "Bad cache size [%s]\n", optarg);
+                return (-1);
+            }
+            break;
+
+        case 'm': // Set the number of volume members
+            if (sscanf(optarg, "%d", &members) != 1) {
+                fprintf(stderr, "Bad volume member count [%s]\n", optarg);
+                return (-1);
+            }
+            break;
+
+        case 'w': // Set the stripe width
+            if (sscanf(optarg, "%d", &stripe) != 1) {
+                fprintf(stderr, "Bad stripe width [%s]\n", optarg);
+                return (-1);
+            }
+            break;
+
+        case 't': // Set the number of checksum workers
+            if (sscanf(optarg, "%d", &csum_threads) != 1) {
+                fprintf(stderr, "Bad checksum thread count [%s]\n", optarg);
+                return (-1);
+            }
+            break;
+
+        case 'q': // Set the scheduler queue depth
+            if (sscanf(optarg, "%d", &queue_depth) != 1) {
+                fprintf(stderr, "Bad scheduler queue depth [%s]\n", optarg);
+                return (-1);
+            }
+            break;
+
+        case 'g': // Write log-structured
+            if ((sscanf(optarg, "%u", &log_segment) != 1) || (log_segment == 0)) {
+                fprintf(stderr, "Bad log segment size [%s]\n", optarg);
+                return (-1);
+            }
+            break;
+
+        case 'p': // Prefix the driver file names
+            prefix = optarg;
+            break;
+
+        default: // Default (unknown)
+            fprintf(stderr, "Unknown command line option (%c), aborting.\n", ch);
+            return (-1);
+        }
+    }
+
+    // Setup the log as needed
+    if (!log_initialized) {
+        initializeLogWithFilehandle(CMPSC311_LOG_STDERR);
+    }
+    if (verbose) {
+        enableLogLevels(LOG_INFO_LEVEL);
+    }
+    if (optind >= argc) {
+        fprintf(stderr, "Missing host files, use -h to see usage, aborting.\n");
+        return (-1);
+    }
+
+    // Configure the volume, cache, checksum pool and log before the driver powers on
+    if (block_volume_configure(members, stripe) == -1) {
+        fprintf(stderr, "Bad volume geometry (%d members, stripe %d), aborting.\n", members, stripe);
+        return (-1);
+    }
+    if (block_volume_schedule(queue_depth, BLOCK_VOLUME_QUEUE_DEADLINE_USEC) == -1) {
+        fprintf(stderr, "Bad scheduler queue depth %d, aborting.\n", queue_depth);
+        return (-1);
+    }
+    block_cache_configure(cache_size);
+    if (block_csum_configure(csum_threads) == -1) {
+        fprintf(stderr, "Bad checksum thread count %d, aborting.\n", csum_threads);
+        return (-1);
+    }
+    block_log_configure(log_segment);
+    if ((buf = malloc(2 * IMPORT_PIECE)) == NULL) {
+        fprintf(stderr, "Failed to allocate the staging buffer, aborting.\n");
+        return (-1);
+    }
+    if (block_poweron() == -1) {
+        logMessage(LOG_ERROR_LEVEL, "Import failed to power on the driver, aborting.");
+        free(buf);
+        return (-1);
+    }
+
+    // Import each file in turn
+    printf("# frame %d bytes, %u frames on %d members\n", BLOCK_FRAME_SIZE, (unsigned)block_volume_frames(), members);
+    printf("%-32s %12s %10s %10s\n", "file", "bytes", "secs", "MB/s");
+    for (i = optind; i < argc; i++) {
+        if (import_file(argv[i], prefix, verify, overwrite, buf)) {
+            logMessage(LOG_ERROR_LEVEL, "Import of host file [%s] failed", argv[i]);
+            failed++;
+        }
+    }
+    secs = import_copy_usec / 1e6;
+    block_volume_stats(&bus);
+    printf("# %d files, %lu bytes in %.3f s, %.2f MB/s, %.2f bus bytes per byte\n", argc - optind - failed,
+        (unsigned long)import_bytes, secs, import_bytes / (secs > 0 ? secs : 1e-6) / (1024 * 1024),
+        import_bytes ? (double)bus.frames_written * BLOCK_FRAME_SIZE / import_bytes : 0);
+
+    // Power off, the driver files are flushed and closed
+    if (block_poweroff() == -1) {
+        logMessage(LOG_ERROR_LEVEL, "Import failed to power off the driver.");
+        failed++;
+    }
+    free(buf);
+
+    // Return successfully if every file was imported
+    return (failed ? -1 : 0);
+}
@@ -0,0 +1,915 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : block_kv.c
+//  Description    : This is the implementation of bkv.  Page 0 of the
+//                   store file is the superblock and every other page is a
+//                   B+-tree node of one frame.  A node is a slotted page:
+//                   the header, an array of record offsets in key order,
+//                   and the records packed down from the end of the frame.
+//                   Leaves are chained left to right for scans.  A leaf
+//                   record is a key and its value; an inner record is a
+//                   key and the child holding the keys from it up to the
+//                   next key, the keys below the first go to the node's
+//                   leftmost child.  Deletes leave nodes underfull rather
+//                   than merge them, and a full node is compacted before
+//                   it is split.
+//
+//                   Nodes are read through a per-store cache with LRU
+//                   replacement.  Changed nodes stay in the cache until
+//                   bkv_sync, bkv_close or the eviction of a changed node,
+//                   and are then written together in page order, each run
+//                   of consecutive pages one block_pwrite.  Every page is
+//                   sealed with computeframechecksum when written and
+//                   checked when read.
+//
+//  Author         : Vinayak Gupta
+//
+
+// Includes
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Project Includes
+#include <block_driver.h>
+#include <block_kv.h>
+#include <block_volume.h>
+#include <cmpsc311_log.h>
+
+// Defines
+#define BKV_MAGIC "BKVSTOR1" // First bytes of the superblock
+#define BKV_LEAF 1 // Node types
+#define BKV_INNER 2
+#define BKV_MAX_HEIGHT 16 // Deepest tree, a node has at least four records
+#define BKV_NO_PAGE 0 // Free cache line, page 0 is never cached
+#define BKV_LEAF_EXTRA 4 // Record bytes before the key: key and value lengths
+#define BKV_INNER_EXTRA 6 // Record bytes before the key: key length and child
+
+#if BLOCK_FRAME_SIZE > 65536
+#error "bkv node offsets are 16 bit, BLOCK_FRAME_SIZE must be at most 65536"
+#endif
+
+// Type definitions
+typedef struct {
+	uint32_t checksum; // computeframechecksum of the node with this field zero
+	uint16_t type; // BKV_LEAF or BKV_INNER
+	uint16_t count; // records in the node
+	uint32_t link; // leaf: next leaf, 0 for the last; inner: leftmost child
+	uint32_t heap; // offset of the lowest record byte
+} BkvNode;
+
+typedef struct {
+	uint32_t checksum; // computeframechecksum of page 0 with this field zero
+	char magic[8]; // BKV_MAGIC
+	uint32_t framesize; // BLOCK_FRAME_SIZE of the driver that made the store
+	uint32_t root; // root node
+	uint32_t pages; // pages in the file, the superblock included
+	uint32_t height; // levels of nodes, 1 while the root is a leaf
+	uint64_t keys; // records in the store
+} BkvSuper;
+
+typedef struct {
+	uint32_t page; // page held, BKV_NO_PAGE if free
+	int dirty; // 1 if changed since last written
+	uint64_t used; // tick of the last use
+	char* data; // the node
+} BkvLine;
+
+struct BlockKV {
+	int16_t fd; // the store file
+	pthread_mutex_t lock; // serializes the calls on the store
+	BkvSuper super; // the superblock
+	int superdirty; // 1 if the superblock changed since last written
+	BkvLine lines[BKV_CACHE_NODES]; // node cache
+	int32_t* where; // cache line of each page, -1 if not cached
+	uint32_t maxwhere; // allocated length of where
+	uint64_t tick; // cache use clock
+	char* scratch; // one frame to rebuild a node in
+	char* stage; // BLOCK_VOLUME_BATCH_FRAMES frames to write a run from
+};
+
+//
+// Implementation
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bkv_compare
+// Description  : order two keys bytewise, the shorter first on a common prefix
+//
+// Inputs       : a, alen - the first key
+//                b, blen - the second key
+// Outputs      : <0, 0 or >0 as a sorts before, with or after b
+static int bkv_compare(const void* a, uint16_t alen, const void* b, uint16_t blen)
+{
+	int c = memcmp(a, b, (alen < blen) ? alen : blen);
+	return (c ? c : (int)alen - (int)blen);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bkv_slots
+// Description  : the slot array of a node
+//
+// Inputs       : node - the node
+// Outputs      : the record offsets, in key order
+static uint16_t* bkv_slots(char* node)
+{
+	return ((uint16_t*)(node + BKV_NODE_HEADER));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bkv_key
+// Description  : the key of a record
+//
+// Inputs       : node - the node
+//                i - the record
+//                klen - the key length (output)
+// Outputs      : the key
+static const char* bkv_key(char* node, int i, uint16_t* klen)
+{
+	char* rec = node + bkv_slots(node)[i];
+	memcpy(klen, rec, sizeof(uint16_t));
+	return (rec + ((((BkvNode*)node)->type == BKV_LEAF) ? BKV_LEAF_EXTRA : BKV_INNER_EXTRA));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bkv_child
+// Description  : the child of an inner record, -1 for the leftmost child
+//
+// Inputs       : node - the inner node
+//                i - the record, -1 for the leftmost child
+// Outputs      : the child page
+static uint32_t bkv_child(char* node, int i)
+{
+	uint32_t child;
+	if (i < 0) {
+		return (((BkvNode*)node)->link);
+	}
+	memcpy(&child, node + bkv_slots(node)[i] + sizeof(uint16_t), sizeof(uint32_t));
+	return (child);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bkv_size
+// Description  : the bytes of a record, its slot not included
+//
+// Inputs       : node - the node
+//                i - the record
+// Outputs      : the record size
+static uint16_t bkv_size(char* node, int i)
+{
+	char* rec = node + bkv_slots(node)[i];
+	uint16_t klen, vlen;
+
+	memcpy(&klen, rec, sizeof(uint16_t));
+	if (((BkvNode*)node)->type == BKV_INNER) {
+		return (BKV_INNER_EXTRA + klen);
+	}
+	memcpy(&vlen, rec + sizeof(uint16_t), sizeof(uint16_t));
+	return (BKV_LEAF_EXTRA + klen + vlen);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bkv_search
+// Description  : binary search of a node for the first record not below key
+//
+// Inputs       : node - the node
+//                key, klen - the key
+//                found - 1 if that record holds key (output)
+// Outputs      : the record index, count if every key is below
+static int bkv_search(char* node, const void* key, uint16_t klen, int* found)
+{
+	int lo = 0, hi = ((BkvNode*)node)->count, mid, c;
+	const char* k;
+	uint16_t len;
+
+	*found = 0;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		k = bkv_key(node, mid, &len);
+		if ((c = bkv_compare(k, len, key, klen)) < 0) {
+			lo = mid + 1;
+		} else {
+			*found = (c == 0);
+			hi = mid;
+		}
+	}
+	if (lo < ((BkvNode*)node)->count) {
+		k = bkv_key(node, lo, &len);
+		*found = (bkv_compare(k, len, key, klen) == 0);
+	}
+	return (lo);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bkv_route
+// Description  : the record of an inner node whose child holds key
+//
+// Inputs       : node - the inner node
+//                key, klen - the key
+// Outputs      : the record index, -1 for the leftmost child
+static int bkv_route(char* node, const void* key, uint16_t klen)
+{
+	int found, i = bkv_search(node, key, klen, &found);
+	return (found ? i : i - 1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bkv_seal / bkv_verify
+// Description  : set and check the checksum of a page
+//
+// Inputs       : page - the page data
+//                pageno - the page number, for the log (bkv_verify)
+// Outputs      : bkv_seal returns 0 if successful, bkv_verify 0 if the
+//                page is intact; -1 if failure
+static int32_t bkv_seal(char* page)
+{
+	uint32_t checksum = 0;
+
+	memcpy(page, &checksum, sizeof(uint32_t));
+	if (computeframechecksum(page, &checksum)) {
+		return (-1);
+	}
+	memcpy(page, &checksum, sizeof(uint32_t));
+	return (0);
+}
+
+static int32_t bkv_verify(char* page, uint32_t pageno)
+{
+	uint32_t stored, checksum = 0;
+
+	memcpy(&stored, page, sizeof(uint32_t));
+	memcpy(page, &checksum, sizeof(uint32_t));
+	if (computeframechecksum(page, &checksum) || (checksum != stored)) {
+		logMessage(LOG_ERROR_LEVEL, "bkv page %u failed its checksum", pageno);
+		return (-1);
+	}
+	memcpy(page, &stored, sizeof(uint32_t));
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bkv_order
+// Description  : qsort order of cache lines by page
+//
+// Inputs       : a, b - pointers to the lines
+// Outputs      : <0, 0 or >0
+static int bkv_order(const void* a, const void* b)
+{
+	uint32_t pa = (*(BkvLine* const*)a)->page, pb = (*(BkvLine* const*)b)->page;
+	return ((pa > pb) - (pa < pb));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bkv_flush
+// Description  : write the changed pages in page order, each run of
+//                consecutive pages, up to BLOCK_VOLUME_BATCH_FRAMES, with
+//                one block_pwrite; pages are allotted in order and written
+//                no later than the first eviction, so a run never starts
+//                past the end of the file
+//
+// Inputs       : kv - the store
+// Outputs      : 0 if successful, -1 if failure
+static int32_t bkv_flush(BlockKV* kv)
+{
+	BkvLine* dirty[BKV_CACHE_NODES + 1];
+	BkvLine super;
+	char superpage[BLOCK_FRAME_SIZE];
+	int n = 0, i, run;
+
+	if (kv->superdirty) {
+		memset(superpage, 0x0, BLOCK_FRAME_SIZE);
+		memcpy(superpage, &kv->super, sizeof(BkvSuper));
+		super.page = 0;
+		super.data = superpage;
+		dirty[n++] = &super;
+	}
+	for (i = 0; i < BKV_CACHE_NODES; i++) {
+		if (kv->lines[i].dirty) {
+			dirty[n++] = &kv->lines[i];
+		}
+	}
+	qsort(dirty, n, sizeof(BkvLine*), bkv_order);
+	for (i = 0; i < n; i += run) {
+		for (run = 0; (i + run < n) && (run < BLOCK_VOLUME_BATCH_FRAMES) && (dirty[i + run]->page == dirty[i]->page + run); run++) {
+			if (bkv_seal(dirty[i + run]->data)) {
+				return (-1);
+			}
+			memcpy(kv->stage + run * BLOCK_FRAME_SIZE, dirty[i + run]->data, BLOCK_FRAME_SIZE);
+		}
+		if (block_pwrite(kv->fd, kv->stage, run * BLOCK_FRAME_SIZE, dirty[i]->page * BLOCK_FRAME_SIZE) != run * BLOCK_FRAME_SIZE) {
+			logMessage(LOG_ERROR_LEVEL, "bkv failed to write pages %u to %u", dirty[i]->page, dirty[i]->page + run - 1);
+			return (-1);
+		}
+	}
+	for (i = 0; i < BKV_CACHE_NODES; i++) {
+		kv->lines[i].dirty = 0;
+	}
+	kv->superdirty = 0;
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bkv_node
+// Description  : bring a node into the cache, evicting the least recently
+//                used one; an operation touches at most 2*BKV_MAX_HEIGHT+1
+//                nodes, fewer than the cache holds, so none of the nodes it
+//                is working on is evicted under it
+//
+// Inputs       : kv - the store
+//                page - the node
+//                fresh - 1 for a node just allotted, nothing is read
+// Outputs      : the node, NULL if failure
+static char* bkv_node(BlockKV* kv, uint32_t page, int fresh)
+{
+	BkvLine* line;
+	int32_t* grown;
+	uint32_t max;
+	int i, victim = 0;
+
+	if (page >= kv->maxwhere) {
+		max = (kv->maxwhere * 2 > page + 1) ? kv->maxwhere * 2 : page + 1;
+		if ((grown = realloc(kv->where, max * sizeof(int32_t))) == NULL) {
+			logMessage(LOG_ERROR_LEVEL, "bkv failed to grow its page index to %u pages", max);
+			return (NULL);
+		}
+		for (i = kv->maxwhere; i < (int)max; i++) {
+			grown[i] = -1;
+		}
+		kv->where = grown;
+		kv->maxwhere = max;
+	}
+	if (kv->where[page] >= 0) {
+		line = &kv->lines[kv->where[page]];
+		line->used = ++kv->tick;
+		return (line->data);
+	}
+
+	for (i = 0; i < BKV_CACHE_NODES; i++) {
+		if (kv->lines[i].page == BKV_NO_PAGE) {
+			victim = i;
+			break;
+		}
+		if (kv->lines[i].used < kv->lines[victim].used) {
+			victim = i;
+		}
+	}
+	line = &kv->lines[victim];
+	if (line->dirty && bkv_flush(kv)) {
+		return (NULL);
+	}
+	if (line->page != BKV_NO_PAGE) {
+		kv->where[line->page] = -1;
+		line->page = BKV_NO_PAGE;
+	}
+	if (!fresh) {
+		if (block_pread(kv->fd, line->data, BLOCK_FRAME_SIZE, page * BLOCK_FRAME_SIZE) != BLOCK_FRAME_SIZE) {
+			logMessage(LOG_ERROR_LEVEL, "bkv failed to read page %u", page);
+			return (NULL);
+		}
+		if (bkv_verify(line->data, page)) {
+			return (NULL);
+		}
+	}
+	line->page = page;
+	line->used = ++kv->tick;
+	kv->where[page] = victim;
+	return (line->data);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bkv_dirty
+// Description  : mark a cached node changed
+//
+// Inputs       : kv - the store
+//                page - the node
+// Outputs      : none
+static void bkv_dirty(BlockKV* kv, uint32_t page)
+{
+	kv->lines[kv->where[page]].dirty = 1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bkv_alloc
+// Description  : allot a new page at the end of the store file
+//
+// Inputs       : kv - the store
+//                page - the page (output)
+// Outputs      : the empty node, NULL if failure
+static char* bkv_alloc(BlockKV* kv, uint32_t* page)
+{
+	char* node;
+
+	if ((uint64_t)(kv->super.pages + 1) * BLOCK_FRAME_SIZE > INT32_MAX) {
+		logMessage(LOG_ERROR_LEVEL, "bkv store is full at %u pages", kv->super.pages);
+		return (NULL);
+	}
+	if ((node = bkv_node(kv, kv->super.pages, 1)) == NULL) {
+		return (NULL);
+	}
+	*page = kv->super.pages++;
+	kv->superdirty = 1;
+	memset(node, 0x0, BLOCK_FRAME_SIZE);
+	bkv_dirty(kv, *page);
+	return (node);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bkv_build
+// Description  : lay records out as a node
+//
+// Inputs       : node - the node to fill
+//                type - BKV_LEAF or BKV_INNER
+//                link - next leaf or leftmost child
+//                recs, lens - the records, in key order
+//                n - the number of records
+// Outputs      : none
+static void bkv_build(char* node, uint16_t type, uint32_t link, char** recs, uint16_t* lens, int n)
+{
+	BkvNode* hdr = (BkvNode*)node;
+	int i;
+
+	memset(hdr, 0x0, sizeof(BkvNode));
+	hdr->type = type;
+	hdr->link = link;
+	hdr->heap = BLOCK_FRAME_SIZE;
+	for (i = 0; i < n; i++) {
+		hdr->heap -= lens[i];
+		memcpy(node + hdr->heap, recs[i], lens[i]);
+		bkv_slots(node)[i] = hdr->heap;
+	}
+	hdr->count = n;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bkv_insert
+// Description  : insert a record into a node at index pos; a node without
+//                room is compacted, or split in two by bytes with the upper
+//                half moving to a new node.  A leaf split copies the first
+//                key of the new node up, an inner split moves its middle
+//                record up and that record's child becomes the new node's
+//                leftmost.
+//
+// Inputs       : kv - the store
+//                page - the node
+//                pos - index of the new record
+//                rec, len - the record
+//                sep, seplen - key to insert in the parent (output)
+//                right - the new node (output)
+// Outputs      : 0 if inserted, 1 if the node was split, -1 if failure
+static int bkv_insert(BlockKV* kv, uint32_t page, int pos, char* rec, uint16_t len, char* sep, uint16_t* seplen, uint32_t* right)
+{
+	char *node, *other, *recs[BLOCK_FRAME_SIZE / BKV_LEAF_EXTRA + 1];
+	uint16_t lens[BLOCK_FRAME_SIZE / BKV_LEAF_EXTRA + 1], klen;
+	BkvNode* hdr;
+	uint32_t total = 0, acc = 0, link, child;
+	int i, n, m;
+
+	if ((node = bkv_node(kv, page, 0)) == NULL) {
+		return (-1);
+	}
+	hdr = (BkvNode*)node;
+	bkv_dirty(kv, page);
+
+	// Room in the free gap
+	if (hdr->heap >= BKV_NODE_HEADER + (hdr->count + 1) * sizeof(uint16_t) + len) {
+		hdr->heap -= len;
+		memcpy(node + hdr->heap, rec, len);
+		memmove(&bkv_slots(node)[pos + 1], &bkv_slots(node)[pos], (hdr->count - pos) * sizeof(uint16_t));
+		bkv_slots(node)[pos] = hdr->heap;
+		hdr->count++;
+		return (0);
+	}
+
+	// Rebuild from a copy, compacted or split
+	memcpy(kv->scratch, node, BLOCK_FRAME_SIZE);
+	for (i = 0, n = 0; i <= hdr->count; i++) {
+		if (i == pos) {
+			recs[n] = rec;
+			lens[n++] = len;
+		}
+		if (i < hdr->count) {
+			recs[n] = kv->scratch + bkv_slots(kv->scratch)[i];
+			lens[n++] = bkv_size(kv->scratch, i);
+		}
+	}
+	for (i = 0; i < n; i++) {
+		total += lens[i] + sizeof(uint16_t);
+	}
+	if (BKV_NODE_HEADER + total <= BLOCK_FRAME_SIZE) {
+		bkv_build(node, hdr->type, hdr->link, recs, lens, n);
+		return (0);
+	}
+	for (m = 0; (m < n - 1) && ((acc < total / 2) || (m == 0)); m++) {
+		acc += lens[m] + sizeof(uint16_t);
+	}
+	if ((other = bkv_alloc(kv, right)) == NULL) {
+		return (-1);
+	}
+	node = bkv_node(kv, page, 0); // still cached, refreshes its use
+	if (((BkvNode*)kv->scratch)->type == BKV_LEAF) {
+		link = ((BkvNode*)kv->scratch)->link;
+		bkv_build(other, BKV_LEAF, link, &recs[m], &lens[m], n - m);
+		bkv_build(node, BKV_LEAF, *right, recs, lens, m);
+		memcpy(seplen, recs[m], sizeof(uint16_t));
+		memcpy(sep, recs[m] + BKV_LEAF_EXTRA, *seplen);
+	} else {
+		memcpy(&klen, recs[m], sizeof(uint16_t));
+		memcpy(&child, recs[m] + sizeof(uint16_t), sizeof(uint32_t));
+		*seplen = klen;
+		memcpy(sep, recs[m] + BKV_INNER_EXTRA, klen);
+		bkv_build(other, BKV_INNER, child, &recs[m + 1], &lens[m + 1], n - m - 1);
+		bkv_build(node, BKV_INNER, ((BkvNode*)kv->scratch)->link, recs, lens, m);
+	}
+	bkv_dirty(kv, page); // again, allotting the new node may have flushed
+	return (1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bkv_descend
+// Description  : walk from the root to the leaf that holds key
+//
+// Inputs       : kv - the store
+//                key, klen - the key
+//                path - page of each level (output)
+//                route - record followed at each inner level (output)
+// Outputs      : the leaf, NULL if failure
+static char* bkv_descend(BlockKV* kv, const void* key, uint16_t klen, uint32_t* path, int* route)
+{
+	char* node;
+	uint32_t level;
+
+	path[0] = kv->super.root;
+	for (level = 0;; level++) {
+		if ((node = bkv_node(kv, path[level], 0)) == NULL) {
+			return (NULL);
+		}
+		if (level == kv->super.height - 1) {
+			return (node);
+		}
+		route[level] = bkv_route(node, key, klen);
+		path[level + 1] = bkv_child(node, route[level]);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bkv_remove
+// Description  : drop record i of a node, its bytes are reclaimed when the
+//                node is next compacted
+//
+// Inputs       : node - the node
+//                i - the record
+// Outputs      : none
+static void bkv_remove(char* node, int i)
+{
+	BkvNode* hdr = (BkvNode*)node;
+	memmove(&bkv_slots(node)[i], &bkv_slots(node)[i + 1], (hdr->count - i - 1) * sizeof(uint16_t));
+	hdr->count--;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bkv_open
+// Description  : open a store in a driver file, an empty file gets a
+//                superblock and an empty root leaf
+//
+// Inputs       : path - the driver file
+// Outputs      : the store, NULL if failure
+BlockKV* bkv_open(char* path)
+{
+	BlockKV* kv;
+	char* page;
+	int32_t got;
+	int i;
+
+	if ((kv = calloc(1, sizeof(BlockKV))) == NULL) {
+		logMessage(LOG_ERROR_LEVEL, "Failed to allocate bkv store [%s]", path);
+		return (NULL);
+	}
+	kv->fd = -1;
+	if (((kv->scratch = malloc(BLOCK_FRAME_SIZE)) == NULL) || ((kv->stage = malloc(BLOCK_VOLUME_BATCH_FRAMES * BLOCK_FRAME_SIZE)) == NULL)
+		|| ((kv->lines[0].data = malloc(BKV_CACHE_NODES * BLOCK_FRAME_SIZE)) == NULL)) {
+		logMessage(LOG_ERROR_LEVEL, "Failed to allocate bkv store [%s]", path);
+		goto fail;
+	}
+	for (i = 0; i < BKV_CACHE_NODES; i++) {
+		kv->lines[i].data = kv->lines[0].data + i * BLOCK_FRAME_SIZE;
+		kv->lines[i].page = BKV_NO_PAGE;
+	}
+	pthread_mutex_init(&kv->lock, NULL);
+	if ((kv->fd = block_open(path)) == -1) {
+		goto fail;
+	}
+
+	// An existing store starts with its superblock
+	page = kv->scratch;
+	if ((got = block_pread(kv->fd, page, BLOCK_FRAME_SIZE, 0)) == BLOCK_FRAME_SIZE) {
+		if (bkv_verify(page, 0)) {
+			goto fail;
+		}
+		memcpy(&kv->super, page, sizeof(BkvSuper));
+		if (memcmp(kv->super.magic, BKV_MAGIC, sizeof(kv->super.magic)) || (kv->super.framesize != BLOCK_FRAME_SIZE)) {
+			logMessage(LOG_ERROR_LEVEL, "[%s] is not a bkv store of %d byte frames", path, BLOCK_FRAME_SIZE);
+			goto fail;
+		}
+		logMessage(LOG_INFO_LEVEL, "Opened bkv store [%s], %lu records in %u pages", path, (unsigned long)kv->super.keys, kv->super.pages);
+		return (kv);
+	}
+	if (got != 0) {
+		logMessage(LOG_ERROR_LEVEL, "[%s] is not a bkv store", path);
+		goto fail;
+	}
+
+	// A new store, the root is an empty leaf
+	memcpy(kv->super.magic, BKV_MAGIC, sizeof(kv->super.magic));
+	kv->super.framesize = BLOCK_FRAME_SIZE;
+	kv->super.pages = 1;
+	kv->super.height = 1;
+	if ((page = bkv_alloc(kv, &kv->super.root)) == NULL) {
+		goto fail;
+	}
+	bkv_build(page, BKV_LEAF, 0, NULL, NULL, 0);
+	if (bkv_flush(kv)) {
+		goto fail;
+	}
+	logMessage(LOG_INFO_LEVEL, "Created bkv store [%s]", path);
+	return (kv);
+
+fail:
+	if (kv->fd != -1) {
+		block_close(kv->fd);
+		pthread_mutex_destroy(&kv->lock);
+	}
+	free(kv->where);
+	free(kv->lines[0].data);
+	free(kv->stage);
+	free(kv->scratch);
+	free(kv);
+	return (NULL);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bkv_close
+// Description  : write back and close a store
+//
+// Inputs       : kv - the store
+// Outputs      : 0 if successful, -1 if failure
+int32_t bkv_close(BlockKV* kv)
+{
+	int32_t ret = 0;
+
+	if (bkv_flush(kv) || (block_close(kv->fd) == -1)) {
+		ret = -1;
+	}
+	pthread_mutex_destroy(&kv->lock);
+	free(kv->where);
+	free(kv->lines[0].data);
+	free(kv->stage);
+	free(kv->scratch);
+	free(kv);
+	return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bkv_sync
+// Description  : write the changed nodes of a store
+//
+// Inputs       : kv - the store
+// Outputs      : 0 if successful, -1 if failure
+int32_t bkv_sync(BlockKV* kv)
+{
+	int32_t ret;
+
+	pthread_mutex_lock(&kv->lock);
+	ret = bkv_flush(kv);
+	pthread_mutex_unlock(&kv->lock);
+	return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bkv_put
+// Description  : insert or replace a record, splitting nodes up the path
+//                and growing a new root when the old one splits
+//
+// Inputs       : kv - the store
+//                key, klen - the key
+//                val, vlen - the value
+// Outputs      : 0 if successful, -1 if failure
+int32_t bkv_put(BlockKV* kv, const void* key, uint16_t klen, const void* val, uint16_t vlen)
+{
+	char rec[BKV_MAX_RECORD + BKV_INNER_EXTRA + BKV_LEAF_EXTRA], sep[BKV_MAX_RECORD], *node, *recs[1] = { rec };
+	uint32_t path[BKV_MAX_HEIGHT], right, child;
+	int route[BKV_MAX_HEIGHT], level, pos, found, r;
+	uint16_t len, seplen;
+	int32_t ret = -1;
+
+	if ((klen == 0) || ((uint32_t)klen + vlen > BKV_MAX_RECORD)) {
+		logMessage(LOG_ERROR_LEVEL, "bkv record of %u key and %u value bytes, at most %d in all", klen, vlen, BKV_MAX_RECORD);
+		return (-1);
+	}
+	pthread_mutex_lock(&kv->lock);
+	if ((node = bkv_descend(kv, key, klen, path, route)) == NULL) {
+		goto done;
+	}
+	pos = bkv_search(node, key, klen, &found);
+	if (found) {
+		bkv_remove(node, pos);
+		bkv_dirty(kv, path[kv->super.height - 1]);
+	} else {
+		kv->super.keys++;
+		kv->superdirty = 1;
+	}
+	memcpy(rec, &klen, sizeof(uint16_t));
+	memcpy(rec + sizeof(uint16_t), &vlen, sizeof(uint16_t));
+	memcpy(rec + BKV_LEAF_EXTRA, key, klen);
+	memcpy(rec + BKV_LEAF_EXTRA + klen, val, vlen);
+	len = BKV_LEAF_EXTRA + klen + vlen;
+
+	// Insert at the leaf, carrying splits up the path
+	for (level = kv->super.height - 1; level >= 0; level--) {
+		if ((r = bkv_insert(kv, path[level], pos, rec, len, sep, &seplen, &right)) <= 0) {
+			ret = r;
+			goto done;
+		}
+		memcpy(rec, &seplen, sizeof(uint16_t));
+		memcpy(rec + sizeof(uint16_t), &right, sizeof(uint32_t));
+		memcpy(rec + BKV_INNER_EXTRA, sep, seplen);
+		len = BKV_INNER_EXTRA + seplen;
+		if (level > 0) {
+			pos = route[level - 1] + 1;
+		}
+	}
+
+	// The root split, a new root points at both halves
+	if (kv->super.height == BKV_MAX_HEIGHT) {
+		logMessage(LOG_ERROR_LEVEL, "bkv tree is at its largest height %d", BKV_MAX_HEIGHT);
+		goto done;
+	}
+	child = kv->super.root;
+	if ((node = bkv_alloc(kv, &kv->super.root)) == NULL) {
+		goto done;
+	}
+	bkv_build(node, BKV_INNER, child, recs, &len, 1);
+	kv->super.height++;
+	ret = 0;
+
+done:
+	pthread_mutex_unlock(&kv->lock);
+	return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bkv_get
+// Description  : look up a record
+//
+// Inputs       : kv - the store
+//                key, klen - the key
+//                val - buffer for the value
+//                max - room in val
+// Outputs      : the value length, BKV_NOT_FOUND if missing, -1 if failure
+int32_t bkv_get(BlockKV* kv, const void* key, uint16_t klen, void* val, uint16_t max)
+{
+	uint32_t path[BKV_MAX_HEIGHT];
+	int route[BKV_MAX_HEIGHT], pos, found;
+	uint16_t len, vlen;
+	const char* k;
+	char* node;
+	int32_t ret = -1;
+
+	pthread_mutex_lock(&kv->lock);
+	if ((node = bkv_descend(kv, key, klen, path, route)) != NULL) {
+		pos = bkv_search(node, key, klen, &found);
+		if (!found) {
+			ret = BKV_NOT_FOUND;
+		} else {
+			k = bkv_key(node, pos, &len);
+			memcpy(&vlen, k - sizeof(uint16_t), sizeof(uint16_t));
+			memcpy(val, k + len, (vlen < max) ? vlen : max);
+			ret = vlen;
+		}
+	}
+	pthread_mutex_unlock(&kv->lock);
+	return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bkv_delete
+// Description  : remove a record from its leaf
+//
+// Inputs       : kv - the store
+//                key, klen - the key
+// Outputs      : 0 if removed, BKV_NOT_FOUND if missing, -1 if failure
+int32_t bkv_delete(BlockKV* kv, const void* key, uint16_t klen)
+{
+	uint32_t path[BKV_MAX_HEIGHT];
+	int route[BKV_MAX_HEIGHT], pos, found;
+	char* node;
+	int32_t ret = -1;
+
+	pthread_mutex_lock(&kv->lock);
+	if ((node = bkv_descend(kv, key, klen, path, route)) != NULL) {
+		pos = bkv_search(node, key, klen, &found);
+		if (!found) {
+			ret = BKV_NOT_FOUND;
+		} else {
+			bkv_remove(node, pos);
+			bkv_dirty(kv, path[kv->super.height - 1]);
+			kv->super.keys--;
+			kv->superdirty = 1;
+			ret = 0;
+		}
+	}
+	pthread_mutex_unlock(&kv->lock);
+	return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bkv_scan
+// Description  : visit records in key order along the leaf chain
+//
+// Inputs       : kv - the store
+//                start, slen - first key, NULL from the smallest
+//                end, elen - key to stop before, NULL to the largest
+//                fn - called with each record
+//                arg - passed to fn
+// Outputs      : records visited, -1 if failure
+int32_t bkv_scan(BlockKV* kv, const void* start, uint16_t slen, const void* end, uint16_t elen, BkvScanFn fn, void* arg)
+{
+	uint32_t path[BKV_MAX_HEIGHT], page;
+	int route[BKV_MAX_HEIGHT], pos, found;
+	uint16_t len, vlen;
+	const char* k;
+	char* node;
+	int32_t ret = -1, visited = 0;
+
+	pthread_mutex_lock(&kv->lock);
+	if ((node = bkv_descend(kv, start ? start : "", start ? slen : 0, path, route)) == NULL) {
+		goto done;
+	}
+	pos = start ? bkv_search(node, start, slen, &found) : 0;
+	for (;;) {
+		for (; pos < ((BkvNode*)node)->count; pos++) {
+			k = bkv_key(node, pos, &len);
+			if (end && (bkv_compare(k, len, end, elen) >= 0)) {
+				ret = visited;
+				goto done;
+			}
+			memcpy(&vlen, k - sizeof(uint16_t), sizeof(uint16_t));
+			visited++;
+			if (fn(k, len, k + len, vlen, arg)) {
+				ret = visited;
+				goto done;
+			}
+		}
+		if ((page = ((BkvNode*)node)->link) == 0) {
+			break;
+		}
+		if ((node = bkv_node(kv, page, 0)) == NULL) {
+			goto done;
+		}
+		pos = 0;
+	}
+	ret = visited;
+
+done:
+	pthread_mutex_unlock(&kv->lock);
+	return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bkv_count
+// Description  : the number of records in a store
+//
+// Inputs       : kv - the store
+// Outputs      : the count
+uint64_t bkv_count(BlockKV* kv)
+{
+	uint64_t keys;
+
+	pthread_mutex_lock(&kv->lock);
+	keys = kv->super.keys;
+	pthread_mutex_unlock(&kv->lock);
+	return (keys);
+}
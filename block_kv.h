@@ -0,0 +1,74 @@
+#ifndef BLOCK_KV_INCLUDED
+#define BLOCK_KV_INCLUDED
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : block_kv.h
+//  Description    : This is the interface of bkv, the embedded key-value
+//                   store.  A store is a B+-tree kept in one driver file,
+//                   one node per frame, so millions of small objects take
+//                   one file handle and share frames instead of holding a
+//                   file and a frame each.  Keys are ordered bytewise,
+//                   shorter first on a common prefix.  A store is used from
+//                   the driver context that opened it; its calls serialize
+//                   on the store.
+//
+//  Author         : Vinayak Gupta
+//
+
+// Include files
+#include <stdint.h>
+
+// Project Includes
+#include <block_geometry.h>
+
+// Defines
+#define BKV_NODE_HEADER 16 // Bytes of a node before its slot array
+#define BKV_MAX_RECORD ((BLOCK_FRAME_SIZE - BKV_NODE_HEADER) / 4 - 8) // Most bytes of key plus value, four records fit a node
+#define BKV_CACHE_NODES 256 // Nodes a store holds in memory
+#define BKV_NOT_FOUND (-2) // bkv_get and bkv_delete on a missing key
+
+// Type definitions
+typedef struct BlockKV BlockKV;
+
+// Called by bkv_scan for each record in order, non-zero stops the scan
+typedef int (*BkvScanFn)(const void* key, uint16_t klen, const void* val, uint16_t vlen, void* arg);
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//
+// Interface functions
+
+BlockKV* bkv_open(char* path);
+// Open the store in the driver file path, creating it if the file is empty, NULL if failure
+
+int32_t bkv_close(BlockKV* kv);
+// Write back the store and close it, the handle is released either way
+
+int32_t bkv_sync(BlockKV* kv);
+// Write the changed nodes to the driver file in batches
+
+int32_t bkv_put(BlockKV* kv, const void* key, uint16_t klen, const void* val, uint16_t vlen);
+// Insert or replace a record, klen of at least 1 and klen+vlen at most BKV_MAX_RECORD
+
+int32_t bkv_get(BlockKV* kv, const void* key, uint16_t klen, void* val, uint16_t max);
+// Copy up to max bytes of the value of key, returns its length or BKV_NOT_FOUND
+
+int32_t bkv_delete(BlockKV* kv, const void* key, uint16_t klen);
+// Remove a record, 0 if removed or BKV_NOT_FOUND
+
+int32_t bkv_scan(BlockKV* kv, const void* start, uint16_t slen, const void* end, uint16_t elen, BkvScanFn fn, void* arg);
+// Visit the records from start up to, not including, end (NULL for either bound
+// is open) until fn returns non-zero, returns the records visited; fn must not
+// call the store
+
+uint64_t bkv_count(BlockKV* kv);
+// Number of records in the store
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,442 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : block_log.c
+//  Description    : This is the implementation of the log-structured frame
+//                   allocator.  Every segment is free, open at one of the
+//                   log heads, or full.  A head hands out the frames of its
+//                   segment in order and opens the next free segment when
+//                   it reaches the end; a full segment goes back to free
+//                   when its last live frame is released.  The user head
+//                   leaves BLOCK_LOG_RESERVE_SEGMENTS free segments to the
+//                   cleaner, which must always be able to open one to move
+//                   live data into.
+//
+//                   The cleaner thread runs once free segments fall below
+//                   BLOCK_LOG_CLEAN_LOW_PCT and keeps going until they
+//                   reach BLOCK_LOG_CLEAN_HIGH_PCT, one segment per driver
+//                   lock.  Victims are chosen by the cost-benefit rule of
+//                   Sprite LFS, so cold segments are cleaned at a higher
+//                   utilisation than hot ones that are still dying.  Like
+//                   the scrubber, it waits for the foreground to go quiet
+//                   unless the reserve is about to be touched.
+//
+//                   The segment table is protected by the driver lock.
+//
+//  Author         : Vinayak Gupta
+//
+
+// Includes
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Project Includes
+#include <block_ctx.h>
+#include <block_driver.h>
+#include <block_log.h>
+#include <cmpsc311_log.h>
+
+// Segment states
+#define BLOCK_LOG_FREE 0
+#define BLOCK_LOG_OPEN 1
+#define BLOCK_LOG_FULL 2
+
+// Type definitions
+typedef struct {
+	int state; // BLOCK_LOG_FREE, OPEN or FULL
+	int32_t live; // frames allotted and not yet released
+	uint64_t stamp; // frames_written when the segment filled, its age
+} BlockLogSegment;
+
+// The log of a context
+struct BlockLogState {
+	uint32_t segframes; // configured frames per segment, 0 if disabled
+	BlockLogSegment* seg; // segment table, NULL when not in log mode
+	uint32_t nsegs; // segments in the volume
+	BlockVolumeFrame frames; // frames in the volume
+	uint32_t nfree; // free segments
+	uint32_t low, high; // cleaning watermarks in free segments
+	int32_t head[BLOCK_LOG_HEADS]; // open segment of each head, -1 if none
+	int32_t next[BLOCK_LOG_HEADS]; // next frame of the open segment
+	uint32_t scan; // where the search for a free segment resumes
+	BlockLogStats stats;
+	int running; // 1 while the cleaner thread exists
+	int stopping; // set to stop the cleaner
+	pthread_t thread;
+	pthread_mutex_t lock; // protects the stop flag
+	pthread_cond_t wake; // signalled when space runs low or to stop
+};
+#define lfs (*block_ctx_bound->log) // the log of the calling thread's context
+
+//
+// Implementation
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_log_ctx_create / block_log_ctx_destroy
+// Description  : create and release the log of a context
+//
+// Inputs       : state - the log to release, may be NULL
+// Outputs      : block_log_ctx_create returns the log, NULL if failure
+struct BlockLogState* block_log_ctx_create(void)
+{
+	struct BlockLogState* state;
+
+	if ((state = calloc(1, sizeof(struct BlockLogState))) == NULL) {
+		return NULL;
+	}
+	pthread_mutex_init(&state->lock, NULL);
+	pthread_cond_init(&state->wake, NULL);
+	return state;
+}
+
+void block_log_ctx_destroy(struct BlockLogState* state)
+{
+	if (state == NULL) {
+		return;
+	}
+	pthread_cond_destroy(&state->wake);
+	pthread_mutex_destroy(&state->lock);
+	free(state);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_log_size
+// Description  : frames in a segment, the last one may be short
+//
+// Inputs       : seg - the segment
+// Outputs      : number of frames
+static int32_t block_log_size(uint32_t seg)
+{
+	BlockVolumeFrame first = seg * lfs.segframes;
+	return ((lfs.frames - first < lfs.segframes) ? lfs.frames - first : lfs.segframes);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_log_sleep
+// Description  : sleep unless the cleaner is woken or being stopped
+//
+// Inputs       : usec - microseconds to sleep
+// Outputs      : 1 if the cleaner should stop, 0 otherwise
+static int block_log_sleep(uint64_t usec)
+{
+	struct timespec until;
+	int stop;
+
+	clock_gettime(CLOCK_REALTIME, &until);
+	until.tv_sec += usec / 1000000;
+	until.tv_nsec += (usec % 1000000) * 1000;
+	if (until.tv_nsec >= 1000000000) {
+		until.tv_sec++;
+		until.tv_nsec -= 1000000000;
+	}
+	pthread_mutex_lock(&lfs.lock);
+	if (!lfs.stopping) {
+		pthread_cond_timedwait(&lfs.wake, &lfs.lock, &until);
+	}
+	stop = lfs.stopping;
+	pthread_mutex_unlock(&lfs.lock);
+	return stop;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_log_thread
+// Description  : the cleaner thread, reclaims segments while space is low
+//
+// Inputs       : arg - unused
+// Outputs      : NULL
+static void* block_log_thread(void* arg)
+{
+	uint32_t nfree;
+	uint64_t idle;
+	int cleaning = 0;
+	int32_t gained;
+
+	(void)arg;
+	while (!lfs.stopping) {
+		nfree = __atomic_load_n(&lfs.nfree, __ATOMIC_RELAXED);
+		if (nfree < lfs.low) {
+			cleaning = 1;
+		}
+		if ((!cleaning) || (nfree >= lfs.high)) {
+			cleaning = 0;
+			if (block_log_sleep(BLOCK_LOG_POLL_USEC)) {
+				break;
+			}
+			continue;
+		}
+
+		// Yield to the foreground while there is room to spare
+		if ((nfree > 2 * BLOCK_LOG_RESERVE_SEGMENTS) && ((idle = driverIdleUsec()) < BLOCK_LOG_IDLE_USEC)) {
+			if (block_log_sleep(BLOCK_LOG_IDLE_USEC - idle)) {
+				break;
+			}
+			continue;
+		}
+		lockDriver();
+		gained = cleanLogSegment();
+		unlockDriver();
+		if (gained <= 0) {
+			cleaning = 0; // nothing worth moving, wait for frames to die
+		}
+	}
+	return NULL;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_log_configure
+// Description  : set the segment size of log-structured mode
+//
+// Inputs       : segment_frames - frames per segment, 0 disables the log
+// Outputs      : 0 if successful, -1 if failure
+int32_t block_log_configure(uint32_t segment_frames)
+{
+	if (lfs.seg != NULL) {
+		logMessage(LOG_ERROR_LEVEL, "Cannot change log mode while powered on");
+		return -1;
+	}
+	lfs.segframes = segment_frames;
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_log_enabled
+// Description  : is the driver running in log-structured mode
+//
+// Inputs       : none
+// Outputs      : 1 if enabled, 0 if not
+int32_t block_log_enabled(void)
+{
+	return (lfs.seg != NULL);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_log_poweron
+// Description  : build the segment table, all free, and start the cleaner
+//
+// Inputs       : frames - frames in the volume
+// Outputs      : 0 if successful, -1 if failure
+int32_t block_log_poweron(BlockVolumeFrame frames)
+{
+	int i;
+
+	if (lfs.segframes == 0) {
+		return 0;
+	}
+	lfs.frames = frames;
+	lfs.nsegs = (frames + lfs.segframes - 1) / lfs.segframes;
+	if (lfs.nsegs < 2 * BLOCK_LOG_RESERVE_SEGMENTS + 2) {
+		logMessage(LOG_ERROR_LEVEL, "Volume of %u frames is too small for %u frame log segments", frames, lfs.segframes);
+		return -1;
+	}
+	if ((lfs.seg = calloc(lfs.nsegs, sizeof(BlockLogSegment))) == NULL) {
+		logMessage(LOG_ERROR_LEVEL, "Failed to allocate log segment table of %u segments", lfs.nsegs);
+		return -1;
+	}
+	lfs.nfree = lfs.nsegs;
+	lfs.low = lfs.nsegs * BLOCK_LOG_CLEAN_LOW_PCT / 100;
+	if (lfs.low < BLOCK_LOG_RESERVE_SEGMENTS + 2) {
+		lfs.low = BLOCK_LOG_RESERVE_SEGMENTS + 2;
+	}
+	lfs.high = lfs.nsegs * BLOCK_LOG_CLEAN_HIGH_PCT / 100;
+	if (lfs.high <= lfs.low) {
+		lfs.high = lfs.low + 1;
+	}
+	for (i = 0; i < BLOCK_LOG_HEADS; i++) {
+		lfs.head[i] = -1;
+	}
+	lfs.scan = 0;
+	memset(&lfs.stats, 0x0, sizeof(lfs.stats));
+
+	lfs.stopping = 0;
+	if (block_ctx_spawn(&lfs.thread, block_log_thread, NULL)) {
+		logMessage(LOG_ERROR_LEVEL, "Failed to start log cleaner thread");
+		free(lfs.seg);
+		lfs.seg = NULL;
+		return -1;
+	}
+	lfs.running = 1;
+	logMessage(LOG_INFO_LEVEL, "Log-structured mode, %u segments of %u frames, cleaning from %u to %u free",
+		lfs.nsegs, lfs.segframes, lfs.low, lfs.high);
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_log_stop
+// Description  : stop the cleaner thread and wait for it
+//
+// Inputs       : none
+// Outputs      : 0
+int32_t block_log_stop(void)
+{
+	if (!lfs.running) {
+		return 0;
+	}
+	pthread_mutex_lock(&lfs.lock);
+	lfs.stopping = 1;
+	pthread_cond_signal(&lfs.wake);
+	pthread_mutex_unlock(&lfs.lock);
+	pthread_join(lfs.thread, NULL);
+	lfs.running = 0;
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_log_poweroff
+// Description  : report and release the segment table
+//
+// Inputs       : none
+// Outputs      : 0
+int32_t block_log_poweroff(void)
+{
+	if (lfs.seg == NULL) {
+		return 0;
+	}
+	logMessage(LOG_INFO_LEVEL, "Log wrote %lu frames, cleaner copied %lu frames out of %lu segments (%lu in the foreground)",
+		(unsigned long)lfs.stats.frames_written, (unsigned long)lfs.stats.frames_copied,
+		(unsigned long)lfs.stats.segments_cleaned, (unsigned long)lfs.stats.foreground_cleans);
+	free(lfs.seg);
+	lfs.seg = NULL;
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_log_alloc
+// Description  : hand out the next frame at a log head, opening a free
+//                segment when the head has none or reached its end
+//
+// Inputs       : head - the log head
+//                frame - the frame (output)
+// Outputs      : 0 if successful, -1 if no segment could be opened
+int32_t block_log_alloc(BlockLogHead head, BlockVolumeFrame* frame)
+{
+	uint32_t seg, reserve = (head == BLOCK_LOG_HEAD_USER) ? BLOCK_LOG_RESERVE_SEGMENTS : 0;
+
+	if ((lfs.head[head] >= 0) && (lfs.next[head] == block_log_size(lfs.head[head]))) {
+		lfs.seg[lfs.head[head]].state = BLOCK_LOG_FULL;
+		lfs.seg[lfs.head[head]].stamp = lfs.stats.frames_written;
+		if (lfs.seg[lfs.head[head]].live == 0) {
+			lfs.seg[lfs.head[head]].state = BLOCK_LOG_FREE; // died before it filled
+			lfs.nfree++;
+		}
+		lfs.head[head] = -1;
+	}
+	if (lfs.head[head] < 0) {
+		if (lfs.nfree <= reserve) {
+			return -1;
+		}
+		for (seg = lfs.scan; lfs.seg[seg].state != BLOCK_LOG_FREE; seg = (seg + 1) % lfs.nsegs)
+			;
+		lfs.scan = (seg + 1) % lfs.nsegs;
+		lfs.seg[seg].state = BLOCK_LOG_OPEN;
+		lfs.seg[seg].live = 0;
+		lfs.head[head] = seg;
+		lfs.next[head] = 0;
+		if (__atomic_sub_fetch(&lfs.nfree, 1, __ATOMIC_RELAXED) < lfs.low) {
+			pthread_mutex_lock(&lfs.lock);
+			pthread_cond_signal(&lfs.wake);
+			pthread_mutex_unlock(&lfs.lock);
+		}
+	}
+	*frame = lfs.head[head] * lfs.segframes + lfs.next[head]++;
+	lfs.seg[lfs.head[head]].live++;
+	if (head == BLOCK_LOG_HEAD_USER) {
+		lfs.stats.frames_written++;
+	}
+	else {
+		lfs.stats.frames_copied++;
+	}
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_log_release
+// Description  : a frame is no longer live
+//
+// Inputs       : frame - the volume frame
+// Outputs      : none
+void block_log_release(BlockVolumeFrame frame)
+{
+	BlockLogSegment* s = &lfs.seg[frame / lfs.segframes];
+
+	if ((--s->live == 0) && (s->state == BLOCK_LOG_FULL)) {
+		s->state = BLOCK_LOG_FREE;
+		__atomic_add_fetch(&lfs.nfree, 1, __ATOMIC_RELAXED);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_log_victim
+// Description  : choose the full segment with the best ratio of space
+//                gained times age to the cost of reading and rewriting it,
+//                (1-u)*age/(1+u) for a segment u live
+//
+// Inputs       : first - first frame of the segment (output)
+//                count - frames in the segment (output)
+// Outputs      : 0 if a segment was chosen, -1 if none has a dead frame
+int32_t block_log_victim(BlockVolumeFrame* first, int32_t* count)
+{
+	double u, score, best = -1.0;
+	uint32_t seg, victim = 0;
+	int32_t size;
+
+	for (seg = 0; seg < lfs.nsegs; seg++) {
+		size = block_log_size(seg);
+		if ((lfs.seg[seg].state != BLOCK_LOG_FULL) || (lfs.seg[seg].live >= size)) {
+			continue;
+		}
+		u = (double)lfs.seg[seg].live / size;
+		score = (1.0 - u) * (double)(lfs.stats.frames_written - lfs.seg[seg].stamp + 1) / (1.0 + u);
+		if (score > best) {
+			best = score;
+			victim = seg;
+		}
+	}
+	if (best < 0) {
+		return -1;
+	}
+	*first = victim * lfs.segframes;
+	*count = block_log_size(victim);
+	lfs.stats.segments_cleaned++;
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_log_foreground
+// Description  : count a clean run by a write that ran out of space
+//
+// Inputs       : none
+// Outputs      : none
+void block_log_foreground(void)
+{
+	lfs.stats.foreground_cleans++;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_log_stats
+// Description  : copy the log counters
+//
+// Inputs       : stats - where to copy them
+// Outputs      : none
+void block_log_stats(BlockLogStats* stats)
+{
+	lockDriver();
+	*stats = lfs.stats;
+	stats->segments = lfs.nsegs;
+	stats->free_segments = lfs.nfree;
+	unlockDriver();
+}
@@ -0,0 +1,96 @@
+#ifndef BLOCK_LOG_INCLUDED
+#define BLOCK_LOG_INCLUDED
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : block_log.h
+//  Description    : This is the interface of the log-structured frame
+//                   allocator.  When enabled, the volume is cut into
+//                   segments and frames are handed out in order from the
+//                   open segment at a log head, so rewrites of a file become
+//                   sequential bus traffic.  A background cleaner copies
+//                   the live frames out of mostly dead segments to reclaim
+//                   them.
+//
+//  Author         : Vinayak Gupta
+//
+
+// Include files
+#include <stdint.h>
+
+// Project Includes
+#include <block_volume.h>
+
+// Defines
+#define BLOCK_LOG_SEGMENT_FRAMES 64 // Default frames per segment
+#define BLOCK_LOG_RESERVE_SEGMENTS 2 // Free segments only the cleaner may open
+#define BLOCK_LOG_CLEAN_LOW_PCT 10 // Start cleaning below this share of free segments
+#define BLOCK_LOG_CLEAN_HIGH_PCT 20 // Stop cleaning at this share of free segments
+#define BLOCK_LOG_IDLE_USEC 2000 // Foreground quiet time before cleaning
+#define BLOCK_LOG_POLL_USEC 100000 // Cleaner check interval when not woken
+
+// Log heads, the cleaner keeps the data it copies apart from new writes
+typedef enum {
+	BLOCK_LOG_HEAD_USER = 0, // frames for file writes
+	BLOCK_LOG_HEAD_CLEANER = 1, // frames for live data moved by the cleaner
+	BLOCK_LOG_HEADS = 2,
+} BlockLogHead;
+
+// Type definitions
+typedef struct {
+	uint32_t segments; // segments in the volume
+	uint32_t free_segments; // segments with no live frame
+	uint64_t frames_written; // frames handed out at the user head
+	uint64_t frames_copied; // live frames moved by the cleaner
+	uint64_t segments_cleaned; // segments reclaimed by the cleaner
+	uint64_t foreground_cleans; // segments cleaned by a write that ran out of space
+} BlockLogStats;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//
+// Interface functions
+
+int32_t block_log_configure(uint32_t segment_frames);
+// Enable log-structured writes with segments of segment_frames frames, 0 disables (default)
+
+int32_t block_log_enabled(void);
+// 1 if the driver is powered on in log-structured mode
+
+int32_t block_log_poweron(BlockVolumeFrame frames);
+// Build the segment table for a volume of frames and start the cleaner, called by block_poweron
+
+int32_t block_log_stop(void);
+// Stop the cleaner if running, called by block_poweroff before it takes the driver lock
+
+int32_t block_log_poweroff(void);
+// Release the segment table, called by block_poweroff
+
+int32_t block_log_alloc(BlockLogHead head, BlockVolumeFrame* frame);
+// Next frame at a log head, -1 if no segment can be opened for it
+
+void block_log_release(BlockVolumeFrame frame);
+// A frame is no longer live, its segment is free once all its frames are
+
+int32_t block_log_victim(BlockVolumeFrame* first, int32_t* count);
+// Pick the segment the cleaner gains most from, -1 if none is worth cleaning
+
+void block_log_foreground(void);
+// Count a clean run by the write path
+
+void block_log_stats(BlockLogStats* stats);
+// Copy the log counters
+
+struct BlockLogState* block_log_ctx_create(void);
+// Create the log of a new context, NULL if failure
+
+void block_log_ctx_destroy(struct BlockLogState* state);
+// Release the log of a context
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
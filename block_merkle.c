@@ -0,0 +1,263 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : block_merkle.c
+//  Description    : This is the implementation of the frame checksum Merkle
+//                   tree.  The tree is a heap-ordered array over a power of
+//                   two leaf capacity.  A leaf holds its frame's CS1 with bit
+//                   32 set so a written frame is never 0, and an interior
+//                   node is the first 8 bytes of the MD5 of its children,
+//                   except that two empty (0) children make an empty parent.
+//                   Every subtree value is thus independent of the
+//                   capacity, which lets trees of different sizes be
+//                   compared node for node and doubled without rehashing.
+//
+//  Author         : Vinayak Gupta
+//
+
+// Includes
+#include <stdlib.h>
+#include <string.h>
+
+// Project Includes
+#include <block_merkle.h>
+#include <cmpsc311_log.h>
+#include <cmpsc311_util.h>
+
+//
+// Implementation
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_merkle_hash
+// Description  : the value of an interior node
+//
+// Inputs       : left, right - the child values
+// Outputs      : the node value
+static uint64_t block_merkle_hash(uint64_t left, uint64_t right)
+{
+	uint64_t pair[2] = { left, right }, sig = 0;
+	uint32_t sigsz = sizeof(sig);
+
+	if ((left == 0) && (right == 0)) {
+		return 0;
+	}
+	generate_md5_signature((char*)pair, sizeof(pair), (char*)&sig, &sigsz);
+	return sig;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_merkle_node
+// Description  : the value of the subtree over leaves [lo, lo+size), size a
+//                power of two and lo a multiple of it; ranges past the
+//                capacity are empty
+//
+// Inputs       : tree - the tree
+//                lo - first leaf
+//                size - number of leaves
+// Outputs      : the subtree value
+static uint64_t block_merkle_node(BlockMerkle* tree, int32_t lo, int32_t size)
+{
+	if (lo >= tree->cap) {
+		return 0;
+	}
+	if (size <= tree->cap) {
+		return tree->nodes[tree->cap / size + lo / size];
+	}
+	return block_merkle_hash(block_merkle_node(tree, lo, size / 2), 0); // right half is past the capacity
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_merkle_span
+// Description  : the smallest power of two covering a number of leaves
+//
+// Inputs       : leaves - the number of leaves
+// Outputs      : the power of two, at least 1
+static int32_t block_merkle_span(int32_t leaves)
+{
+	int32_t size = 1;
+	while (size < leaves) {
+		size *= 2;
+	}
+	return size;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_merkle_grow
+// Description  : double the capacity until it holds a number of leaves, the
+//                old tree becomes the leftmost subtree so only the new root
+//                path is hashed
+//
+// Inputs       : tree - the tree
+//                leaves - leaves needed
+// Outputs      : 0 if successful, -1 if failure
+static int32_t block_merkle_grow(BlockMerkle* tree, int32_t leaves)
+{
+	uint64_t* nodes;
+	int32_t cap, level, k;
+
+	if (tree->cap == 0) {
+		cap = block_merkle_span(leaves < BLOCK_MERKLE_MIN_LEAVES ? BLOCK_MERKLE_MIN_LEAVES : leaves);
+		if ((tree->nodes = calloc(2 * (size_t)cap, sizeof(uint64_t))) == NULL) {
+			logMessage(LOG_ERROR_LEVEL, "Failed to allocate Merkle tree of %d leaves", cap);
+			return -1;
+		}
+		tree->cap = cap;
+		return 0;
+	}
+	while (tree->cap < leaves) {
+		cap = tree->cap * 2;
+		if ((nodes = calloc(2 * (size_t)cap, sizeof(uint64_t))) == NULL) {
+			logMessage(LOG_ERROR_LEVEL, "Failed to grow Merkle tree to %d leaves", cap);
+			return -1;
+		}
+		// Level with nodes [level, 2*level) moves to [2*level, 3*level)
+		for (level = 1; level <= tree->cap; level *= 2) {
+			for (k = level; k < 2 * level; k++) {
+				nodes[k + level] = tree->nodes[k];
+			}
+		}
+		nodes[1] = block_merkle_hash(nodes[2], nodes[3]);
+		free(tree->nodes);
+		tree->nodes = nodes;
+		tree->cap = cap;
+	}
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_merkle_update
+// Description  : set consecutive leaves and rehash the nodes above them,
+//                one pass per level over the changed range
+//
+// Inputs       : tree - the tree
+//                first - first leaf (file frame)
+//                count - number of leaves
+//                checksums - the CS1 of each frame
+// Outputs      : 0 if successful, -1 if failure
+int32_t block_merkle_update(BlockMerkle* tree, int32_t first, int32_t count, uint32_t* checksums)
+{
+	int32_t i, lo, hi;
+
+	if (count <= 0) {
+		return 0;
+	}
+	if ((tree->cap < first + count) && block_merkle_grow(tree, first + count)) {
+		return -1;
+	}
+	for (i = 0; i < count; i++) {
+		tree->nodes[tree->cap + first + i] = (1ULL << 32) | checksums[i];
+	}
+	lo = (tree->cap + first) / 2;
+	hi = (tree->cap + first + count - 1) / 2;
+	for (; lo > 0; lo /= 2, hi /= 2) {
+		for (i = lo; i <= hi; i++) {
+			tree->nodes[i] = block_merkle_hash(tree->nodes[2 * i], tree->nodes[2 * i + 1]);
+		}
+	}
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_merkle_root
+// Description  : the digest of the first leaves of a tree
+//
+// Inputs       : tree - the tree
+//                leaves - number of leaves (file frames)
+// Outputs      : the digest, 0 for an empty file
+uint64_t block_merkle_root(BlockMerkle* tree, int32_t leaves)
+{
+	if (leaves <= 0) {
+		return 0;
+	}
+	return block_merkle_node(tree, 0, block_merkle_span(leaves));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_merkle_walk
+// Description  : descend into the subtrees that differ and list the leaves
+//
+// Inputs       : a, b - the trees
+//                lo, size - the subtree
+//                limit - leaves at or past this are not listed
+//                frames - where to list them
+//                max - room in frames
+//                n - leaves found so far (in/out)
+// Outputs      : none
+static void block_merkle_walk(BlockMerkle* a, BlockMerkle* b, int32_t lo, int32_t size, int32_t limit, int32_t* frames, int32_t max, int32_t* n)
+{
+	if ((lo >= limit) || (block_merkle_node(a, lo, size) == block_merkle_node(b, lo, size))) {
+		return;
+	}
+	if (size == 1) {
+		if (*n < max) {
+			frames[*n] = lo;
+		}
+		(*n)++;
+		return;
+	}
+	block_merkle_walk(a, b, lo, size / 2, limit, frames, max, n);
+	block_merkle_walk(a, b, lo + size / 2, size / 2, limit, frames, max, n);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_merkle_diff
+// Description  : find the leaves two trees differ in, visiting only the
+//                subtrees whose values differ
+//
+// Inputs       : a, na - the first tree and its number of leaves
+//                b, nb - the second tree and its number of leaves
+//                frames - where to list the differing leaves
+//                max - room in frames
+// Outputs      : number of differing leaves
+int32_t block_merkle_diff(BlockMerkle* a, int32_t na, BlockMerkle* b, int32_t nb, int32_t* frames, int32_t max)
+{
+	int32_t limit = (na > nb) ? na : nb, n = 0;
+
+	block_merkle_walk(a, b, 0, block_merkle_span(limit), limit, frames, max, &n);
+	return n;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_merkle_copy
+// Description  : make dst an independent copy of src
+//
+// Inputs       : dst - the empty tree to fill
+//                src - the tree to copy
+// Outputs      : 0 if successful, -1 if failure
+int32_t block_merkle_copy(BlockMerkle* dst, BlockMerkle* src)
+{
+	dst->nodes = NULL;
+	dst->cap = 0;
+	if (src->cap == 0) {
+		return 0;
+	}
+	if ((dst->nodes = malloc(2 * (size_t)src->cap * sizeof(uint64_t))) == NULL) {
+		logMessage(LOG_ERROR_LEVEL, "Failed to copy Merkle tree of %d leaves", src->cap);
+		return -1;
+	}
+	memcpy(dst->nodes, src->nodes, 2 * (size_t)src->cap * sizeof(uint64_t));
+	dst->cap = src->cap;
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_merkle_free
+// Description  : release the nodes of a tree
+//
+// Inputs       : tree - the tree
+// Outputs      : none
+void block_merkle_free(BlockMerkle* tree)
+{
+	free(tree->nodes);
+	tree->nodes = NULL;
+	tree->cap = 0;
+}
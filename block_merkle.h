@@ -0,0 +1,54 @@
+#ifndef BLOCK_MERKLE_INCLUDED
+#define BLOCK_MERKLE_INCLUDED
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : block_merkle.h
+//  Description    : This is the interface of the frame checksum Merkle tree.
+//                   Each file keeps a binary hash tree whose leaves are the
+//                   CS1 checksums of its frames, so a file's digest and the
+//                   frames two files differ in can be found without reading
+//                   the frames back.
+//
+//  Author         : Vinayak Gupta
+//
+
+// Include files
+#include <stdint.h>
+
+// Defines
+#define BLOCK_MERKLE_MIN_LEAVES 16 // Leaf capacity of a new tree
+
+// Type definitions
+typedef struct {
+	uint64_t* nodes; // node k has children 2k and 2k+1, leaf i is node cap+i
+	int32_t cap; // leaf capacity, a power of two, 0 for an empty tree
+} BlockMerkle;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//
+// Interface functions
+
+int32_t block_merkle_update(BlockMerkle* tree, int32_t first, int32_t count, uint32_t* checksums);
+// Set count consecutive leaves from first to the given frame checksums, growing the tree as needed
+
+uint64_t block_merkle_root(BlockMerkle* tree, int32_t leaves);
+// Digest of the first leaves leaves, 0 for none
+
+int32_t block_merkle_diff(BlockMerkle* a, int32_t na, BlockMerkle* b, int32_t nb, int32_t* frames, int32_t max);
+// Leaves that differ between two trees, lists up to max of them and returns the count
+
+int32_t block_merkle_copy(BlockMerkle* dst, BlockMerkle* src);
+// Make dst an independent copy of src
+
+void block_merkle_free(BlockMerkle* tree);
+// Release the nodes of a tree, leaving it empty
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,425 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : block_mmap.c
+//  Description    : This is the implementation of memory-mapped views of
+//                   BLOCK files.  A view starts out as PROT_NONE anonymous
+//                   memory.  The first touch of a page faults into the
+//                   SIGSEGV handler, which reads the frames backing the page
+//                   straight into the view and makes it read-only.  The first
+//                   write to a read-only page faults again, marks its frames
+//                   dirty and makes it writable.  block_msync writes only the
+//                   dirty frames back and re-arms them as read-only.
+//
+//                   Faults are resolved at the granularity of a "unit", the
+//                   larger of the frame size and the system page size.
+//                   Writes through the view are not seen by block_read until
+//                   block_msync.  block_close of a file and block_poweroff
+//                   fail while it has live views, so a view never writes
+//                   into a file that took over its handle.  Faults and the
+//                   calls below take the driver lock like any other block_*
+//                   call.
+//
+//                   Faults are serviced inside the SIGSEGV handler, which
+//                   takes the driver lock, reads frames and may allocate and
+//                   log; none of that is async-signal-safe.  A view may
+//                   therefore only be touched by plain code of the program:
+//                   not from a signal handler, and not by a library call
+//                   that holds the heap, stdio or log locks while it reads
+//                   the buffer it was given (fwrite, logMessage, ...).  The
+//                   driver itself is safe, its lock is recursive, so views
+//                   may be passed to the block_* calls.  Touch a view first,
+//                   or copy out of it, before handing it to other libraries.
+//
+//  Author         : Vinayak Gupta
+//
+
+// Includes
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// Project Includes
+#include <block_ctx.h>
+#include <block_driver.h>
+#include <block_geometry.h>
+#include <block_mmap.h>
+#include <block_trace.h>
+#include <block_volume.h>
+#include <cmpsc311_log.h>
+
+// Frame states within a view
+#define BLOCK_MMAP_ABSENT 0 // not yet read, page is PROT_NONE
+#define BLOCK_MMAP_CLEAN 1 // read from the file, page is PROT_READ
+#define BLOCK_MMAP_DIRTY 2 // written through the view, page is PROT_READ|PROT_WRITE
+
+// Type definitions
+typedef struct {
+	char* addr; // start of the view
+	size_t length; // length of the view, a multiple of the unit size
+	int16_t fd; // file backing the view
+	int32_t nframes; // file frames covered by the view
+	uint8_t* state; // per frame state, one of BLOCK_MMAP_*
+	int inuse; // 1 if this slot holds a live view
+	BlockContext* ctx; // context of the file, faults and syncs run in it
+} BlockMapping;
+
+// The live views of every context and the fault handler state
+static BlockMapping mappings[BLOCK_MMAP_MAX_MAPPINGS];
+static pthread_mutex_t maplock = PTHREAD_MUTEX_INITIALIZER; // claims and releases of view slots
+static size_t mmapunit; // fault unit in bytes
+static int handler_installed;
+static struct sigaction prev_segv; // handler to chain to for unrelated faults
+
+//
+// Implementation
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_mmap_find
+// Description  : find the view containing an address
+//
+// Inputs       : addr - the address
+// Outputs      : the view, NULL if the address is not in any view
+static BlockMapping* block_mmap_find(char* addr)
+{
+	int i;
+	for (i = 0; i < BLOCK_MMAP_MAX_MAPPINGS; i++) {
+		if ((mappings[i].inuse) && (addr >= mappings[i].addr) && (addr < mappings[i].addr + mappings[i].length)) {
+			return &mappings[i];
+		}
+	}
+	return NULL;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_mmap_views
+// Description  : count the live views of the calling thread's context,
+//                driver lock held
+//
+// Inputs       : fd - the file handle, -1 for the views of every file
+// Outputs      : number of live views
+int block_mmap_views(int16_t fd)
+{
+	int i, n = 0;
+
+	pthread_mutex_lock(&maplock);
+	for (i = 0; i < BLOCK_MMAP_MAX_MAPPINGS; i++) {
+		if (mappings[i].inuse && (mappings[i].ctx == block_ctx_bound) && ((fd == -1) || (mappings[i].fd == fd))) {
+			n++;
+		}
+	}
+	pthread_mutex_unlock(&maplock);
+	return n;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_mmap_fill
+// Description  : resolve a fault on one unit of a view, driver lock held
+//
+// Inputs       : map - the view
+//                addr - the faulting address
+// Outputs      : 0 if resolved, -1 if failure
+static int block_mmap_fill(BlockMapping* map, char* addr)
+{
+	size_t unit = (size_t)(addr - map->addr) / mmapunit;
+	char* base = map->addr + unit * mmapunit;
+	int32_t first = (int32_t)(unit * (mmapunit / BLOCK_FRAME_SIZE));
+	int32_t count = (int32_t)(mmapunit / BLOCK_FRAME_SIZE);
+	int32_t i;
+
+	if (first + count > map->nframes) {
+		count = map->nframes - first; // tail of the view past the file stays zero
+	}
+
+	// Absent: fill the unit from the file and expose it read-only
+	if (map->state[first] == BLOCK_MMAP_ABSENT) {
+		if (mprotect(base, mmapunit, PROT_READ | PROT_WRITE)) {
+			return -1;
+		}
+		if ((count > 0) && (readFileFrames(map->fd, first, count, base) < 0)) {
+			mprotect(base, mmapunit, PROT_NONE);
+			return -1;
+		}
+		for (i = 0; i < count; i++) {
+			map->state[first + i] = BLOCK_MMAP_CLEAN;
+		}
+		return (mprotect(base, mmapunit, PROT_READ));
+	}
+
+	// Clean: this is the first write, track the frames as dirty
+	for (i = 0; i < count; i++) {
+		map->state[first + i] = BLOCK_MMAP_DIRTY;
+	}
+	return (mprotect(base, mmapunit, PROT_READ | PROT_WRITE));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_mmap_fault
+// Description  : resolve a fault on one unit of a view
+//
+// Inputs       : map - the view
+//                addr - the faulting address
+// Outputs      : 0 if resolved, -1 if failure
+static int block_mmap_fault(BlockMapping* map, char* addr)
+{
+	BlockContext* prev = block_ctx_enter(map->ctx);
+	int ret;
+	lockDriver();
+	ret = block_mmap_fill(map, addr);
+	unlockDriver();
+	block_ctx_leave(prev);
+	return ret;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_mmap_handler
+// Description  : SIGSEGV handler, faults outside every view are passed on to
+//                the previously installed handler
+//
+// Inputs       : sig - the signal
+//                info - the fault information
+//                ctx - the interrupted context
+// Outputs      : none
+static void block_mmap_handler(int sig, siginfo_t* info, void* ctx)
+{
+	BlockMapping* map = block_mmap_find((char*)info->si_addr);
+
+	if ((map != NULL) && (block_mmap_fault(map, (char*)info->si_addr) == 0)) {
+		return; // the faulting access is restarted
+	}
+	if (prev_segv.sa_flags & SA_SIGINFO) {
+		prev_segv.sa_sigaction(sig, info, ctx);
+	} else if ((prev_segv.sa_handler != SIG_DFL) && (prev_segv.sa_handler != SIG_IGN)) {
+		prev_segv.sa_handler(sig);
+	} else {
+		signal(SIGSEGV, SIG_DFL); // re-raised by the restarted access
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_mmap_map
+// Description  : map the first "length" bytes of file "fd"
+//
+// Inputs       : fd - the file handle
+//                length - bytes to map, 0 maps the whole file
+// Outputs      : start of the view if successful, NULL if failure
+static char* block_mmap_map(int16_t fd, uint32_t length)
+{
+	struct sigaction act;
+	BlockMapping* map = NULL;
+	int32_t filesize;
+	size_t units;
+	int i;
+
+	if (checkFileHandle(fd)) {
+		return NULL;
+	}
+	filesize = getFileSize(fd);
+	if (length == 0) {
+		length = filesize;
+	}
+	if ((length == 0) || (length > filesize)) {
+		logMessage(LOG_ERROR_LEVEL, "Cannot map %u bytes of file %d of size %d", length, fd, filesize);
+		return NULL;
+	}
+	if (unpackFile(fd)) {
+		return NULL; // the view works on whole frames of the file
+	}
+	pthread_mutex_lock(&maplock);
+	for (i = 0; (i < BLOCK_MMAP_MAX_MAPPINGS) && (map == NULL); i++) {
+		if (!mappings[i].inuse && (mappings[i].ctx == NULL)) {
+			map = &mappings[i];
+			map->ctx = block_ctx_bound; // claimed, live once inuse is set
+		}
+	}
+	if (map == NULL) {
+		pthread_mutex_unlock(&maplock);
+		logMessage(LOG_ERROR_LEVEL, "Too many live block mappings [%d]", BLOCK_MMAP_MAX_MAPPINGS);
+		return NULL;
+	}
+
+	// Install the fault handler on first use
+	if (!handler_installed) {
+		mmapunit = sysconf(_SC_PAGESIZE);
+		if (mmapunit < BLOCK_FRAME_SIZE) {
+			mmapunit = BLOCK_FRAME_SIZE;
+		}
+		memset(&act, 0x0, sizeof(act));
+		act.sa_sigaction = block_mmap_handler;
+		act.sa_flags = SA_SIGINFO | SA_NODEFER;
+		sigemptyset(&act.sa_mask);
+		if (sigaction(SIGSEGV, &act, &prev_segv)) {
+			map->ctx = NULL;
+			pthread_mutex_unlock(&maplock);
+			logMessage(LOG_ERROR_LEVEL, "Failed to install block mapping fault handler");
+			return NULL;
+		}
+		handler_installed = 1;
+	}
+	pthread_mutex_unlock(&maplock);
+
+	// Reserve the view, nothing is read until it is touched
+	units = (length + mmapunit - 1) / mmapunit;
+	map->length = units * mmapunit;
+	map->nframes = (length + BLOCK_FRAME_SIZE - 1) / BLOCK_FRAME_SIZE;
+	map->fd = fd;
+	if ((map->state = calloc(units * (mmapunit / BLOCK_FRAME_SIZE), sizeof(uint8_t))) == NULL) {
+		logMessage(LOG_ERROR_LEVEL, "Failed to allocate block mapping state");
+		map->ctx = NULL;
+		return NULL;
+	}
+	map->addr = mmap(NULL, map->length, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (map->addr == MAP_FAILED) {
+		logMessage(LOG_ERROR_LEVEL, "Failed to reserve %zu bytes for block mapping", map->length);
+		free(map->state);
+		map->ctx = NULL;
+		return NULL;
+	}
+	map->inuse = 1;
+	logMessage(LOG_INFO_LEVEL, "Mapped %u bytes of file %d at %p", length, fd, map->addr);
+	return (map->addr);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_mmap
+// Description  : map the first "length" bytes of file "fd"
+//
+// Inputs       : fd - the file handle
+//                length - bytes to map, 0 maps the whole file
+// Outputs      : start of the view if successful, NULL if failure
+char* block_mmap(int16_t fd, uint32_t length)
+{
+	char* addr;
+	uint64_t span = block_trace_begin();
+	lockDriver();
+	addr = block_mmap_map(fd, length);
+	unlockDriver();
+	block_trace_end("block_mmap", span);
+	return addr;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_mmap_sync
+// Description  : write the dirty frames of a view back to its file, runs of
+//                adjacent dirty frames are written as one batch
+//
+// Inputs       : addr - start of the view
+// Outputs      : number of frames written if successful, -1 if failure
+static int32_t block_mmap_sync(char* addr)
+{
+	BlockMapping* map = block_mmap_find(addr);
+	int32_t first, count, written = 0;
+	size_t unit;
+
+	if ((map == NULL) || (map->addr != addr)) {
+		logMessage(LOG_ERROR_LEVEL, "block_msync on unknown mapping %p", addr);
+		return -1;
+	}
+	if (checkFileHandle(map->fd)) {
+		return -1;
+	}
+
+	first = 0;
+	while (first < map->nframes) {
+		if (map->state[first] != BLOCK_MMAP_DIRTY) {
+			first++;
+			continue;
+		}
+		for (count = 1; (first + count < map->nframes) && (count < BLOCK_VOLUME_BATCH_FRAMES) &&
+			 (map->state[first + count] == BLOCK_MMAP_DIRTY); count++)
+			;
+
+		// Re-arm the pages first so writes during the flush fault again
+		for (unit = first / (mmapunit / BLOCK_FRAME_SIZE); unit <= (first + count - 1) / (mmapunit / BLOCK_FRAME_SIZE); unit++) {
+			mprotect(map->addr + unit * mmapunit, mmapunit, PROT_READ);
+		}
+		memset(&map->state[first], BLOCK_MMAP_CLEAN, count);
+		if (writeFileFrames(map->fd, first, count, map->addr + (size_t)first * BLOCK_FRAME_SIZE) < 0) {
+			memset(&map->state[first], BLOCK_MMAP_DIRTY, count);
+			logMessage(LOG_ERROR_LEVEL, "block_msync failed writing frames %d-%d of file %d", first, first + count - 1, map->fd);
+			return -1;
+		}
+		written += count;
+		first += count;
+	}
+	logMessage(LOG_INFO_LEVEL, "block_msync wrote %d dirty frames of file %d", written, map->fd);
+	return written;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_msync
+// Description  : write the dirty frames of a view back to its file
+//
+// Inputs       : addr - start of the view
+// Outputs      : number of frames written if successful, -1 if failure
+int32_t block_msync(char* addr)
+{
+	BlockMapping* map = block_mmap_find(addr);
+	BlockContext* prev = block_ctx_enter((map != NULL) ? map->ctx : block_ctx_bound);
+	int32_t ret;
+	uint64_t span = block_trace_begin();
+	lockDriver();
+	ret = block_mmap_sync(addr);
+	unlockDriver();
+	block_ctx_leave(prev);
+	block_trace_end("block_msync", span);
+	return ret;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_mmap_unmap
+// Description  : sync and release a view
+//
+// Inputs       : addr - start of the view
+// Outputs      : 0 if successful, -1 if failure
+static int32_t block_mmap_unmap(char* addr)
+{
+	BlockMapping* map = block_mmap_find(addr);
+
+	if ((map == NULL) || (map->addr != addr)) {
+		logMessage(LOG_ERROR_LEVEL, "block_munmap on unknown mapping %p", addr);
+		return -1;
+	}
+	if (block_mmap_sync(addr) < 0) {
+		return -1;
+	}
+	munmap(map->addr, map->length);
+	free(map->state);
+	pthread_mutex_lock(&maplock);
+	memset(map, 0x0, sizeof(BlockMapping));
+	pthread_mutex_unlock(&maplock);
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_munmap
+// Description  : sync and release a view
+//
+// Inputs       : addr - start of the view
+// Outputs      : 0 if successful, -1 if failure
+int32_t block_munmap(char* addr)
+{
+	BlockMapping* map = block_mmap_find(addr);
+	BlockContext* prev = block_ctx_enter((map != NULL) ? map->ctx : block_ctx_bound);
+	int32_t ret;
+	uint64_t span = block_trace_begin();
+	lockDriver();
+	ret = block_mmap_unmap(addr);
+	unlockDriver();
+	block_ctx_leave(prev);
+	block_trace_end("block_munmap", span);
+	return ret;
+}
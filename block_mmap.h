@@ -0,0 +1,49 @@
+#ifndef BLOCK_MMAP_INCLUDED
+#define BLOCK_MMAP_INCLUDED
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : block_mmap.h
+//  Description    : This is the interface for memory-mapped views of BLOCK
+//                   files.  A view is a contiguous virtual range whose pages
+//                   are filled from the file's frames on first touch; frames
+//                   written through the view are tracked as dirty and only
+//                   those are written back by block_msync.  A file cannot be
+//                   closed, nor the driver powered off, while it has views.
+//                   Faults are serviced in a SIGSEGV handler that is not
+//                   async-signal-safe, see block_mmap.c for where a view may
+//                   be touched.
+//
+//  Author         : Vinayak Gupta
+//
+
+// Include files
+#include <stdint.h>
+
+// Defines
+#define BLOCK_MMAP_MAX_MAPPINGS 16 // Maximum number of live views
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//
+// Interface functions
+
+char* block_mmap(int16_t fd, uint32_t length);
+// Map the first length bytes of fd (0 maps the whole file), NULL on failure
+
+int32_t block_msync(char* addr);
+// Write the dirty frames of the view starting at addr back to the file
+
+int32_t block_munmap(char* addr);
+// Sync and release the view starting at addr
+
+int block_mmap_views(int16_t fd);
+// Live views of fd (-1 for any file) in the calling thread's context, driver lock held
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
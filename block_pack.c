@@ -0,0 +1,294 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : block_pack.c
+//  Description    : This is the implementation of the small-file packer.
+//                   Each pack frame is cut into BLOCK_PACK_SLOTS slots and a
+//                   bitmap records which are claimed; a packed file holds a
+//                   contiguous run of slots just large enough for its size.
+//                   New runs go first-fit into the packs, starting from the
+//                   pack that last had room, and a pack whose last slot is
+//                   given back is dropped so the driver can free its frame.
+//
+//                   The pack table is protected by the driver lock.
+//
+//  Author         : Vinayak Gupta
+//
+
+// Includes
+#include <stdlib.h>
+
+// Project Includes
+#include <block_ctx.h>
+#include <block_pack.h>
+#include <cmpsc311_log.h>
+
+// Type definitions
+typedef struct {
+	BlockVolumeFrame frame; // volume frame holding the pack
+	uint32_t used; // claimed slots, bit i for slot i, 0 if the entry is free
+} BlockPackFrame;
+
+// The packer of a context
+struct BlockPackState {
+	uint32_t threshold; // configured largest packed file, 0 if disabled
+	uint32_t active; // threshold latched at power on
+	int powered; // 1 between block_pack_poweron and block_pack_poweroff
+	BlockPackFrame* packs; // pack table
+	int32_t npacks; // entries in use or free in the table
+	int32_t maxpacks; // allocated length of the table
+	int32_t* spare; // stack of free entries
+	int32_t nspare; // entries on the spare stack
+	int32_t hint; // pack that last had room
+};
+#define packer (*block_ctx_bound->pack) // the packer of the calling thread's context
+
+//
+// Implementation
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_pack_ctx_create / block_pack_ctx_destroy
+// Description  : create and release the packer of a context
+//
+// Inputs       : state - the packer to release, may be NULL
+// Outputs      : block_pack_ctx_create returns the packer, NULL if failure
+struct BlockPackState* block_pack_ctx_create(void)
+{
+	return calloc(1, sizeof(struct BlockPackState));
+}
+
+void block_pack_ctx_destroy(struct BlockPackState* state)
+{
+	free(state);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_pack_mask
+// Description  : bitmap of a run of slots
+//
+// Inputs       : slot - first slot of the run
+//                slots - length of the run, at most BLOCK_PACK_SLOTS
+// Outputs      : the bitmap
+static uint32_t block_pack_mask(int32_t slot, int32_t slots)
+{
+	return (((1u << slots) - 1) << slot);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_pack_fit
+// Description  : find a run of free slots in a pack
+//
+// Inputs       : used - the claimed slots of the pack
+//                slots - length of the run
+// Outputs      : the first slot of the run, -1 if the pack has no such run
+static int32_t block_pack_fit(uint32_t used, int32_t slots)
+{
+	int32_t s;
+
+	for (s = 0; s + slots <= BLOCK_PACK_SLOTS; s++) {
+		if ((used & block_pack_mask(s, slots)) == 0) {
+			return s;
+		}
+	}
+	return -1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_pack_configure
+// Description  : set the size at or below which new files are packed
+//
+// Inputs       : threshold - largest packed file in bytes, 0 disables
+// Outputs      : 0 if successful, -1 if failure
+int32_t block_pack_configure(uint32_t threshold)
+{
+	if (packer.powered) {
+		logMessage(LOG_ERROR_LEVEL, "Cannot change the pack threshold while powered on");
+		return -1;
+	}
+	if (threshold > BLOCK_PACK_MAX_THRESHOLD) {
+		logMessage(LOG_ERROR_LEVEL, "Pack threshold %u above the %u byte limit", threshold, BLOCK_PACK_MAX_THRESHOLD);
+		return -1;
+	}
+	packer.threshold = threshold;
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_pack_threshold
+// Description  : largest file kept packed
+//
+// Inputs       : none
+// Outputs      : bytes, 0 if packing is off or the driver is powered off
+uint32_t block_pack_threshold(void)
+{
+	return (packer.powered ? packer.active : 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_pack_poweron
+// Description  : latch the threshold and start with an empty pack table
+//
+// Inputs       : none
+// Outputs      : none
+void block_pack_poweron(void)
+{
+	packer.active = packer.threshold;
+	packer.npacks = packer.nspare = packer.hint = 0;
+	packer.powered = 1;
+	if (packer.active) {
+		logMessage(LOG_INFO_LEVEL, "Packing files of up to %u bytes in %d slots of %d bytes",
+			packer.active, BLOCK_PACK_SLOTS, BLOCK_PACK_SLOT_BYTES);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_pack_poweroff
+// Description  : report and release the pack table
+//
+// Inputs       : none
+// Outputs      : none
+void block_pack_poweroff(void)
+{
+	int32_t i, live = 0, slots = 0;
+
+	for (i = 0; i < packer.npacks; i++) {
+		if (packer.packs[i].used) {
+			live++;
+			slots += __builtin_popcount(packer.packs[i].used);
+		}
+	}
+	if (packer.active) {
+		logMessage(LOG_INFO_LEVEL, "Packer held %d slots in %d frames", slots, live);
+	}
+	free(packer.packs);
+	free(packer.spare);
+	packer.packs = NULL;
+	packer.spare = NULL;
+	packer.npacks = packer.maxpacks = packer.nspare = 0;
+	packer.powered = 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_pack_alloc
+// Description  : claim a run of slots in an existing pack frame, first fit
+//                from the pack that last had room
+//
+// Inputs       : slots - length of the run
+//                pack - the pack (output)
+// Outputs      : the first slot of the run, -1 if no pack has room
+int32_t block_pack_alloc(int32_t slots, int32_t* pack)
+{
+	int32_t i, p, s;
+
+	for (i = 0; i < packer.npacks; i++) {
+		p = (packer.hint + i) % packer.npacks;
+		if ((packer.packs[p].used == 0) || ((s = block_pack_fit(packer.packs[p].used, slots)) < 0)) {
+			continue;
+		}
+		packer.packs[p].used |= block_pack_mask(s, slots);
+		packer.hint = p;
+		*pack = p;
+		return s;
+	}
+	return -1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_pack_add
+// Description  : turn a frame into a new pack frame and claim its first
+//                slots, free table entries are reused first
+//
+// Inputs       : frame - the volume frame
+//                slots - length of the run
+//                pack - the pack (output)
+// Outputs      : the first slot of the run, -1 if failure
+int32_t block_pack_add(BlockVolumeFrame frame, int32_t slots, int32_t* pack)
+{
+	BlockPackFrame* packs;
+	int32_t* spare;
+	int32_t max;
+
+	if (packer.nspare > 0) {
+		*pack = packer.spare[--packer.nspare];
+	} else {
+		if (packer.npacks == packer.maxpacks) {
+			max = packer.maxpacks ? packer.maxpacks * 2 : 64;
+			if ((packs = realloc(packer.packs, max * sizeof(BlockPackFrame))) == NULL) {
+				logMessage(LOG_ERROR_LEVEL, "Failed to grow pack table to %d frames", max);
+				return -1;
+			}
+			packer.packs = packs;
+			if ((spare = realloc(packer.spare, max * sizeof(int32_t))) == NULL) {
+				logMessage(LOG_ERROR_LEVEL, "Failed to grow pack table to %d frames", max);
+				return -1;
+			}
+			packer.spare = spare;
+			packer.maxpacks = max;
+		}
+		*pack = packer.npacks++;
+	}
+	packer.packs[*pack].frame = frame;
+	packer.packs[*pack].used = block_pack_mask(0, slots);
+	packer.hint = *pack;
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_pack_release
+// Description  : give a run of slots back to its pack
+//
+// Inputs       : pack - the pack
+//                slot - first slot of the run
+//                slots - length of the run
+// Outputs      : 1 if the pack is now empty and was dropped, 0 otherwise
+int32_t block_pack_release(int32_t pack, int32_t slot, int32_t slots)
+{
+	packer.packs[pack].used &= ~block_pack_mask(slot, slots);
+	if (packer.packs[pack].used) {
+		return 0;
+	}
+	packer.spare[packer.nspare++] = pack;
+	return 1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_pack_frame
+// Description  : volume frame holding a pack
+//
+// Inputs       : pack - the pack
+// Outputs      : the volume frame
+BlockVolumeFrame block_pack_frame(int32_t pack)
+{
+	return packer.packs[pack].frame;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_pack_remap
+// Description  : follow a pack frame the driver moved on the volume
+//
+// Inputs       : from - the old volume frame
+//                to - the new volume frame
+// Outputs      : 0 if from held a pack, -1 if not
+int32_t block_pack_remap(BlockVolumeFrame from, BlockVolumeFrame to)
+{
+	int32_t p;
+
+	for (p = 0; p < packer.npacks; p++) {
+		if (packer.packs[p].used && (packer.packs[p].frame == from)) {
+			packer.packs[p].frame = to;
+			return 0;
+		}
+	}
+	return -1;
+}
@@ -0,0 +1,72 @@
+#ifndef BLOCK_PACK_INCLUDED
+#define BLOCK_PACK_INCLUDED
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : block_pack.h
+//  Description    : This is the interface of the small-file packer.  When
+//                   enabled, a new file owns no frame of its own; while it
+//                   stays at or below the pack threshold its bytes live in
+//                   a run of slots of a pack frame shared with other small
+//                   files.  A file that grows past the threshold is
+//                   promoted to dedicated frames by the driver.
+//
+//  Author         : Vinayak Gupta
+//
+
+// Include files
+#include <stdint.h>
+
+// Project Includes
+#include <block_volume.h>
+
+// Defines
+#define BLOCK_PACK_SLOTS 16 // Slots per pack frame
+#define BLOCK_PACK_SLOT_BYTES (BLOCK_FRAME_SIZE / BLOCK_PACK_SLOTS) // Bytes per slot
+#define BLOCK_PACK_MAX_THRESHOLD (BLOCK_FRAME_SIZE / 2) // Largest file worth packing
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//
+// Interface functions
+
+int32_t block_pack_configure(uint32_t threshold);
+// Pack files of at most threshold bytes, 0 disables (default), must precede block_poweron
+
+uint32_t block_pack_threshold(void);
+// Largest file kept packed in the powered on driver, 0 if packing is off
+
+void block_pack_poweron(void);
+// Start with no pack frames, called by block_poweron
+
+void block_pack_poweroff(void);
+// Release the pack table, called by block_poweroff
+
+int32_t block_pack_alloc(int32_t slots, int32_t* pack);
+// Claim a run of slots in a pack frame with room, returns the first slot, -1 if none has room
+
+int32_t block_pack_add(BlockVolumeFrame frame, int32_t slots, int32_t* pack);
+// Make frame a new pack frame and claim its first slots, returns the first slot, -1 if failure
+
+int32_t block_pack_release(int32_t pack, int32_t slot, int32_t slots);
+// Give slots back, returns 1 if the pack frame is now empty and was dropped
+
+BlockVolumeFrame block_pack_frame(int32_t pack);
+// Volume frame holding a pack
+
+int32_t block_pack_remap(BlockVolumeFrame from, BlockVolumeFrame to);
+// A pack frame moved on the volume, -1 if from is not a pack frame
+
+struct BlockPackState* block_pack_ctx_create(void);
+// Create the packer of a new context, NULL if failure
+
+void block_pack_ctx_destroy(struct BlockPackState* state);
+// Release the packer of a context
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,283 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : block_qos.c
+//  Description    : This is the implementation of the per-file I/O classes.
+//                   Each class has a byte bucket and a request bucket,
+//                   refilled at the configured rates and BLOCK_QOS_BURST_MSEC
+//                   deep.  A piece is admitted once both buckets are out of
+//                   debt and takes its cost from them, so one large piece
+//                   may overdraw a bucket and the class then waits for the
+//                   debt to refill.  The normal and bulk classes also hold
+//                   back while any latency request is in flight and not
+//                   itself throttled, so a latency request waits for at
+//                   most the one piece that already has the driver lock.
+//
+//  Author         : Vinayak Gupta
+//
+
+// Includes
+#include <pthread.h>
+#include <time.h>
+
+// Project Includes
+#include <block_qos.h>
+#include <cmpsc311_log.h>
+
+// Type definitions
+typedef struct {
+	uint32_t rate; // bytes per second, 0 if unlimited
+	uint32_t iops; // requests per second, 0 if unlimited
+	double bytes; // byte tokens, negative while in debt
+	double ops; // request tokens, negative while in debt
+	uint64_t last; // usec of the last refill
+	int32_t inflight; // requests between block_qos_begin and block_qos_end
+	int32_t throttled; // of those, waiting for tokens
+	BlockQosStats stats;
+} BlockQosBucket;
+
+// The classes, one set per process
+static struct {
+	BlockQosBucket cls[BLOCK_QOS_CLASSES];
+	pthread_mutex_t lock; // protects everything above
+	pthread_cond_t wake; // signalled when a latency request ends or is throttled
+} qos = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.wake = PTHREAD_COND_INITIALIZER,
+};
+
+//
+// Implementation
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_qos_usec
+// Description  : monotonic clock in microseconds
+//
+// Inputs       : none
+// Outputs      : microseconds
+static uint64_t block_qos_usec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_qos_refill
+// Description  : add the tokens earned since the last refill, up to the
+//                bucket depth
+//
+// Inputs       : b - the class
+//                now - the time in usec
+// Outputs      : none
+static void block_qos_refill(BlockQosBucket* b, uint64_t now)
+{
+	double elapsed = (now - b->last) / 1e6;
+
+	b->last = now;
+	if (b->rate) {
+		b->bytes += elapsed * b->rate;
+		if (b->bytes > b->rate * (BLOCK_QOS_BURST_MSEC / 1000.0)) {
+			b->bytes = b->rate * (BLOCK_QOS_BURST_MSEC / 1000.0);
+		}
+	}
+	if (b->iops) {
+		b->ops += elapsed * b->iops;
+		if (b->ops > b->iops * (BLOCK_QOS_BURST_MSEC / 1000.0) + 1) {
+			b->ops = b->iops * (BLOCK_QOS_BURST_MSEC / 1000.0) + 1;
+		}
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_qos_wait
+// Description  : wait on the class condition, at most usec
+//
+// Inputs       : usec - longest wait, 0 to wait until signalled
+// Outputs      : none
+static void block_qos_wait(uint64_t usec)
+{
+	struct timespec until;
+
+	if (usec == 0) {
+		pthread_cond_wait(&qos.wake, &qos.lock);
+		return;
+	}
+	clock_gettime(CLOCK_REALTIME, &until);
+	until.tv_sec += usec / 1000000;
+	until.tv_nsec += (usec % 1000000) * 1000;
+	if (until.tv_nsec >= 1000000000) {
+		until.tv_sec++;
+		until.tv_nsec -= 1000000000;
+	}
+	pthread_cond_timedwait(&qos.wake, &qos.lock, &until);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_qos_configure
+// Description  : set the budgets of a class, its buckets start full
+//
+// Inputs       : cls - the class
+//                bytes_per_sec - bandwidth, 0 for no limit
+//                iops - requests per second, 0 for no limit
+// Outputs      : 0 if successful, -1 if failure
+int32_t block_qos_configure(BlockQosClass cls, uint32_t bytes_per_sec, uint32_t iops)
+{
+	BlockQosBucket* b;
+
+	if ((cls < 0) || (cls >= BLOCK_QOS_CLASSES)) {
+		logMessage(LOG_ERROR_LEVEL, "Unknown I/O class %d", cls);
+		return -1;
+	}
+	pthread_mutex_lock(&qos.lock);
+	b = &qos.cls[cls];
+	b->rate = bytes_per_sec;
+	b->iops = iops;
+	b->bytes = b->rate * (BLOCK_QOS_BURST_MSEC / 1000.0);
+	b->ops = b->iops * (BLOCK_QOS_BURST_MSEC / 1000.0) + 1;
+	b->last = block_qos_usec();
+	pthread_mutex_unlock(&qos.lock);
+	logMessage(LOG_INFO_LEVEL, "I/O class %d limited to %u bytes/sec and %u requests/sec", cls, bytes_per_sec, iops);
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_qos_begin
+// Description  : a request of the class starts
+//
+// Inputs       : cls - the class
+// Outputs      : the start time in usec
+uint64_t block_qos_begin(BlockQosClass cls)
+{
+	pthread_mutex_lock(&qos.lock);
+	qos.cls[cls].inflight++;
+	pthread_mutex_unlock(&qos.lock);
+	return block_qos_usec();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_qos_admit
+// Description  : wait until the class may run its next piece, then charge
+//                the piece to its buckets
+//
+// Inputs       : cls - the class
+//                bytes - size of the piece
+//                first - 1 for the first piece of a request
+// Outputs      : none
+void block_qos_admit(BlockQosClass cls, uint32_t bytes, int first)
+{
+	BlockQosBucket* b = &qos.cls[cls];
+	uint64_t now, start = 0, usec;
+
+	pthread_mutex_lock(&qos.lock);
+	for (;;) {
+		now = block_qos_usec();
+		if ((cls != BLOCK_QOS_LATENCY) && (qos.cls[BLOCK_QOS_LATENCY].inflight > qos.cls[BLOCK_QOS_LATENCY].throttled)) {
+			start = start ? start : now;
+			block_qos_wait(0);
+			continue;
+		}
+		block_qos_refill(b, now);
+		usec = 0;
+		if (b->rate && (b->bytes < 0)) {
+			usec = (uint64_t)(-b->bytes * 1e6 / b->rate) + 1;
+		}
+		if (first && b->iops && (b->ops < 1)) {
+			if ((uint64_t)((1 - b->ops) * 1e6 / b->iops) + 1 > usec) {
+				usec = (uint64_t)((1 - b->ops) * 1e6 / b->iops) + 1;
+			}
+		}
+		if (usec == 0) {
+			break;
+		}
+		start = start ? start : now;
+		if (b->throttled++ == 0) {
+			pthread_cond_broadcast(&qos.wake); // the classes held back by us may run
+		}
+		block_qos_wait(usec);
+		b->throttled--;
+	}
+	if (b->rate) {
+		b->bytes -= bytes;
+	}
+	if (first && b->iops) {
+		b->ops -= 1;
+	}
+	b->stats.bytes += bytes;
+	if (start) {
+		b->stats.throttled_usec += now - start;
+	}
+	pthread_mutex_unlock(&qos.lock);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_qos_end
+// Description  : a request of the class is done, the classes held back by
+//                a latency request are let go when the last one ends
+//
+// Inputs       : cls - the class
+//                start - what block_qos_begin returned
+// Outputs      : none
+void block_qos_end(BlockQosClass cls, uint64_t start)
+{
+	uint64_t usec = block_qos_usec() - start;
+	int bucket = 0;
+
+	while ((bucket < BLOCK_QOS_HIST_BUCKETS - 1) && (usec >= (2ULL << bucket))) {
+		bucket++;
+	}
+	pthread_mutex_lock(&qos.lock);
+	qos.cls[cls].stats.requests++;
+	qos.cls[cls].stats.hist[bucket]++;
+	if ((--qos.cls[cls].inflight == 0) && (cls == BLOCK_QOS_LATENCY)) {
+		pthread_cond_broadcast(&qos.wake);
+	}
+	pthread_mutex_unlock(&qos.lock);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_qos_stats
+// Description  : copy the counters of a class
+//
+// Inputs       : cls - the class
+//                stats - where to copy them
+// Outputs      : none
+void block_qos_stats(BlockQosClass cls, BlockQosStats* stats)
+{
+	pthread_mutex_lock(&qos.lock);
+	*stats = qos.cls[cls].stats;
+	pthread_mutex_unlock(&qos.lock);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_qos_percentile
+// Description  : latency under which pct percent of the requests completed
+//
+// Inputs       : stats - the class counters
+//                pct - the percentile, 1 to 100
+// Outputs      : the upper bound of the histogram bucket in usec, 0 if no
+//                request completed
+uint64_t block_qos_percentile(BlockQosStats* stats, int pct)
+{
+	uint64_t seen = 0, want;
+	int i;
+
+	if (stats->requests == 0) {
+		return 0;
+	}
+	want = (stats->requests * pct + 99) / 100;
+	for (i = 0; i < BLOCK_QOS_HIST_BUCKETS - 1; i++) {
+		if ((seen += stats->hist[i]) >= want) {
+			break;
+		}
+	}
+	return (2ULL << i);
+}
@@ -0,0 +1,71 @@
+#ifndef BLOCK_QOS_INCLUDED
+#define BLOCK_QOS_INCLUDED
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : block_qos.h
+//  Description    : This is the interface of the per-file I/O classes.  Every
+//                   open file belongs to a class, set with block_qos.  A
+//                   block_read or block_write is cut into pieces of at most
+//                   BLOCK_QOS_SPLIT_FRAMES frames, each taking the driver
+//                   lock on its own.  Before each piece the class is admitted
+//                   against its token buckets, and the normal and bulk
+//                   classes also wait for every latency request in flight.
+//
+//  Author         : Vinayak Gupta
+//
+
+// Include files
+#include <stdint.h>
+
+// Defines
+#define BLOCK_QOS_SPLIT_FRAMES 16 // Largest piece of a request run under one driver lock
+#define BLOCK_QOS_BURST_MSEC 100 // Bucket depth, in time at the configured rate
+#define BLOCK_QOS_HIST_BUCKETS 32 // Request latency histogram, bucket i holds [2^i, 2^(i+1)) usec
+
+// I/O classes
+typedef enum {
+	BLOCK_QOS_LATENCY = 0, // interactive, ahead of the other classes
+	BLOCK_QOS_NORMAL = 1, // the default of every file
+	BLOCK_QOS_BULK = 2, // background transfers
+	BLOCK_QOS_CLASSES = 3,
+} BlockQosClass;
+
+// Type definitions
+typedef struct {
+	uint64_t requests; // block_read/block_write calls completed
+	uint64_t bytes; // bytes admitted
+	uint64_t throttled_usec; // time spent waiting for tokens or the latency class
+	uint64_t hist[BLOCK_QOS_HIST_BUCKETS]; // request latencies
+} BlockQosStats;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//
+// Interface functions
+
+int32_t block_qos_configure(BlockQosClass cls, uint32_t bytes_per_sec, uint32_t iops);
+// Set the bandwidth and request budgets of a class, 0 for no limit (default)
+
+uint64_t block_qos_begin(BlockQosClass cls);
+// A request of the class starts, returns its start time for block_qos_end
+
+void block_qos_admit(BlockQosClass cls, uint32_t bytes, int first);
+// Wait until the class may run a piece of bytes, first is set for the first piece of a request
+
+void block_qos_end(BlockQosClass cls, uint64_t start);
+// A request of the class is done, record its latency
+
+void block_qos_stats(BlockQosClass cls, BlockQosStats* stats);
+// Copy the counters of a class
+
+uint64_t block_qos_percentile(BlockQosStats* stats, int pct);
+// Upper bound in usec of the pct percentile request latency
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,275 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : block_record.c
+//  Description    : This is the implementation of the call recorder.  Calls
+//                   are appended under the recorder lock to a stdio stream
+//                   with a large buffer, so recording costs a hash of the
+//                   payload and a memcpy of the record.  Records are written
+//                   as calls finish; a call's timestamp is when it started.
+//
+//  Author         : Vinayak Gupta
+//
+
+// Includes
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Project Includes
+#include <block_geometry.h>
+#include <block_record.h>
+#include <cmpsc311_log.h>
+
+// Defines
+#define BLOCK_RECORD_BUFFER (1 << 20) // Bytes buffered before the log is written
+
+// The recorder, one per process
+static struct {
+	int on; // 1 while calls are recorded
+	int hashes; // 1 if payloads are hashed
+	FILE* out; // the log
+	char* buffer; // stdio buffer of the log
+	uint64_t nsec0; // monotonic nsec when recording started
+	uint64_t calls; // calls recorded
+	int threads; // threads that have recorded a call
+	pthread_mutex_t lock; // protects everything above
+} recorder = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static __thread uint16_t mythread; // the calling thread's number, 0 until its first call
+
+//
+// Implementation
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_record_nsec
+// Description  : monotonic clock in nanoseconds
+//
+// Inputs       : none
+// Outputs      : nanoseconds
+static uint64_t block_record_nsec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_record_hash
+// Description  : FNV-1a hash of a payload
+//
+// Inputs       : data - the payload
+//                len - its length
+// Outputs      : the hash
+static uint64_t block_record_hash(const void* data, int32_t len)
+{
+	const unsigned char* p = data;
+	uint64_t h = 0xcbf29ce484222325ULL;
+	int32_t i;
+
+	for (i = 0; i < len; i++) {
+		h = (h ^ p[i]) * 0x100000001b3ULL;
+	}
+	return (h);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_record_start
+// Description  : create a log and start recording calls to it
+//
+// Inputs       : path - the log file
+//                hashes - 1 to hash payloads
+// Outputs      : 0 if successful, -1 if failure
+int32_t block_record_start(const char* path, int hashes)
+{
+	BlockRecordHeader hdr;
+
+	pthread_mutex_lock(&recorder.lock);
+	if (recorder.on) {
+		pthread_mutex_unlock(&recorder.lock);
+		logMessage(LOG_ERROR_LEVEL, "Already recording calls");
+		return (-1);
+	}
+	if ((recorder.out = fopen(path, "wb")) == NULL) {
+		pthread_mutex_unlock(&recorder.lock);
+		logMessage(LOG_ERROR_LEVEL, "Failed to create call log [%s]", path);
+		return (-1);
+	}
+	if ((recorder.buffer = malloc(BLOCK_RECORD_BUFFER)) != NULL) {
+		setvbuf(recorder.out, recorder.buffer, _IOFBF, BLOCK_RECORD_BUFFER);
+	}
+	memset(&hdr, 0x0, sizeof(hdr));
+	memcpy(hdr.magic, BLOCK_RECORD_MAGIC, sizeof(hdr.magic));
+	hdr.version = BLOCK_RECORD_VERSION;
+	hdr.flags = hashes ? BLOCK_RECORD_HASHED : 0;
+	hdr.framesize = BLOCK_FRAME_SIZE;
+	if (fwrite(&hdr, sizeof(hdr), 1, recorder.out) != 1) {
+		fclose(recorder.out);
+		free(recorder.buffer);
+		recorder.buffer = NULL;
+		pthread_mutex_unlock(&recorder.lock);
+		logMessage(LOG_ERROR_LEVEL, "Failed to write call log [%s]", path);
+		return (-1);
+	}
+	recorder.hashes = hashes;
+	recorder.calls = 0;
+	recorder.nsec0 = block_record_nsec();
+	__atomic_store_n(&recorder.on, 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&recorder.lock);
+	logMessage(LOG_INFO_LEVEL, "Recording calls to [%s]%s", path, hashes ? " with payload hashes" : "");
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_record_stop
+// Description  : stop recording and close the log
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+int32_t block_record_stop(void)
+{
+	int32_t ret = 0;
+
+	pthread_mutex_lock(&recorder.lock);
+	if (!recorder.on) {
+		pthread_mutex_unlock(&recorder.lock);
+		return (0);
+	}
+	__atomic_store_n(&recorder.on, 0, __ATOMIC_RELEASE);
+	if (fclose(recorder.out)) {
+		logMessage(LOG_ERROR_LEVEL, "Failed to write call log");
+		ret = -1;
+	}
+	free(recorder.buffer);
+	recorder.buffer = NULL;
+	recorder.out = NULL;
+	logMessage(LOG_INFO_LEVEL, "Recorded %lu calls on %d threads", (unsigned long)recorder.calls, recorder.threads);
+	pthread_mutex_unlock(&recorder.lock);
+	return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_record_begin
+// Description  : timestamp a call about to start
+//
+// Inputs       : none
+// Outputs      : monotonic nanoseconds, 0 when nothing is recording
+uint64_t block_record_begin(void)
+{
+	if (!__atomic_load_n(&recorder.on, __ATOMIC_RELAXED)) {
+		return (0);
+	}
+	return (block_record_nsec());
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_record_call
+// Description  : append a finished call to the log
+//
+// Inputs       : start - what block_record_begin returned
+//                op - the call
+//                fd - the file handle
+//                offset - file offset, seek target or open flags
+//                length - bytes asked for, ignored for an open
+//                result - what the call returned
+//                data - the path of an open, the payload of a read or write
+// Outputs      : none
+void block_record_call(uint64_t start, BlockRecordOp op, int16_t fd, uint32_t offset, int32_t length, int32_t result, const void* data)
+{
+	BlockRecord rec;
+	uint64_t now;
+
+	if (start == 0) {
+		return;
+	}
+	now = block_record_nsec();
+	memset(&rec, 0x0, sizeof(rec));
+	rec.op = op;
+	rec.fd = fd;
+	rec.offset = offset;
+	rec.length = (op == BLOCK_RECORD_OPEN) ? (int32_t)strlen(data) : length;
+	rec.result = result;
+	rec.latency = (now - start > UINT32_MAX) ? UINT32_MAX : (uint32_t)(now - start);
+
+	pthread_mutex_lock(&recorder.lock);
+	if (!recorder.on || (start < recorder.nsec0)) {
+		pthread_mutex_unlock(&recorder.lock);
+		return;
+	}
+	if (mythread == 0) {
+		mythread = ++recorder.threads;
+	}
+	rec.thread = mythread;
+	rec.usec = (start - recorder.nsec0) / 1000;
+	if (recorder.hashes && (data != NULL) && (op != BLOCK_RECORD_OPEN) && (result > 0)) {
+		rec.hash = block_record_hash(data, result);
+	}
+	fwrite(&rec, sizeof(rec), 1, recorder.out);
+	if (op == BLOCK_RECORD_OPEN) {
+		fwrite(data, rec.length, 1, recorder.out);
+	}
+	recorder.calls++;
+	pthread_mutex_unlock(&recorder.lock);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_record_load
+// Description  : open a call log for reading
+//
+// Inputs       : path - the log file
+//                hdr - the header (output)
+// Outputs      : the stream positioned at the first call, NULL if failure
+FILE* block_record_load(const char* path, BlockRecordHeader* hdr)
+{
+	FILE* in;
+
+	if ((in = fopen(path, "rb")) == NULL) {
+		logMessage(LOG_ERROR_LEVEL, "Failed to open call log [%s]", path);
+		return (NULL);
+	}
+	if ((fread(hdr, sizeof(BlockRecordHeader), 1, in) != 1) || memcmp(hdr->magic, BLOCK_RECORD_MAGIC, sizeof(hdr->magic))
+		|| (hdr->version != BLOCK_RECORD_VERSION)) {
+		logMessage(LOG_ERROR_LEVEL, "[%s] is not a call log", path);
+		fclose(in);
+		return (NULL);
+	}
+	return (in);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_record_next
+// Description  : read the next call of a log
+//
+// Inputs       : in - the log
+//                rec - the call (output)
+//                path - the path of an open (output)
+//                max - room in path
+// Outputs      : 1 if a call was read, 0 at the end of the log, -1 if failure
+int32_t block_record_next(FILE* in, BlockRecord* rec, char* path, uint32_t max)
+{
+	if (fread(rec, sizeof(BlockRecord), 1, in) != 1) {
+		return (feof(in) ? 0 : -1);
+	}
+	if ((rec->op < BLOCK_RECORD_OPEN) || (rec->op > BLOCK_RECORD_PWRITE)) {
+		logMessage(LOG_ERROR_LEVEL, "Unknown call %d in call log", rec->op);
+		return (-1);
+	}
+	if (rec->op == BLOCK_RECORD_OPEN) {
+		if ((rec->length < 0) || ((uint32_t)rec->length >= max) || (fread(path, 1, rec->length, in) != (size_t)rec->length)) {
+			logMessage(LOG_ERROR_LEVEL, "Bad path in call log");
+			return (-1);
+		}
+		path[rec->length] = 0x0;
+	}
+	return (1);
+}
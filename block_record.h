@@ -0,0 +1,91 @@
+#ifndef BLOCK_RECORD_INCLUDED
+#define BLOCK_RECORD_INCLUDED
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : block_record.h
+//  Description    : This is the interface of the call recorder.  While
+//                   recording, every block_open, block_close, block_read,
+//                   block_write, block_seek, block_pread and block_pwrite
+//                   is appended to a binary log as a fixed size record, an
+//                   open followed by its path.
+//                   Payloads are not kept, a record carries a 64 bit hash
+//                   of its payload instead when hashing is on.  The log
+//                   is re-driven against the driver by block_replay.
+//
+//  Author         : Vinayak Gupta
+//
+
+// Include files
+#include <stdint.h>
+#include <stdio.h>
+
+// Defines
+#define BLOCK_RECORD_MAGIC "BLKREC01" // First bytes of a call log
+#define BLOCK_RECORD_VERSION 1 // Format of the records that follow the header
+#define BLOCK_RECORD_HASHED 0x1 // Header flag, the records carry payload hashes
+
+// Recorded calls
+typedef enum {
+	BLOCK_RECORD_OPEN = 1, // offset holds the open flags, the path follows
+	BLOCK_RECORD_CLOSE = 2,
+	BLOCK_RECORD_READ = 3, // offset is where the read started
+	BLOCK_RECORD_WRITE = 4, // offset is where the write started
+	BLOCK_RECORD_SEEK = 5, // offset is the target
+	BLOCK_RECORD_PREAD = 6, // offset is where the read started, the cursor did not move
+	BLOCK_RECORD_PWRITE = 7, // offset is where the write started, the cursor did not move
+} BlockRecordOp;
+
+// Log header
+typedef struct {
+	char magic[8]; // BLOCK_RECORD_MAGIC
+	uint32_t version; // BLOCK_RECORD_VERSION
+	uint32_t flags; // BLOCK_RECORD_HASHED
+	uint32_t framesize; // BLOCK_FRAME_SIZE of the recording driver
+	uint32_t reserved;
+} BlockRecordHeader;
+
+// One call
+typedef struct {
+	uint64_t usec; // start of the call, microseconds since recording began
+	uint64_t hash; // FNV-1a hash of the payload moved, 0 if not hashed
+	uint32_t offset; // file offset, seek target or open flags
+	int32_t length; // bytes asked for, the path length of an open
+	int32_t result; // what the call returned
+	uint32_t latency; // nanoseconds the call took, saturating
+	uint16_t thread; // recording thread, numbered from 1 in order of first call
+	int16_t fd; // file handle, the returned one for an open
+	uint8_t op; // BlockRecordOp
+	uint8_t reserved[3];
+} BlockRecord;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//
+// Interface functions
+
+int32_t block_record_start(const char* path, int hashes);
+// Record the calls to a new log at path, with payload hashes if hashes is 1
+
+int32_t block_record_stop(void);
+// Stop recording and close the log
+
+uint64_t block_record_begin(void);
+// Timestamp of a call about to start, 0 when nothing is recording
+
+void block_record_call(uint64_t start, BlockRecordOp op, int16_t fd, uint32_t offset, int32_t length, int32_t result, const void* data);
+// Append a call begun at start, data is the path of an open or the payload moved
+
+FILE* block_record_load(const char* path, BlockRecordHeader* hdr);
+// Open a log for reading and check its header, NULL if failure
+
+int32_t block_record_next(FILE* in, BlockRecord* rec, char* path, uint32_t max);
+// Read the next call and the path of an open, 1 if read, 0 at the end, -1 if failure
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
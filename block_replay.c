@@ -0,0 +1,596 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : block_replay.c
+//  Description    : This is the call log replayer.  It re-drives the calls
+//                   a driver recorded with block_record_start (block_sim -R)
+//                   against a freshly powered on volume, paced to the
+//                   recorded start times or as fast as it can.  The calls of
+//                   all recorded threads are issued from one thread in the
+//                   order they were logged.  Files the log reads before it
+//                   writes them are first created at the size the log needs,
+//                   and written payloads are filler derived from the
+//                   recorded hash, so the same bytes are written wherever
+//                   the recording wrote the same bytes.  The replay latency
+//                   of each call type is reported next to the recorded one.
+//
+//  Author         : Vinayak Gupta
+//
+
+// Include Files
+#include <search.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Project Includes
+#include <block_cache.h>
+#include <block_driver.h>
+#include <block_geometry.h>
+#include <block_log.h>
+#include <block_pack.h>
+#include <block_record.h>
+#include <block_volume.h>
+#include <cmpsc311_log.h>
+
+// Defines
+#define REPLAY_ARGUMENTS "hvfl:c:m:w:q:g:k:"
+#define REPLAY_OPS (BLOCK_RECORD_PWRITE + 1) // Rows of the latency table
+#define USAGE                                                                    \
+    "USAGE: block_replay [-h] [-v] [-f] [-l <logfile>] [-c <sz>] [-m <members>]\n" \
+    "                    [-w <stripe>] [-q <depth>] [-g <frames>] [-k <bytes>]\n" \
+    "                    <call-log>\n"                                           \
+    "\n"                                                                         \
+    "where:\n"                                                                   \
+    "    -h - help mode (display this message)\n"                                \
+    "    -v - verbose output\n"                                                  \
+    "    -f - issue the calls as fast as possible, not at the recorded times\n"  \
+    "    -l - write log messages to the filename <logfile>\n"                    \
+    "    -c - set the block frame cache to <sz> frames (0 disables)\n"          \
+    "    -m - stripe the volume across <members> controllers (default 1)\n"      \
+    "    -w - stripe width of <stripe> frames per member (default 1)\n"          \
+    "    -q - hold up to <depth> writes in the volume scheduler (0 disables)\n" \
+    "    -g - log-structured writes in segments of <frames> frames\n"         \
+    "    -k - pack files of up to <bytes> bytes several to a frame\n"          \
+    "\n"                                                                         \
+    "    <call-log> - calls recorded with block_sim -R\n"                        \
+    "\n"
+
+// A file named in the log
+typedef struct {
+    char* path; // the path opened
+    uint32_t written; // bytes the log has written to it so far
+    uint32_t needed; // bytes it must hold before the replay starts
+} ReplayFile;
+
+// The calls of one type
+typedef struct {
+    uint64_t calls; // calls replayed
+    uint64_t bytes; // bytes moved by the replay
+    uint64_t recorded_nsec; // sum of the recorded latencies
+    uint64_t replay_nsec; // sum of the replay latencies
+    uint64_t differ; // calls whose result differed from the recorded one
+} ReplayStats;
+
+//
+// Global Data
+BlockRecord* calls; // the log
+char** paths; // the path of each open in the log, NULL for other calls
+uint64_t ncalls;
+ReplayFile* files; // the files named in the log
+int nfiles;
+
+//
+// Functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : replay_nsec
+// Description  : monotonic clock in nanoseconds
+//
+// Inputs       : none
+// Outputs      : nanoseconds
+
+static uint64_t replay_nsec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : replay_fill
+// Description  : fill a write payload with filler derived from the recorded
+//                hash, or from the offset when the log has no hashes
+//
+// Inputs       : buf - the payload
+//                len - its length
+//                seed - the hash or offset
+// Outputs      : none
+
+static void replay_fill(char* buf, int32_t len, uint64_t seed)
+{
+    int32_t i;
+
+    seed |= 1;
+    for (i = 0; i < len; i++) {
+        seed ^= seed << 13;
+        seed ^= seed >> 7;
+        seed ^= seed << 17;
+        buf[i] = (char)seed;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : replay_file
+// Description  : find a file named in the log, adding it on first sight
+//
+// Inputs       : path - the path opened
+// Outputs      : index of the file, -1 if failure
+
+static int replay_file(char* path)
+{
+    ENTRY item, *found;
+    ReplayFile* grown;
+
+    item.key = path;
+    if ((found = hsearch(item, FIND)) != NULL) {
+        return ((int)(intptr_t)found->data);
+    }
+    if ((grown = realloc(files, (nfiles + 1) * sizeof(ReplayFile))) == NULL) {
+        return (-1);
+    }
+    files = grown;
+    files[nfiles].path = path;
+    files[nfiles].written = 0;
+    files[nfiles].needed = 0;
+    item.data = (void*)(intptr_t)nfiles;
+    if (hsearch(item, ENTER) == NULL) {
+        return (-1);
+    }
+    return (nfiles++);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : replay_load
+// Description  : read a call log into memory and work out how large each
+//                file must be before the replay so that the recorded reads
+//                and seeks of data written before the recording succeed
+//
+// Inputs       : log - the call log
+//                maxlen - largest read or write in the log (output)
+// Outputs      : 0 if successful, -1 if failure
+
+static int replay_load(char* log, int32_t* maxlen)
+{
+    BlockRecordHeader hdr;
+    BlockRecord rec;
+    BlockRecord* grown;
+    char** grownpaths;
+    char path[BLOCK_MAX_PATH_LENGTH];
+    int open[BLOCK_MAX_OPEN_FILES]; // the file each recorded handle is open on
+    uint64_t max = 0;
+    uint32_t end;
+    int ret, f, writing;
+    FILE* in;
+
+    if ((in = block_record_load(log, &hdr)) == NULL) {
+        return (-1);
+    }
+    if (hdr.framesize != BLOCK_FRAME_SIZE) {
+        logMessage(LOG_INFO_LEVEL, "Log recorded with %u byte frames, replaying with %d", hdr.framesize, BLOCK_FRAME_SIZE);
+    }
+    if (hcreate(BLOCK_MAX_TOTAL_FILES / 16) == 0) {
+        fclose(in);
+        return (-1);
+    }
+    memset(open, 0xff, sizeof(open));
+    *maxlen = 0;
+    while ((ret = block_record_next(in, &rec, path, sizeof(path))) == 1) {
+        if (ncalls == max) {
+            max = max ? max * 2 : 65536;
+            if ((grown = realloc(calls, max * sizeof(BlockRecord))) == NULL) {
+                ret = -1;
+                break;
+            }
+            calls = grown;
+            if ((grownpaths = realloc(paths, max * sizeof(char*))) == NULL) {
+                ret = -1;
+                break;
+            }
+            paths = grownpaths;
+        }
+        calls[ncalls] = rec;
+        paths[ncalls] = NULL;
+        f = ((rec.fd >= 0) && (rec.fd < BLOCK_MAX_OPEN_FILES)) ? open[rec.fd] : -1;
+        switch (rec.op) {
+        case BLOCK_RECORD_OPEN:
+            if (((paths[ncalls] = strdup(path)) == NULL) || ((f = replay_file(paths[ncalls])) == -1)) {
+                ret = -1;
+            } else if ((rec.result >= 0) && (rec.fd < BLOCK_MAX_OPEN_FILES)) {
+                open[rec.fd] = f;
+            }
+            break;
+
+        case BLOCK_RECORD_CLOSE:
+            if ((f >= 0) && (rec.result == 0)) {
+                open[rec.fd] = -1;
+            }
+            break;
+
+        case BLOCK_RECORD_READ:
+        case BLOCK_RECORD_WRITE:
+        case BLOCK_RECORD_PREAD:
+        case BLOCK_RECORD_PWRITE:
+            *maxlen = (rec.length > *maxlen) ? rec.length : *maxlen;
+            end = rec.offset + ((rec.result > 0) ? rec.result : 0);
+            writing = (rec.op == BLOCK_RECORD_WRITE) || (rec.op == BLOCK_RECORD_PWRITE);
+            if ((f >= 0) && writing && (end > files[f].written)) {
+                files[f].written = end;
+            }
+            if ((f >= 0) && !writing && (end > files[f].written) && (end > files[f].needed)) {
+                files[f].needed = end;
+            }
+            break;
+
+        case BLOCK_RECORD_SEEK:
+            if ((f >= 0) && (rec.result == 0) && (rec.offset > files[f].written) && (rec.offset > files[f].needed)) {
+                files[f].needed = rec.offset;
+            }
+            break;
+        }
+        if (ret == -1) {
+            break;
+        }
+        ncalls++;
+    }
+    fclose(in);
+    if (ret == -1) {
+        logMessage(LOG_ERROR_LEVEL, "Failed to load call log [%s] at call %lu", log, (unsigned long)ncalls);
+        return (-1);
+    }
+    logMessage(LOG_INFO_LEVEL, "Loaded %lu calls on %d files from [%s]", (unsigned long)ncalls, nfiles, log);
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : replay_preload
+// Description  : create the files that hold data from before the recording
+//
+// Inputs       : buf - a payload buffer
+//                maxlen - its length
+// Outputs      : bytes preloaded if successful, -1 if failure
+
+static int64_t replay_preload(char* buf, int32_t maxlen)
+{
+    int64_t total = 0;
+    uint32_t done;
+    int32_t len;
+    int16_t fd;
+    int f;
+
+    for (f = 0; f < nfiles; f++) {
+        if (files[f].needed == 0) {
+            continue;
+        }
+        if ((fd = block_open(files[f].path)) == -1) {
+            logMessage(LOG_ERROR_LEVEL, "Preload of [%s] failed", files[f].path);
+            return (-1);
+        }
+        for (done = 0; done < files[f].needed; done += len) {
+            len = (files[f].needed - done > (uint32_t)maxlen) ? maxlen : (int32_t)(files[f].needed - done);
+            replay_fill(buf, len, done);
+            if (block_write(fd, buf, len) != len) {
+                logMessage(LOG_ERROR_LEVEL, "Preload of [%s] failed at %u", files[f].path, done);
+                block_close(fd);
+                return (-1);
+            }
+        }
+        block_close(fd);
+        total += files[f].needed;
+    }
+    return (total);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : replay_calls
+// Description  : issue the calls of the log, mapping the recorded file
+//                handles onto the replay ones.  A read or write that
+//                would not start where the recording's did is preceded by
+//                a seek, so one diverging call does not shift the rest.
+//
+// Inputs       : buf - a payload buffer
+//                fast - 1 to ignore the recorded times
+//                stats - per call type totals (output)
+// Outputs      : 0 if successful, -1 if failure
+
+static int replay_calls(char* buf, int fast, ReplayStats* stats)
+{
+    int16_t fds[BLOCK_MAX_OPEN_FILES]; // the replay handle of each recorded one
+    uint32_t pos[BLOCK_MAX_OPEN_FILES]; // the replay position of each replay handle
+    uint64_t start, began, now, i;
+    BlockRecord* rec;
+    int32_t ret = 0;
+    int16_t fd;
+
+    memset(fds, 0xff, sizeof(fds));
+    start = replay_nsec();
+    for (i = 0; i < ncalls; i++) {
+        rec = &calls[i];
+        if ((rec->fd < 0) || (rec->fd >= BLOCK_MAX_OPEN_FILES)) {
+            fd = -1;
+        } else {
+            fd = fds[rec->fd];
+        }
+
+        // Wait for the recorded start time
+        if (!fast && ((now = (replay_nsec() - start) / 1000) < rec->usec)) {
+            usleep(rec->usec - now);
+        }
+
+        if ((rec->op == BLOCK_RECORD_WRITE) || (rec->op == BLOCK_RECORD_PWRITE)) {
+            replay_fill(buf, rec->length, rec->hash ? rec->hash : rec->offset);
+        }
+        began = replay_nsec();
+        switch (rec->op) {
+        case BLOCK_RECORD_OPEN:
+            ret = block_open_flags(paths[i], (int32_t)rec->offset);
+            if ((ret >= 0) && (rec->result >= 0) && (rec->fd < BLOCK_MAX_OPEN_FILES)) {
+                fds[rec->fd] = ret;
+                pos[ret] = 0;
+            }
+            break;
+
+        case BLOCK_RECORD_CLOSE:
+            ret = block_close(fd);
+            if ((ret == 0) && (rec->fd >= 0) && (rec->fd < BLOCK_MAX_OPEN_FILES)) {
+                fds[rec->fd] = -1;
+            }
+            break;
+
+        case BLOCK_RECORD_SEEK:
+            if (((ret = block_seek(fd, rec->offset)) == 0) && (fd >= 0)) {
+                pos[fd] = rec->offset;
+            }
+            break;
+
+        case BLOCK_RECORD_READ:
+        case BLOCK_RECORD_WRITE:
+            if ((fd >= 0) && (pos[fd] != rec->offset) && (block_seek(fd, rec->offset) == 0)) {
+                pos[fd] = rec->offset;
+            }
+            if (rec->op == BLOCK_RECORD_READ) {
+                ret = block_read(fd, buf, rec->length);
+            } else {
+                ret = block_write(fd, buf, rec->length);
+            }
+            if ((ret > 0) && (fd >= 0)) {
+                pos[fd] += ret;
+                stats[rec->op].bytes += ret;
+            }
+            break;
+
+        case BLOCK_RECORD_PREAD:
+        case BLOCK_RECORD_PWRITE:
+            if (rec->op == BLOCK_RECORD_PREAD) {
+                ret = block_pread(fd, buf, rec->length, rec->offset);
+            } else {
+                ret = block_pwrite(fd, buf, rec->length, rec->offset);
+            }
+            if (ret > 0) {
+                stats[rec->op].bytes += ret;
+            }
+            break;
+        }
+        stats[rec->op].calls++;
+        stats[rec->op].replay_nsec += replay_nsec() - began;
+        stats[rec->op].recorded_nsec += rec->latency;
+        if ((rec->op == BLOCK_RECORD_OPEN) ? ((ret >= 0) != (rec->result >= 0)) : (ret != rec->result)) {
+            stats[rec->op].differ++;
+        }
+    }
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : replay_log
+// Description  : replay a call log on a freshly powered on volume and print
+//                what it cost
+//
+// Inputs       : log - the call log
+//                fast - 1 to ignore the recorded times
+// Outputs      : 0 if successful, -1 if failure
+
+static int replay_log(char* log, int fast)
+{
+    static const char* names[REPLAY_OPS] = { "", "open", "close", "read", "write", "seek", "pread", "pwrite" };
+    ReplayStats stats[REPLAY_OPS];
+    BlockVolumeStats bus0, bus;
+    uint64_t start, elapsed, bytes = 0;
+    int32_t maxlen;
+    int64_t preloaded;
+    char* buf = NULL;
+    int ret = -1, op;
+
+    if (replay_load(log, &maxlen)) {
+        return (-1);
+    }
+    maxlen = (maxlen < BLOCK_FRAME_SIZE) ? BLOCK_FRAME_SIZE : maxlen;
+    if ((buf = malloc(maxlen)) == NULL) {
+        return (-1);
+    }
+    if (block_poweron() == -1) {
+        logMessage(LOG_ERROR_LEVEL, "Replay failed to power on the driver");
+        free(buf);
+        return (-1);
+    }
+    if (((preloaded = replay_preload(buf, maxlen)) == -1) || block_volume_flush()) {
+        goto done;
+    }
+
+    // Replay the calls, the scheduler is drained so they are charged all of their writes
+    memset(stats, 0x0, sizeof(stats));
+    block_volume_stats(&bus0);
+    start = replay_nsec();
+    if (replay_calls(buf, fast, stats) || block_volume_flush()) {
+        goto done;
+    }
+    elapsed = (replay_nsec() - start) / 1000;
+    block_volume_stats(&bus);
+
+    printf("# %lu calls from %s, %s, %lu bytes preloaded\n", (unsigned long)ncalls, log,
+        fast ? "as fast as possible" : "at the recorded times", (unsigned long)preloaded);
+    printf("%-8s %10s %12s %12s %12s %8s\n", "call", "calls", "bytes", "rec(usec)", "replay(usec)", "differ");
+    for (op = BLOCK_RECORD_OPEN; op < REPLAY_OPS; op++) {
+        printf("%-8s %10lu %12lu %12.1f %12.1f %8lu\n", names[op], (unsigned long)stats[op].calls,
+            (unsigned long)stats[op].bytes,
+            stats[op].calls ? stats[op].recorded_nsec / 1e3 / stats[op].calls : 0.0,
+            stats[op].calls ? stats[op].replay_nsec / 1e3 / stats[op].calls : 0.0, (unsigned long)stats[op].differ);
+        bytes += stats[op].bytes;
+    }
+    printf("# %.3f s recorded, %.3f s replayed, %.2f MB/s, %lu frames read, %lu frames written\n",
+        ncalls ? calls[ncalls - 1].usec / 1e6 : 0.0, elapsed / 1e6,
+        bytes / (elapsed ? elapsed / 1e6 : 1e-6) / (1024 * 1024),
+        (unsigned long)(bus.frames_read - bus0.frames_read), (unsigned long)(bus.frames_written - bus0.frames_written));
+    ret = 0;
+
+done:
+    if (block_poweroff() == -1) {
+        logMessage(LOG_ERROR_LEVEL, "Replay failed to power off the driver");
+        ret = -1;
+    }
+    free(buf);
+    return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : main
+// Description  : The main function for the call log replayer
+//
+// Inputs       : argc - the number of command line parameters
+//                argv - the parameters
+// Outputs      : 0 if successful, -1 if failure
+
+int main(int argc, char* argv[])
+{
+
+    // Local variables
+    int ch, verbose = 0, log_initialized = 0, fast = 0;
+    uint32_t cache_size = 1024, log_segment = 0, pack_threshold = 0;
+    int members = 1, stripe = 1, queue_depth = BLOCK_VOLUME_QUEUE_DEPTH;
+
+    // Process the command line parameters
+    while ((ch = getopt(argc, argv, REPLAY_ARGUMENTS)) != -1) {
+
+        switch (ch) {
+        case 'h': // Help, print usage
+            fprintf(stderr, USAGE);
+            return (-1);
+
+        case 'v': // Verbose Flag
+            verbose = 1;
+            break;
+
+        case 'f': // Replay as fast as possible
+            fast = 1;
+            break;
+
+        case 'l': // Set the log filename
+            initializeLogWithFilename(optarg);
+            log_initialized = 1;
+            break;
+
+        case 'c': // Set cache line size
+            if (sscanf(optarg, "%u", &cache_size) != 1) {
+                fprintf(stderr, "Bad cache size [%s]\n", optarg);
+                return (-1);
+            }
+            break;
+
+        case 'm': // Set the number of volume members
+            if (sscanf(optarg, "%d", &members) != 1) {
+                fprintf(stderr, "Bad volume member count [%s]\n", optarg);
+                return (-1);
+            }
+            break;
+
+        case 'w': // Set the stripe width
+            if (sscanf(optarg, "%d", &stripe) != 1) {
+                fprintf(stderr, "Bad stripe width [%s]\n", optarg);
+                return (-1);
+            }
+            break;
+
+        case 'q': // Set the scheduler queue depth
+            if (sscanf(optarg, "%d", &queue_depth) != 1) {
+                fprintf(stderr, "Bad scheduler queue depth [%s]\n", optarg);
+                return (-1);
+            }
+            break;
+
+        case 'g': // Write log-structured
+            if ((sscanf(optarg, "%u", &log_segment) != 1) || (log_segment == 0)) {
+                fprintf(stderr, "Bad log segment size [%s]\n", optarg);
+                return (-1);
+            }
+            break;
+
+        case 'k': // Pack small files
+            if (sscanf(optarg, "%u", &pack_threshold) != 1) {
+                fprintf(stderr, "Bad pack threshold [%s]\n", optarg);
+                return (-1);
+            }
+            break;
+
+        default: // Default (unknown)
+            fprintf(stderr, "Unknown command line option (%c), aborting.\n", ch);
+            return (-1);
+        }
+    }
+
+    // Setup the log as needed
+    if (!log_initialized) {
+        initializeLogWithFilehandle(CMPSC311_LOG_STDERR);
+    }
+    if (verbose) {
+        enableLogLevels(LOG_INFO_LEVEL);
+    }
+    if (optind >= argc) {
+        fprintf(stderr, "Missing call log, use -h to see usage, aborting.\n");
+        return (-1);
+    }
+
+    // Configure the volume before the driver powers on
+    if (block_volume_configure(members, stripe) == -1) {
+        fprintf(stderr, "Bad volume geometry (%d members, stripe %d), aborting.\n", members, stripe);
+        return (-1);
+    }
+    if (block_volume_schedule(queue_depth, BLOCK_VOLUME_QUEUE_DEADLINE_USEC) == -1) {
+        fprintf(stderr, "Bad scheduler queue depth %d, aborting.\n", queue_depth);
+        return (-1);
+    }
+    block_cache_configure(cache_size);
+    block_log_configure(log_segment);
+    if (block_pack_configure(pack_threshold) == -1) {
+        fprintf(stderr, "Bad pack threshold %u, aborting.\n", pack_threshold);
+        return (-1);
+    }
+
+    // Replay the log
+    if (replay_log(argv[optind], fast)) {
+        logMessage(LOG_ERROR_LEVEL, "Replay of call log [%s] failed, aborting.", argv[optind]);
+        return (-1);
+    }
+
+    // Return successfully
+    return (0);
+}
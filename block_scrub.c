@@ -0,0 +1,340 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : block_scrub.c
+//  Description    : This is the implementation of the background scrubber.
+//                   One thread walks the volume frame by frame, skipping the
+//                   free frames, and compares the CS1 returned with each
+//                   read against computeframechecksum.  Reads are paced by
+//                   a token bucket refilled at the configured byte rate,
+//                   and the thread only runs once the driver has been idle
+//                   for BLOCK_SCRUB_IDLE_USEC, so foreground calls never
+//                   queue behind it for long.
+//
+//                   A frame that fails its check is re-read under the
+//                   driver lock.  A good copy, from a re-read or from the
+//                   frame cache, is written back, relocated to a fresh
+//                   frame once the frame has had BLOCK_QUARANTINE_ERRORS
+//                   errors; otherwise the frame is recorded as unrepairable.
+//
+//  Author         : Vinayak Gupta
+//
+
+// Includes
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Project Includes
+#include <block_cache.h>
+#include <block_ctx.h>
+#include <block_driver.h>
+#include <block_geometry.h>
+#include <block_scrub.h>
+#include <cmpsc311_log.h>
+
+// The scrubber of a context
+struct BlockScrubState {
+	int running; // 1 while the thread exists
+	int stopping; // set to stop the thread
+	uint32_t rate; // bytes per second
+	pthread_t thread;
+	pthread_mutex_t lock; // protects the fields below and the stop flag
+	pthread_cond_t wake; // signalled to interrupt a sleep
+	BlockScrubStats stats;
+	BlockVolumeFrame bad[BLOCK_SCRUB_MAX_BADFRAMES];
+	int32_t nbad;
+};
+#define scrub (*block_ctx_bound->scrub) // the scrubber of the calling thread's context
+
+//
+// Implementation
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_scrub_ctx_create / block_scrub_ctx_destroy
+// Description  : create and release the scrubber of a context
+//
+// Inputs       : state - the scrubber to release, may be NULL
+// Outputs      : block_scrub_ctx_create returns the scrubber, NULL if failure
+struct BlockScrubState* block_scrub_ctx_create(void)
+{
+	struct BlockScrubState* state;
+
+	if ((state = calloc(1, sizeof(struct BlockScrubState))) == NULL) {
+		return NULL;
+	}
+	pthread_mutex_init(&state->lock, NULL);
+	pthread_cond_init(&state->wake, NULL);
+	return state;
+}
+
+void block_scrub_ctx_destroy(struct BlockScrubState* state)
+{
+	if (state == NULL) {
+		return;
+	}
+	pthread_cond_destroy(&state->wake);
+	pthread_mutex_destroy(&state->lock);
+	free(state);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_scrub_sleep
+// Description  : sleep unless the scrubber is being stopped
+//
+// Inputs       : usec - microseconds to sleep
+// Outputs      : 1 if the scrubber should stop, 0 otherwise
+static int block_scrub_sleep(uint64_t usec)
+{
+	struct timespec until;
+	int stop;
+
+	clock_gettime(CLOCK_REALTIME, &until);
+	until.tv_sec += usec / 1000000;
+	until.tv_nsec += (usec % 1000000) * 1000;
+	if (until.tv_nsec >= 1000000000) {
+		until.tv_sec++;
+		until.tv_nsec -= 1000000000;
+	}
+	pthread_mutex_lock(&scrub.lock);
+	while ((!scrub.stopping) && (pthread_cond_timedwait(&scrub.wake, &scrub.lock, &until) != ETIMEDOUT))
+		;
+	stop = scrub.stopping;
+	pthread_mutex_unlock(&scrub.lock);
+	return stop;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_scrub_check
+// Description  : read a frame and verify the checksum returned with it
+//
+// Inputs       : frame - the volume frame
+//                buf - frame buffer to read into
+// Outputs      : 0 if the frame is good, -1 if not
+static int block_scrub_check(BlockVolumeFrame frame, void* buf)
+{
+	BlockXferRegister regstate;
+	uint32_t checksum;
+
+	regstate = block_volume_io(create_opcode(BLOCK_OP_RDFRME, 0, 0, 0), frame, buf);
+	if (get_RTcode(regstate) != BLOCK_RET_SUCCESS) {
+		return -1;
+	}
+	if (computeframechecksum(buf, &checksum)) {
+		return -1;
+	}
+	return ((uint32_t)get_CScode(regstate) == checksum ? 0 : -1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_scrub_repair
+// Description  : try to restore a frame that failed its check, the driver
+//                lock keeps the frame from being rewritten or released
+//
+// Inputs       : frame - the volume frame
+//                buf - frame buffer to work in
+// Outputs      : none
+static void block_scrub_repair(BlockVolumeFrame frame, void* buf)
+{
+	int tries, good = -1;
+	int32_t i;
+
+	lockDriver();
+	if (!getFrameStatus(frame)) {
+		unlockDriver(); // released while we were looking at it
+		return;
+	}
+	noteFrameError(frame);
+	if (block_cache_get(frame, buf) == 0) {
+		good = 0;
+	}
+	for (tries = 0; (good < 0) && (tries < BLOCK_SCRUB_RETRIES); tries++) {
+		if ((good = block_scrub_check(frame, buf)) < 0) {
+			noteFrameError(frame);
+		}
+	}
+	if ((good == 0) && (writeMappedFrame(&frame, buf) == 0)) {
+		unlockDriver();
+		pthread_mutex_lock(&scrub.lock);
+		scrub.stats.repaired++;
+		pthread_mutex_unlock(&scrub.lock);
+		logMessage(LOG_INFO_LEVEL, "Scrubber repaired frame %u", frame);
+		return;
+	}
+	unlockDriver();
+
+	pthread_mutex_lock(&scrub.lock);
+	scrub.stats.unrepairable++;
+	for (i = 0; (i < scrub.nbad) && (scrub.bad[i] != frame); i++)
+		;
+	if ((i == scrub.nbad) && (scrub.nbad < BLOCK_SCRUB_MAX_BADFRAMES)) {
+		scrub.bad[scrub.nbad++] = frame; // remembered once across passes
+	}
+	pthread_mutex_unlock(&scrub.lock);
+	logMessage(LOG_ERROR_LEVEL, "Scrubber found unrepairable frame %u", frame);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_scrub_thread
+// Description  : the scrubber thread, walks the volume until stopped
+//
+// Inputs       : arg - unused
+// Outputs      : NULL
+static void* block_scrub_thread(void* arg)
+{
+	char buf[BLOCK_FRAME_SIZE];
+	BlockVolumeFrame frame = 0;
+	struct timespec now, last;
+	double tokens = 0, burst;
+	uint64_t idle;
+
+	(void)arg;
+	burst = (scrub.rate < BLOCK_FRAME_SIZE) ? BLOCK_FRAME_SIZE : scrub.rate;
+	clock_gettime(CLOCK_MONOTONIC, &last);
+	while (!scrub.stopping) {
+
+		// Yield to the foreground
+		if ((idle = driverIdleUsec()) < BLOCK_SCRUB_IDLE_USEC) {
+			if (block_scrub_sleep(BLOCK_SCRUB_IDLE_USEC - idle)) {
+				break;
+			}
+			continue;
+		}
+
+		// Refill the bucket, wait if there is not a frame's worth
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		tokens += ((now.tv_sec - last.tv_sec) + (now.tv_nsec - last.tv_nsec) / 1e9) * scrub.rate;
+		last = now;
+		if (tokens > burst) {
+			tokens = burst;
+		}
+		if (tokens < BLOCK_FRAME_SIZE) {
+			if (block_scrub_sleep((uint64_t)((BLOCK_FRAME_SIZE - tokens) * 1e6 / scrub.rate) + 1)) {
+				break;
+			}
+			continue;
+		}
+
+		// Next allotted frame, wrapping at the end of the volume
+		if (frame >= block_volume_frames()) {
+			frame = 0;
+			pthread_mutex_lock(&scrub.lock);
+			scrub.stats.passes++;
+			pthread_mutex_unlock(&scrub.lock);
+		}
+		if (!getFrameStatus(frame)) {
+			frame++;
+			continue;
+		}
+		tokens -= BLOCK_FRAME_SIZE;
+		if (block_scrub_check(frame, buf)) {
+			pthread_mutex_lock(&scrub.lock);
+			scrub.stats.checksum_errors++;
+			pthread_mutex_unlock(&scrub.lock);
+			block_scrub_repair(frame, buf);
+		}
+		pthread_mutex_lock(&scrub.lock);
+		scrub.stats.frames_scanned++;
+		pthread_mutex_unlock(&scrub.lock);
+		frame++;
+	}
+	return NULL;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_scrub_start
+// Description  : start the scrubber thread
+//
+// Inputs       : bytes_per_sec - read bandwidth budget
+// Outputs      : 0 if successful, -1 if failure
+int32_t block_scrub_start(uint32_t bytes_per_sec)
+{
+	if (bytes_per_sec == 0) {
+		logMessage(LOG_ERROR_LEVEL, "Scrubber needs a non-zero bandwidth budget");
+		return -1;
+	}
+	pthread_mutex_lock(&scrub.lock);
+	if (scrub.running) {
+		pthread_mutex_unlock(&scrub.lock);
+		logMessage(LOG_ERROR_LEVEL, "Scrubber already running");
+		return -1;
+	}
+	scrub.rate = bytes_per_sec;
+	scrub.stopping = 0;
+	memset(&scrub.stats, 0x0, sizeof(scrub.stats));
+	scrub.nbad = 0;
+	if (block_ctx_spawn(&scrub.thread, block_scrub_thread, NULL)) {
+		pthread_mutex_unlock(&scrub.lock);
+		logMessage(LOG_ERROR_LEVEL, "Failed to start scrubber thread");
+		return -1;
+	}
+	scrub.running = 1;
+	pthread_mutex_unlock(&scrub.lock);
+	logMessage(LOG_INFO_LEVEL, "Scrubber started at %u bytes/sec", bytes_per_sec);
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_scrub_stop
+// Description  : stop the scrubber thread and wait for it
+//
+// Inputs       : none
+// Outputs      : 0
+int32_t block_scrub_stop(void)
+{
+	pthread_mutex_lock(&scrub.lock);
+	if (!scrub.running) {
+		pthread_mutex_unlock(&scrub.lock);
+		return 0;
+	}
+	scrub.stopping = 1;
+	pthread_cond_signal(&scrub.wake);
+	pthread_mutex_unlock(&scrub.lock);
+	pthread_join(scrub.thread, NULL);
+	scrub.running = 0;
+	logMessage(LOG_INFO_LEVEL, "Scrubber stopped, %lu frames scanned in %lu passes, %lu checksum errors, %lu repaired, %lu unrepairable",
+		(unsigned long)scrub.stats.frames_scanned, (unsigned long)scrub.stats.passes, (unsigned long)scrub.stats.checksum_errors,
+		(unsigned long)scrub.stats.repaired, (unsigned long)scrub.stats.unrepairable);
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_scrub_stats
+// Description  : copy the scrubber counters
+//
+// Inputs       : stats - where to copy them
+// Outputs      : none
+void block_scrub_stats(BlockScrubStats* stats)
+{
+	pthread_mutex_lock(&scrub.lock);
+	*stats = scrub.stats;
+	pthread_mutex_unlock(&scrub.lock);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_scrub_badframes
+// Description  : copy the frames the scrubber could not repair
+//
+// Inputs       : frames - where to copy them
+//                max - room in frames
+// Outputs      : number of frames copied
+int32_t block_scrub_badframes(BlockVolumeFrame* frames, int32_t max)
+{
+	int32_t n;
+
+	pthread_mutex_lock(&scrub.lock);
+	n = (scrub.nbad < max) ? scrub.nbad : max;
+	memcpy(frames, scrub.bad, n * sizeof(BlockVolumeFrame));
+	pthread_mutex_unlock(&scrub.lock);
+	return n;
+}
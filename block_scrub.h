@@ -0,0 +1,63 @@
+#ifndef BLOCK_SCRUB_INCLUDED
+#define BLOCK_SCRUB_INCLUDED
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : block_scrub.h
+//  Description    : This is the interface of the background scrubber, a
+//                   thread that walks the allotted frames of the volume and
+//                   verifies their checksums off the foreground path.
+//
+//  Author         : Vinayak Gupta
+//
+
+// Include files
+#include <stdint.h>
+
+// Project Includes
+#include <block_volume.h>
+
+// Defines
+#define BLOCK_SCRUB_IDLE_USEC 2000 // Foreground quiet time before scrubbing
+#define BLOCK_SCRUB_RETRIES 8 // Re-reads of a bad frame before giving up
+#define BLOCK_SCRUB_MAX_BADFRAMES 64 // Unrepairable frames remembered
+
+// Type definitions
+typedef struct {
+	uint64_t frames_scanned; // allotted frames verified
+	uint64_t passes; // complete walks of the volume
+	uint64_t checksum_errors; // frames whose first read failed the checksum
+	uint64_t repaired; // bad frames rewritten from a good copy
+	uint64_t unrepairable; // bad frames with no good copy
+} BlockScrubStats;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//
+// Interface functions
+
+int32_t block_scrub_start(uint32_t bytes_per_sec);
+// Start the scrubber, reading at most bytes_per_sec from the volume
+
+int32_t block_scrub_stop(void);
+// Stop the scrubber if running, called by block_poweroff
+
+void block_scrub_stats(BlockScrubStats* stats);
+// Copy the scrubber counters
+
+int32_t block_scrub_badframes(BlockVolumeFrame* frames, int32_t max);
+// Copy up to max unrepairable frames, returns the number copied
+
+struct BlockScrubState* block_scrub_ctx_create(void);
+// Create the scrubber of a new context, NULL if failure
+
+void block_scrub_ctx_destroy(struct BlockScrubState* state);
+// Release the scrubber of a context
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
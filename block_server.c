@@ -0,0 +1,387 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : block_server.c
+//  Description    : This is the BLOCK server daemon.  It owns the driver and
+//                   the bus, and serves the processes that attach to its
+//                   shared memory segment through block_client.  Every
+//                   client slot has its own server thread that runs the
+//                   slot's requests in order; the driver lock serializes
+//                   them against the other slots.  A client may only use
+//                   the handles it opened, and whatever it leaves open is
+//                   closed when it disconnects or its process dies.
+//
+//  Author         : Vinayak Gupta
+//
+
+// Include Files
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Project Includes
+#include <block_cache.h>
+#include <block_driver.h>
+#include <block_geometry.h>
+#include <block_server.h>
+#include <block_volume.h>
+#include <cmpsc311_log.h>
+
+// Defines
+#define BLOCK_SERVER_ARGUMENTS "hvl:n:c:m:w:"
+#define USAGE                                                                    \
+    "USAGE: block_server [-h] [-v] [-l <logfile>] [-n <name>] [-c <sz>]\n"      \
+    "                    [-m <members>] [-w <stripe>]\n"                         \
+    "\n"                                                                         \
+    "where:\n"                                                                   \
+    "    -h - help mode (display this message)\n"                                \
+    "    -v - verbose output\n"                                                  \
+    "    -l - write log messages to the filename <logfile>\n"                    \
+    "    -n - serve on shared memory object <name> (default /block_server)\n"   \
+    "    -c - set the block frame cache to <sz> frames (0 disables)\n"          \
+    "    -m - stripe the volume across <members> controllers (default 1)\n"      \
+    "    -w - stripe width of <stripe> frames per member (default 1)\n"          \
+    "\n"                                                                         \
+    "The server runs until it receives SIGINT or SIGTERM.\n"                     \
+    "\n"
+
+// The server side of one client slot
+typedef struct {
+    int index; // slot number
+    BlockServerSlot* slot; // the shared slot
+    pthread_t thread; // the thread serving it
+    char owned[BLOCK_MAX_OPEN_FILES]; // handles opened by the current client
+    uint64_t requests; // requests served since startup
+    uint64_t clients; // clients served since startup
+} BlockServerClient;
+
+//
+// Global Data
+BlockServerShared* shared; // the mapped segment
+BlockServerClient clients[BLOCK_SERVER_MAX_CLIENTS];
+volatile sig_atomic_t stopping; // set by SIGINT/SIGTERM
+
+//
+// Functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : server_stop
+// Description  : signal handler, asks the server to shut down
+//
+// Inputs       : sig - the signal
+// Outputs      : none
+
+static void server_stop(int sig)
+{
+    (void)sig;
+    stopping = 1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : server_release
+// Description  : close what the client of a slot left open and free the
+//                slot for the next client
+//
+// Inputs       : c - the slot
+// Outputs      : none
+
+static void server_release(BlockServerClient* c)
+{
+    int fd, leaked = 0;
+
+    for (fd = 0; fd < BLOCK_MAX_OPEN_FILES; fd++) {
+        if (c->owned[fd]) {
+            block_close(fd);
+            c->owned[fd] = 0;
+            leaked++;
+        }
+    }
+    if (leaked) {
+        logMessage(LOG_INFO_LEVEL, "Closed %d files left open by the client of slot %d", leaked, c->index);
+    }
+    c->slot->pid = 0;
+    c->slot->sq_tail = 0;
+    c->slot->cq_tail = 0;
+    __atomic_store_n(&c->slot->state, BLOCK_SERVER_SLOT_FREE, __ATOMIC_RELEASE);
+    syscall(SYS_futex, &c->slot->state, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : server_execute
+// Description  : run one request of a slot
+//
+// Inputs       : c - the slot
+//                e - the request, result is filled in
+//                payload - the request's payload chunk
+// Outputs      : none
+
+static void server_execute(BlockServerClient* c, BlockServerEntry* e, char* payload)
+{
+    int16_t fd;
+
+    e->result = -1;
+    if (e->op == BLOCK_SERVER_OP_OPEN) {
+        if ((e->len < 1) || (e->len > BLOCK_MAX_PATH_LENGTH) || (payload[e->len - 1] != 0x0)) {
+            logMessage(LOG_ERROR_LEVEL, "Bad open request from slot %d", c->index);
+            return;
+        }
+        if ((fd = block_open_flags(payload, (int32_t)e->arg)) >= 0) {
+            c->owned[fd] = 1;
+        }
+        e->result = fd;
+        return;
+    }
+
+    // Every other request names a handle this client opened
+    if ((e->fd < 0) || (e->fd >= BLOCK_MAX_OPEN_FILES) || !c->owned[e->fd]) {
+        logMessage(LOG_ERROR_LEVEL, "Slot %d used handle %d it did not open", c->index, e->fd);
+        return;
+    }
+    switch (e->op) {
+    case BLOCK_SERVER_OP_CLOSE:
+        if ((e->result = block_close(e->fd)) == 0) {
+            c->owned[e->fd] = 0;
+        }
+        break;
+
+    case BLOCK_SERVER_OP_READ:
+        if ((e->len >= 0) && (e->len <= BLOCK_SERVER_CHUNK)) {
+            e->result = block_read(e->fd, payload, e->len);
+        }
+        break;
+
+    case BLOCK_SERVER_OP_WRITE:
+        if ((e->len >= 0) && (e->len <= BLOCK_SERVER_CHUNK)) {
+            e->result = block_write(e->fd, payload, e->len);
+        }
+        break;
+
+    case BLOCK_SERVER_OP_SEEK:
+        e->result = block_seek(e->fd, e->arg);
+        break;
+
+    default:
+        logMessage(LOG_ERROR_LEVEL, "Unknown request %u from slot %d", e->op, c->index);
+        break;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : server_thread
+// Description  : serve one slot until the server stops, requests are run in
+//                submission order and completed in place
+//
+// Inputs       : arg - the slot
+// Outputs      : NULL
+
+static void* server_thread(void* arg)
+{
+    BlockServerClient* c = arg;
+    BlockServerSlot* s = c->slot;
+    struct timespec poll = { 0, BLOCK_SERVER_POLL_MSEC * 1000000L };
+    uint32_t head = 0, tail, state;
+
+    while (!stopping) {
+
+        // Wait for a client to claim the slot
+        state = __atomic_load_n(&s->state, __ATOMIC_ACQUIRE);
+        if (state == BLOCK_SERVER_SLOT_FREE) {
+            syscall(SYS_futex, &s->state, FUTEX_WAIT, BLOCK_SERVER_SLOT_FREE, &poll, NULL, 0);
+            head = 0;
+            continue;
+        }
+
+        // Serve what has been submitted
+        tail = __atomic_load_n(&s->sq_tail, __ATOMIC_ACQUIRE);
+        if (head != tail) {
+            while (head != tail) {
+                server_execute(c, &s->ring[head % BLOCK_SERVER_RING_DEPTH], s->payload[head % BLOCK_SERVER_RING_DEPTH]);
+                head++;
+                c->requests++;
+                block_server_post(&s->cq_tail, head, &s->client_sleeping);
+            }
+            continue;
+        }
+
+        // Idle, clean up after a departed client or wait for requests
+        if ((state == BLOCK_SERVER_SLOT_LEAVING) || ((kill(s->pid, 0) == -1) && (errno == ESRCH))) {
+            logMessage(LOG_INFO_LEVEL, "Client %d left slot %d", s->pid, c->index);
+            server_release(c);
+            c->clients++;
+            head = 0;
+            continue;
+        }
+        block_server_sleep(&s->sq_tail, &s->server_sleeping, tail, BLOCK_SERVER_POLL_MSEC);
+    }
+    return (NULL);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : main
+// Description  : The main function for the BLOCK server
+//
+// Inputs       : argc - the number of command line parameters
+//                argv - the parameters
+// Outputs      : 0 if successful, -1 if failure
+
+int main(int argc, char* argv[])
+{
+    // Local variables
+    char* name = BLOCK_SERVER_NAME;
+    uint32_t cache_size = 1024;
+    int ch, fd, i, started, verbose = 0, log_initialized = 0, ret = 0;
+    int members = 1, stripe = 1;
+    struct sigaction sa;
+
+    // Process the command line parameters
+    while ((ch = getopt(argc, argv, BLOCK_SERVER_ARGUMENTS)) != -1) {
+
+        switch (ch) {
+        case 'h': // Help, print usage
+            fprintf(stderr, USAGE);
+            return (-1);
+
+        case 'v': // Verbose Flag
+            verbose = 1;
+            break;
+
+        case 'l': // Set the log filename
+            initializeLogWithFilename(optarg);
+            log_initialized = 1;
+            break;
+
+        case 'n': // Set the shared memory object
+            name = optarg;
+            break;
+
+        case 'c': // Set cache line size
+            if (sscanf(optarg, "%u", &cache_size) != 1) {
+                logMessage(LOG_ERROR_LEVEL, "Bad cache size [%s]", optarg);
+                return (-1);
+            }
+            break;
+
+        case 'm': // Set the number of volume members
+            if (sscanf(optarg, "%d", &members) != 1) {
+                logMessage(LOG_ERROR_LEVEL, "Bad volume member count [%s]", optarg);
+                return (-1);
+            }
+            break;
+
+        case 'w': // Set the stripe width
+            if (sscanf(optarg, "%d", &stripe) != 1) {
+                logMessage(LOG_ERROR_LEVEL, "Bad stripe width [%s]", optarg);
+                return (-1);
+            }
+            break;
+
+        default: // Default (unknown)
+            fprintf(stderr, "Unknown command line option (%c), aborting.\n", ch);
+            return (-1);
+        }
+    }
+
+    // Setup the log as needed
+    if (!log_initialized) {
+        initializeLogWithFilehandle(CMPSC311_LOG_STDERR);
+    }
+    if (verbose) {
+        enableLogLevels(LOG_INFO_LEVEL);
+    }
+
+    // Power on the driver
+    if (block_volume_configure(members, stripe) == -1) {
+        fprintf(stderr, "Bad volume geometry (%d members, stripe %d), aborting.\n", members, stripe);
+        return (-1);
+    }
+    block_cache_configure(cache_size);
+    if (block_poweron() == -1) {
+        logMessage(LOG_ERROR_LEVEL, "BLOCK server failed to power on the driver.");
+        return (-1);
+    }
+
+    // Create the segment, replacing one left by a server that died
+    shm_unlink(name);
+    if ((fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0660)) == -1) {
+        logMessage(LOG_ERROR_LEVEL, "Failed to create shared memory object %s (%s)", name, strerror(errno));
+        block_poweroff();
+        return (-1);
+    }
+    if (ftruncate(fd, sizeof(BlockServerShared)) == -1) {
+        logMessage(LOG_ERROR_LEVEL, "Failed to size shared memory object %s (%s)", name, strerror(errno));
+        close(fd);
+        shm_unlink(name);
+        block_poweroff();
+        return (-1);
+    }
+    shared = mmap(NULL, sizeof(BlockServerShared), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shared == MAP_FAILED) {
+        logMessage(LOG_ERROR_LEVEL, "Failed to map shared memory object %s (%s)", name, strerror(errno));
+        shm_unlink(name);
+        block_poweroff();
+        return (-1);
+    }
+
+    // Start a thread per slot, then open for business
+    memset(&sa, 0x0, sizeof(sa));
+    sa.sa_handler = server_stop;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    shared->version = BLOCK_SERVER_VERSION;
+    shared->running = 1;
+    for (started = 0; started < BLOCK_SERVER_MAX_CLIENTS; started++) {
+        clients[started].index = started;
+        clients[started].slot = &shared->slot[started];
+        if (pthread_create(&clients[started].thread, NULL, server_thread, &clients[started])) {
+            logMessage(LOG_ERROR_LEVEL, "Failed to start the thread of slot %d", started);
+            stopping = 1;
+            ret = -1;
+            break;
+        }
+    }
+    __atomic_store_n(&shared->magic, BLOCK_SERVER_MAGIC, __ATOMIC_RELEASE);
+    logMessage(LOG_OUTPUT_LEVEL, "BLOCK server serving %d client slots on %s.", BLOCK_SERVER_MAX_CLIENTS, name);
+
+    // Wait to be stopped
+    while (!stopping) {
+        pause();
+    }
+
+    // Shut down, clients still attached see running drop
+    __atomic_store_n(&shared->running, 0, __ATOMIC_RELEASE);
+    for (i = 0; i < started; i++) {
+        syscall(SYS_futex, &shared->slot[i].state, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+        syscall(SYS_futex, &shared->slot[i].sq_tail, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+        pthread_join(clients[i].thread, NULL);
+        if (shared->slot[i].state != BLOCK_SERVER_SLOT_FREE) {
+            server_release(&clients[i]);
+        }
+        if (clients[i].requests > 0) {
+            logMessage(LOG_INFO_LEVEL, "Slot %d served %lu requests for %lu clients", i,
+                (unsigned long)clients[i].requests, (unsigned long)clients[i].clients);
+        }
+    }
+    shm_unlink(name);
+    munmap(shared, sizeof(BlockServerShared));
+    if (block_poweroff() == -1) {
+        logMessage(LOG_ERROR_LEVEL, "BLOCK server failed to power off the driver.");
+        ret = -1;
+    }
+    logMessage(LOG_OUTPUT_LEVEL, "BLOCK server shut down.");
+    return (ret);
+}
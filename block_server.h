@@ -0,0 +1,90 @@
+#ifndef BLOCK_SERVER_INCLUDED
+#define BLOCK_SERVER_INCLUDED
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : block_server.h
+//  Description    : This is the shared-memory layout between block_server,
+//                   the daemon that owns the driver, and its clients.  The
+//                   segment holds one slot per client.  A slot is a ring of
+//                   request entries, each with its own payload chunk: the
+//                   client fills entries and advances sq_tail, the server
+//                   runs them in order, stores the results in place and
+//                   advances cq_tail.  Each side sleeps on the other's index
+//                   with a futex once a short spin finds nothing to do.
+//
+//  Author         : Vinayak Gupta
+//
+
+// Include files
+#include <stdint.h>
+
+// Defines
+#define BLOCK_SERVER_NAME "/block_server" // Default shared memory object
+#define BLOCK_SERVER_MAGIC 0x424c4b53 // "BLKS", set once the segment is ready
+#define BLOCK_SERVER_VERSION 1 // Layout version, bumped on any change
+#define BLOCK_SERVER_MAX_CLIENTS 16 // Client slots in the segment
+#define BLOCK_SERVER_RING_DEPTH 32 // Requests in flight per client
+#define BLOCK_SERVER_CHUNK 65536 // Payload bytes per request
+#define BLOCK_SERVER_SPINS 2000 // Polls of an index before sleeping on it
+#define BLOCK_SERVER_POLL_MSEC 100 // Server sleep bound, to notice shutdown and dead clients
+
+// Slot states
+#define BLOCK_SERVER_SLOT_FREE 0 // no client
+#define BLOCK_SERVER_SLOT_BUSY 1 // claimed by the client in pid
+#define BLOCK_SERVER_SLOT_LEAVING 2 // released by the client, the server is cleaning up
+
+// Request operations
+typedef enum {
+	BLOCK_SERVER_OP_OPEN = 1, // payload holds the path, arg the BLOCK_O_* flags
+	BLOCK_SERVER_OP_CLOSE = 2, // close fd
+	BLOCK_SERVER_OP_READ = 3, // read len bytes at the cursor into the payload
+	BLOCK_SERVER_OP_WRITE = 4, // write len bytes of the payload at the cursor
+	BLOCK_SERVER_OP_SEEK = 5, // move the cursor to arg
+} BlockServerOp;
+
+// Type definitions
+typedef struct {
+	uint32_t op; // BLOCK_SERVER_OP_*
+	int32_t fd; // the file handle
+	uint32_t arg; // flags or offset
+	int32_t len; // payload bytes
+	int32_t result; // the driver's return value, set by the server
+} BlockServerEntry;
+
+typedef struct {
+	uint32_t state; // BLOCK_SERVER_SLOT_*
+	int32_t pid; // the client process
+	uint32_t sq_tail __attribute__((aligned(64))); // requests submitted, advanced by the client
+	uint32_t server_sleeping; // 1 while the server sleeps on sq_tail
+	uint32_t cq_tail __attribute__((aligned(64))); // requests completed, advanced by the server
+	uint32_t client_sleeping; // 1 while the client sleeps on cq_tail
+	BlockServerEntry ring[BLOCK_SERVER_RING_DEPTH] __attribute__((aligned(64)));
+	char payload[BLOCK_SERVER_RING_DEPTH][BLOCK_SERVER_CHUNK] __attribute__((aligned(4096)));
+} BlockServerSlot;
+
+typedef struct {
+	uint32_t magic; // BLOCK_SERVER_MAGIC once initialized
+	uint32_t version; // BLOCK_SERVER_VERSION
+	uint32_t running; // cleared when the server shuts down
+	BlockServerSlot slot[BLOCK_SERVER_MAX_CLIENTS];
+} BlockServerShared;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//
+// Interface functions, shared by the server and the client library
+
+int block_server_sleep(uint32_t* word, uint32_t* sleeping, uint32_t seen, int msec);
+// Spin and then sleep while *word == seen, at most msec (-1 forever); 1 if it changed
+
+void block_server_post(uint32_t* word, uint32_t value, uint32_t* sleeping);
+// Publish a new *word and wake the other side if it sleeps on it
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -11,31 +11,63 @@
 // Include Files
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 // Project Includes
+#include <block_cache.h>
 #include <block_controller.h>
+#include <block_csum.h>
 #include <block_driver.h>
+#include <block_log.h>
+#include <block_pack.h>
+#include <block_record.h>
+#include <block_scrub.h>
+#include <block_trace.h>
+#include <block_volume.h>
 #include <cmpsc311_log.h>
 #include <cmpsc311_util.h>
 
 // Defines
 #define BLOCK_WORKLOAD_DIR "workload"
-#define BLOCK_SIM_MAX_OPEN_FILES 128
-#define BLOCK_ARGUMENTS "huvl:x:"
+#define BLOCK_SIM_FTABLE_MIN 16 // Initial file table size, doubled as files are opened
+#define BLOCK_SIM_VALIDATE_CHUNK (BLOCK_FRAME_SIZE * 64) // Bytes compared per validation read
+#define BLOCK_SIM_VALIDATE_THREADS 4 // Default number of files validated at once
+#define BLOCK_SIM_MAX_VALIDATE_THREADS 64 // Maximum number of validation threads
+#define BLOCK_ARGUMENTS "huvdHl:x:c:m:w:s:t:q:g:k:j:T:R:"
 #define USAGE                                                                    \
-    "USAGE: block_sim [-h] [-v] [-l <logfile>] [-c <sz>] <workload-file>\n"      \
+    "USAGE: block_sim [-h] [-v] [-d] [-l <logfile>] [-c <sz>] [-m <members>]\n"  \
+    "                 [-w <stripe>] [-s <rate>] [-t <threads>] [-q <depth>]\n"  \
+    "                 [-g <frames>] [-k <bytes>] [-j <jobs>] [-T <trace>]\n"     \
+    "                 [-R <calls> [-H]] <workload-file>\n"                     \
     "\n"                                                                         \
     "where:\n"                                                                   \
     "    -h - help mode (display this message)\n"                                \
     "    -v - verbose output\n"                                                  \
+    "    -d - dump each validated file to workload/<file>.cmm for debugging\n"  \
     "    -l - write log messages to the filename <logfile>\n"                    \
-    "    -c - set the block block cache to size <sz> (disabled for assign #2)\n" \
+    "    -c - set the block frame cache to <sz> frames (0 disables)\n"          \
+    "    -m - stripe the volume across <members> controllers (default 1)\n"      \
+    "    -w - stripe width of <stripe> frames per member (default 1)\n"          \
+    "    -s - run the background scrubber at <rate> bytes/sec\n"                 \
+    "    -t - hash frames on <threads> checksum workers (default 2)\n"          \
+    "    -q - hold up to <depth> writes in the volume scheduler (0 disables)\n" \
+    "    -g - log-structured writes in segments of <frames> frames\n"         \
+    "    -k - pack files of up to <bytes> bytes several to a frame\n"          \
+    "    -j - validate <jobs> files at once at the end of the run (default 4)\n" \
+    "    -T - write a Chrome/Perfetto JSON timeline of the run to <trace>\n"   \
+    "    -R - record the block_* calls of the run to <calls> for block_replay\n" \
+    "    -H - keep a hash of each payload in the recorded calls\n"              \
     "\n"                                                                         \
     "    <workload-file> - file contain the workload to simulate\n"              \
     "\n"
@@ -49,12 +81,25 @@ typedef struct {
 //
 // Global Data
 int verbose;
+uint32_t scrub_rate; // background scrubber budget, 0 leaves it off
+int dump_cmm; // write a .cmm copy of each validated file
+int validate_threads = BLOCK_SIM_VALIDATE_THREADS; // files validated at once
+
+// The shared state of the validation threads
+typedef struct {
+    BlockSimulationTable* ftable; // the files to validate
+    int nfiles; // number of entries in ftable
+    int next; // next entry to claim
+    int failed; // set once any file fails
+    pthread_mutex_t lock; // protects next and failed
+} BlockSimulationValidation;
 
 //
 // Functional Prototypes
 
 int simulate_BLOCK(char* wload); // control loop of the BLOCK simulation
 int validate_file(char* fname, int16_t mfh); // Validate a file in the filesystem
+int validate_files(BlockSimulationTable* ftable, int nfiles); // Validate every file, several at once
 
 //
 // Functions
@@ -74,6 +119,14 @@ int main(int argc, char* argv[])
     // Local variables
     int ch, verbose = 0, log_initialized = 0, unit_tests = 0;
     uint32_t cache_size = 1024; // Defaults to 1024 cache lines
+    int members = 1, stripe = 1; // Defaults to the single controller
+    int csum_threads = BLOCK_CSUM_DEFAULT_THREADS;
+    int queue_depth = BLOCK_VOLUME_QUEUE_DEPTH;
+    uint32_t log_segment = 0; // Defaults to writing in place
+    uint32_t pack_threshold = 0; // Defaults to a frame per file
+    char* trace_file = NULL;
+    char* record_file = NULL; // Defaults to not recording the calls
+    int record_hashes = 0;
 
     // Process the command line parameters
     while ((ch = getopt(argc, argv, BLOCK_ARGUMENTS)) != -1) {
@@ -87,6 +140,14 @@ int main(int argc, char* argv[])
             verbose = 1;
             break;
 
+        case 'd': // Dump validated files
+            dump_cmm = 1;
+            break;
+
+        case 'H': // Hash the recorded payloads
+            record_hashes = 1;
+            break;
+
         case 'u': // Unit test Flag
             unit_tests = 1;
             break;
@@ -98,10 +159,75 @@ int main(int argc, char* argv[])
 
         case 'c': // Set cache line size
             if (sscanf(optarg, "%u", &cache_size) != 1) {
-                logMessage(LOG_ERROR_LEVEL, "Bad  cache size [%s]", argv[optind]);
+                logMessage(LOG_ERROR_LEVEL, "Bad  cache size [%s]", optarg);
+            }
+            break;
+
+        case 'm': // Set the number of volume members
+            if (sscanf(optarg, "%d", &members) != 1) {
+                logMessage(LOG_ERROR_LEVEL, "Bad volume member count [%s]", optarg);
+                return (-1);
+            }
+            break;
+
+        case 'w': // Set the stripe width
+            if (sscanf(optarg, "%d", &stripe) != 1) {
+                logMessage(LOG_ERROR_LEVEL, "Bad stripe width [%s]", optarg);
+                return (-1);
+            }
+            break;
+
+        case 's': // Start the scrubber
+            if (sscanf(optarg, "%u", &scrub_rate) != 1) {
+                logMessage(LOG_ERROR_LEVEL, "Bad scrubber rate [%s]", optarg);
+                return (-1);
+            }
+            break;
+
+        case 't': // Set the number of checksum workers
+            if (sscanf(optarg, "%d", &csum_threads) != 1) {
+                logMessage(LOG_ERROR_LEVEL, "Bad checksum thread count [%s]", optarg);
+                return (-1);
+            }
+            break;
+
+        case 'q': // Set the scheduler queue depth
+            if (sscanf(optarg, "%d", &queue_depth) != 1) {
+                logMessage(LOG_ERROR_LEVEL, "Bad scheduler queue depth [%s]", optarg);
+                return (-1);
+            }
+            break;
+
+        case 'g': // Write log-structured
+            if ((sscanf(optarg, "%u", &log_segment) != 1) || (log_segment == 0)) {
+                logMessage(LOG_ERROR_LEVEL, "Bad log segment size [%s]", optarg);
+                return (-1);
+            }
+            break;
+
+        case 'k': // Pack small files
+            if (sscanf(optarg, "%u", &pack_threshold) != 1) {
+                logMessage(LOG_ERROR_LEVEL, "Bad pack threshold [%s]", optarg);
+                return (-1);
+            }
+            break;
+
+        case 'j': // Set the number of validation threads
+            if ((sscanf(optarg, "%d", &validate_threads) != 1) || (validate_threads < 1) ||
+                (validate_threads > BLOCK_SIM_MAX_VALIDATE_THREADS)) {
+                logMessage(LOG_ERROR_LEVEL, "Bad validation thread count [%s]", optarg);
+                return (-1);
             }
             break;
 
+        case 'T': // Trace the run
+            trace_file = optarg;
+            break;
+
+        case 'R': // Record the calls of the run
+            record_file = optarg;
+            break;
+
         default: // Default (unknown)
             fprintf(stderr, "Unknown command line option (%c), aborting.\n", ch);
             return (-1);
@@ -120,6 +246,26 @@ int main(int argc, char* argv[])
         enableLogLevels(BlockControllerLLevel | BlockDriverLLevel | BlockSimulatorLLevel);
     }
 
+    // Configure the volume geometry, scheduler, cache, checksum pool, log and packer before the driver powers on
+    if (block_volume_configure(members, stripe) == -1) {
+        fprintf(stderr, "Bad volume geometry (%d members, stripe %d), aborting.\n", members, stripe);
+        return (-1);
+    }
+    if (block_volume_schedule(queue_depth, BLOCK_VOLUME_QUEUE_DEADLINE_USEC) == -1) {
+        fprintf(stderr, "Bad scheduler queue depth %d, aborting.\n", queue_depth);
+        return (-1);
+    }
+    block_cache_configure(cache_size);
+    if (block_csum_configure(csum_threads) == -1) {
+        fprintf(stderr, "Bad checksum thread count %d, aborting.\n", csum_threads);
+        return (-1);
+    }
+    block_log_configure(log_segment);
+    if (block_pack_configure(pack_threshold) == -1) {
+        fprintf(stderr, "Bad pack threshold %u, aborting.\n", pack_threshold);
+        return (-1);
+    }
+
     // If exgtracting file from data
     if (unit_tests) {
 
@@ -142,12 +288,28 @@ int main(int argc, char* argv[])
             return (-1);
         }
 
-        // Run the simulation
+        // Run the simulation, tracing and recording it if asked
+        if (trace_file != NULL) {
+            block_trace_enable(1);
+        }
+        if ((record_file != NULL) && (block_record_start(record_file, record_hashes) == -1)) {
+            fprintf(stderr, "Failed to create call log %s, aborting.\n", record_file);
+            return (-1);
+        }
         if (simulate_BLOCK(argv[optind]) == 0) {
             logMessage(LOG_INFO_LEVEL, "BLOCK simulation completed successfully.\n\n");
         } else {
             logMessage(LOG_INFO_LEVEL, "BLOCK simulation failed.\n\n");
         }
+        if ((record_file != NULL) && (block_record_stop() == -1)) {
+            fprintf(stderr, "Failed to write call log %s.\n", record_file);
+        }
+        if (trace_file != NULL) {
+            block_trace_enable(0);
+            if (block_trace_export(trace_file) == -1) {
+                fprintf(stderr, "Failed to write trace file %s.\n", trace_file);
+            }
+        }
     }
 
     // Return successfully
@@ -170,11 +332,9 @@ int simulate_BLOCK(char* wload)
     char line[1024], fname[128], command[128], text[1025], *sep, *rbuf;
     FILE* fhandle = NULL;
     int32_t err = 0, len, off, fields, linecount;
-    BlockSimulationTable ftable[BLOCK_SIM_MAX_OPEN_FILES];
-    int idx, i;
-
-    // Setup the file table
-    memset(ftable, 0x0, sizeof(BlockSimulationTable) * BLOCK_SIM_MAX_OPEN_FILES);
+    uint64_t span;
+    BlockSimulationTable *ftable = NULL, *grown;
+    int idx, i, nfiles = 0, maxfiles = 0;
 
     // Open the workload file
     linecount = 0;
@@ -191,10 +351,16 @@ int simulate_BLOCK(char* wload)
         return (-1);
     }
     logMessage(BlockSimulatorLLevel, "BLOCK simulator initialization complete.");
+    if ((scrub_rate > 0) && (block_scrub_start(scrub_rate) == -1)) {
+        logMessage(LOG_ERROR_LEVEL, "BLOCK simulator failed to start the scrubber.");
+        fclose(fhandle);
+        return (-1);
+    }
 
     // While file not done
  	 while (!feof(fhandle)) {
         // Get the line and bail out on fail
+        span = block_trace_begin();
         if (fgets(line, 1024, fhandle) != NULL) {
 
             // Parse out the string
@@ -215,23 +381,26 @@ int simulate_BLOCK(char* wload)
             // Now walk the the table looking for the file
             idx = -1;
             i = 0;
-            while ((i < BLOCK_SIM_MAX_OPEN_FILES) && (idx == -1)) {
-                if ((ftable[i].filename != NULL) && (strcmp(ftable[i].filename, fname) == 0)) {
+            while ((i < nfiles) && (idx == -1)) {
+                if (strcmp(ftable[i].filename, fname) == 0) {
                     idx = i;
                 }
                 i++;
             }
+            block_trace_end("block_sim parse", span);
 
             // File is not found, open the file
             if (idx == -1) {
 
-                // Log message, find unused index and save filename for later use
+                // Log message, grow the table as needed and save filename for later use
                 logMessage(BlockSimulatorLLevel, "BLOCK_SIM : Opening file [%s]", fname);
-                idx = 0;
-                while ((ftable[idx].filename != NULL) && (idx < BLOCK_SIM_MAX_OPEN_FILES)) {
-                    idx++;
+                if (nfiles == maxfiles) {
+                    maxfiles = maxfiles ? maxfiles * 2 : BLOCK_SIM_FTABLE_MIN;
+                    grown = realloc(ftable, sizeof(BlockSimulationTable) * maxfiles);
+                    CMPSC_ASSERT1(grown != NULL, "Failed to grow BLOCK sim file table to [%d]", maxfiles);
+                    ftable = grown;
                 }
-                CMPSC_ASSERT1(idx < BLOCK_SIM_MAX_OPEN_FILES, "Too many open files on BLOCK sim [%d]", idx);
+                idx = nfiles++;
                 ftable[idx].filename = strdup(fname);
 
                 // Now perform the open
@@ -339,15 +508,10 @@ int simulate_BLOCK(char* wload)
         }
     }
 
-    // Now walk the the table looking for the file
-    for (i = 0; i < BLOCK_SIM_MAX_OPEN_FILES; i++) {
-        if (ftable[i].filename != NULL) {
-            if (validate_file(ftable[i].filename, ftable[idx].fhandle) != 0) {
-                logMessage(LOG_ERROR_LEVEL, "BLOCK Validation failed on file [%s].", ftable[i].filename, fname);
-                fclose(fhandle);
-                return (-1);
-            }
-        }
+    // Now validate every file in the table
+    if (validate_files(ftable, nfiles) != 0) {
+        fclose(fhandle);
+        return (-1);
     }
 
     // Shut down the interface
@@ -360,10 +524,53 @@ int simulate_BLOCK(char* wload)
     logMessage(LOG_OUTPUT_LEVEL, "BLOCK simulation: all tests successful!!!.");
 
     // Close the workload file, successfully
+    for (i = 0; i < nfiles; i++) {
+        free(ftable[i].filename);
+    }
+    free(ftable);
     fclose(fhandle);
     return (0);
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : compare_buffers
+// Description  : Find the first byte where two buffers differ, 16 bytes at
+//                a time where SSE2 is available
+//
+// Inputs       : a, b - the buffers
+//                len - the number of bytes to compare
+// Outputs      : the offset of the first difference, len if they match
+
+static size_t compare_buffers(const char* a, const char* b, size_t len)
+{
+
+    // Local variables
+    size_t idx = 0;
+
+#ifdef __SSE2__
+    __m128i va, vb;
+    int mask;
+
+    // Compare 16 bytes at a time, the mask has a zero bit per differing byte
+    for (; idx + 16 <= len; idx += 16) {
+        va = _mm_loadu_si128((const __m128i*)(a + idx));
+        vb = _mm_loadu_si128((const __m128i*)(b + idx));
+        if ((mask = _mm_movemask_epi8(_mm_cmpeq_epi8(va, vb))) != 0xffff) {
+            return (idx + __builtin_ctz(~mask));
+        }
+    }
+#endif
+
+    // Compare the tail byte for byte
+    for (; idx < len; idx++) {
+        if (a[idx] != b[idx]) {
+            break;
+        }
+    }
+    return (idx);
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : validate_file
@@ -379,9 +586,10 @@ int validate_file(char* fname, int16_t mfh)
     // Local variables
     char filename[256], bkfile[256], *filbuf, *membuf;
     struct stat stats;
-    int idx, fh;
+    size_t pos, len, idx;
+    int fh, bk = -1, ret = -1;
 
-    // First figure out how big the file is, setup buffer
+    // First figure out how big the file is, map the reference copy
     snprintf(filename, 256, "%s/%s", BLOCK_WORKLOAD_DIR, fname);
     if ((stat(filename, &stats) != 0) || (stats.st_size == 0)) {
         logMessage(LOG_ERROR_LEVEL, "Failure validating file [%s], missing or "
@@ -389,62 +597,146 @@ int validate_file(char* fname, int16_t mfh)
             filename);
         return (-1);
     }
-    if (((filbuf = malloc(stats.st_size)) == NULL) || ((membuf = malloc(stats.st_size)) == NULL)) {
+    if ((fh = open(filename, O_RDONLY)) == -1) {
+        logMessage(LOG_ERROR_LEVEL, "Failure validating file [%s], open failed ", filename);
+        return (-1);
+    }
+    filbuf = mmap(NULL, stats.st_size, PROT_READ, MAP_PRIVATE, fh, 0);
+    close(fh);
+    if (filbuf == MAP_FAILED) {
+        logMessage(LOG_ERROR_LEVEL, "Failure validating file [%s], mmap failed (%s)", filename, strerror(errno));
+        return (-1);
+    }
+    madvise(filbuf, stats.st_size, MADV_SEQUENTIAL);
+    if ((membuf = malloc(BLOCK_SIM_VALIDATE_CHUNK)) == NULL) {
         logMessage(LOG_ERROR_LEVEL, "Failure validating file [%s], failed "
                                     "buffer allocation.",
             filename);
+        munmap(filbuf, stats.st_size);
         return (-1);
     }
 
-    // Now open the file and read the contents
-    if ((fh = open(filename, O_RDONLY)) == -1) {
-        logMessage(LOG_ERROR_LEVEL, "Failure validating file [%s], open failed ", filename);
-        return (-1);
-    }
-    if ((read(fh, filbuf, stats.st_size)) == -1) {
-        logMessage(LOG_ERROR_LEVEL, "Failure validating file [%s], read failed ", filename);
-        return (-1);
+    // Create a backup of the memory file so people can debug, if asked
+    if (dump_cmm) {
+        snprintf(bkfile, 256, "%s/%s.cmm", BLOCK_WORKLOAD_DIR, fname);
+        if ((bk = open(bkfile, O_RDWR | O_CREAT | O_TRUNC, S_IRWXU)) == -1) {
+            logMessage(LOG_ERROR_LEVEL, "Failure creating backup file [%s], open failed (%s) ",
+                bkfile, strerror(errno));
+            goto done;
+        }
     }
-    close(fh);
 
-    // Seek to the beginning of the memory file, read the contents
+    // Seek to the beginning of the memory file
     if (block_seek(mfh, 0) == -1) {
         // Failed, error out
         logMessage(LOG_ERROR_LEVEL, "Read block file [%s] see to zero failed.", fname);
-        return (-1);
-    }
-    if (block_read(mfh, membuf, stats.st_size) != stats.st_size) {
-        // Failed, error out
-        logMessage(LOG_ERROR_LEVEL, "Read block file [%s] of length %d failed.", fname, stats.st_size);
-        return (-1);
+        goto done;
     }
 
-    // Now create a backup of the memory file so people can debug
-    snprintf(bkfile, 256, "%s/%s.cmm", BLOCK_WORKLOAD_DIR, fname);
-    if ((fh = open(bkfile, O_RDWR | O_CREAT | O_TRUNC, S_IRWXU)) == -1) {
-        logMessage(LOG_ERROR_LEVEL, "Failure creating backup file [%s], open failed (%s) ",
-            bkfile, strerror(errno));
-        return (-1);
+    // Now stream the memory file a chunk at a time and compare
+    for (pos = 0; pos < (size_t)stats.st_size; pos += len) {
+        len = stats.st_size - pos;
+        if (len > BLOCK_SIM_VALIDATE_CHUNK) {
+            len = BLOCK_SIM_VALIDATE_CHUNK;
+        }
+        if (block_read(mfh, membuf, len) != (int32_t)len) {
+            // Failed, error out
+            logMessage(LOG_ERROR_LEVEL, "Read block file [%s] of length %d failed at offset %lu.",
+                fname, stats.st_size, (unsigned long)pos);
+            goto done;
+        }
+        if ((bk != -1) && (write(bk, membuf, len) != (ssize_t)len)) {
+            logMessage(LOG_ERROR_LEVEL, "Failure writing backup file [%s].", bkfile);
+            goto done;
+        }
+        if ((idx = compare_buffers(membuf, filbuf + pos, len)) < len) {
+            logMessage(LOG_ERROR_LEVEL, "Validation of [%s] failed at offset %lu (mem %x/'%c' "
+                                        "!= fil %x/'%c'",
+                fname, (unsigned long)(pos + idx), membuf[idx], membuf[idx], filbuf[pos + idx], filbuf[pos + idx]);
+            goto done;
+        }
     }
-    if ((write(fh, membuf, stats.st_size)) == -1) {
-        logMessage(LOG_ERROR_LEVEL, "Failure writing backup file [%s].", bkfile);
-        return (-1);
+
+    // Log success
+    logMessage(LOG_OUTPUT_LEVEL, "Validation of [%s], length %d sucessful.", fname, stats.st_size);
+    ret = 0;
+
+done:
+    // Free the buffers and return
+    if (bk != -1) {
+        close(bk);
     }
-    close(fh);
+    free(membuf);
+    munmap(filbuf, stats.st_size);
+    return (ret);
+}
 
-    // Now walk the buffers and compare byte for byte
-    for (idx = 0; idx < stats.st_size; idx++) {
-        if (membuf[idx] != filbuf[idx]) {
-            logMessage(LOG_ERROR_LEVEL, "Validation of [%s] failed at offset %d (mem %x/'%c' "
-                                        "!= fil %x/'%c'",
-                fname, idx, membuf[idx], membuf[idx], filbuf[idx], filbuf[idx]);
-            return (-1);
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : validate_thread
+// Description  : Validation thread, claims files from the table until none
+//                are left or one fails
+//
+// Inputs       : arg - the shared validation state
+// Outputs      : NULL
+
+static void* validate_thread(void* arg)
+{
+
+    // Local variables
+    BlockSimulationValidation* val = arg;
+    uint64_t span;
+    int i, ret;
+
+    for (;;) {
+        pthread_mutex_lock(&val->lock);
+        if (val->failed || (val->next == val->nfiles)) {
+            pthread_mutex_unlock(&val->lock);
+            return (NULL);
+        }
+        i = val->next++;
+        pthread_mutex_unlock(&val->lock);
+
+        span = block_trace_begin();
+        ret = validate_file(val->ftable[i].filename, val->ftable[i].fhandle);
+        block_trace_end("validate_file", span);
+        if (ret != 0) {
+            logMessage(LOG_ERROR_LEVEL, "BLOCK Validation failed on file [%s].", val->ftable[i].filename);
+            pthread_mutex_lock(&val->lock);
+            val->failed = 1;
+            pthread_mutex_unlock(&val->lock);
         }
     }
+}
 
-    // Free the buffers, log success, and return successfully
-    free(filbuf);
-    free(membuf);
-    logMessage(LOG_OUTPUT_LEVEL, "Validation of [%s], length %d sucessful.", fname, stats.st_size);
-    return (0);
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : validate_files
+// Description  : Validate every file in the table, each file has its own
+//                handle so up to validate_threads of them run at once
+//
+// Inputs       : ftable - the file table
+//                nfiles - the number of files in the table
+// Outputs      : 0 if successful test, -1 if failure
+
+int validate_files(BlockSimulationTable* ftable, int nfiles)
+{
+
+    // Local variables
+    BlockSimulationValidation val = { ftable, nfiles, 0, 0, PTHREAD_MUTEX_INITIALIZER };
+    pthread_t threads[BLOCK_SIM_MAX_VALIDATE_THREADS];
+    int i, started;
+
+    // Start the threads, the caller validates alongside them
+    for (started = 0; (started < validate_threads - 1) && (started < nfiles - 1); started++) {
+        if (pthread_create(&threads[started], NULL, validate_thread, &val)) {
+            logMessage(LOG_ERROR_LEVEL, "Failed to start validation thread %d, continuing with fewer.", started);
+            break;
+        }
+    }
+    validate_thread(&val);
+    for (i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    return (val.failed ? -1 : 0);
 }
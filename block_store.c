@@ -0,0 +1,136 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : block_store.c
+//  Description    : This is the implementation of the stand-in block store,
+//                   an in-memory controller used to back additional volume
+//                   members.  It follows the block_io_bus register contract:
+//                   reads return the frame checksum in CS1, writes are
+//                   rejected with BLOCK_RET_CHECKSUM_ERROR if CS1 does not
+//                   match the frame contents.
+//
+//  Author         : Vinayak Gupta
+//
+
+// Includes
+#include <stdlib.h>
+#include <string.h>
+
+// Project Includes
+#include <block_driver.h>
+#include <block_geometry.h>
+#include <block_store.h>
+#include <cmpsc311_log.h>
+
+//
+// Implementation
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_store_create
+// Description  : Create a new stand-in block store, storage is allocated
+//                when the store receives BLOCK_OP_INITMS
+//
+// Inputs       : none
+// Outputs      : pointer to the store if successful, NULL if failure
+BlockStore* block_store_create(void)
+{
+	BlockStore* store;
+	if ((store = calloc(1, sizeof(BlockStore))) == NULL) {
+		logMessage(LOG_ERROR_LEVEL, "Failed to allocate stand-in block store");
+		return NULL;
+	}
+	return store;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_store_destroy
+// Description  : Release the store and its frame storage
+//
+// Inputs       : store - the store to release
+// Outputs      : none
+void block_store_destroy(BlockStore* store)
+{
+	if (store == NULL) {
+		return;
+	}
+	free(store->frames);
+	free(store);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_store_bus
+// Description  : Execute one controller operation against the store
+//
+// Inputs       : store - the store to operate on
+//                regstate - the request register (KY1, FM1, CS1)
+//                buf - frame buffer for read/write operations
+// Outputs      : response register, RT1 holds the return code
+BlockXferRegister block_store_bus(BlockStore* store, BlockXferRegister regstate, void* buf)
+{
+	BlockXferRegister KY1, FM1, CS1, RT1;
+	uint32_t checksum;
+
+	KY1 = get_KYcode(regstate);
+	FM1 = get_FMcode(regstate);
+	CS1 = (uint32_t)get_CScode(regstate);
+	RT1 = BLOCK_RET_SUCCESS;
+
+	switch (KY1) {
+	case BLOCK_OP_INITMS: // frames are zero filled by calloc
+		if (store->frames == NULL) {
+			store->frames = calloc(BLOCK_BLOCK_SIZE, BLOCK_FRAME_SIZE);
+		}
+		if (store->frames == NULL) {
+			logMessage(LOG_ERROR_LEVEL, "Stand-in block store failed to allocate frames");
+			RT1 = (uint8_t)BLOCK_RET_ERROR;
+			break;
+		}
+		store->powered = 1;
+		break;
+
+	case BLOCK_OP_BZERO:
+		if (!store->powered) {
+			RT1 = (uint8_t)BLOCK_RET_ERROR;
+			break;
+		}
+		memset(store->frames, 0x0, (size_t)BLOCK_FRAME_SIZE * BLOCK_BLOCK_SIZE);
+		break;
+
+	case BLOCK_OP_RDFRME:
+		if ((!store->powered) || (buf == NULL) || (FM1 >= BLOCK_BLOCK_SIZE)) {
+			RT1 = (uint8_t)BLOCK_RET_ERROR;
+			break;
+		}
+		memcpy(buf, store->frames[FM1], BLOCK_FRAME_SIZE);
+		computeframechecksum(buf, &checksum);
+		CS1 = checksum;
+		store->reads++;
+		break;
+
+	case BLOCK_OP_WRFRME:
+		if ((!store->powered) || (buf == NULL) || (FM1 >= BLOCK_BLOCK_SIZE)) {
+			RT1 = (uint8_t)BLOCK_RET_ERROR;
+			break;
+		}
+		computeframechecksum(buf, &checksum);
+		if (checksum != CS1) {
+			RT1 = BLOCK_RET_CHECKSUM_ERROR;
+			break;
+		}
+		memcpy(store->frames[FM1], buf, BLOCK_FRAME_SIZE);
+		store->writes++;
+		break;
+
+	case BLOCK_OP_POWOFF:
+		store->powered = 0;
+		break;
+
+	default:
+		RT1 = (uint8_t)BLOCK_RET_ERROR;
+		break;
+	}
+
+	return (create_opcode(KY1, FM1, CS1, RT1));
+}
@@ -0,0 +1,49 @@
+#ifndef BLOCK_STORE_INCLUDED
+#define BLOCK_STORE_INCLUDED
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : block_store.h
+//  Description    : This is the interface of the stand-in block store, an
+//                   in-memory controller that speaks the same register
+//                   protocol as block_io_bus.  Volume members other than the
+//                   hardware controller are backed by these stores.
+//
+//  Author         : Vinayak Gupta
+//
+
+// Include files
+#include <stdint.h>
+
+// Project Includes
+#include <block_geometry.h>
+
+// Type definitions
+typedef struct {
+	char (*frames)[BLOCK_FRAME_SIZE]; // frame storage, allocated at BLOCK_OP_INITMS
+	int powered; // 1 if initialized, 0 otherwise
+	uint64_t reads; // frames read through this store
+	uint64_t writes; // frames written through this store
+} BlockStore;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//
+// Interface functions
+
+BlockStore* block_store_create(void);
+// Create a new (powered off) stand-in block store
+
+void block_store_destroy(BlockStore* store);
+// Release the store and its frame storage
+
+BlockXferRegister block_store_bus(BlockStore* store, BlockXferRegister regstate, void* buf);
+// Execute one controller operation against the store, same contract as block_io_bus
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
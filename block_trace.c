@@ -0,0 +1,257 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : block_trace.c
+//  Description    : This is the implementation of the span tracer.  Spans are
+//                   stamped with the TSC where there is one (the monotonic
+//                   clock elsewhere) and appended to a buffer owned by the
+//                   calling thread, so recording takes no lock.  A thread's
+//                   buffer is registered on its first span and kept for the
+//                   life of the process so spans of exited threads can still
+//                   be exported.  TSC ticks are converted to microseconds
+//                   against the monotonic clock at export.
+//
+//  Author         : Vinayak Gupta
+//
+
+// Includes
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#ifdef BLOCK_TRACE_USDT
+#include <sys/sdt.h>
+#endif
+
+// Project Includes
+#include <block_trace.h>
+#include <cmpsc311_log.h>
+
+// Type definitions
+typedef struct {
+	const char* name; // span name
+	uint64_t start; // start timestamp
+	uint64_t end; // end timestamp
+} BlockTraceEvent;
+
+typedef struct BlockTraceBuffer {
+	BlockTraceEvent* events; // the spans of this thread
+	uint32_t count; // spans recorded
+	uint32_t cap; // room in events
+	uint64_t dropped; // spans lost to a full or unallocated buffer
+	int tid; // thread number in the timeline
+	struct BlockTraceBuffer* next; // registry link
+} BlockTraceBuffer;
+
+// The tracer, one per process
+static struct {
+	int on; // 1 while spans are recorded
+	uint64_t tick0; // timestamp when recording started
+	uint64_t nsec0; // monotonic nsec when recording started
+	BlockTraceBuffer* buffers; // every thread that has recorded a span
+	int threads; // number of registered buffers
+	pthread_mutex_t lock; // protects the registry
+} tracer = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static __thread BlockTraceBuffer* mybuffer; // the calling thread's buffer
+
+//
+// Implementation
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_trace_nsec
+// Description  : monotonic clock in nanoseconds
+//
+// Inputs       : none
+// Outputs      : nanoseconds
+static uint64_t block_trace_nsec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_trace_clock
+// Description  : the span timestamp, TSC ticks or monotonic nanoseconds
+//
+// Inputs       : none
+// Outputs      : the timestamp
+static uint64_t block_trace_clock(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return (__rdtsc());
+#else
+	return (block_trace_nsec());
+#endif
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_trace_buffer
+// Description  : the calling thread's buffer, registered on first use
+//
+// Inputs       : none
+// Outputs      : the buffer, NULL if it could not be allocated
+static BlockTraceBuffer* block_trace_buffer(void)
+{
+	BlockTraceBuffer* b;
+
+	if (mybuffer != NULL) {
+		return (mybuffer);
+	}
+	if ((b = calloc(1, sizeof(BlockTraceBuffer))) == NULL) {
+		return (NULL);
+	}
+	pthread_mutex_lock(&tracer.lock);
+	b->tid = ++tracer.threads;
+	b->next = tracer.buffers;
+	tracer.buffers = b;
+	pthread_mutex_unlock(&tracer.lock);
+	mybuffer = b;
+	return (b);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_trace_enable
+// Description  : start or stop recording spans
+//
+// Inputs       : on - 1 to start, 0 to stop
+// Outputs      : 0
+int32_t block_trace_enable(int on)
+{
+	BlockTraceBuffer* b;
+
+	pthread_mutex_lock(&tracer.lock);
+	if (on && !tracer.on) {
+		for (b = tracer.buffers; b != NULL; b = b->next) {
+			b->count = 0;
+			b->dropped = 0;
+		}
+		tracer.nsec0 = block_trace_nsec();
+		tracer.tick0 = block_trace_clock();
+	}
+	__atomic_store_n(&tracer.on, on ? 1 : 0, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&tracer.lock);
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_trace_begin
+// Description  : open a span
+//
+// Inputs       : none
+// Outputs      : the start timestamp, 0 when nothing is recording
+uint64_t block_trace_begin(void)
+{
+#ifndef BLOCK_TRACE_USDT
+	if (!__atomic_load_n(&tracer.on, __ATOMIC_RELAXED)) {
+		return (0);
+	}
+#endif
+	return (block_trace_clock());
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_trace_end
+// Description  : close a span and record it in the calling thread's buffer
+//
+// Inputs       : name - the span name, a string constant
+//                start - the timestamp returned by block_trace_begin
+// Outputs      : none
+void block_trace_end(const char* name, uint64_t start)
+{
+	BlockTraceBuffer* b;
+	BlockTraceEvent* grown;
+	uint64_t end;
+	uint32_t cap;
+
+	if (start == 0) {
+		return;
+	}
+	end = block_trace_clock();
+#ifdef BLOCK_TRACE_USDT
+	DTRACE_PROBE3(block, span, name, start, end);
+#endif
+	if (!__atomic_load_n(&tracer.on, __ATOMIC_RELAXED) || ((b = block_trace_buffer()) == NULL)) {
+		return;
+	}
+
+	// Grow the buffer by doubling up to the per-thread limit
+	if (b->count == b->cap) {
+		cap = b->cap ? b->cap * 2 : 4096;
+		if ((cap > BLOCK_TRACE_THREAD_EVENTS) || ((grown = realloc(b->events, sizeof(BlockTraceEvent) * cap)) == NULL)) {
+			b->dropped++;
+			return;
+		}
+		b->events = grown;
+		b->cap = cap;
+	}
+	b->events[b->count].name = name;
+	b->events[b->count].start = start;
+	b->events[b->count].end = end;
+	b->count++;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_trace_export
+// Description  : write the recorded spans as a Chrome/Perfetto JSON
+//                timeline of complete ("X") events, one track per thread
+//
+// Inputs       : path - the file to write
+// Outputs      : 0 if successful, -1 if failure
+int32_t block_trace_export(const char* path)
+{
+	BlockTraceBuffer* b;
+	BlockTraceEvent* e;
+	FILE* out;
+	double usec_per_tick;
+	uint64_t ticks, spans = 0, dropped = 0;
+	uint32_t i;
+	int first = 1;
+
+	if ((out = fopen(path, "w")) == NULL) {
+		logMessage(LOG_ERROR_LEVEL, "Failed to open trace file [%s]", path);
+		return (-1);
+	}
+
+	// Calibrate the clock against the monotonic time elapsed since enable
+	pthread_mutex_lock(&tracer.lock);
+	ticks = block_trace_clock() - tracer.tick0;
+	usec_per_tick = ticks ? (block_trace_nsec() - tracer.nsec0) / 1000.0 / ticks : 0;
+
+	fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+	for (b = tracer.buffers; b != NULL; b = b->next) {
+		fprintf(out, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"thread %d\"}}",
+			first ? "" : ",", b->tid, b->tid);
+		first = 0;
+		for (i = 0; i < b->count; i++) {
+			e = &b->events[i];
+			fprintf(out, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+				e->name, b->tid, (double)(int64_t)(e->start - tracer.tick0) * usec_per_tick,
+				(double)(e->end - e->start) * usec_per_tick);
+		}
+		spans += b->count;
+		dropped += b->dropped;
+	}
+	fprintf(out, "\n]}\n");
+	pthread_mutex_unlock(&tracer.lock);
+
+	if (fclose(out)) {
+		logMessage(LOG_ERROR_LEVEL, "Failed to write trace file [%s]", path);
+		return (-1);
+	}
+	logMessage(LOG_INFO_LEVEL, "Trace of %lu spans on %d threads written to [%s], %lu spans dropped",
+		(unsigned long)spans, tracer.threads, path, (unsigned long)dropped);
+	return (0);
+}
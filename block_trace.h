@@ -0,0 +1,45 @@
+#ifndef BLOCK_TRACE_INCLUDED
+#define BLOCK_TRACE_INCLUDED
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : block_trace.h
+//  Description    : This is the interface of the span tracer.  Timed spans
+//                   around the driver stages are kept in per-thread buffers
+//                   and exported as a Chrome/Perfetto JSON timeline.  Build
+//                   with -DBLOCK_TRACE_USDT to also fire a block:span USDT
+//                   probe at the end of every span.
+//
+//  Author         : Vinayak Gupta
+//
+
+// Include files
+#include <stdint.h>
+
+// Defines
+#define BLOCK_TRACE_THREAD_EVENTS (1 << 20) // Spans kept per thread, later ones are dropped
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//
+// Interface functions
+
+int32_t block_trace_enable(int on);
+// Start (1) or stop (0) recording spans, starting discards earlier spans
+
+uint64_t block_trace_begin(void);
+// Open a span, returns its start timestamp (0 when nothing is recording)
+
+void block_trace_end(const char* name, uint64_t start);
+// Close the span opened at start, name must be a string constant
+
+int32_t block_trace_export(const char* path);
+// Write the recorded spans as Chrome/Perfetto JSON, traced threads must be idle
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,950 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : block_volume.c
+//  Description    : This is the implementation of the volume layer.  Logical
+//                   frames are striped across the members in runs of
+//                   "stripe" frames, so logical frame L lives on member
+//                   (L / stripe) % members.  Multi-frame requests are split
+//                   per member and each member is driven by its own worker
+//                   thread, so bus operations to different members overlap.
+//
+//                   Requests pass through a scheduler.  Writes are queued
+//                   (a rewrite of a queued frame replaces it), reads of a
+//                   queued frame are answered from the queue and duplicate
+//                   reads in a batch go to the bus once.  The queue is
+//                   flushed when full, when its oldest write reaches the
+//                   deadline, or before any other operation, and every
+//                   batch is sent to each member in elevator (C-LOOK) order
+//                   of member frame.  A queued write the members still
+//                   reject after BLOCK_VOLUME_WRITE_RETRIES re-sends is
+//                   parked: it stays in the queue, reads of its frame are
+//                   answered from it, and it is no longer sent.  The driver
+//                   takes parked writes with block_volume_unpark and moves
+//                   their data to other frames.  When the queue holds
+//                   nothing but parked writes, new writes go straight to
+//                   the bus so their caller sees the real response.
+//
+//  Author         : Vinayak Gupta
+//
+
+// Includes
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Project Includes
+#include <block_ctx.h>
+#include <block_driver.h>
+#include <block_geometry.h>
+#include <block_store.h>
+#include <block_trace.h>
+#include <block_volume.h>
+#include <cmpsc311_log.h>
+
+// Type definitions
+typedef struct {
+	BlockStore* store; // stand-in store, NULL for the block_io_bus controller
+	pthread_mutex_t buslock; // one operation at a time on the member bus
+	pthread_t worker; // worker thread driving this member
+	BlockVolumeXfer** jobs; // requests assigned by the current batch
+	int njobs; // number of requests assigned, 0 when idle
+	BlockFrameIndex head; // member frame served last, the elevator position
+} BlockVolumeMember;
+
+typedef struct {
+	BlockVolumeFrame frame; // logical frame to write
+	uint32_t checksum; // CS1 given with the write
+	int parked; // 1 if the members rejected it, held for block_volume_unpark
+	char data[BLOCK_FRAME_SIZE]; // frame contents
+} BlockVolumePending;
+
+// The scheduler queue in front of the members
+typedef struct {
+	int depth; // writes held before a flush, 0 sends writes straight through
+	uint32_t deadline; // longest a queued write waits for the bus, usec
+	BlockVolumePending* pending; // the queued writes
+	int count; // number of queued writes, parked ones included
+	int parked; // number of parked writes
+	uint64_t oldest; // monotonic usec the first queued write arrived
+	int stopping; // set to stop the flusher
+	pthread_t flusher; // enforces the deadline while the volume is idle
+	pthread_mutex_t lock; // held across every scheduled operation
+	pthread_cond_t queued; // signalled when the queue becomes non-empty
+	uint64_t issued, merged, served, dupreads; // statistics
+	uint64_t rdframes, wrframes; // frames moved over the member buses
+} BlockVolumeSched;
+
+// The volume of a context
+struct BlockVolumeState {
+	int members; // number of striped controllers
+	int stripe; // stripe width in frames
+	int powered; // 1 if the members are initialized
+	int stopping; // set to shut the worker threads down
+	int pending; // members still working on the current batch
+	pthread_mutex_t lock; // protects the job assignment
+	pthread_cond_t work; // signalled when jobs are assigned
+	pthread_cond_t done; // signalled when a member finishes its jobs
+	pthread_mutex_t batch; // one multi-member batch at a time
+	BlockVolumeMember member[BLOCK_VOLUME_MAX_MEMBERS];
+	int standin; // 1 if member 0 is a stand-in store rather than block_io_bus
+	BlockVolumeSched queue; // the scheduler queue
+};
+#define volume (*block_ctx_bound->volume) // the volume of the calling thread's context
+#define sched (volume.queue) // its scheduler queue
+
+//
+// Implementation
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_volume_ctx_create / block_volume_ctx_destroy
+// Description  : create and release the volume of a context
+//
+// Inputs       : standin - 1 to back member 0 with a stand-in store
+//                state - the volume to release, may be NULL
+// Outputs      : block_volume_ctx_create returns the volume, NULL if failure
+struct BlockVolumeState* block_volume_ctx_create(int standin)
+{
+	struct BlockVolumeState* state;
+
+	if ((state = calloc(1, sizeof(struct BlockVolumeState))) == NULL) {
+		return NULL;
+	}
+	state->members = 1;
+	state->stripe = 1;
+	state->standin = standin;
+	pthread_mutex_init(&state->lock, NULL);
+	pthread_cond_init(&state->work, NULL);
+	pthread_cond_init(&state->done, NULL);
+	pthread_mutex_init(&state->batch, NULL);
+	state->queue.depth = BLOCK_VOLUME_QUEUE_DEPTH;
+	state->queue.deadline = BLOCK_VOLUME_QUEUE_DEADLINE_USEC;
+	pthread_mutex_init(&state->queue.lock, NULL);
+	pthread_cond_init(&state->queue.queued, NULL);
+	return state;
+}
+
+void block_volume_ctx_destroy(struct BlockVolumeState* state)
+{
+	if (state == NULL) {
+		return;
+	}
+	pthread_cond_destroy(&state->queue.queued);
+	pthread_mutex_destroy(&state->queue.lock);
+	pthread_mutex_destroy(&state->batch);
+	pthread_cond_destroy(&state->done);
+	pthread_cond_destroy(&state->work);
+	pthread_mutex_destroy(&state->lock);
+	free(state);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_volume_map
+// Description  : translate a logical frame into a member and member frame
+//
+// Inputs       : frame - the logical frame
+//                pframe - the frame within the member (output)
+// Outputs      : the member index
+static int block_volume_map(BlockVolumeFrame frame, BlockFrameIndex* pframe)
+{
+	BlockVolumeFrame stripeno = frame / volume.stripe;
+	*pframe = (BlockFrameIndex)((stripeno / volume.members) * volume.stripe + frame % volume.stripe);
+	return (stripeno % volume.members);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_volume_usec
+// Description  : monotonic clock in microseconds
+//
+// Inputs       : none
+// Outputs      : microseconds
+static uint64_t block_volume_usec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_volume_dispatch
+// Description  : send a register state to one member, FM1 is rewritten with
+//                the member-relative frame.  The member bus lock lets
+//                background tasks share a member with the foreground.
+//
+// Inputs       : m - the member index
+//                regstate - the request register
+//                pframe - the member frame
+//                buf - the frame buffer
+// Outputs      : the member response register
+static BlockXferRegister block_volume_dispatch(int m, BlockXferRegister regstate, BlockFrameIndex pframe, void* buf)
+{
+	uint64_t span;
+
+	regstate = create_opcode(get_KYcode(regstate), pframe, (uint32_t)get_CScode(regstate), get_RTcode(regstate));
+	pthread_mutex_lock(&volume.member[m].buslock);
+	__atomic_add_fetch(&sched.issued, 1, __ATOMIC_RELAXED);
+	if (get_KYcode(regstate) == BLOCK_OP_RDFRME) {
+		__atomic_add_fetch(&sched.rdframes, 1, __ATOMIC_RELAXED);
+	} else if (get_KYcode(regstate) == BLOCK_OP_WRFRME) {
+		__atomic_add_fetch(&sched.wrframes, 1, __ATOMIC_RELAXED);
+	}
+	span = block_trace_begin();
+#if !BLOCK_VOLUME_STANDIN
+	if (volume.member[m].store == NULL) {
+		regstate = block_io_bus(regstate, buf);
+		block_trace_end("block_io_bus", span);
+		pthread_mutex_unlock(&volume.member[m].buslock);
+		return (regstate);
+	}
+#endif
+	regstate = block_store_bus(volume.member[m].store, regstate, buf);
+	block_trace_end("block_store_bus", span);
+	pthread_mutex_unlock(&volume.member[m].buslock);
+	return (regstate);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_volume_elevator
+// Description  : order the requests of one member C-LOOK fashion, upwards
+//                from the member frame served last and then wrapping
+//
+// Inputs       : jobs - the requests, all on member m
+//                njobs - the number of requests
+//                m - the member
+// Outputs      : none
+static void block_volume_elevator(BlockVolumeXfer** jobs, int njobs, int m)
+{
+	BlockVolumeXfer* job;
+	BlockFrameIndex pframe, head = __atomic_load_n(&volume.member[m].head, __ATOMIC_RELAXED);
+	uint32_t k;
+	int i, j;
+
+	for (i = 1; i < njobs; i++) {
+		job = jobs[i];
+		block_volume_map(job->frame, &pframe);
+		k = (uint32_t)((pframe - head) & (BLOCK_BLOCK_SIZE - 1));
+		for (j = i; j > 0; j--) {
+			block_volume_map(jobs[j - 1]->frame, &pframe);
+			if ((uint32_t)((pframe - head) & (BLOCK_BLOCK_SIZE - 1)) <= k) {
+				break;
+			}
+			jobs[j] = jobs[j - 1];
+		}
+		jobs[j] = job;
+	}
+	if (njobs > 0) {
+		block_volume_map(jobs[njobs - 1]->frame, &pframe);
+		__atomic_store_n(&volume.member[m].head, pframe, __ATOMIC_RELAXED);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_volume_run
+// Description  : execute a list of requests, all on the same member
+//
+// Inputs       : jobs - the requests
+//                njobs - the number of requests
+// Outputs      : none
+static void block_volume_run(BlockVolumeXfer** jobs, int njobs)
+{
+	BlockFrameIndex pframe;
+	int i, m;
+	for (i = 0; i < njobs; i++) {
+		m = block_volume_map(jobs[i]->frame, &pframe);
+		jobs[i]->regstate = block_volume_dispatch(m, jobs[i]->regstate, pframe, jobs[i]->buf);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_volume_worker
+// Description  : member worker thread, runs the jobs assigned to its member
+//
+// Inputs       : arg - the member
+// Outputs      : NULL
+static void* block_volume_worker(void* arg)
+{
+	BlockVolumeMember* mem = arg;
+	pthread_mutex_lock(&volume.lock);
+	for (;;) {
+		while ((!volume.stopping) && (mem->njobs == 0)) {
+			pthread_cond_wait(&volume.work, &volume.lock);
+		}
+		if (volume.stopping) {
+			break;
+		}
+		pthread_mutex_unlock(&volume.lock);
+		block_volume_run(mem->jobs, mem->njobs);
+		pthread_mutex_lock(&volume.lock);
+		mem->njobs = 0;
+		if (--volume.pending == 0) {
+			pthread_cond_signal(&volume.done);
+		}
+	}
+	pthread_mutex_unlock(&volume.lock);
+	return NULL;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_volume_issue
+// Description  : send one frame operation to the member holding the frame
+//
+// Inputs       : regstate - the request register, FM1 is ignored
+//                frame - the logical frame
+//                buf - the frame buffer
+// Outputs      : the member response register
+static BlockXferRegister block_volume_issue(BlockXferRegister regstate, BlockVolumeFrame frame, void* buf)
+{
+	BlockFrameIndex pframe;
+	int m = block_volume_map(frame, &pframe);
+	__atomic_store_n(&volume.member[m].head, pframe, __ATOMIC_RELAXED);
+	return (block_volume_dispatch(m, regstate, pframe, buf));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_volume_issue_batch
+// Description  : send a set of frame operations to the members, the
+//                requests for each member are put in elevator order and run
+//                by that member's worker while the other members run theirs
+//
+// Inputs       : xfers - the requests, regstate is replaced by the response
+//                count - the number of requests
+// Outputs      : 0 if successful, -1 if failure
+static int32_t block_volume_issue_batch(BlockVolumeXfer* xfers, int count)
+{
+	BlockVolumeXfer** slots;
+	int start[BLOCK_VOLUME_MAX_MEMBERS + 1], fill[BLOCK_VOLUME_MAX_MEMBERS];
+	BlockFrameIndex pframe;
+	int i, m, busy;
+
+	if (count <= 0) {
+		return 0;
+	}
+	if (count == 1) {
+		xfers[0].regstate = block_volume_issue(xfers[0].regstate, xfers[0].frame, xfers[0].buf);
+		return 0;
+	}
+
+	// Bucket the requests by member and order each bucket
+	if ((slots = malloc(sizeof(BlockVolumeXfer*) * count)) == NULL) {
+		logMessage(LOG_ERROR_LEVEL, "Failed to allocate volume batch");
+		return -1;
+	}
+	memset(fill, 0x0, sizeof(fill));
+	for (i = 0; i < count; i++) {
+		fill[block_volume_map(xfers[i].frame, &pframe)]++;
+	}
+	start[0] = 0;
+	for (m = 0; m < volume.members; m++) {
+		start[m + 1] = start[m] + fill[m];
+		fill[m] = start[m];
+	}
+	for (i = 0; i < count; i++) {
+		m = block_volume_map(xfers[i].frame, &pframe);
+		slots[fill[m]++] = &xfers[i];
+	}
+	for (m = 0; m < volume.members; m++) {
+		block_volume_elevator(&slots[start[m]], start[m + 1] - start[m], m);
+	}
+	if ((volume.members == 1) || (pthread_mutex_trylock(&volume.batch) != 0)) {
+		block_volume_run(slots, count); // the workers are on another batch, the member bus locks keep order
+		free(slots);
+		return 0;
+	}
+
+	// Hand each member its requests and wait for all of them
+	pthread_mutex_lock(&volume.lock);
+	for (m = 0, busy = 0; m < volume.members; m++) {
+		if (start[m + 1] > start[m]) {
+			volume.member[m].jobs = &slots[start[m]];
+			volume.member[m].njobs = start[m + 1] - start[m];
+			busy++;
+		}
+	}
+	volume.pending = busy;
+	pthread_cond_broadcast(&volume.work);
+	while (volume.pending > 0) {
+		pthread_cond_wait(&volume.done, &volume.lock);
+	}
+	pthread_mutex_unlock(&volume.lock);
+	pthread_mutex_unlock(&volume.batch);
+
+	free(slots);
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_volume_flush_locked
+// Description  : send every queued write to the members as one batch,
+//                writes the controller rejects are re-sent on their own
+//                and parked if they keep failing; scheduler lock held
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if the writes could not be sent, they
+//                stay queued
+static int32_t block_volume_flush_locked(void)
+{
+	BlockVolumeXfer* xfers;
+	BlockVolumePending* p;
+	int i, n, kept, tries;
+
+	if (sched.count == sched.parked) {
+		return 0;
+	}
+	if ((xfers = malloc(sizeof(BlockVolumeXfer) * sched.count)) == NULL) {
+		logMessage(LOG_ERROR_LEVEL, "Failed to allocate scheduler flush");
+		return -1;
+	}
+	for (i = 0, n = 0; i < sched.count; i++) {
+		p = &sched.pending[i];
+		if (!p->parked) {
+			xfers[n].regstate = create_opcode(BLOCK_OP_WRFRME, 0, p->checksum, 0);
+			xfers[n].frame = p->frame;
+			xfers[n++].buf = p->data;
+		}
+	}
+	if (block_volume_issue_batch(xfers, n)) {
+		free(xfers);
+		return -1;
+	}
+
+	// Keep the parked writes, old and new, in queue order
+	for (i = 0, n = 0, kept = 0; i < sched.count; i++) {
+		p = &sched.pending[i];
+		if (!p->parked) {
+			for (tries = 0; (get_RTcode(xfers[n].regstate) != BLOCK_RET_SUCCESS) ||
+				 ((uint32_t)get_CScode(xfers[n].regstate) != p->checksum); tries++) {
+				if (tries == BLOCK_VOLUME_WRITE_RETRIES) {
+					logMessage(LOG_ERROR_LEVEL, "Queued write of frame %u failed after %d retries, parked", p->frame, tries);
+					p->parked = 1;
+					sched.parked++;
+					break;
+				}
+				xfers[n].regstate = block_volume_issue(create_opcode(BLOCK_OP_WRFRME, 0, p->checksum, 0), p->frame, p->data);
+			}
+			n++;
+		}
+		if (p->parked) {
+			if (kept != i) {
+				memcpy(&sched.pending[kept], p, sizeof(BlockVolumePending));
+			}
+			kept++;
+		}
+	}
+	free(xfers);
+	sched.count = kept;
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_volume_queue_write
+// Description  : queue a write, replacing a queued write of the same frame;
+//                with the queue full of parked writes it goes to the bus at
+//                once; scheduler lock held
+//
+// Inputs       : regstate - the write request, CS1 is the frame checksum
+//                frame - the logical frame
+//                buf - the frame contents
+// Outputs      : the response register, success once queued
+static BlockXferRegister block_volume_queue_write(BlockXferRegister regstate, BlockVolumeFrame frame, void* buf)
+{
+	BlockVolumePending* p = NULL;
+	uint32_t checksum = (uint32_t)get_CScode(regstate);
+	int i, fresh = 1;
+
+	for (i = 0; (i < sched.count) && (p == NULL); i++) {
+		if (sched.pending[i].frame == frame) {
+			p = &sched.pending[i];
+			sched.merged++;
+		}
+	}
+	if (p == NULL) {
+		if (sched.count == sched.depth) {
+			block_volume_flush_locked();
+		}
+		if (sched.count == sched.depth) {
+			return (block_volume_issue(regstate, frame, buf));
+		}
+		p = &sched.pending[sched.count++];
+		p->frame = frame;
+		p->parked = 0;
+	}
+	else if (p->parked) {
+		p->parked = 0; // new data for the frame, it gets another try
+		sched.parked--;
+	}
+	else {
+		fresh = 0;
+	}
+	if (fresh && (sched.count - sched.parked == 1)) {
+		sched.oldest = block_volume_usec();
+		pthread_cond_signal(&sched.queued);
+	}
+	p->checksum = checksum;
+	memcpy(p->data, buf, BLOCK_FRAME_SIZE);
+	return (create_opcode(BLOCK_OP_WRFRME, 0, checksum, BLOCK_RET_SUCCESS));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_volume_queued_read
+// Description  : answer a read from the queue; scheduler lock held
+//
+// Inputs       : frame - the logical frame
+//                buf - the frame buffer
+//                regstate - the response register (output)
+// Outputs      : 1 if the frame was queued, 0 otherwise
+static int block_volume_queued_read(BlockVolumeFrame frame, void* buf, BlockXferRegister* regstate)
+{
+	int i;
+	for (i = 0; i < sched.count; i++) {
+		if (sched.pending[i].frame == frame) {
+			memcpy(buf, sched.pending[i].data, BLOCK_FRAME_SIZE);
+			*regstate = create_opcode(BLOCK_OP_RDFRME, 0, sched.pending[i].checksum, BLOCK_RET_SUCCESS);
+			sched.served++;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_volume_deadline
+// Description  : flush the queue if its oldest write is due; scheduler lock
+//                held
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if the flush failed
+static int32_t block_volume_deadline(void)
+{
+	if ((sched.count > sched.parked) && (block_volume_usec() - sched.oldest >= sched.deadline)) {
+		return (block_volume_flush_locked());
+	}
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_volume_flusher
+// Description  : flusher thread, enforces the deadline while no requests
+//                arrive to do it
+//
+// Inputs       : arg - unused
+// Outputs      : NULL
+static void* block_volume_flusher(void* arg)
+{
+	struct timespec until;
+	uint64_t wait;
+
+	(void)arg;
+	pthread_mutex_lock(&sched.lock);
+	while (!sched.stopping) {
+		if (sched.count == sched.parked) {
+			pthread_cond_wait(&sched.queued, &sched.lock);
+			continue;
+		}
+		wait = sched.oldest + sched.deadline - block_volume_usec();
+		if ((int64_t)wait <= 0) {
+			block_volume_flush_locked();
+			continue;
+		}
+		clock_gettime(CLOCK_REALTIME, &until);
+		until.tv_sec += wait / 1000000;
+		until.tv_nsec += (wait % 1000000) * 1000;
+		if (until.tv_nsec >= 1000000000) {
+			until.tv_sec++;
+			until.tv_nsec -= 1000000000;
+		}
+		pthread_cond_timedwait(&sched.queued, &sched.lock, &until);
+	}
+	pthread_mutex_unlock(&sched.lock);
+	return NULL;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_volume_configure
+// Description  : set the member count and stripe width of the volume
+//
+// Inputs       : members - number of controllers (1 is the plain device)
+//                stripe - number of consecutive frames per member
+// Outputs      : 0 if successful, -1 if failure
+int32_t block_volume_configure(int members, int stripe)
+{
+	if (volume.powered) {
+		logMessage(LOG_ERROR_LEVEL, "Cannot reconfigure volume while powered on");
+		return -1;
+	}
+	if ((members < 1) || (members > BLOCK_VOLUME_MAX_MEMBERS) || (stripe < 1) || (stripe > BLOCK_BLOCK_SIZE)) {
+		logMessage(LOG_ERROR_LEVEL, "Invalid volume geometry %d members stripe %d", members, stripe);
+		return -1;
+	}
+	if (BLOCK_BLOCK_SIZE % stripe) {
+		logMessage(LOG_ERROR_LEVEL, "Stripe width %d does not divide block size %d", stripe, BLOCK_BLOCK_SIZE);
+		return -1;
+	}
+	volume.members = members;
+	volume.stripe = stripe;
+	logMessage(LOG_INFO_LEVEL, "Volume configured with %d members, stripe width %d frames", members, stripe);
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_volume_poweron
+// Description  : initialize every member and start the member workers
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+int32_t block_volume_poweron(void)
+{
+	BlockXferRegister regstate;
+	int m;
+
+	for (m = 0; m < volume.members; m++) {
+		pthread_mutex_init(&volume.member[m].buslock, NULL);
+		if (((m > 0) || volume.standin) && (volume.member[m].store == NULL)) {
+			if ((volume.member[m].store = block_store_create()) == NULL) {
+				return -1;
+			}
+		}
+		regstate = create_opcode(BLOCK_OP_INITMS, 0, 0, 0);
+		regstate = block_volume_dispatch(m, regstate, 0, NULL);
+		if (get_RTcode(regstate) != BLOCK_RET_SUCCESS) {
+			logMessage(LOG_ERROR_LEVEL, "Failed to initialize volume member %d", m);
+			return -1;
+		}
+	}
+
+	// Workers are only needed when there is something to overlap
+	volume.stopping = 0;
+	if (volume.members > 1) {
+		for (m = 0; m < volume.members; m++) {
+			volume.member[m].njobs = 0;
+			if (block_ctx_spawn(&volume.member[m].worker, block_volume_worker, &volume.member[m])) {
+				logMessage(LOG_ERROR_LEVEL, "Failed to start volume member %d worker", m);
+				return -1;
+			}
+		}
+	}
+
+	// The scheduler queue and its flusher
+	sched.count = 0;
+	sched.parked = 0;
+	sched.stopping = 0;
+	sched.issued = sched.merged = sched.served = sched.dupreads = 0;
+	sched.rdframes = sched.wrframes = 0;
+	if (sched.depth > 0) {
+		if ((sched.pending = malloc(sizeof(BlockVolumePending) * sched.depth)) == NULL) {
+			logMessage(LOG_ERROR_LEVEL, "Failed to allocate volume scheduler queue");
+			return -1;
+		}
+		if (block_ctx_spawn(&sched.flusher, block_volume_flusher, NULL)) {
+			logMessage(LOG_ERROR_LEVEL, "Failed to start volume scheduler flusher");
+			free(sched.pending);
+			sched.pending = NULL;
+			return -1;
+		}
+	}
+	volume.powered = 1;
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_volume_poweroff
+// Description  : stop the member workers and power off every member
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+int32_t block_volume_poweroff(void)
+{
+	BlockXferRegister regstate;
+	int m, ret = 0;
+
+	// Drain the scheduler before the workers go away
+	if (sched.pending != NULL) {
+		pthread_mutex_lock(&sched.lock);
+		sched.stopping = 1;
+		pthread_cond_signal(&sched.queued);
+		pthread_mutex_unlock(&sched.lock);
+		pthread_join(sched.flusher, NULL);
+		if (block_volume_flush()) {
+			logMessage(LOG_ERROR_LEVEL, "Failed to flush the volume scheduler queue");
+			ret = -1;
+		}
+		if (sched.parked > 0) {
+			logMessage(LOG_ERROR_LEVEL, "%d parked writes were never written", sched.parked);
+			ret = -1;
+		}
+		free(sched.pending);
+		sched.pending = NULL;
+	}
+	logMessage(LOG_INFO_LEVEL, "Volume scheduler issued %lu bus operations, %lu writes merged, %lu reads served from the queue, %lu duplicate reads",
+		(unsigned long)sched.issued, (unsigned long)sched.merged, (unsigned long)sched.served, (unsigned long)sched.dupreads);
+
+	if (volume.members > 1) {
+		pthread_mutex_lock(&volume.lock);
+		volume.stopping = 1;
+		pthread_cond_broadcast(&volume.work);
+		pthread_mutex_unlock(&volume.lock);
+		for (m = 0; m < volume.members; m++) {
+			pthread_join(volume.member[m].worker, NULL);
+		}
+	}
+	for (m = 0; m < volume.members; m++) {
+		regstate = create_opcode(BLOCK_OP_POWOFF, 0, 0, 0);
+		regstate = block_volume_dispatch(m, regstate, 0, NULL);
+		if (get_RTcode(regstate) != BLOCK_RET_SUCCESS) {
+			logMessage(LOG_ERROR_LEVEL, "Failed to power off volume member %d", m);
+			ret = -1;
+		}
+		if (volume.member[m].store != NULL) {
+			block_store_destroy(volume.member[m].store);
+			volume.member[m].store = NULL;
+		}
+		pthread_mutex_destroy(&volume.member[m].buslock);
+	}
+	volume.powered = 0;
+	return ret;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_volume_frames
+// Description  : total number of logical frames in the volume
+//
+// Inputs       : none
+// Outputs      : the frame count
+BlockVolumeFrame block_volume_frames(void)
+{
+	return ((BlockVolumeFrame)volume.members * BLOCK_BLOCK_SIZE);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_volume_schedule
+// Description  : set the scheduler queue depth and deadline
+//
+// Inputs       : depth - writes held before a flush, 0 disables queueing
+//                deadline_usec - longest a queued write waits
+// Outputs      : 0 if successful, -1 if failure
+int32_t block_volume_schedule(int depth, uint32_t deadline_usec)
+{
+	if (volume.powered) {
+		logMessage(LOG_ERROR_LEVEL, "Cannot reconfigure the scheduler while powered on");
+		return -1;
+	}
+	if ((depth < 0) || (depth > BLOCK_VOLUME_MAX_QUEUE)) {
+		logMessage(LOG_ERROR_LEVEL, "Invalid scheduler queue depth %d", depth);
+		return -1;
+	}
+	sched.depth = depth;
+	sched.deadline = deadline_usec;
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_volume_flush
+// Description  : send every queued write to the members
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+int32_t block_volume_flush(void)
+{
+	int32_t ret;
+	pthread_mutex_lock(&sched.lock);
+	ret = block_volume_flush_locked();
+	pthread_mutex_unlock(&sched.lock);
+	return ret;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_volume_parked
+// Description  : number of parked writes, read without the scheduler lock
+//
+// Inputs       : none
+// Outputs      : the count
+int block_volume_parked(void)
+{
+	return (__atomic_load_n(&sched.parked, __ATOMIC_RELAXED));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_volume_unpark
+// Description  : take the oldest parked write out of the queue
+//
+// Inputs       : frame - the frame it was for (output)
+//                buf - frame buffer for its data (output)
+// Outputs      : 1 if a write was taken, 0 if none is parked
+int32_t block_volume_unpark(BlockVolumeFrame* frame, void* buf)
+{
+	int i, taken = 0;
+
+	pthread_mutex_lock(&sched.lock);
+	for (i = 0; (i < sched.count) && !taken; i++) {
+		if (sched.pending[i].parked) {
+			*frame = sched.pending[i].frame;
+			memcpy(buf, sched.pending[i].data, BLOCK_FRAME_SIZE);
+			memmove(&sched.pending[i], &sched.pending[i + 1], (sched.count - i - 1) * sizeof(BlockVolumePending));
+			sched.count--;
+			sched.parked--;
+			taken = 1;
+		}
+	}
+	pthread_mutex_unlock(&sched.lock);
+	return (taken);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_volume_stats
+// Description  : copy the bus counters
+//
+// Inputs       : stats - where to copy them
+// Outputs      : none
+void block_volume_stats(BlockVolumeStats* stats)
+{
+	pthread_mutex_lock(&sched.lock);
+	stats->issued = __atomic_load_n(&sched.issued, __ATOMIC_RELAXED);
+	stats->frames_read = __atomic_load_n(&sched.rdframes, __ATOMIC_RELAXED);
+	stats->frames_written = __atomic_load_n(&sched.wrframes, __ATOMIC_RELAXED);
+	stats->merged = sched.merged;
+	pthread_mutex_unlock(&sched.lock);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_volume_io
+// Description  : issue one frame operation through the scheduler
+//
+// Inputs       : regstate - the request register, FM1 is ignored
+//                frame - the logical frame
+//                buf - the frame buffer
+// Outputs      : the response register
+BlockXferRegister block_volume_io(BlockXferRegister regstate, BlockVolumeFrame frame, void* buf)
+{
+	BlockXferRegister response;
+
+	if (sched.pending == NULL) {
+		return (block_volume_issue(regstate, frame, buf));
+	}
+	pthread_mutex_lock(&sched.lock);
+	switch (get_KYcode(regstate)) {
+	case BLOCK_OP_WRFRME:
+		response = block_volume_queue_write(regstate, frame, buf);
+		break;
+	case BLOCK_OP_RDFRME:
+		if (!block_volume_queued_read(frame, buf, &response)) {
+			block_volume_deadline();
+			pthread_mutex_unlock(&sched.lock);
+			return (block_volume_issue(regstate, frame, buf)); // not queued, so the bus has it
+		}
+		break;
+	default:
+		block_volume_flush_locked(); // anything else sees the queued writes done
+		response = block_volume_issue(regstate, frame, buf);
+		break;
+	}
+	block_volume_deadline(); // a failed flush stays queued, it is not this request's error
+	pthread_mutex_unlock(&sched.lock);
+	return (response);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_volume_batch
+// Description  : issue a set of frame operations through the scheduler,
+//                writes are queued, reads of queued frames are answered
+//                from the queue and each remaining frame is read once
+//
+// Inputs       : xfers - the requests, regstate is replaced by the response
+//                count - the number of requests
+// Outputs      : 0 if successful, -1 if failure
+int32_t block_volume_batch(BlockVolumeXfer* xfers, int count)
+{
+	BlockVolumeXfer* reads;
+	int* first;
+	int i, j, n, wrote = 0, ret = 0;
+
+	if (sched.pending == NULL) {
+		return (block_volume_issue_batch(xfers, count));
+	}
+	if (count <= 0) {
+		return 0;
+	}
+	reads = malloc(sizeof(BlockVolumeXfer) * count);
+	first = malloc(sizeof(int) * count);
+	if ((reads == NULL) || (first == NULL)) {
+		logMessage(LOG_ERROR_LEVEL, "Failed to allocate volume batch");
+		free(reads);
+		free(first);
+		return -1;
+	}
+
+	pthread_mutex_lock(&sched.lock);
+	for (i = 0, n = 0; i < count; i++) {
+		first[i] = -1;
+		switch (get_KYcode(xfers[i].regstate)) {
+		case BLOCK_OP_WRFRME:
+			xfers[i].regstate = block_volume_queue_write(xfers[i].regstate, xfers[i].frame, xfers[i].buf);
+			wrote = 1;
+			break;
+		case BLOCK_OP_RDFRME:
+			if (block_volume_queued_read(xfers[i].frame, xfers[i].buf, &xfers[i].regstate)) {
+				break;
+			}
+			for (j = 0; (j < i) && (first[i] < 0); j++) {
+				if ((first[j] >= 0) && (reads[first[j]].frame == xfers[i].frame)) {
+					first[i] = first[j]; // same frame read earlier in the batch
+					sched.dupreads++;
+				}
+			}
+			if (first[i] < 0) {
+				reads[n] = xfers[i];
+				first[i] = n++;
+			}
+			break;
+		default:
+			block_volume_flush_locked();
+			xfers[i].regstate = block_volume_issue(xfers[i].regstate, xfers[i].frame, xfers[i].buf);
+			break;
+		}
+	}
+	block_volume_deadline();
+	if (!wrote) {
+		pthread_mutex_unlock(&sched.lock); // read-only, nothing queued here can flush under these reads
+	}
+	if (block_volume_issue_batch(reads, n)) {
+		ret = -1;
+	}
+	if (wrote) {
+		pthread_mutex_unlock(&sched.lock);
+	}
+	for (i = 0; i < count; i++) {
+		if (first[i] >= 0) {
+			if (reads[first[i]].buf != xfers[i].buf) {
+				memcpy(xfers[i].buf, reads[first[i]].buf, BLOCK_FRAME_SIZE);
+			}
+			xfers[i].regstate = reads[first[i]].regstate;
+		}
+	}
+
+	free(reads);
+	free(first);
+	return ret;
+}
@@ -0,0 +1,95 @@
+#ifndef BLOCK_VOLUME_INCLUDED
+#define BLOCK_VOLUME_INCLUDED
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : block_volume.h
+//  Description    : This is the interface of the volume layer, which stripes
+//                   a logical frame space across several controller
+//                   instances.  Member 0 is the block_io_bus controller, the
+//                   remaining members are stand-in block stores.
+//
+//  Author         : Vinayak Gupta
+//
+
+// Include files
+#include <stdint.h>
+
+// Project Includes
+#include <block_geometry.h>
+
+// Defines
+#define BLOCK_VOLUME_MAX_MEMBERS 16 // Maximum number of striped controllers
+#define BLOCK_VOLUME_BATCH_FRAMES 64 // Frames staged per multi-frame request
+#define BLOCK_VOLUME_QUEUE_DEPTH 64 // Default writes held by the scheduler
+#define BLOCK_VOLUME_MAX_QUEUE 1024 // Maximum scheduler queue depth
+#define BLOCK_VOLUME_QUEUE_DEADLINE_USEC 5000 // Default longest wait of a queued write
+#define BLOCK_VOLUME_WRITE_RETRIES 16 // Re-sends of a queued write the controller rejects before it is parked
+
+// Type definitions
+typedef uint32_t BlockVolumeFrame; // Logical frame index across all members
+
+typedef struct {
+	BlockXferRegister regstate; // request register in, controller response out
+	BlockVolumeFrame frame; // logical frame the request targets
+	void* buf; // frame buffer
+} BlockVolumeXfer;
+
+typedef struct {
+	uint64_t issued; // operations sent to the members
+	uint64_t frames_read; // frames read from the members
+	uint64_t frames_written; // frames written to the members
+	uint64_t merged; // queued writes replaced by a later write of the frame
+} BlockVolumeStats;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//
+// Interface functions
+
+int32_t block_volume_configure(int members, int stripe);
+// Set the member count and stripe width (frames), must precede block_poweron
+
+int32_t block_volume_schedule(int depth, uint32_t deadline_usec);
+// Set the scheduler queue depth (0 disables queueing) and deadline, must precede block_poweron
+
+int32_t block_volume_poweron(void);
+// Initialize every member controller and start the member workers
+
+int32_t block_volume_poweroff(void);
+// Power off every member controller and stop the member workers
+
+BlockVolumeFrame block_volume_frames(void);
+// Total number of logical frames in the volume
+
+BlockXferRegister block_volume_io(BlockXferRegister regstate, BlockVolumeFrame frame, void* buf);
+// Issue one frame operation through the scheduler to the member holding the frame
+
+int32_t block_volume_batch(BlockVolumeXfer* xfers, int count);
+// Issue a set of frame operations, members are driven in parallel
+
+int32_t block_volume_flush(void);
+// Send every write held by the scheduler to the members
+
+int block_volume_parked(void);
+// Number of queued writes the members kept rejecting, held for block_volume_unpark
+
+int32_t block_volume_unpark(BlockVolumeFrame* frame, void* buf);
+// Take the oldest parked write and its data out of the queue, 0 if there is none
+
+void block_volume_stats(BlockVolumeStats* stats);
+// Copy the bus counters, reset by block_volume_poweron
+
+struct BlockVolumeState* block_volume_ctx_create(int standin);
+// Create the volume of a new context, member 0 a stand-in store if standin is 1
+
+void block_volume_ctx_destroy(struct BlockVolumeState* state);
+// Release the volume of a context
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
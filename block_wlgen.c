@@ -0,0 +1,464 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : block_wlgen.c
+//  Description    : This is the synthetic workload generator for the BLOCK
+//                   simulator.  It writes a workload in the block_sim format
+//                   ("<file> <COMMAND> <len> <off> :<payload>") along with
+//                   the reference copy of every file the workload touches,
+//                   which validate_file compares the driver's files against.
+//
+//                   Files are picked with a Zipfian popularity, operations
+//                   follow a read/write/seek mix, record sizes follow one of
+//                   a few distributions and a fraction of the operations
+//                   continue at the current position instead of a random
+//                   offset.  The generator is driven by its own PRNG, so a
+//                   given seed reproduces the same workload everywhere.
+//
+//  Author         : Vinayak Gupta
+//
+
+// Include Files
+#include <errno.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Project Includes
+#include <cmpsc311_log.h>
+
+// Defines
+#define WLGEN_ARGUMENTS "hf:n:z:x:r:d:q:m:s:o:p:"
+#define WLGEN_MAX_RECORD 900 // block_sim reads lines of at most 1023 characters
+#define USAGE                                                                    \
+    "USAGE: block_wlgen [-h] [-f <files>] [-n <ops>] [-z <theta>] [-x <r:w:s>]\n"\
+    "                   [-r <min:max>] [-d <dist>] [-q <seq>] [-m <bytes>]\n"    \
+    "                   [-s <seed>] [-o <dir>] [-p <prefix>] <workload-file>\n"  \
+    "\n"                                                                         \
+    "where:\n"                                                                   \
+    "    -h - help mode (display this message)\n"                                \
+    "    -f - number of files (default 8)\n"                                     \
+    "    -n - number of operations (default 10000)\n"                            \
+    "    -z - Zipf skew of file popularity, 0 is uniform (default 0.99)\n"       \
+    "    -x - read:write:seek mix in relative weights (default 30:60:10)\n"     \
+    "    -r - record size range in bytes (default 1:900)\n"                      \
+    "    -d - record size distribution: fixed, uniform or exp (default uniform)\n"\
+    "    -q - percentage of sequential operations (default 50)\n"                \
+    "    -m - maximum size of a file in bytes (default 1048576)\n"               \
+    "    -s - PRNG seed (default 1)\n"                                           \
+    "    -o - directory for the reference files (default workload)\n"           \
+    "    -p - file name prefix (default wl)\n"                                   \
+    "\n"                                                                         \
+    "    <workload-file> - file to write the workload to\n"                      \
+    "\n"
+
+// Record size distributions
+typedef enum {
+    WLGEN_FIXED = 0, // always the minimum
+    WLGEN_UNIFORM = 1, // uniform over the range
+    WLGEN_EXP = 2, // exponential with the range midpoint as mean, clipped
+} WlgenDistribution;
+
+// The shadow of one generated file
+typedef struct {
+    char name[64]; // file name
+    char* data; // contents after the operations so far
+    uint32_t size; // file size
+    uint32_t pos; // current position
+} WlgenFile;
+
+// The generator configuration
+typedef struct {
+    int files, rweight, wweight, sweight, seqpct, dist;
+    long ops;
+    double theta;
+    uint32_t minrec, maxrec, maxsize;
+    uint64_t seed;
+    char *dir, *prefix;
+} WlgenConfig;
+
+//
+// Global Data
+static uint64_t wlgen_state; // PRNG state
+
+//
+// Functional Prototypes
+
+int generate_workload(WlgenConfig* cfg, char* wload); // write the workload and reference files
+
+//
+// Functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : wlgen_random / wlgen_uniform
+// Description  : splitmix64 PRNG, independent of the C library so seeds
+//                reproduce across platforms
+//
+// Inputs       : n - the range of wlgen_uniform
+// Outputs      : 64 random bits / a double in [0,1) / an integer in [0,n)
+static uint64_t wlgen_random(void)
+{
+    uint64_t z = (wlgen_state += 0x9e3779b97f4a7c15ull);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return (z ^ (z >> 31));
+}
+
+static double wlgen_unit(void)
+{
+    return ((wlgen_random() >> 11) * (1.0 / 9007199254740992.0));
+}
+
+static uint32_t wlgen_uniform(uint32_t n)
+{
+    return ((n == 0) ? 0 : (uint32_t)(wlgen_random() % n));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : wlgen_zipf
+// Description  : pick a file from the Zipf cumulative distribution
+//
+// Inputs       : cdf - cumulative popularity, cdf[files-1] == 1
+//                files - number of files
+// Outputs      : the file index
+static int wlgen_zipf(double* cdf, int files)
+{
+    double u = wlgen_unit();
+    int lo = 0, hi = files - 1, mid;
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (cdf[mid] <= u) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return (lo);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : wlgen_record
+// Description  : draw a record size
+//
+// Inputs       : cfg - the configuration
+// Outputs      : the size in bytes
+static uint32_t wlgen_record(WlgenConfig* cfg)
+{
+    double mean;
+    uint32_t len;
+
+    switch (cfg->dist) {
+    case WLGEN_FIXED:
+        return (cfg->minrec);
+    case WLGEN_EXP:
+        mean = (cfg->minrec + cfg->maxrec) / 2.0;
+        len = (uint32_t)(-log(1.0 - wlgen_unit()) * mean);
+        break;
+    default:
+        len = cfg->minrec + wlgen_uniform(cfg->maxrec - cfg->minrec + 1);
+        break;
+    }
+    if (len < cfg->minrec) {
+        len = cfg->minrec;
+    }
+    if (len > cfg->maxrec) {
+        len = cfg->maxrec;
+    }
+    return (len);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : wlgen_write
+// Description  : emit a WRITE or WRITEAT of fresh data and apply it to the
+//                shadow file
+//
+// Inputs       : out - the workload
+//                f - the file
+//                len - record size
+//                off - offset for WRITEAT, -1 for a WRITE at the position
+// Outputs      : 0 if successful, -1 if failure
+static int wlgen_write(FILE* out, WlgenFile* f, uint32_t len, int64_t off)
+{
+    static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789 .,;!?-";
+    char payload[WLGEN_MAX_RECORD + 1];
+    uint32_t i;
+
+    if (off >= 0) {
+        f->pos = (uint32_t)off;
+    }
+    for (i = 0; i < len; i++) {
+        payload[i] = (wlgen_uniform(64) == 0) ? '^' : alphabet[wlgen_uniform(sizeof(alphabet) - 1)];
+    }
+    payload[len] = 0x0;
+    fprintf(out, "%s %s %u %u :%s\n", f->name, (off >= 0) ? "WRITEAT" : "WRITE", len, (off >= 0) ? (uint32_t)off : 0, payload);
+
+    // The simulator turns '^' into newlines before writing
+    for (i = 0; i < len; i++) {
+        if (payload[i] == '^') {
+            payload[i] = '\n';
+        }
+    }
+    memcpy(f->data + f->pos, payload, len);
+    f->pos += len;
+    if (f->pos > f->size) {
+        f->size = f->pos;
+    }
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : main
+// Description  : The main function for the workload generator
+//
+// Inputs       : argc - the number of command line parameters
+//                argv - the parameters
+// Outputs      : 0 if successful, -1 if failure
+
+int main(int argc, char* argv[])
+{
+    // Local variables
+    WlgenConfig cfg = {
+        .files = 8,
+        .ops = 10000,
+        .theta = 0.99,
+        .rweight = 30, .wweight = 60, .sweight = 10,
+        .minrec = 1, .maxrec = WLGEN_MAX_RECORD,
+        .dist = WLGEN_UNIFORM,
+        .seqpct = 50,
+        .maxsize = 1048576,
+        .seed = 1,
+        .dir = "workload",
+        .prefix = "wl",
+    };
+    unsigned long long seed;
+    int ch;
+
+    // Process the command line parameters
+    initializeLogWithFilehandle(CMPSC311_LOG_STDERR);
+    while ((ch = getopt(argc, argv, WLGEN_ARGUMENTS)) != -1) {
+
+        switch (ch) {
+        case 'h': // Help, print usage
+            fprintf(stderr, USAGE);
+            return (-1);
+
+        case 'f': // Number of files
+            if ((sscanf(optarg, "%d", &cfg.files) != 1) || (cfg.files < 1)) {
+                logMessage(LOG_ERROR_LEVEL, "Bad file count [%s]", optarg);
+                return (-1);
+            }
+            break;
+
+        case 'n': // Number of operations
+            if ((sscanf(optarg, "%ld", &cfg.ops) != 1) || (cfg.ops < 0)) {
+                logMessage(LOG_ERROR_LEVEL, "Bad operation count [%s]", optarg);
+                return (-1);
+            }
+            break;
+
+        case 'z': // Zipf skew
+            if ((sscanf(optarg, "%lf", &cfg.theta) != 1) || (cfg.theta < 0)) {
+                logMessage(LOG_ERROR_LEVEL, "Bad Zipf skew [%s]", optarg);
+                return (-1);
+            }
+            break;
+
+        case 'x': // Operation mix
+            if ((sscanf(optarg, "%d:%d:%d", &cfg.rweight, &cfg.wweight, &cfg.sweight) != 3) || (cfg.rweight < 0) ||
+                (cfg.wweight < 1) || (cfg.sweight < 0)) {
+                logMessage(LOG_ERROR_LEVEL, "Bad operation mix [%s], writes must have a weight", optarg);
+                return (-1);
+            }
+            break;
+
+        case 'r': // Record size range
+            if ((sscanf(optarg, "%u:%u", &cfg.minrec, &cfg.maxrec) != 2) || (cfg.minrec < 1) ||
+                (cfg.minrec > cfg.maxrec) || (cfg.maxrec > WLGEN_MAX_RECORD)) {
+                logMessage(LOG_ERROR_LEVEL, "Bad record range [%s], at most %d bytes", optarg, WLGEN_MAX_RECORD);
+                return (-1);
+            }
+            break;
+
+        case 'd': // Record size distribution
+            if (strcmp(optarg, "fixed") == 0) {
+                cfg.dist = WLGEN_FIXED;
+            } else if (strcmp(optarg, "uniform") == 0) {
+                cfg.dist = WLGEN_UNIFORM;
+            } else if (strcmp(optarg, "exp") == 0) {
+                cfg.dist = WLGEN_EXP;
+            } else {
+                logMessage(LOG_ERROR_LEVEL, "Unknown record size distribution [%s]", optarg);
+                return (-1);
+            }
+            break;
+
+        case 'q': // Sequential percentage
+            if ((sscanf(optarg, "%d", &cfg.seqpct) != 1) || (cfg.seqpct < 0) || (cfg.seqpct > 100)) {
+                logMessage(LOG_ERROR_LEVEL, "Bad sequential percentage [%s]", optarg);
+                return (-1);
+            }
+            break;
+
+        case 'm': // Maximum file size
+            if (sscanf(optarg, "%u", &cfg.maxsize) != 1) {
+                logMessage(LOG_ERROR_LEVEL, "Bad maximum file size [%s]", optarg);
+                return (-1);
+            }
+            break;
+
+        case 's': // PRNG seed
+            if (sscanf(optarg, "%llu", &seed) != 1) {
+                logMessage(LOG_ERROR_LEVEL, "Bad seed [%s]", optarg);
+                return (-1);
+            }
+            cfg.seed = seed;
+            break;
+
+        case 'o': // Reference file directory
+            cfg.dir = optarg;
+            break;
+
+        case 'p': // File name prefix
+            cfg.prefix = optarg;
+            break;
+
+        default: // Default (unknown)
+            fprintf(stderr, "Unknown command line option (%c), aborting.\n", ch);
+            return (-1);
+        }
+    }
+
+    // The workload file is the last parameter
+    if (argc != optind + 1) {
+        fprintf(stderr, USAGE);
+        return (-1);
+    }
+    if (cfg.maxsize < cfg.maxrec) {
+        logMessage(LOG_ERROR_LEVEL, "Maximum file size %u is below the largest record %u", cfg.maxsize, cfg.maxrec);
+        return (-1);
+    }
+    if (generate_workload(&cfg, argv[optind])) {
+        logMessage(LOG_ERROR_LEVEL, "Workload generation failed.");
+        return (-1);
+    }
+
+    // Return successfully
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : generate_workload
+// Description  : generate the operations, then write out the reference files
+//
+// Inputs       : cfg - the configuration
+//                wload - the workload file to create
+// Outputs      : 0 if successful, -1 if failure
+
+int generate_workload(WlgenConfig* cfg, char* wload)
+{
+    // Local variables
+    WlgenFile* files;
+    double *cdf, sum;
+    char path[256];
+    FILE *out, *ref;
+    long op, counts[3] = { 0, 0, 0 };
+    uint32_t len, off, room;
+    int i, kind, total;
+
+    // Setup the files and the popularity distribution
+    wlgen_state = cfg->seed;
+    files = calloc(cfg->files, sizeof(WlgenFile));
+    cdf = malloc(cfg->files * sizeof(double));
+    if ((files == NULL) || (cdf == NULL)) {
+        logMessage(LOG_ERROR_LEVEL, "Failed to allocate %d generator files", cfg->files);
+        return (-1);
+    }
+    for (i = 0, sum = 0; i < cfg->files; i++) {
+        snprintf(files[i].name, sizeof(files[i].name), "%s%06d.txt", cfg->prefix, i);
+        sum += 1.0 / pow(i + 1, cfg->theta);
+        cdf[i] = sum;
+    }
+    for (i = 0; i < cfg->files; i++) {
+        cdf[i] /= sum;
+    }
+    cdf[cfg->files - 1] = 1.0;
+    if ((out = fopen(wload, "w")) == NULL) {
+        logMessage(LOG_ERROR_LEVEL, "Failure opening the workload file [%s], error: %s.", wload, strerror(errno));
+        return (-1);
+    }
+
+    // Generate the operations
+    total = cfg->rweight + cfg->wweight + cfg->sweight;
+    for (op = 0; op < cfg->ops; op++) {
+        WlgenFile* f = &files[wlgen_zipf(cdf, cfg->files)];
+        if ((f->data == NULL) && ((f->data = malloc(cfg->maxsize)) == NULL)) {
+            logMessage(LOG_ERROR_LEVEL, "Failed to allocate shadow of [%s]", f->name);
+            fclose(out);
+            return (-1);
+        }
+        kind = wlgen_uniform(total);
+        kind = (kind < cfg->rweight) ? 0 : (kind < cfg->rweight + cfg->wweight) ? 1 : 2;
+        if (f->size == 0) {
+            kind = 1; // the first operation on a file creates it
+        }
+        len = wlgen_record(cfg);
+
+        switch (kind) {
+        case 0: // READ, seeking first if random or too close to the end
+            if (len > f->size) {
+                len = f->size;
+            }
+            if ((wlgen_uniform(100) >= cfg->seqpct) || (f->pos + len > f->size)) {
+                f->pos = wlgen_uniform(f->size - len + 1);
+                fprintf(out, "%s SEEK 0 %u :\n", f->name, f->pos);
+            }
+            fprintf(out, "%s READ %u 0 :\n", f->name, len);
+            f->pos += len;
+            break;
+
+        case 1: // WRITE at the position or WRITEAT a random offset
+            room = cfg->maxsize - len;
+            if ((wlgen_uniform(100) < cfg->seqpct) && (f->pos <= room)) {
+                wlgen_write(out, f, len, -1);
+            } else {
+                off = wlgen_uniform(((f->size < room) ? f->size : room) + 1);
+                wlgen_write(out, f, len, off);
+            }
+            break;
+
+        default: // SEEK anywhere in the file
+            f->pos = wlgen_uniform(f->size + 1);
+            fprintf(out, "%s SEEK 0 %u :\n", f->name, f->pos);
+            break;
+        }
+        counts[kind]++;
+    }
+    fclose(out);
+
+    // Write the reference files of every file the workload touched
+    for (i = 0; i < cfg->files; i++) {
+        if (files[i].data == NULL) {
+            continue;
+        }
+        snprintf(path, sizeof(path), "%s/%s", cfg->dir, files[i].name);
+        if (((ref = fopen(path, "w")) == NULL) || (fwrite(files[i].data, 1, files[i].size, ref) != files[i].size)) {
+            logMessage(LOG_ERROR_LEVEL, "Failure writing reference file [%s], error: %s.", path, strerror(errno));
+            return (-1);
+        }
+        fclose(ref);
+        free(files[i].data);
+    }
+    free(files);
+    free(cdf);
+    logMessage(LOG_OUTPUT_LEVEL, "Generated %ld operations (%ld reads, %ld writes, %ld seeks) on %d files, seed %llu.",
+        cfg->ops, counts[0], counts[1], counts[2], cfg->files, (unsigned long long)cfg->seed);
+    return (0);
+}